@@ -0,0 +1,158 @@
+﻿// TuneExpertAllan.c: Overlapping Allan deviation from hierarchically averaged samples
+//
+// Level 0 holds the raw samples and gives fully overlapping estimates for tau = 1..ALLAN_BLOCK samples.
+// Every other level averages pairs of the level below and only adds tau = ALLAN_BLOCK * 2^L, so the
+// overlap step grows with tau while the state stays at 2 * ALLAN_BLOCK values per level.
+
+#include "TuneExpertAllan.h"
+#include "TuneExpertRealtime.h"
+#include "TuneExpertSeqlock.h"
+#include <stdatomic.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+void allan_init(ALLAN_STATE* pState)
+{
+    memset(pState, 0, sizeof(*pState));
+}
+
+// Difference between the mean of the newest m values and the mean of the m values before them
+static double block_diff(const double* pdRing, unsigned long long ullCount, int m)
+{
+    double dNew = 0, dOld = 0;
+    int i;
+
+    for (i = 0; i < m; i++)
+    {
+        dNew += pdRing[(ullCount - 1 - i) % (2 * ALLAN_BLOCK)];
+        dOld += pdRing[(ullCount - 1 - m - i) % (2 * ALLAN_BLOCK)];
+    }
+    return (dNew - dOld) / m;
+}
+
+void allan_push(ALLAN_STATE* pState, double dValue)
+{
+    int iLevel;
+
+    for (iLevel = 0; iLevel < ALLAN_LEVELS; iLevel++)
+    {
+        unsigned long long ullCount = ++pState->aullCount[iLevel];
+        double d;
+
+        pState->adRing[iLevel][(ullCount - 1) % (2 * ALLAN_BLOCK)] = dValue;
+
+        if (iLevel == 0)
+        {
+            int k;
+            for (k = 0; k <= ALLAN_BLOCK_LOG2 && ullCount >= (2ull << k); k++)
+            {
+                d = block_diff(pState->adRing[0], ullCount, 1 << k);
+                pState->adSumSq[k] += d * d;
+                pState->aullTerms[k]++;
+            }
+        }
+        else if (ullCount >= 2 * ALLAN_BLOCK)
+        {
+            d = block_diff(pState->adRing[iLevel], ullCount, ALLAN_BLOCK);
+            pState->adSumSq[iLevel + ALLAN_BLOCK_LOG2] += d * d;
+            pState->aullTerms[iLevel + ALLAN_BLOCK_LOG2]++;
+        }
+
+        // Pass the average of each pair up to the next level
+        if (ullCount & 1)
+        {
+            pState->adPending[iLevel] = dValue;
+            break;
+        }
+        dValue = (pState->adPending[iLevel] + dValue) / 2;
+    }
+}
+
+int allan_get(const ALLAN_STATE* pState, double dTau0, AllanPoint* pPoints, int iMax)
+{
+    int k, n = 0;
+
+    for (k = 0; k < ALLAN_TAUS && n < iMax; k++)
+    {
+        if (pState->aullTerms[k] == 0) continue;
+        pPoints[n].dTau = dTau0 * (double)(1ull << k);
+        pPoints[n].dAdev = sqrt(pState->adSumSq[k] / (2.0 * pState->aullTerms[k]));
+        pPoints[n].ullTerms = pState->aullTerms[k];
+        n++;
+    }
+    return n;
+}
+
+static _Atomic(ALLAN_STATE*) pLiveAllan;    // ALLAN_AXES states from realtime_alloc, set by the first update
+static SEQLOCK AllanLock;
+static struct timespec tsFirst, tsLast;
+static unsigned long long ullSamples;
+static _Atomic double dFixedTau0;
+static atomic_bool bResetPending;
+
+// Runs on the acquisition thread only
+void allan_update(double dPos1, double dPos2, double dPos3)
+{
+    ALLAN_STATE* pAllan = atomic_load_explicit(&pLiveAllan, memory_order_relaxed);
+    struct timespec tsNow;
+
+    if (!pAllan)
+    {
+        if (!(pAllan = realtime_alloc(ALLAN_AXES * sizeof(ALLAN_STATE)))) return;
+        atomic_store_explicit(&pLiveAllan, pAllan, memory_order_release);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &tsNow);
+
+    seqlock_write_begin(&AllanLock);
+    if (atomic_exchange_explicit(&bResetPending, false, memory_order_acquire))
+    {
+        allan_init(&pAllan[0]);
+        allan_init(&pAllan[1]);
+        allan_init(&pAllan[2]);
+        ullSamples = 0;
+    }
+    if (ullSamples++ == 0) tsFirst = tsNow;
+    tsLast = tsNow;
+    allan_push(&pAllan[0], dPos1);
+    allan_push(&pAllan[1], dPos2);
+    allan_push(&pAllan[2], dPos3);
+    seqlock_write_end(&AllanLock);
+}
+
+void set_allan_tau0(double dSeconds)
+{
+    atomic_store(&dFixedTau0, dSeconds);
+}
+
+void reset_allan(void)
+{
+    atomic_store_explicit(&bResetPending, true, memory_order_release);
+}
+
+int read_allan(short axis, AllanPoint* pPoints, int iMax)
+{
+    ALLAN_STATE Copy;
+    const ALLAN_STATE* pAllan;
+    double dTau0 = atomic_load(&dFixedTau0);
+    unsigned long long ullCount;
+    struct timespec tsStart, tsEnd;
+    unsigned int uiSeq;
+
+    if (axis < 0 || axis >= ALLAN_AXES || !(pAllan = atomic_load_explicit(&pLiveAllan, memory_order_acquire))) return 0;
+    do {
+        uiSeq = seqlock_read_begin(&AllanLock);
+        memcpy(Copy.adSumSq, pAllan[axis].adSumSq, sizeof(Copy.adSumSq));
+        memcpy(Copy.aullTerms, pAllan[axis].aullTerms, sizeof(Copy.aullTerms));
+        ullCount = ullSamples;
+        tsStart = tsFirst;
+        tsEnd = tsLast;
+    } while (seqlock_read_retry(&AllanLock, uiSeq));
+
+    if (dTau0 <= 0)
+    {
+        if (ullCount < 2) return 0;
+        dTau0 = ((tsEnd.tv_sec - tsStart.tv_sec) + (tsEnd.tv_nsec - tsStart.tv_nsec) * 1e-9) / (ullCount - 1);
+    }
+    return allan_get(&Copy, dTau0, pPoints, iMax);
+}
@@ -0,0 +1,34 @@
+﻿// TuneExpertAllan.h: Streaming overlapping Allan deviation per axis with bounded memory
+//
+
+#pragma once
+
+#define ALLAN_AXES 3
+#define ALLAN_LEVELS 40                 // decimation levels, level L holds averages of 2^L samples
+#define ALLAN_BLOCK_LOG2 3              // taus up to 2^ALLAN_BLOCK_LOG2 samples are fully overlapping
+#define ALLAN_BLOCK (1 << ALLAN_BLOCK_LOG2)
+#define ALLAN_TAUS (ALLAN_LEVELS + ALLAN_BLOCK_LOG2)
+
+typedef struct {
+    double dTau;                        // seconds
+    double dAdev;                       // um
+    unsigned long long ullTerms;        // number of differences averaged
+} AllanPoint;
+
+typedef struct {
+    double adRing[ALLAN_LEVELS][2 * ALLAN_BLOCK];   // last 2 blocks of each level
+    unsigned long long aullCount[ALLAN_LEVELS];     // samples seen at each level
+    double adPending[ALLAN_LEVELS];                 // first half of the next pair average
+    double adSumSq[ALLAN_TAUS];
+    unsigned long long aullTerms[ALLAN_TAUS];
+} ALLAN_STATE;
+
+void allan_init(ALLAN_STATE* pState);
+void allan_push(ALLAN_STATE* pState, double dValue);
+int allan_get(const ALLAN_STATE* pState, double dTau0, AllanPoint* pPoints, int iMax);
+
+// Live estimator fed by the acquisition path. With no tau0 set the mean sample interval is measured.
+void allan_update(double dPos1, double dPos2, double dPos3);
+void set_allan_tau0(double dSeconds);
+void reset_allan(void);
+int read_allan(short axis, AllanPoint* pPoints, int iMax);
@@ -0,0 +1,546 @@
+﻿// TuneExpertArrow.c: Arrow IPC writer with a minimal flatbuffer encoder
+//
+// Flatbuffer metadata is laid out parent first, child offsets are patched once the child is placed, so every
+// uoffset points forward as the format requires. Record batch bodies are written with writev straight from
+// the column buffers.
+
+#include "TuneExpertArrow.h"
+#include "TuneExpertCapture.h"
+#include "TuneExpertEnv.h"
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+
+#include <unistd.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define ARROW_MAGIC "ARROW1"
+#define ARROW_METADATA_V5 4
+
+enum E_ARROW_HEADER { ARROW_HEADER_SCHEMA = 1, ARROW_HEADER_RECORD_BATCH = 3 };
+enum E_ARROW_TYPE { ARROW_TYPE_INT = 2, ARROW_TYPE_FLOAT = 3, ARROW_TYPE_TIMESTAMP = 10 };
+
+static const struct {
+    const char* pName;
+    unsigned char ucType, ucBytes;
+    bool bSigned;
+} aColumnDefs[ARROW_COLUMNS] = {
+    { "time", ARROW_TYPE_TIMESTAMP, 8, true },
+    { "ax1_raw", ARROW_TYPE_INT, 8, true }, { "ax2_raw", ARROW_TYPE_INT, 8, true }, { "ax3_raw", ARROW_TYPE_INT, 8, true },
+    { "ax1_vel_raw", ARROW_TYPE_INT, 4, true }, { "ax2_vel_raw", ARROW_TYPE_INT, 4, true }, { "ax3_vel_raw", ARROW_TYPE_INT, 4, true },
+    { "gelt_status", ARROW_TYPE_INT, 4, false }, { "valid", ARROW_TYPE_INT, 2, false },
+    { "ax1_um", ARROW_TYPE_FLOAT, 8, true }, { "ax2_um", ARROW_TYPE_FLOAT, 8, true }, { "ax3_um", ARROW_TYPE_FLOAT, 8, true },
+    { "ax1_umps", ARROW_TYPE_FLOAT, 8, true }, { "ax2_umps", ARROW_TYPE_FLOAT, 8, true }, { "ax3_umps", ARROW_TYPE_FLOAT, 8, true }
+};
+
+typedef struct {
+    unsigned char* p;
+    size_t ulLen, ulSize;
+    int iError;
+} FLATBUF;
+
+typedef struct {
+    unsigned char ucSize;                   // 0 leaves the field out of the table
+    uint64_t ullValue;                      // offsets are patched later with fb_patch
+} FB_FIELD;
+
+typedef struct {
+    int64_t llOffset;
+    int32_t iMetaDataLength, iPad;
+    int64_t llBodyLength;
+} ARROW_BLOCK;
+
+struct ARROW_WRITER {
+    int fd;
+    bool bFile;
+    unsigned long long ullOffset;
+    ARROW_BLOCK* aBlocks;
+    unsigned long ulBlocks, ulBlockSize;
+    double dCompNum, dLambdaNm;
+    unsigned int uiFold;
+    FLATBUF Fb;
+    void* pScratch;                         // transposed columns for arrow_write_raw
+};
+
+static size_t fb_grow(FLATBUF* fb, size_t ulBytes)
+{
+    size_t ulAt = fb->ulLen;
+
+    if (fb->ulLen + ulBytes > fb->ulSize)
+    {
+        size_t ulSize = fb->ulSize ? fb->ulSize : 1024;
+        unsigned char* p;
+        while (ulSize < fb->ulLen + ulBytes) ulSize *= 2;
+        if (!(p = realloc(fb->p, ulSize)))
+        {
+            fb->iError = -1;
+            return 0;
+        }
+        fb->p = p;
+        fb->ulSize = ulSize;
+    }
+    memset(fb->p + ulAt, 0, ulBytes);
+    fb->ulLen += ulBytes;
+    return ulAt;
+}
+
+static void fb_pad(FLATBUF* fb, size_t ulAlign)
+{
+    if (fb->ulLen % ulAlign) fb_grow(fb, ulAlign - fb->ulLen % ulAlign);
+}
+
+static void fb_put(FLATBUF* fb, size_t ulAt, const void* pData, size_t ulBytes)
+{
+    if (!fb->iError) memcpy(fb->p + ulAt, pData, ulBytes);
+}
+
+static void fb_patch(FLATBUF* fb, size_t ulAt, size_t ulTarget)
+{
+    uint32_t uiOffset = (uint32_t)(ulTarget - ulAt);
+    fb_put(fb, ulAt, &uiOffset, 4);
+}
+
+// Writes the vtable and then the table; returns the table and the position of each field in aulPos
+static size_t fb_table(FLATBUF* fb, const FB_FIELD* aFields, int iFields, size_t* aulPos)
+{
+    uint16_t auiVtable[2 + 16];
+    size_t ulRel = 4, ulVtable, ulTable;
+    int32_t iSoffset;
+    int i;
+
+    for (i = 0; i < iFields; i++)
+    {
+        auiVtable[2 + i] = 0;
+        if (!aFields[i].ucSize) continue;
+        ulRel = (ulRel + aFields[i].ucSize - 1) & ~(size_t)(aFields[i].ucSize - 1);
+        auiVtable[2 + i] = (uint16_t)ulRel;
+        ulRel += aFields[i].ucSize;
+    }
+    auiVtable[0] = (uint16_t)(4 + 2 * iFields);
+    auiVtable[1] = (uint16_t)ulRel;
+
+    fb_pad(fb, 2);
+    ulVtable = fb_grow(fb, auiVtable[0]);
+    fb_put(fb, ulVtable, auiVtable, auiVtable[0]);
+    fb_pad(fb, 8);
+    ulTable = fb_grow(fb, ulRel);
+    iSoffset = (int32_t)(ulTable - ulVtable);
+    fb_put(fb, ulTable, &iSoffset, 4);
+    for (i = 0; i < iFields; i++)
+    {
+        aulPos[i] = ulTable + auiVtable[2 + i];
+        if (aFields[i].ucSize) fb_put(fb, aulPos[i], &aFields[i].ullValue, aFields[i].ucSize);   // little endian
+    }
+    return ulTable;
+}
+
+static size_t fb_vector(FLATBUF* fb, uint32_t uiCount, size_t ulElement, size_t ulAlign, const void* pData)
+{
+    size_t ulAt;
+
+    while ((fb->ulLen + 4) % ulAlign) fb_grow(fb, 1);
+    ulAt = fb_grow(fb, 4 + uiCount * ulElement);
+    fb_put(fb, ulAt, &uiCount, 4);
+    if (pData) fb_put(fb, ulAt + 4, pData, uiCount * ulElement);
+    return ulAt;
+}
+
+static size_t fb_string(FLATBUF* fb, const char* pText)
+{
+    uint32_t uiLen = (uint32_t)strlen(pText);
+    size_t ulAt;
+
+    fb_pad(fb, 4);
+    ulAt = fb_grow(fb, 4 + uiLen + 1);
+    fb_put(fb, ulAt, &uiLen, 4);
+    fb_put(fb, ulAt + 4, pText, uiLen);
+    return ulAt;
+}
+
+static size_t put_type(FLATBUF* fb, int iColumn)
+{
+    size_t aulPos[2], ulTable;
+
+    if (aColumnDefs[iColumn].ucType == ARROW_TYPE_TIMESTAMP)
+    {
+        FB_FIELD aFields[2] = { { 2, 3 }, { 4, 0 } };  // nanoseconds, timezone
+        ulTable = fb_table(fb, aFields, 2, aulPos);
+        fb_patch(fb, aulPos[1], fb_string(fb, "UTC"));
+    }
+    else if (aColumnDefs[iColumn].ucType == ARROW_TYPE_FLOAT)
+    {
+        FB_FIELD aFields[1] = { { 2, 2 } };           // double precision
+        ulTable = fb_table(fb, aFields, 1, aulPos);
+    }
+    else
+    {
+        FB_FIELD aFields[2] = { { 4, aColumnDefs[iColumn].ucBytes * 8u }, { 1, aColumnDefs[iColumn].bSigned } };
+        ulTable = fb_table(fb, aFields, 2, aulPos);
+    }
+    return ulTable;
+}
+
+static size_t put_schema(FLATBUF* fb)
+{
+    FB_FIELD aSchema[2] = { { 2, 0 }, { 4, 0 } };     // little endian, fields
+    size_t aulPos[6], ulSchema, ulFields;
+    int i;
+
+    ulSchema = fb_table(fb, aSchema, 2, aulPos);
+    ulFields = fb_vector(fb, ARROW_COLUMNS, 4, 4, NULL);
+    fb_patch(fb, aulPos[1], ulFields);
+    for (i = 0; i < ARROW_COLUMNS; i++)
+    {
+        // name, nullable, type_type, type, dictionary, children
+        FB_FIELD aField[6] = { { 4, 0 }, { 1, 0 }, { 1, aColumnDefs[i].ucType }, { 4, 0 }, { 0, 0 }, { 4, 0 } };
+        size_t ulField = fb_table(fb, aField, 6, aulPos);
+
+        fb_patch(fb, ulFields + 4 + 4 * i, ulField);
+        fb_patch(fb, aulPos[0], fb_string(fb, aColumnDefs[i].pName));
+        fb_patch(fb, aulPos[3], put_type(fb, i));
+        fb_patch(fb, aulPos[5], fb_vector(fb, 0, 4, 4, NULL));
+    }
+    return ulSchema;
+}
+
+// Message table with the header left for the caller to patch; returns the header field position
+static size_t put_message(FLATBUF* fb, int iHeaderType, uint64_t ullBodyLength)
+{
+    FB_FIELD aFields[4] = { { 2, ARROW_METADATA_V5 }, { 1, (uint64_t)iHeaderType }, { 4, 0 }, { 8, ullBodyLength } };
+    size_t aulPos[4], ulRoot;
+
+    fb->ulLen = 0;
+    fb->iError = 0;
+    ulRoot = fb_grow(fb, 4);
+    fb_patch(fb, ulRoot, fb_table(fb, aFields, 4, aulPos));
+    return aulPos[2];
+}
+
+static int write_vec(int fd, struct iovec* aIov, int iCount)
+{
+    while (iCount)
+    {
+        ssize_t lDone = writev(fd, aIov, iCount);
+        if (lDone < 0)
+        {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        while (iCount && (size_t)lDone >= aIov->iov_len)
+        {
+            lDone -= aIov->iov_len;
+            aIov++;
+            iCount--;
+        }
+        if (iCount)
+        {
+            aIov->iov_base = (char*)aIov->iov_base + lDone;
+            aIov->iov_len -= lDone;
+        }
+    }
+    return 0;
+}
+
+static int write_bytes(ARROW_WRITER* pWriter, const void* pData, size_t ulBytes)
+{
+    struct iovec iov;
+
+    iov.iov_base = (void*)pData;
+    iov.iov_len = ulBytes;
+    if (write_vec(pWriter->fd, &iov, 1) != 0) return -1;
+    pWriter->ullOffset += ulBytes;
+    return 0;
+}
+
+// Encapsulated message: continuation marker, metadata size, flatbuffer padded to 8 bytes, then the body
+static int write_message(ARROW_WRITER* pWriter, struct iovec* aBody, int iBody, uint64_t ullBodyLength, bool bRecordBatch)
+{
+    struct iovec aIov[2 + 2 * ARROW_COLUMNS];
+    uint32_t auiPrefix[2];
+    unsigned long long ullStart = pWriter->ullOffset;
+    int i;
+
+    fb_pad(&pWriter->Fb, 8);
+    if (pWriter->Fb.iError) return -1;
+    auiPrefix[0] = 0xffffffffu;
+    auiPrefix[1] = (uint32_t)pWriter->Fb.ulLen;
+    aIov[0].iov_base = auiPrefix;
+    aIov[0].iov_len = sizeof(auiPrefix);
+    aIov[1].iov_base = pWriter->Fb.p;
+    aIov[1].iov_len = pWriter->Fb.ulLen;
+    for (i = 0; i < iBody; i++) aIov[2 + i] = aBody[i];
+    if (write_vec(pWriter->fd, aIov, 2 + iBody) != 0) return -1;
+    pWriter->ullOffset += sizeof(auiPrefix) + pWriter->Fb.ulLen + ullBodyLength;
+
+    if (bRecordBatch && pWriter->bFile)
+    {
+        ARROW_BLOCK* pBlock;
+        if (pWriter->ulBlocks == pWriter->ulBlockSize)
+        {
+            unsigned long ulSize = pWriter->ulBlockSize ? pWriter->ulBlockSize * 2 : 64;
+            ARROW_BLOCK* a = realloc(pWriter->aBlocks, ulSize * sizeof(ARROW_BLOCK));
+            if (!a) return -1;
+            pWriter->aBlocks = a;
+            pWriter->ulBlockSize = ulSize;
+        }
+        pBlock = &pWriter->aBlocks[pWriter->ulBlocks++];
+        pBlock->llOffset = (int64_t)ullStart;
+        pBlock->iMetaDataLength = (int32_t)(sizeof(auiPrefix) + pWriter->Fb.ulLen);
+        pBlock->iPad = 0;
+        pBlock->llBodyLength = (int64_t)ullBodyLength;
+    }
+    return 0;
+}
+
+static ARROW_WRITER* arrow_start(int fd, bool bFile)
+{
+    static const char szFileMagic[8] = ARROW_MAGIC;
+    ARROW_WRITER* pWriter;
+    size_t ulHeader;
+
+    if (fd < 0) return NULL;
+    if (!(pWriter = calloc(1, sizeof(ARROW_WRITER))))
+    {
+        close(fd);
+        return NULL;
+    }
+    pWriter->fd = fd;
+    pWriter->bFile = bFile;
+    pWriter->dCompNum = read_comp_num();
+    pWriter->dLambdaNm = LAMBDA_NM;
+    pWriter->uiFold = FOLD;
+
+    ulHeader = put_message(&pWriter->Fb, ARROW_HEADER_SCHEMA, 0);
+    fb_patch(&pWriter->Fb, ulHeader, put_schema(&pWriter->Fb));
+    if ((bFile && write_bytes(pWriter, szFileMagic, sizeof(szFileMagic)) != 0) || write_message(pWriter, NULL, 0, 0, false) != 0)
+    {
+        pWriter->bFile = false;
+        arrow_close(pWriter);
+        return NULL;
+    }
+    return pWriter;
+}
+
+ARROW_WRITER* arrow_open_file(const char* pPath)
+{
+    return arrow_start(open(pPath, O_WRONLY | O_CREAT | O_TRUNC, 0644), true);
+}
+
+ARROW_WRITER* arrow_open_stream(int fd)
+{
+    return arrow_start(fd, false);
+}
+
+ARROW_WRITER* arrow_open_socket(const char* pSocketPath)
+{
+    struct sockaddr_un addr;
+    int fd;
+
+    if (strlen(pSocketPath) >= sizeof(addr.sun_path) || (fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) return NULL;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, pSocketPath);
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0)
+    {
+        close(fd);
+        return NULL;
+    }
+    return arrow_start(fd, false);
+}
+
+void arrow_set_comp_num(ARROW_WRITER* pWriter, double dCompNum)
+{
+    pWriter->dCompNum = dCompNum;
+}
+
+void arrow_set_optics(ARROW_WRITER* pWriter, double dLambdaNm, unsigned int uiFold)
+{
+    pWriter->dLambdaNm = dLambdaNm;
+    pWriter->uiFold = uiFold;
+}
+
+int arrow_write_columns(ARROW_WRITER* pWriter, const ArrowColumns* pColumns, unsigned long ulCount)
+{
+    static const unsigned char aZero[8];
+    const void* apData[ARROW_COLUMNS] = {
+        pColumns->pllTime, pColumns->apllPos[0], pColumns->apllPos[1], pColumns->apllPos[2],
+        pColumns->apiVel[0], pColumns->apiVel[1], pColumns->apiVel[2], pColumns->puiGeLtStatus, pColumns->pwValid,
+        pColumns->apdPos[0], pColumns->apdPos[1], pColumns->apdPos[2], pColumns->apdVel[0], pColumns->apdVel[1], pColumns->apdVel[2]
+    };
+    struct iovec aBody[2 * ARROW_COLUMNS];
+    int64_t allNodes[2 * ARROW_COLUMNS], allBuffers[4 * ARROW_COLUMNS];
+    uint64_t ullBody = 0;
+    FB_FIELD aBatch[3] = { { 8, ulCount }, { 4, 0 }, { 4, 0 } };   // length, nodes, buffers
+    size_t aulPos[3], ulHeader;
+    int i, iBody = 0;
+
+    for (i = 0; i < ARROW_COLUMNS; i++)
+    {
+        uint64_t ullBytes = (uint64_t)ulCount * aColumnDefs[i].ucBytes;
+
+        if (!apData[i]) return -1;
+        allNodes[2 * i] = ulCount;
+        allNodes[2 * i + 1] = 0;                        // no nulls, so the validity buffer is empty
+        allBuffers[4 * i] = (int64_t)ullBody;
+        allBuffers[4 * i + 1] = 0;
+        allBuffers[4 * i + 2] = (int64_t)ullBody;
+        allBuffers[4 * i + 3] = (int64_t)ullBytes;
+        aBody[iBody].iov_base = (void*)apData[i];
+        aBody[iBody++].iov_len = ullBytes;
+        if (ullBytes % 8)
+        {
+            aBody[iBody].iov_base = (void*)aZero;
+            aBody[iBody++].iov_len = 8 - ullBytes % 8;
+        }
+        ullBody += (ullBytes + 7) & ~7ull;
+    }
+
+    ulHeader = put_message(&pWriter->Fb, ARROW_HEADER_RECORD_BATCH, ullBody);
+    fb_patch(&pWriter->Fb, ulHeader, fb_table(&pWriter->Fb, aBatch, 3, aulPos));
+    fb_patch(&pWriter->Fb, aulPos[1], fb_vector(&pWriter->Fb, ARROW_COLUMNS, 16, 8, allNodes));
+    fb_patch(&pWriter->Fb, aulPos[2], fb_vector(&pWriter->Fb, 2 * ARROW_COLUMNS, 16, 8, allBuffers));
+    return write_message(pWriter, aBody, iBody, ullBody, true);
+}
+
+typedef struct {
+    int64_t allTime[ARROW_BATCH_ROWS];
+    int64_t aallPos[3][ARROW_BATCH_ROWS];
+    int32_t aaiVel[3][ARROW_BATCH_ROWS];
+    uint32_t auiGeLt[ARROW_BATCH_ROWS];
+    uint16_t awValid[ARROW_BATCH_ROWS];
+    double aadPos[3][ARROW_BATCH_ROWS];
+    double aadVel[3][ARROW_BATCH_ROWS];
+} ARROW_SCRATCH;
+
+// One transposition pass per batch, then the conversions run column by column
+int arrow_write_raw(ARROW_WRITER* pWriter, const RawSample* pSamples, unsigned long ulCount)
+{
+    const double dPos = UM_PER_COUNT_AT(pWriter->dLambdaNm, pWriter->uiFold, pWriter->dCompNum);
+    const double dVel = UMPS_PER_COUNT(dPos);
+    const double dOffset = START_MM * 1000;
+    ARROW_SCRATCH* s;
+    ArrowColumns cols;
+    int j;
+
+    if (!pWriter->pScratch && !(pWriter->pScratch = malloc(sizeof(ARROW_SCRATCH)))) return -1;
+    s = pWriter->pScratch;
+    cols.pllTime = s->allTime;
+    cols.puiGeLtStatus = s->auiGeLt;
+    cols.pwValid = s->awValid;
+    for (j = 0; j < 3; j++)
+    {
+        cols.apllPos[j] = s->aallPos[j];
+        cols.apiVel[j] = s->aaiVel[j];
+        cols.apdPos[j] = s->aadPos[j];
+        cols.apdVel[j] = s->aadVel[j];
+    }
+
+    while (ulCount)
+    {
+        unsigned long n = ulCount < ARROW_BATCH_ROWS ? ulCount : ARROW_BATCH_ROWS, i;
+
+        for (i = 0; i < n; i++)
+        {
+            s->allTime[i] = pSamples[i].llTime;
+            s->aallPos[0][i] = pSamples[i].llAx1Pos;
+            s->aallPos[1][i] = pSamples[i].llAx2Pos;
+            s->aallPos[2][i] = pSamples[i].llAx3Pos;
+            s->aaiVel[0][i] = (int32_t)pSamples[i].lAx1Vel;
+            s->aaiVel[1][i] = (int32_t)pSamples[i].lAx2Vel;
+            s->aaiVel[2][i] = (int32_t)pSamples[i].lAx3Vel;
+            s->auiGeLt[i] = pSamples[i].uiGeLtStatus;
+            s->awValid[i] = pSamples[i].wValid;
+        }
+        for (j = 0; j < 3; j++)
+            for (i = 0; i < n; i++)
+            {
+                s->aadPos[j][i] = dPos * s->aallPos[j][i] - dOffset;
+                s->aadVel[j][i] = dVel * s->aaiVel[j][i];
+            }
+
+        if (arrow_write_columns(pWriter, &cols, n) != 0) return -1;
+        pSamples += n;
+        ulCount -= n;
+    }
+    return 0;
+}
+
+// Stream end marker, then for files the footer listing the record batches
+int arrow_close(ARROW_WRITER* pWriter)
+{
+    static const uint32_t auiEos[2] = { 0xffffffffu, 0 };
+    int rc = 0;
+
+    if (!pWriter) return 0;
+    if (write_bytes(pWriter, auiEos, sizeof(auiEos)) != 0) rc = -1;
+    if (rc == 0 && pWriter->bFile)
+    {
+        FLATBUF* fb = &pWriter->Fb;
+        FB_FIELD aFooter[4] = { { 2, ARROW_METADATA_V5 }, { 4, 0 }, { 4, 0 }, { 4, 0 } };  // version, schema, dictionaries, batches
+        size_t aulPos[4], ulRoot;
+        int32_t iFooterLen;
+
+        fb->ulLen = 0;
+        fb->iError = 0;
+        ulRoot = fb_grow(fb, 4);
+        fb_patch(fb, ulRoot, fb_table(fb, aFooter, 4, aulPos));
+        fb_patch(fb, aulPos[1], put_schema(fb));
+        fb_patch(fb, aulPos[2], fb_vector(fb, 0, sizeof(ARROW_BLOCK), 8, NULL));
+        fb_patch(fb, aulPos[3], fb_vector(fb, (uint32_t)pWriter->ulBlocks, sizeof(ARROW_BLOCK), 8, pWriter->aBlocks));
+        iFooterLen = (int32_t)fb->ulLen;
+        if (fb->iError || write_bytes(pWriter, fb->p, fb->ulLen) != 0 ||
+            write_bytes(pWriter, &iFooterLen, 4) != 0 || write_bytes(pWriter, ARROW_MAGIC, 6) != 0)
+            rc = -1;
+    }
+    if (close(pWriter->fd) != 0) rc = -1;
+    free(pWriter->Fb.p);
+    free(pWriter->aBlocks);
+    free(pWriter->pScratch);
+    free(pWriter);
+    return rc;
+}
+
+int arrow_export_capture(const char* pCapturePath, const char* pArrowPath)
+{
+    CAPTURE_READER* pReader;
+    ARROW_WRITER* pWriter;
+    const CAPTURE_INDEX_ENTRY* pIndex;
+    RawSample* aBuf;
+    unsigned long ulEntries, ulChunk, ulRows = 0;
+    double dCompNum = 0;
+    long n;
+    int rc = 0;
+
+    if (!(pReader = capture_open_read(pCapturePath))) return -1;
+    pWriter = arrow_open_file(pArrowPath);
+    aBuf = malloc(ARROW_BATCH_ROWS * sizeof(RawSample));
+    if (pWriter && aBuf)
+    {
+        pIndex = capture_index(pReader, &ulEntries);
+        arrow_set_optics(pWriter, capture_header(pReader)->dLambdaNm, capture_header(pReader)->uiFold);
+        // Batches end at compensation changes, so each one converts with the factor its chunks were recorded under
+        for (ulChunk = 0; ulChunk < ulEntries; ulChunk++)
+        {
+            double d;
+
+            if (capture_chunk_comp(pReader, ulChunk, &d) != 0) break;
+            if (ulRows && (d != dCompNum || ulRows + pIndex[ulChunk].uiSamples > ARROW_BATCH_ROWS))
+            {
+                if (arrow_write_raw(pWriter, aBuf, ulRows) != 0) break;
+                ulRows = 0;
+            }
+            if (ulRows == 0) arrow_set_comp_num(pWriter, dCompNum = d);
+            if ((n = capture_read_chunk(pReader, ulChunk, aBuf + ulRows)) < 0) break;
+            ulRows += (unsigned long)n;
+        }
+        if (ulChunk < ulEntries || (ulRows && arrow_write_raw(pWriter, aBuf, ulRows) != 0)) rc = -1;
+    }
+    else rc = -1;
+    if (arrow_close(pWriter) != 0) rc = -1;
+    free(aBuf);
+    capture_close_read(pReader);
+    return rc;
+}
@@ -0,0 +1,45 @@
+﻿// TuneExpertArrow.h: Apache Arrow IPC file and stream export of raw and converted samples
+//
+
+#pragma once
+
+#include "TuneExpertData.h"
+#include <stdint.h>
+
+#define ARROW_BATCH_ROWS 65536              // rows per record batch written by arrow_write_raw
+#define ARROW_COLUMNS 15
+
+// Column order of the schema. The time column is timestamp[ns, UTC]; velocities are raw 32 bit counts.
+enum E_ARROW_COLUMN
+{
+    ARROW_TIME,
+    ARROW_AX1_RAW, ARROW_AX2_RAW, ARROW_AX3_RAW,
+    ARROW_AX1_VEL_RAW, ARROW_AX2_VEL_RAW, ARROW_AX3_VEL_RAW,
+    ARROW_GELT_STATUS, ARROW_VALID,
+    ARROW_AX1_UM, ARROW_AX2_UM, ARROW_AX3_UM,
+    ARROW_AX1_UMPS, ARROW_AX2_UMPS, ARROW_AX3_UMPS
+};
+
+// Caller owned column buffers, written to the output as they are
+typedef struct {
+    const int64_t* pllTime;
+    const int64_t* apllPos[3];
+    const int32_t* apiVel[3];
+    const uint32_t* puiGeLtStatus;
+    const uint16_t* pwValid;
+    const double* apdPos[3];                // um
+    const double* apdVel[3];                // um/s
+} ArrowColumns;
+
+typedef struct ARROW_WRITER ARROW_WRITER;
+
+ARROW_WRITER* arrow_open_file(const char* pPath);
+ARROW_WRITER* arrow_open_stream(int fd);              // takes ownership of fd, e.g. a pipe
+ARROW_WRITER* arrow_open_socket(const char* pSocketPath);
+void arrow_set_comp_num(ARROW_WRITER* pWriter, double dCompNum);   // used by arrow_write_raw, defaults to the live factor
+void arrow_set_optics(ARROW_WRITER* pWriter, double dLambdaNm, unsigned int uiFold);   // defaults to LAMBDA_NM and FOLD
+int arrow_write_raw(ARROW_WRITER* pWriter, const RawSample* pSamples, unsigned long ulCount);
+int arrow_write_columns(ARROW_WRITER* pWriter, const ArrowColumns* pColumns, unsigned long ulCount);
+int arrow_close(ARROW_WRITER* pWriter);
+
+int arrow_export_capture(const char* pCapturePath, const char* pArrowPath);
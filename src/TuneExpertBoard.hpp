@@ -0,0 +1,242 @@
+﻿// TuneExpertBoard.hpp: C++17 RAII board handle with reads specialized at compile time on axes and fields
+//
+// Board::read<Axes, Fields>() selects the vendor calls and conversions with if constexpr, so a one or two axis
+// loop transfers and scales only what it asks for. One axis samples it and reads its registers; two or three
+// axes latch one software sample for all of them and skip the others' transfers. These reads go straight to
+// the board, past the acquisition pipeline (statistics, capture, broadcast); read_latest() serves that path.
+
+#pragma once
+
+extern "C" {
+#include "TuneExpertData.h"
+#include "TuneExpertEnv.h"
+#include "TuneExpertVendor.h"
+}
+
+#include "TuneExpertUnits.hpp"
+
+#include <stdexcept>
+#include <string>
+#include <utility>
+
+namespace TuneExpert {
+
+enum AxisMask : unsigned { Axis1 = 1, Axis2 = 2, Axis3 = 4, AllAxes = 7 };
+enum FieldMask : unsigned { Position = 1, Velocity = 2, Valid = 4, PosVel = 3 };
+
+class BoardError : public std::runtime_error {
+public:
+    BoardError(const char* pWhen, N1231B_RETURN rc)
+        : std::runtime_error(std::string("Error '") + vendor_api()->pfnGetErrStr(rc) + "' when " + pWhen), Rc(rc) {}
+    N1231B_RETURN code() const noexcept { return Rc; }
+
+private:
+    N1231B_RETURN Rc;
+};
+
+namespace detail {
+
+constexpr int axis_count(unsigned uiAxes) { return (uiAxes & 1) + ((uiAxes >> 1) & 1) + ((uiAxes >> 2) & 1); }
+constexpr int first_axis(unsigned uiAxes) { return (uiAxes & Axis1) ? 0 : (uiAxes & Axis2) ? 1 : 2; }
+constexpr unsigned short valid_bit(int iAxis) { return iAxis == 0 ? N1231B_VALID_1 : iAxis == 1 ? N1231B_VALID_2 : N1231B_VALID_3; }
+
+template <unsigned Axes, unsigned Fields> struct Check {
+    static_assert(Axes && !(Axes & ~AllAxes), "Axes is a non-empty mask of Axis1, Axis2, Axis3");
+    static_assert((Fields & PosVel) && !(Fields & ~(PosVel | Valid)), "Fields needs Position or Velocity, optionally Valid");
+};
+
+// Storage for all three axes keeps the layout fixed; only the selected entries are written
+template <class P, class V, unsigned Axes, unsigned Fields> struct ReadingBase : Check<Axes, Fields> {
+    P aPos[3] = {};
+    V aVel[3] = {};
+    unsigned short wValid = 0;              // N1231B_VALID_* of the selected axes, when Fields has Valid
+
+    template <int A> P pos() const
+    {
+        static_assert((Axes >> A) & 1 && (Fields & Position), "axis or position not read");
+        return aPos[A];
+    }
+    template <int A> V vel() const
+    {
+        static_assert((Axes >> A) & 1 && (Fields & Velocity), "axis or velocity not read");
+        return aVel[A];
+    }
+    template <int A> bool valid() const
+    {
+        static_assert((Axes >> A) & 1 && (Fields & Valid), "axis or valid bits not read");
+        return wValid & valid_bit(A);
+    }
+};
+
+// Holds the vendor lock for one read, released on the way out of a throw as well
+struct VendorLock {
+    VendorLock() { vendor_lock(); }
+    ~VendorLock() { vendor_unlock(); }
+    VendorLock(const VendorLock&) = delete;
+    VendorLock& operator=(const VendorLock&) = delete;
+};
+
+} // namespace detail
+
+// Raw 36 bit counts and raw velocity
+template <unsigned Axes, unsigned Fields = Position | Valid>
+struct RawReading : detail::ReadingBase<long long, long, Axes, Fields> {};
+
+// um relative to START_MM and um/s, as PosVelSample
+template <unsigned Axes, unsigned Fields = Position | Valid>
+struct Reading : detail::ReadingBase<double, double, Axes, Fields> {};
+
+class Board {
+public:
+    // Opens the default board as the library's board and sets it up as open_device() does, but throws where
+    // that exits. A missing driver is an error unless the simulated board was opted into (see TuneExpertVendor.h).
+    Board() : bOwned(true)
+    {
+        N1231B_LOCATION sDevice;
+        unsigned int uiFound = 0;
+
+        if (hBrd) throw BoardError("opening the board, it is already open", N1231B_ERR_DEVICE);
+        if (vendor_load() != 0) throw BoardError((std::string("loading the driver, ") + read_vendor_error()).c_str(), N1231B_ERR_DRIVER);
+        pApi = vendor_api();
+        N1231B_RETURN rc = pApi->pfnFind(NULL, &uiFound, NULL, 0);
+        if (rc == N1231B_SUCCESS && !uiFound) rc = N1231B_ERR_DEVICE;
+        if (rc != N1231B_SUCCESS) throw BoardError("finding the board", rc);
+        pApi->pfnDefaultDevice(&sDevice);
+        if ((rc = pApi->pfnOpen(&sDevice, &hBrd, NULL)) != N1231B_SUCCESS)
+        {
+            hBrd = (N1231B_HANDLE)0;
+            throw BoardError("opening the default board", rc);
+        }
+        setup_device();
+        set_compensation(read_comp_num());
+    }
+
+    // Uses the board open_device() opened, without closing it
+    static Board attached()
+    {
+        if (!hBrd) throw BoardError("attaching to the board, it is not open", N1231B_ERR_HANDLE);
+        return Board(false);
+    }
+
+    Board(const Board&) = delete;
+    Board& operator=(const Board&) = delete;
+    Board(Board&& Other) noexcept
+        : bOwned(std::exchange(Other.bOwned, false)), pApi(Other.pApi), dPCnvrt2um(Other.dPCnvrt2um), dVCnvrt2umps(Other.dVCnvrt2umps) {}
+    Board& operator=(Board&& Other) noexcept
+    {
+        if (this != &Other)
+        {
+            close();
+            bOwned = std::exchange(Other.bOwned, false);
+            pApi = Other.pApi;
+            dPCnvrt2um = Other.dPCnvrt2um;
+            dVCnvrt2umps = Other.dVCnvrt2umps;
+        }
+        return *this;
+    }
+    ~Board() { close(); }
+
+    N1231B_HANDLE handle() const noexcept { return hBrd; }
+
+    // Scales for read(), taken from the environment when the board was opened
+    void set_compensation(double dCompNum) noexcept
+    {
+        dPCnvrt2um = LibraryOptics::um_per_count(dCompNum);
+        dVCnvrt2umps = LibraryOptics::umps_per_count(dCompNum);
+    }
+
+    template <unsigned Axes, unsigned Fields = Position | Valid> RawReading<Axes, Fields> read_raw() const
+    {
+        RawReading<Axes, Fields> r;
+        detail::VendorLock Lock;
+
+        if constexpr (detail::axis_count(Axes) == 1)
+        {
+            constexpr int A = detail::first_axis(Axes);
+            N1231B_RETURN rc = pApi->pfnSamplePosVel(hBrd, (N1231B_AXIS)A);
+            bool bValid = true;
+
+            if (rc != N1231B_SUCCESS) throw BoardError("sampling", rc);
+            if constexpr ((Fields & Position) != 0)
+            {
+                union { N1231B_INT64 s; long i64; } uPos = {};
+
+                rc = pApi->pfnReadRawPos(hBrd, (N1231B_AXIS)A, &uPos.s);
+                if (rc != N1231B_SUCCESS && rc != N1231B_ERR_AXIS) throw BoardError("reading the position", rc);
+                bValid = rc == N1231B_SUCCESS;
+                r.aPos[A] = uPos.i64;
+            }
+            if constexpr ((Fields & Velocity) != 0)
+            {
+                rc = pApi->pfnReadRawVel(hBrd, (N1231B_AXIS)A, &r.aVel[A]);
+                if (rc != N1231B_SUCCESS && rc != N1231B_ERR_AXIS) throw BoardError("reading the velocity", rc);
+                bValid = bValid && rc == N1231B_SUCCESS;
+            }
+            if constexpr ((Fields & Valid) != 0) r.wValid = bValid ? detail::valid_bit(A) : 0;
+        }
+        else
+        {
+            union { N1231B_INT64 s; long i64; } auPos[3] = {};
+            unsigned short wValid = 0;
+            N1231B_RETURN rc = pApi->pfnGetRawPosVelAll(hBrd,
+                pos_ptr<Axes, Fields, 0>(auPos[0].s), vel_ptr<Axes, Fields, 0>(r.aVel[0]),
+                pos_ptr<Axes, Fields, 1>(auPos[1].s), vel_ptr<Axes, Fields, 1>(r.aVel[1]),
+                pos_ptr<Axes, Fields, 2>(auPos[2].s), vel_ptr<Axes, Fields, 2>(r.aVel[2]),
+                (Fields & Valid) ? &wValid : nullptr);
+
+            if (rc != N1231B_SUCCESS && rc != N1231B_ERR_AXIS) throw BoardError("reading positions", rc);
+            if constexpr ((Fields & Position) != 0)
+            {
+                if constexpr ((Axes & Axis1) != 0) r.aPos[0] = auPos[0].i64;
+                if constexpr ((Axes & Axis2) != 0) r.aPos[1] = auPos[1].i64;
+                if constexpr ((Axes & Axis3) != 0) r.aPos[2] = auPos[2].i64;
+            }
+            if constexpr ((Fields & Valid) != 0) r.wValid = wValid & (((Axes & Axis1) ? N1231B_VALID_1 : 0) | ((Axes & Axis2) ? N1231B_VALID_2 : 0) | ((Axes & Axis3) ? N1231B_VALID_3 : 0));
+        }
+        return r;
+    }
+
+    template <unsigned Axes, unsigned Fields = Position | Valid> Reading<Axes, Fields> read() const
+    {
+        RawReading<Axes, Fields> r = read_raw<Axes, Fields>();
+        Reading<Axes, Fields> s;
+
+        convert<Axes, Fields, 0>(r, s);
+        convert<Axes, Fields, 1>(r, s);
+        convert<Axes, Fields, 2>(r, s);
+        s.wValid = r.wValid;
+        return s;
+    }
+
+private:
+    bool bOwned;
+    const VENDOR_API* pApi = vendor_api();
+    double dPCnvrt2um = 0, dVCnvrt2umps = 0;
+
+    explicit Board(bool bOwn) : bOwned(bOwn) { set_compensation(read_comp_num()); }
+
+    void close() noexcept
+    {
+        if (bOwned && hBrd) pApi->pfnClose(&hBrd);
+        bOwned = false;
+    }
+
+    template <unsigned Axes, unsigned Fields, int A> static N1231B_INT64* pos_ptr(N1231B_INT64& Pos)
+    {
+        if constexpr (((Axes >> A) & 1) && (Fields & Position)) return &Pos;
+        else return nullptr;
+    }
+    template <unsigned Axes, unsigned Fields, int A> static long* vel_ptr(long& lVel)
+    {
+        if constexpr (((Axes >> A) & 1) && (Fields & Velocity)) return &lVel;
+        else return nullptr;
+    }
+
+    template <unsigned Axes, unsigned Fields, int A> void convert(const RawReading<Axes, Fields>& r, Reading<Axes, Fields>& s) const
+    {
+        if constexpr (((Axes >> A) & 1) && (Fields & Position)) s.aPos[A] = dPCnvrt2um * r.aPos[A] - START_MM * 1000;
+        if constexpr (((Axes >> A) & 1) && (Fields & Velocity)) s.aVel[A] = dVCnvrt2umps * r.aVel[A];
+    }
+};
+
+} // namespace TuneExpert
@@ -0,0 +1,503 @@
+﻿// TuneExpertBroadcast.c: Disruptor style broadcast ring fed by the acquisition thread
+//
+// Every sample is written once into the ring. BLOCK and DROP_OLDEST consumers own a cursor (the last sequence
+// they released) and read the ring slots in place; before overwriting a slot the producer checks the slowest
+// BLOCK cursor, cached so the scan only happens about once per ring lap. Sequences count from 1, the slot of
+// sequence s is s & ulMask. DROP_NEWEST and DECIMATE need the producer to decide per consumer what to keep,
+// which a shared slot cannot express, so those consumers get their own queue and cost one copy per kept sample.
+// An unsubscribed cursor is retired rather than freed: its queue and eventfd go once every broadcast_update that
+// could still see it has returned, checked whenever a consumer comes or goes, so nobody waits on the producer.
+
+#include "TuneExpertBroadcast.h"
+#include "TuneExpertRealtime.h"
+#include <stdatomic.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#define BROADCAST_SPIN 1000                 // polls before a waiting side starts sleeping
+#define BROADCAST_SLEEP_NS 10000
+
+enum E_CURSOR_STATE
+{
+    CURSOR_FREE,
+    CURSOR_ACTIVE,
+    CURSOR_RETIRED                          // unsubscribed, queue and eventfd not yet released
+};
+
+// One cache line per consumer so cursors moving on different cores do not share lines
+typedef struct {
+    _Alignas(64) atomic_ullong ullCursor;   // last ring sequence released, or queue entries consumed
+    atomic_int iState;
+    int iPolicy;
+    atomic_ullong ullRead, ullDropped, ullDecimated, ullLapped, ullBlockedNs;
+    LatestSample* pQueue;                   // DROP_NEWEST and DECIMATE only
+    unsigned long ulQueueMask;
+    unsigned int uiDecimation, uiPhase;     // uiPhase is producer only
+    atomic_ullong ullQueued;                // queue entries written
+    bool bGeLt;
+    int fdNotify;                           // -1 until broadcast_notify_fd
+    atomic_ullong ullArmedAt;               // published or queued count that signals fdNotify
+    unsigned long long ullRetiredAt;        // updates entered when retired, freed once as many have left
+} BROADCAST_CURSOR;
+
+typedef struct {
+    _Alignas(64) atomic_ullong ullPublished;    // last sequence written
+    BROADCAST_CURSOR aCursor[BROADCAST_MAX_CONSUMERS];
+    unsigned long long ullGate;             // producer only, cached slowest blocking cursor
+    unsigned long ulMask;
+    atomic_uint uiQueued;                   // bit per cursor with its own queue
+    atomic_uint uiArmed;                    // bit per cursor waiting for a signal
+    atomic_bool bStopped;
+    atomic_int iRefs;                       // the live pointer plus one per consumer
+    LatestSample* aSlots;
+} BROADCAST_RING;
+
+struct BROADCAST_CONSUMER {
+    BROADCAST_RING* pRing;
+    BROADCAST_CURSOR* pCursor;
+    unsigned long long ullFirst;            // first sequence of the last peek, to detect being lapped
+};
+
+static _Atomic(BROADCAST_RING*) pLiveRing;
+static atomic_bool bBroadcastBusy;
+static atomic_ullong ullUpdatesEntered, ullUpdatesLeft;
+static pthread_mutex_t BroadcastMutex = PTHREAD_MUTEX_INITIALIZER;
+static atomic_int iGeLtConsumers;
+
+static long long monotonic_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void pause_ns(long lNs)
+{
+    struct timespec ts = { 0, lNs };
+    nanosleep(&ts, NULL);
+}
+
+static bool has_queue(int iPolicy)
+{
+    return iPolicy == BROADCAST_DROP_NEWEST || iPolicy == BROADCAST_DECIMATE;
+}
+
+static void free_cursor(BROADCAST_CURSOR* c)
+{
+    realtime_free(c->pQueue);
+    c->pQueue = NULL;
+    if (c->fdNotify >= 0) close(c->fdNotify);
+    c->fdNotify = -1;
+    atomic_store(&c->iState, CURSOR_FREE);
+}
+
+// Caller holds BroadcastMutex; frees retired cursors no update in progress can still reach
+static void reap_cursors(BROADCAST_RING* pRing, bool bAll)
+{
+    unsigned long long ullLeft = atomic_load(&ullUpdatesLeft);
+    int i;
+
+    for (i = 0; i < BROADCAST_MAX_CONSUMERS; i++)
+    {
+        BROADCAST_CURSOR* c = &pRing->aCursor[i];
+
+        if (atomic_load(&c->iState) == CURSOR_RETIRED && (bAll || ullLeft >= c->ullRetiredAt)) free_cursor(c);
+    }
+}
+
+// The last reference is dropped after the producer let go of the ring, so every retired cursor can go
+static void release_ring(BROADCAST_RING* pRing)
+{
+    if (atomic_fetch_sub(&pRing->iRefs, 1) != 1) return;
+    reap_cursors(pRing, true);
+    realtime_free(pRing->aSlots);
+    realtime_free(pRing);
+}
+
+static void signal_fd(int fd)
+{
+    uint64_t ullOne = 1;
+    if (write(fd, &ullOne, sizeof(ullOne)) < 0) return;
+}
+
+// Wakes the armed consumers whose counter reached its target, or all of them
+static void signal_armed(BROADCAST_RING* pRing, bool bAll)
+{
+    // Sequentially consistent, like the load of uiQueued in publish(), see broadcast_unsubscribe()
+    unsigned int uiArmed = atomic_load(&pRing->uiArmed);
+
+    while (uiArmed)
+    {
+        int i = 0;
+        BROADCAST_CURSOR* c;
+
+        while (!(uiArmed & (1u << i))) i++;
+        uiArmed &= ~(1u << i);
+        c = &pRing->aCursor[i];
+        if (!bAll && (c->pQueue ? atomic_load_explicit(&c->ullQueued, memory_order_relaxed) : atomic_load_explicit(&pRing->ullPublished, memory_order_relaxed)) <
+            atomic_load_explicit(&c->ullArmedAt, memory_order_relaxed)) continue;
+        // The consumer may disarm at the same time; whoever clears the bit owns the signal
+        if (atomic_fetch_and(&pRing->uiArmed, ~(1u << i)) & (1u << i)) signal_fd(c->fdNotify);
+    }
+}
+
+static void stop_live(void)
+{
+    BROADCAST_RING* pRing = atomic_exchange(&pLiveRing, NULL);
+
+    if (!pRing) return;
+    // Also frees a producer waiting on a blocking consumer
+    atomic_store(&pRing->bStopped, true);
+    while (atomic_load(&bBroadcastBusy));
+    signal_armed(pRing, true);
+    release_ring(pRing);
+}
+
+int start_broadcast(unsigned long ulCapacity)
+{
+    BROADCAST_RING* pRing;
+    unsigned long ulSize = 2;
+
+    if (ulCapacity == 0) ulCapacity = BROADCAST_DEFAULT_CAPACITY;
+    while (ulSize < ulCapacity) ulSize <<= 1;
+    if (!(pRing = realtime_alloc(sizeof(BROADCAST_RING)))) return -1;
+    if (!(pRing->aSlots = realtime_alloc(ulSize * sizeof(LatestSample))))
+    {
+        realtime_free(pRing);
+        return -1;
+    }
+    pRing->ulMask = ulSize - 1;
+    atomic_store(&pRing->iRefs, 1);
+
+    pthread_mutex_lock(&BroadcastMutex);
+    stop_live();
+    atomic_store(&pLiveRing, pRing);
+    pthread_mutex_unlock(&BroadcastMutex);
+    return 0;
+}
+
+void stop_broadcast(void)
+{
+    pthread_mutex_lock(&BroadcastMutex);
+    stop_live();
+    pthread_mutex_unlock(&BroadcastMutex);
+}
+
+BROADCAST_CONSUMER* broadcast_subscribe_config(const BroadcastConfig* pConfig)
+{
+    BROADCAST_CONSUMER* pConsumer;
+    BROADCAST_RING* pRing;
+    int i;
+
+    if (!(pConsumer = calloc(1, sizeof(BROADCAST_CONSUMER)))) return NULL;
+    pthread_mutex_lock(&BroadcastMutex);
+    if ((pRing = atomic_load(&pLiveRing)) != NULL) reap_cursors(pRing, false);
+    if (pRing)
+        for (i = 0; i < BROADCAST_MAX_CONSUMERS; i++)
+        {
+            BROADCAST_CURSOR* c = &pRing->aCursor[i];
+
+            if (atomic_load(&c->iState) != CURSOR_FREE) continue;
+            c->iPolicy = pConfig->iPolicy;
+            c->pQueue = NULL;
+            c->fdNotify = -1;
+            c->bGeLt = pConfig->bGeLt;
+            if (has_queue(c->iPolicy))
+            {
+                unsigned long ulQueue = pConfig->ulQueue ? pConfig->ulQueue : pRing->ulMask + 1, ulSize = 2;
+
+                while (ulSize < ulQueue) ulSize <<= 1;
+                if (!(c->pQueue = realtime_alloc(ulSize * sizeof(LatestSample)))) break;
+                c->ulQueueMask = ulSize - 1;
+                c->uiDecimation = pConfig->uiDecimation ? pConfig->uiDecimation : BROADCAST_DEFAULT_DECIMATION;
+                c->uiPhase = 0;
+            }
+            atomic_store(&c->ullRead, 0);
+            atomic_store(&c->ullDropped, 0);
+            atomic_store(&c->ullDecimated, 0);
+            atomic_store(&c->ullLapped, 0);
+            atomic_store(&c->ullBlockedNs, 0);
+            atomic_store(&c->ullQueued, 0);
+            atomic_store(&c->ullCursor, c->pQueue ? 0 : atomic_load(&pRing->ullPublished));
+            atomic_store(&c->iState, CURSOR_ACTIVE);
+            if (c->pQueue) atomic_fetch_or(&pRing->uiQueued, 1u << i);
+            if (c->bGeLt) atomic_fetch_add(&iGeLtConsumers, 1);
+            atomic_fetch_add(&pRing->iRefs, 1);
+            pConsumer->pRing = pRing;
+            pConsumer->pCursor = c;
+            break;
+        }
+    pthread_mutex_unlock(&BroadcastMutex);
+    if (!pConsumer->pRing)
+    {
+        free(pConsumer);
+        return NULL;
+    }
+    return pConsumer;
+}
+
+BROADCAST_CONSUMER* broadcast_subscribe(int iPolicy)
+{
+    BroadcastConfig bc;
+
+    memset(&bc, 0, sizeof(bc));
+    bc.iPolicy = iPolicy;
+    return broadcast_subscribe_config(&bc);
+}
+
+// Never waits for the producer, which may itself be blocked on a consumer whose thread is calling this
+void broadcast_unsubscribe(BROADCAST_CONSUMER* pConsumer)
+{
+    BROADCAST_RING* pRing;
+    BROADCAST_CURSOR* c;
+
+    if (!pConsumer) return;
+    pRing = pConsumer->pRing;
+    c = pConsumer->pCursor;
+    pthread_mutex_lock(&BroadcastMutex);
+    atomic_fetch_and(&pRing->uiQueued, ~(1u << (c - pRing->aCursor)));
+    atomic_fetch_and(&pRing->uiArmed, ~(1u << (c - pRing->aCursor)));
+    if (c->bGeLt) atomic_fetch_sub(&iGeLtConsumers, 1);
+    // An update that entered before the bits were cleared may still fill the queue or signal the eventfd; one
+    // entering later reads the cleared bits, as both sides order these accesses sequentially consistent
+    c->ullRetiredAt = atomic_load(&ullUpdatesEntered);
+    atomic_store(&c->iState, c->pQueue || c->fdNotify >= 0 ? CURSOR_RETIRED : CURSOR_FREE);
+    reap_cursors(pRing, false);
+    release_ring(pRing);
+    pthread_mutex_unlock(&BroadcastMutex);
+    free(pConsumer);
+}
+
+static unsigned long peek_queue(BROADCAST_CURSOR* c, const LatestSample** ppSlots)
+{
+    unsigned long long ullCursor = atomic_load_explicit(&c->ullCursor, memory_order_relaxed);
+    unsigned long long ullQueued = atomic_load_explicit(&c->ullQueued, memory_order_acquire);
+    unsigned long ulSlot = (unsigned long)(ullCursor & c->ulQueueMask);
+    unsigned long ulRun = c->ulQueueMask + 1 - ulSlot;
+
+    if (ullQueued == ullCursor) return 0;
+    *ppSlots = &c->pQueue[ulSlot];
+    return ullQueued - ullCursor < ulRun ? (unsigned long)(ullQueued - ullCursor) : ulRun;
+}
+
+unsigned long broadcast_peek(BROADCAST_CONSUMER* pConsumer, const LatestSample** ppSlots)
+{
+    BROADCAST_RING* pRing = pConsumer->pRing;
+    BROADCAST_CURSOR* c = pConsumer->pCursor;
+    unsigned long long ullCursor, ullPublished;
+    unsigned long ulSlot, ulCount;
+
+    if (c->pQueue) return peek_queue(c, ppSlots);
+    ullCursor = atomic_load_explicit(&c->ullCursor, memory_order_relaxed);
+    ullPublished = atomic_load_explicit(&pRing->ullPublished, memory_order_acquire);
+
+    // The producer may already be filling the slot after ullPublished, so a lap counts from there.
+    // A BLOCK cursor can be exactly a ring behind, the producer then waits for it before that write.
+    if (c->iPolicy == BROADCAST_DROP_OLDEST && ullPublished + 1 - ullCursor > pRing->ulMask + 1)
+    {
+        // Resume keeping the newest half ring
+        unsigned long long ullResume = ullPublished - (pRing->ulMask + 1) / 2;
+
+        atomic_fetch_add(&c->ullLapped, 1);
+        atomic_fetch_add(&c->ullDropped, ullResume - ullCursor);
+        ullCursor = ullResume;
+        atomic_store_explicit(&c->ullCursor, ullCursor, memory_order_release);
+    }
+    if (ullPublished == ullCursor) return 0;
+    ulSlot = (unsigned long)((ullCursor + 1) & pRing->ulMask);
+    ulCount = ullPublished - ullCursor < pRing->ulMask + 1 - ulSlot ? (unsigned long)(ullPublished - ullCursor) : pRing->ulMask + 1 - ulSlot;
+    pConsumer->ullFirst = ullCursor + 1;
+    *ppSlots = &pRing->aSlots[ulSlot];
+    return ulCount;
+}
+
+long broadcast_wait(BROADCAST_CONSUMER* pConsumer, const LatestSample** ppSlots, long long llTimeoutNs)
+{
+    long long llDeadline = llTimeoutNs < 0 ? 0 : monotonic_ns() + llTimeoutNs;
+    unsigned long n;
+    int iSpin = 0;
+
+    while ((n = broadcast_peek(pConsumer, ppSlots)) == 0)
+    {
+        if (atomic_load(&pConsumer->pRing->bStopped)) return (n = broadcast_peek(pConsumer, ppSlots)) ? (long)n : -1;
+        if (llTimeoutNs >= 0 && monotonic_ns() >= llDeadline) return 0;
+        if (++iSpin > BROADCAST_SPIN) pause_ns(BROADCAST_SLEEP_NS);
+    }
+    return (long)n;
+}
+
+int broadcast_release(BROADCAST_CONSUMER* pConsumer, unsigned long ulCount)
+{
+    BROADCAST_RING* pRing = pConsumer->pRing;
+    BROADCAST_CURSOR* c = pConsumer->pCursor;
+    unsigned long long ullPublished;
+
+    atomic_fetch_add_explicit(&c->ullRead, ulCount, memory_order_relaxed);
+    atomic_store_explicit(&c->ullCursor, atomic_load_explicit(&c->ullCursor, memory_order_relaxed) + ulCount, memory_order_release);
+    if (c->iPolicy != BROADCAST_DROP_OLDEST) return 0;
+
+    // A DROP_OLDEST consumer is not waited for, so check that its slots were not reused while it read them
+    ullPublished = atomic_load_explicit(&pRing->ullPublished, memory_order_acquire);
+    return ullPublished + 1 >= pConsumer->ullFirst + pRing->ulMask + 1 ? -1 : 0;
+}
+
+BroadcastStats read_broadcast_stats(BROADCAST_CONSUMER* pConsumer)
+{
+    BROADCAST_CURSOR* c = pConsumer->pCursor;
+    BroadcastStats bs;
+
+    bs.ullRead = atomic_load(&c->ullRead);
+    bs.ullDropped = atomic_load(&c->ullDropped);
+    bs.ullDecimated = atomic_load(&c->ullDecimated);
+    bs.ullLapped = atomic_load(&c->ullLapped);
+    bs.ullBlockedNs = atomic_load(&c->ullBlockedNs);
+    bs.ulBacklog = (unsigned long)((c->pQueue ? atomic_load(&c->ullQueued) : atomic_load(&pConsumer->pRing->ullPublished)) - atomic_load(&c->ullCursor));
+    return bs;
+}
+
+int broadcast_notify_fd(BROADCAST_CONSUMER* pConsumer)
+{
+    BROADCAST_CURSOR* c = pConsumer->pCursor;
+
+    if (c->fdNotify < 0) c->fdNotify = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    return c->fdNotify;
+}
+
+int broadcast_arm(BROADCAST_CONSUMER* pConsumer, unsigned long ulCount)
+{
+    BROADCAST_RING* pRing = pConsumer->pRing;
+    BROADCAST_CURSOR* c = pConsumer->pCursor;
+    unsigned int uiBit = 1u << (c - pRing->aCursor);
+    unsigned long ulCapacity = c->pQueue ? c->ulQueueMask + 1 : pRing->ulMask + 1;
+    unsigned long long ullTarget;
+
+    if (broadcast_notify_fd(pConsumer) < 0) return -1;
+    // A full queue or ring is as much as can ever be waited for
+    if (ulCount == 0) ulCount = 1;
+    if (ulCount > ulCapacity) ulCount = ulCapacity;
+    ullTarget = atomic_load(&c->ullCursor) + ulCount;
+    atomic_store(&c->ullArmedAt, ullTarget);
+    atomic_fetch_or(&pRing->uiArmed, uiBit);
+
+    // Samples that arrived before the bit was visible are not signalled, so look again
+    if (atomic_load(&pRing->bStopped) || (c->pQueue ? atomic_load(&c->ullQueued) : atomic_load(&pRing->ullPublished)) >= ullTarget)
+    {
+        atomic_fetch_and(&pRing->uiArmed, ~uiBit);
+        return 1;
+    }
+    return 0;
+}
+
+// Slowest BLOCK cursor; DROP_OLDEST consumers notice being lapped themselves
+static unsigned long long scan_gate(BROADCAST_RING* pRing, BROADCAST_CURSOR** ppSlowest)
+{
+    // A consumer subscribing later starts at or after the current sequence
+    unsigned long long ullGate = atomic_load_explicit(&pRing->ullPublished, memory_order_relaxed);
+    int i;
+
+    *ppSlowest = NULL;
+    for (i = 0; i < BROADCAST_MAX_CONSUMERS; i++)
+    {
+        BROADCAST_CURSOR* c = &pRing->aCursor[i];
+        unsigned long long ullCursor;
+
+        if (atomic_load_explicit(&c->iState, memory_order_acquire) != CURSOR_ACTIVE || c->iPolicy != BROADCAST_BLOCK) continue;
+        ullCursor = atomic_load_explicit(&c->ullCursor, memory_order_acquire);
+        if (ullCursor < ullGate)
+        {
+            ullGate = ullCursor;
+            *ppSlowest = c;
+        }
+    }
+    return ullGate;
+}
+
+// Admission to a consumer's own queue; only the producer writes ullQueued and uiPhase
+static void enqueue(BROADCAST_CURSOR* c, const LatestSample* pSample)
+{
+    unsigned long long ullQueued = atomic_load_explicit(&c->ullQueued, memory_order_relaxed);
+    unsigned long long ullUsed = ullQueued - atomic_load_explicit(&c->ullCursor, memory_order_acquire);
+
+    if (c->iPolicy == BROADCAST_DECIMATE && ullUsed > c->ulQueueMask / 2)
+    {
+        if (c->uiPhase++ % c->uiDecimation != 0)
+        {
+            atomic_fetch_add_explicit(&c->ullDecimated, 1, memory_order_relaxed);
+            atomic_fetch_add_explicit(&c->ullDropped, 1, memory_order_relaxed);
+            return;
+        }
+    }
+    else c->uiPhase = 0;
+    if (ullUsed > c->ulQueueMask)
+    {
+        atomic_fetch_add_explicit(&c->ullDropped, 1, memory_order_relaxed);
+        return;
+    }
+    c->pQueue[ullQueued & c->ulQueueMask] = *pSample;
+    atomic_store_explicit(&c->ullQueued, ullQueued + 1, memory_order_release);
+}
+
+static void publish(BROADCAST_RING* pRing, const LatestSample* pSample)
+{
+    unsigned long long ullNext = atomic_load_explicit(&pRing->ullPublished, memory_order_relaxed) + 1;
+    unsigned int uiQueued = atomic_load(&pRing->uiQueued);
+    LatestSample* pSlot;
+
+    // Writing sequence ullNext reuses the slot of ullNext - capacity, which every BLOCK cursor must have passed
+    if (ullNext > pRing->ulMask + 1 && pRing->ullGate < ullNext - (pRing->ulMask + 1))
+    {
+        unsigned long long ullNeed = ullNext - (pRing->ulMask + 1);
+        BROADCAST_CURSOR *pSlowest, *pWaitedOn = NULL;
+        long long llWaitStart = 0;
+        int iSpin = 0;
+
+        while ((pRing->ullGate = scan_gate(pRing, &pSlowest)) < ullNeed)
+        {
+            if (atomic_load(&pRing->bStopped)) return;
+            if (!llWaitStart)
+            {
+                llWaitStart = monotonic_ns();
+                pWaitedOn = pSlowest;
+            }
+            if (++iSpin > BROADCAST_SPIN) pause_ns(BROADCAST_SLEEP_NS);
+        }
+        if (pWaitedOn) atomic_fetch_add_explicit(&pWaitedOn->ullBlockedNs, monotonic_ns() - llWaitStart, memory_order_relaxed);
+    }
+
+    pSlot = &pRing->aSlots[ullNext & pRing->ulMask];
+    *pSlot = *pSample;
+    atomic_store_explicit(&pRing->ullPublished, ullNext, memory_order_release);
+
+    while (uiQueued)
+    {
+        int i = 0;
+
+        while (!(uiQueued & (1u << i))) i++;
+        uiQueued &= ~(1u << i);
+        enqueue(&pRing->aCursor[i], pSlot);
+    }
+    signal_armed(pRing, false);
+}
+
+bool broadcast_wants_gelt(void)
+{
+    return atomic_load_explicit(&iGeLtConsumers, memory_order_relaxed) > 0;
+}
+
+// Runs on the acquisition thread
+void broadcast_update(const LatestSample* pSample)
+{
+    BROADCAST_RING* pRing;
+
+    atomic_store(&bBroadcastBusy, true);
+    atomic_fetch_add(&ullUpdatesEntered, 1);
+    if ((pRing = atomic_load(&pLiveRing)) != NULL) publish(pRing, pSample);
+    atomic_fetch_add_explicit(&ullUpdatesLeft, 1, memory_order_release);
+    atomic_store(&bBroadcastBusy, false);
+}
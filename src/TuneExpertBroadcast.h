@@ -0,0 +1,64 @@
+﻿// TuneExpertBroadcast.h: Single producer ring that every subscriber reads in place (fan-out of acquired samples)
+//
+
+#pragma once
+
+#include "TuneExpertData.h"
+
+#define BROADCAST_MAX_CONSUMERS 16
+#define BROADCAST_DEFAULT_CAPACITY 65536
+#define BROADCAST_DEFAULT_DECIMATION 10
+
+// What happens to a consumer that falls behind
+enum E_BROADCAST_POLICY
+{
+    BROADCAST_BLOCK,                        // the acquisition thread waits for it when the ring is full
+    BROADCAST_DROP_OLDEST,                  // never waited for; once lapped it skips ahead, keeping the newest half ring
+    BROADCAST_DROP_NEWEST,                  // own queue, samples arriving while it is full are not queued
+    BROADCAST_DECIMATE                      // own queue, only one sample in uiDecimation is queued while it is over half full
+};
+
+typedef struct {
+    int iPolicy;                            // E_BROADCAST_POLICY
+    unsigned long ulQueue;                  // queue of the DROP_NEWEST and DECIMATE policies, 0 = ring capacity
+    unsigned int uiDecimation;              // 0 = BROADCAST_DEFAULT_DECIMATION
+    bool bGeLt;                             // the board's comparator status is only read while a consumer wants it
+} BroadcastConfig;
+
+typedef struct {
+    unsigned long long ullRead;             // samples released by the consumer
+    unsigned long long ullDropped;          // samples it never saw, by any policy
+    unsigned long long ullDecimated;        // part of ullDropped left out by decimation
+    unsigned long long ullLapped;           // times a DROP_OLDEST consumer was lapped
+    unsigned long long ullBlockedNs;        // time the acquisition thread spent waiting for it
+    unsigned long ulBacklog;                // samples available but not yet released
+} BroadcastStats;
+
+typedef struct BROADCAST_CONSUMER BROADCAST_CONSUMER;
+
+// The capacity is rounded up to a power of two; stopping keeps the ring alive until its last consumer leaves
+int start_broadcast(unsigned long ulCapacity);
+void stop_broadcast(void);
+
+// Consumers start at the next sample published after they subscribe
+BROADCAST_CONSUMER* broadcast_subscribe(int iPolicy);
+BROADCAST_CONSUMER* broadcast_subscribe_config(const BroadcastConfig* pConfig);
+void broadcast_unsubscribe(BROADCAST_CONSUMER* pConsumer);
+
+// Points *ppSlots at the consumer's next unread samples and returns how many follow contiguously
+unsigned long broadcast_peek(BROADCAST_CONSUMER* pConsumer, const LatestSample** ppSlots);
+// As broadcast_peek, waiting up to llTimeoutNs (< 0 = forever); -1 once stopped and drained
+long broadcast_wait(BROADCAST_CONSUMER* pConsumer, const LatestSample** ppSlots, long long llTimeoutNs);
+// Hands ulCount samples back; -1 if a DROP_OLDEST consumer was lapped while reading them
+int broadcast_release(BROADCAST_CONSUMER* pConsumer, unsigned long ulCount);
+BroadcastStats read_broadcast_stats(BROADCAST_CONSUMER* pConsumer);
+
+// Event loops wait on this eventfd instead of polling (-1 where there is none). broadcast_arm asks the
+// acquisition thread to signal it once ulCount samples are available or the ring stops; it returns 1 when
+// that is already the case, in which case nothing is signalled, 0 once armed.
+int broadcast_notify_fd(BROADCAST_CONSUMER* pConsumer);
+int broadcast_arm(BROADCAST_CONSUMER* pConsumer, unsigned long ulCount);
+
+// Acquisition side
+bool broadcast_wants_gelt(void);
+void broadcast_update(const LatestSample* pSample);
@@ -0,0 +1,1261 @@
+﻿// TuneExpertCapture.c: Capture files made of independently decodable compressed chunks
+//
+// Layout: file header, chunks (header + payload), chunk index, footer. Every chunk is complete on its own,
+// and completed chunks are handed on at most CAPTURE_FLUSH_NS apart, so a crash loses the chunk still pending
+// in memory and those completed in the CAPTURE_FLUSH_NS before it; the reader rebuilds a missing index.
+
+#include "TuneExpertCapture.h"
+#include "TuneExpertCodec.h"
+#include "TuneExpertEnv.h"
+#include "TuneExpertEnvelope.h"
+#include "TuneExpertQuery.h"
+#include "TuneExpertRealtime.h"
+#include "TuneExpertReplay.h"
+#include "TuneExpertVendor.h"
+#include <stdatomic.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define file_seek fseeko
+#define file_tell ftello
+
+static long long monotonic_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+typedef struct CLOSING_SEGMENT {
+    struct CLOSING_SEGMENT* pNext;
+    ASYNC_WRITER* pAsync;
+    ENVELOPE_BUILDER* pEnvelope;
+    SUMMARY_BUILDER* pSummary;
+    char szSummary[CAPTURE_PATH_MAX + 24];
+} CLOSING_SEGMENT;
+
+typedef struct {
+    char szPrefix[CAPTURE_PATH_MAX];
+    long long llSegmentNs;
+    unsigned long long ullSegmentBytes;
+    CaptureSegment* aSegments;          // szPath holds the file name relative to the catalog
+    unsigned long ulSegments, ulSize;
+    CLOSING_SEGMENT *pClosingHead, *pClosingTail;   // finished segments, closed and synced by the segment thread
+    unsigned long ulPrepare;            // segment number whose writer the segment thread opens ahead, 0 if none
+    bool bPrepared;                     // ulPrepare has been attempted, pPrepared holds the result
+    ASYNC_WRITER* pPrepared;
+    pthread_t Thread;
+    bool bThread, bStop;
+    int iCloseError;
+    pthread_mutex_t Mutex;
+    pthread_cond_t Cond;
+} SEGMENT_SET;
+
+struct CAPTURE_WRITER {
+    FILE* fp;
+    ASYNC_WRITER* pAsync;
+    SEGMENT_SET* pSet;
+    ENVELOPE_BUILDER* pEnvelope;        // NULL for streams, writes its sidecar as the capture grows
+    SUMMARY_BUILDER* pSummary;          // NULL for streams
+    char szSummary[CAPTURE_PATH_MAX + 24];
+    unsigned long long ullOffset;
+    long long llFlushTime;              // monotonic time completed chunks were last handed on
+    double dCompNum;                    // factor of the pending samples
+    uint32_t uiComp;                    // compensation records in the current file
+    CAPTURE_INDEX_ENTRY* pIndex;
+    unsigned long ulEntries, ulIndexSize;
+    RawSample aPending[CAPTURE_CHUNK_SAMPLES];
+    unsigned long ulPending;
+    unsigned char aPayload[CAPTURE_CHUNK_SAMPLES / CODEC_BLOCK * CODEC_MAX_BYTES(CODEC_BLOCK)];
+};
+
+struct CAPTURE_READER {
+    FILE* fp;
+    char szPath[CAPTURE_PATH_MAX];
+    CAPTURE_FILE_HEADER Header;
+    unsigned long ulHeaderBytes;        // where the first chunk starts, by version
+    CAPTURE_INDEX_ENTRY* pIndex;
+    unsigned long ulEntries, ulNextChunk;
+    uint32_t uiComp;                    // compensation record last looked up by capture_chunk_comp, and its factor
+    double dComp;
+    unsigned long long ullPos;          // file position after the last chunk read, to skip needless seeks
+    RawSample aChunk[CAPTURE_CHUNK_SAMPLES];
+    unsigned long ulChunkCount, ulChunkPos;
+    unsigned char* pPayload;
+    size_t ulPayloadSize;
+};
+
+struct CAPTURE_CATALOG {
+    CaptureSegment* aSegments;          // szPath resolved against the catalog directory
+    unsigned long ulSegments, ulNext;
+    CAPTURE_READER* pReader;
+};
+
+static int sink_write(CAPTURE_WRITER* pWriter, const void* pData, size_t ulBytes)
+{
+    int rc;
+
+    if (pWriter->pAsync) rc = async_writer_write(pWriter->pAsync, pData, ulBytes);
+    else if (pWriter->fp) rc = fwrite(pData, 1, ulBytes, pWriter->fp) == ulBytes ? 0 : -1;
+    else rc = -1;
+    if (rc == 0) pWriter->ullOffset += ulBytes;
+    return rc;
+}
+
+static uint32_t capture_source(void)
+{
+    if (read_replay_status().bActive) return CAPTURE_SOURCE_REPLAY;
+    switch (read_vendor_backend())
+    {
+    case VENDOR_DRIVER: return CAPTURE_SOURCE_BOARD;
+    case VENDOR_SIMULATED: return CAPTURE_SOURCE_SIMULATED;
+    default: return CAPTURE_SOURCE_UNKNOWN;
+    }
+}
+
+static int begin_file(CAPTURE_WRITER* pWriter, long long llStartTime)
+{
+    CAPTURE_FILE_HEADER hdr;
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.szMagic, CAPTURE_MAGIC, sizeof(hdr.szMagic));
+    hdr.uiVersion = CAPTURE_VERSION;
+    hdr.uiFold = FOLD;
+    hdr.dLambdaNm = LAMBDA_NM;
+    hdr.dCompNum = pWriter->dCompNum;
+    hdr.llStartTime = llStartTime;
+    hdr.uiSource = capture_source();
+    pWriter->ullOffset = 0;
+    pWriter->uiComp = 0;
+    pWriter->ulEntries = 0;
+    pWriter->llFlushTime = monotonic_ns();
+    return sink_write(pWriter, &hdr, sizeof(hdr));
+}
+
+static int end_file(CAPTURE_WRITER* pWriter)
+{
+    CAPTURE_FOOTER ftr;
+    size_t ulBytes = pWriter->ulEntries * sizeof(CAPTURE_INDEX_ENTRY);
+
+    ftr.uiMagic = CAPTURE_INDEX_MAGIC;
+    ftr.uiEntries = (uint32_t)pWriter->ulEntries;
+    ftr.ullIndexOffset = pWriter->ullOffset;
+    ftr.uiEntrySize = sizeof(CAPTURE_INDEX_ENTRY);
+    ftr.uiIndexCrc = codec_crc32c(0, pWriter->pIndex, ulBytes);
+    if (ulBytes && sink_write(pWriter, pWriter->pIndex, ulBytes) != 0) return -1;
+    return sink_write(pWriter, &ftr, sizeof(ftr));
+}
+
+static CAPTURE_WRITER* capture_start(FILE* fp, ASYNC_WRITER* pAsync, const char* pPath)
+{
+    CAPTURE_WRITER* pWriter;
+
+    if (!fp && !pAsync) return NULL;
+    if ((pPath && strlen(pPath) >= CAPTURE_PATH_MAX) || !(pWriter = calloc(1, sizeof(CAPTURE_WRITER))))
+    {
+        if (fp) fclose(fp);
+        async_writer_close(pAsync);
+        return NULL;
+    }
+    pWriter->fp = fp;
+    pWriter->pAsync = pAsync;
+    pWriter->dCompNum = read_comp_num();
+    if (pPath)
+    {
+        char szEnvelope[CAPTURE_PATH_MAX + 8];
+
+        snprintf(szEnvelope, sizeof(szEnvelope), "%s%s", pPath, ENVELOPE_SUFFIX);
+        pWriter->pEnvelope = envelope_new(szEnvelope);
+        snprintf(pWriter->szSummary, sizeof(pWriter->szSummary), "%s%s", pPath, SUMMARY_SUFFIX);
+        pWriter->pSummary = summary_new();
+    }
+    if (begin_file(pWriter, get_time_ns()) != 0)
+    {
+        capture_close(pWriter);
+        return NULL;
+    }
+    return pWriter;
+}
+
+CAPTURE_WRITER* capture_open(const char* pPath)
+{
+    return capture_start(fopen(pPath, "wb"), NULL, pPath);
+}
+
+CAPTURE_WRITER* capture_open_fd(int fd)
+{
+    return capture_start(fdopen(fd, "wb"), NULL, NULL);
+}
+
+CAPTURE_WRITER* capture_open_async(const char* pPath)
+{
+    return capture_start(NULL, async_writer_open(pPath, WRITER_DEFAULT_BUFFERS, WRITER_DEFAULT_BUFFER_BYTES), pPath);
+}
+
+// Rewrites the whole catalog and renames it into place so readers never see a partial one
+static void write_catalog(SEGMENT_SET* pSet)
+{
+    char szPath[CAPTURE_PATH_MAX + 8], szTemp[CAPTURE_PATH_MAX + 16];
+    CaptureSegment* aCopy;
+    unsigned long i, n;
+    FILE* fp;
+
+    pthread_mutex_lock(&pSet->Mutex);
+    n = pSet->ulSegments;
+    if ((aCopy = malloc((n ? n : 1) * sizeof(CaptureSegment))) != NULL) memcpy(aCopy, pSet->aSegments, n * sizeof(CaptureSegment));
+    pthread_mutex_unlock(&pSet->Mutex);
+    if (!aCopy) return;
+
+    snprintf(szPath, sizeof(szPath), "%s.cat", pSet->szPrefix);
+    snprintf(szTemp, sizeof(szTemp), "%s.cat.tmp", pSet->szPrefix);
+    if ((fp = fopen(szTemp, "w")) != NULL)
+    {
+        fprintf(fp, "segment,first_ns,last_ns,samples,file\n");
+        for (i = 0; i < n; i++)
+            fprintf(fp, "%lu,%lld,%lld,%llu,%s\n", i + 1, aCopy[i].llFirstTime, aCopy[i].llLastTime, aCopy[i].ullSamples, aCopy[i].szPath);
+        if (fclose(fp) == 0)
+        {
+            rename(szTemp, szPath);
+        }
+    }
+    free(aCopy);
+}
+
+static int segment_path(const SEGMENT_SET* pSet, unsigned long ulNumber, char* pPath, size_t ulSize)
+{
+    int n = snprintf(pPath, ulSize, "%s_%06lu.cap", pSet->szPrefix, ulNumber);
+    return n >= 0 && (size_t)n < ulSize ? 0 : -1;
+}
+
+// Takes the writer the segment thread opened ahead for this segment, or opens it here when there is none
+static ASYNC_WRITER* segment_writer(SEGMENT_SET* pSet, unsigned long ulNumber, const char* pPath)
+{
+    ASYNC_WRITER* pAsync = NULL;
+    bool bTaken = false;
+
+    pthread_mutex_lock(&pSet->Mutex);
+    if (pSet->bThread && pSet->ulPrepare == ulNumber)
+    {
+        while (!pSet->bPrepared) pthread_cond_wait(&pSet->Cond, &pSet->Mutex);
+        pAsync = pSet->pPrepared;
+        bTaken = pAsync != NULL;
+        pSet->pPrepared = NULL;
+        pSet->bPrepared = false;
+        pSet->ulPrepare = 0;
+    }
+    pthread_mutex_unlock(&pSet->Mutex);
+    return bTaken ? pAsync : async_writer_open(pPath, WRITER_DEFAULT_BUFFERS, WRITER_DEFAULT_BUFFER_BYTES);
+}
+
+// Starts the next segment; it is listed in the catalog with last_ns -1 until it is closed
+static int open_segment(CAPTURE_WRITER* pWriter)
+{
+    SEGMENT_SET* pSet = pWriter->pSet;
+    CaptureSegment seg;
+    char szPath[CAPTURE_PATH_MAX], szEnvelope[CAPTURE_PATH_MAX + 8];
+    const char *pName, *p;
+    int rc;
+
+    if (segment_path(pSet, pSet->ulSegments + 1, szPath, sizeof(szPath)) != 0) return -1;
+    for (pName = p = szPath; *p; p++) if (*p == '/' || *p == '\\') pName = p + 1;
+    memset(&seg, 0, sizeof(seg));
+    memcpy(seg.szPath, pName, strlen(pName) + 1);
+    seg.llFirstTime = get_time_ns();
+    seg.llLastTime = -1;
+
+    if (!(pWriter->pAsync = segment_writer(pSet, pSet->ulSegments + 1, szPath))) return -1;
+    snprintf(szEnvelope, sizeof(szEnvelope), "%s%s", szPath, ENVELOPE_SUFFIX);
+    pWriter->pEnvelope = envelope_new(szEnvelope);
+    snprintf(pWriter->szSummary, sizeof(pWriter->szSummary), "%s%s", szPath, SUMMARY_SUFFIX);
+    pWriter->pSummary = summary_new();
+    rc = begin_file(pWriter, seg.llFirstTime);
+
+    pthread_mutex_lock(&pSet->Mutex);
+    if (pSet->ulSegments == pSet->ulSize)
+    {
+        unsigned long ulSize = pSet->ulSize ? pSet->ulSize * 2 : 16;
+        CaptureSegment* a = realloc(pSet->aSegments, ulSize * sizeof(CaptureSegment));
+        if (a)
+        {
+            pSet->aSegments = a;
+            pSet->ulSize = ulSize;
+        }
+    }
+    if (pSet->ulSegments < pSet->ulSize) pSet->aSegments[pSet->ulSegments++] = seg;
+    else rc = -1;
+    // Have the following segment's file, buffers and ring ready before this one fills up
+    pSet->ulPrepare = pSet->ulSegments + 1;
+    pSet->bPrepared = false;
+    pthread_cond_signal(&pSet->Cond);
+    pthread_mutex_unlock(&pSet->Mutex);
+    return rc;
+}
+
+static int finish_segment(CAPTURE_WRITER* pWriter)
+{
+    SEGMENT_SET* pSet = pWriter->pSet;
+    unsigned long long ullSamples = 0;
+    unsigned long i;
+    int rc = end_file(pWriter);
+
+    for (i = 0; i < pWriter->ulEntries; i++) ullSamples += pWriter->pIndex[i].uiSamples;
+    pthread_mutex_lock(&pSet->Mutex);
+    if (pSet->ulSegments)
+    {
+        CaptureSegment* pSeg = &pSet->aSegments[pSet->ulSegments - 1];
+        if (pWriter->ulEntries)
+        {
+            pSeg->llFirstTime = pWriter->pIndex[0].llFirstTime;
+            pSeg->llLastTime = pWriter->pIndex[pWriter->ulEntries - 1].llLastTime;
+        }
+        else pSeg->llLastTime = pSeg->llFirstTime;
+        pSeg->ullSamples = ullSamples;
+    }
+    pthread_mutex_unlock(&pSet->Mutex);
+    return rc;
+}
+
+static void close_segment(SEGMENT_SET* pSet, CLOSING_SEGMENT* pSeg)
+{
+    int rc = 0;
+
+    if (async_writer_close(pSeg->pAsync) != 0) rc = -1;
+    if (pSeg->pEnvelope && envelope_finish(pSeg->pEnvelope) != 0) rc = -1;
+    envelope_free(pSeg->pEnvelope);
+    if (pSeg->pSummary && summary_save(pSeg->pSummary, pSeg->szSummary) != 0) rc = -1;
+    summary_free(pSeg->pSummary);
+    free(pSeg);
+    write_catalog(pSet);
+    if (rc != 0)
+    {
+        pthread_mutex_lock(&pSet->Mutex);
+        pSet->iCloseError = -1;
+        pthread_mutex_unlock(&pSet->Mutex);
+    }
+}
+
+// Opens the next segment's writer ahead of time and closes finished segments (drain, truncate, fsync, sidecars,
+// catalog), so rotation on the thread writing samples is only a pointer swap
+static void* segment_thread(void* pArg)
+{
+    SEGMENT_SET* pSet = pArg;
+
+    pthread_mutex_lock(&pSet->Mutex);
+    for (;;)
+    {
+        CLOSING_SEGMENT* pSeg;
+
+        if (pSet->ulPrepare && !pSet->bPrepared)
+        {
+            unsigned long ulNumber = pSet->ulPrepare;
+            char szPath[CAPTURE_PATH_MAX];
+            ASYNC_WRITER* pAsync = NULL;
+
+            pthread_mutex_unlock(&pSet->Mutex);
+            if (segment_path(pSet, ulNumber, szPath, sizeof(szPath)) == 0)
+                pAsync = async_writer_open(szPath, WRITER_DEFAULT_BUFFERS, WRITER_DEFAULT_BUFFER_BYTES);
+            pthread_mutex_lock(&pSet->Mutex);
+            if (pSet->ulPrepare == ulNumber)
+            {
+                pSet->pPrepared = pAsync;
+                pSet->bPrepared = true;
+                pthread_cond_broadcast(&pSet->Cond);
+            }
+            else if (pAsync)
+            {
+                async_writer_close(pAsync);
+                remove(szPath);
+            }
+            continue;
+        }
+        if ((pSeg = pSet->pClosingHead) != NULL)
+        {
+            if (!(pSet->pClosingHead = pSeg->pNext)) pSet->pClosingTail = NULL;
+            pthread_mutex_unlock(&pSet->Mutex);
+            close_segment(pSet, pSeg);
+            pthread_mutex_lock(&pSet->Mutex);
+            continue;
+        }
+        if (pSet->bStop) break;
+        pthread_cond_wait(&pSet->Cond, &pSet->Mutex);
+    }
+    pthread_mutex_unlock(&pSet->Mutex);
+    return NULL;
+}
+
+static int next_segment(CAPTURE_WRITER* pWriter)
+{
+    SEGMENT_SET* pSet = pWriter->pSet;
+    CLOSING_SEGMENT* pSeg = malloc(sizeof(CLOSING_SEGMENT));
+    int rc = finish_segment(pWriter);
+
+    if (!pSeg) return -1;
+    pSeg->pNext = NULL;
+    pSeg->pAsync = pWriter->pAsync;
+    pSeg->pEnvelope = pWriter->pEnvelope;
+    pSeg->pSummary = pWriter->pSummary;
+    memcpy(pSeg->szSummary, pWriter->szSummary, sizeof(pSeg->szSummary));
+    pWriter->pAsync = NULL;
+    pWriter->pEnvelope = NULL;
+    pWriter->pSummary = NULL;
+    if (open_segment(pWriter) != 0) rc = -1;
+
+    if (!pSet->bThread)
+    {
+        close_segment(pSet, pSeg);
+        return rc;
+    }
+    pthread_mutex_lock(&pSet->Mutex);
+    if (pSet->pClosingTail) pSet->pClosingTail->pNext = pSeg;
+    else pSet->pClosingHead = pSeg;
+    pSet->pClosingTail = pSeg;
+    pthread_cond_signal(&pSet->Cond);
+    pthread_mutex_unlock(&pSet->Mutex);
+    return rc;
+}
+
+// Finishes queued closes and discards a writer opened ahead for a segment that will not be written
+static void stop_segment_thread(SEGMENT_SET* pSet)
+{
+    char szPath[CAPTURE_PATH_MAX];
+
+    if (!pSet->bThread) return;
+    pthread_mutex_lock(&pSet->Mutex);
+    pSet->bStop = true;
+    pthread_cond_signal(&pSet->Cond);
+    pthread_mutex_unlock(&pSet->Mutex);
+    pthread_join(pSet->Thread, NULL);
+    pSet->bThread = false;
+    if (pSet->bPrepared && pSet->pPrepared)
+    {
+        async_writer_close(pSet->pPrepared);
+        if (segment_path(pSet, pSet->ulPrepare, szPath, sizeof(szPath)) == 0) remove(szPath);
+    }
+    pSet->pPrepared = NULL;
+    pSet->ulPrepare = 0;
+}
+
+static bool segment_full(const CAPTURE_WRITER* pWriter)
+{
+    const SEGMENT_SET* pSet = pWriter->pSet;
+
+    if (pSet->ullSegmentBytes && pWriter->ullOffset >= pSet->ullSegmentBytes) return true;
+    return pSet->llSegmentNs && pWriter->ulEntries &&
+        pWriter->pIndex[pWriter->ulEntries - 1].llLastTime - pWriter->pIndex[0].llFirstTime >= pSet->llSegmentNs;
+}
+
+CAPTURE_WRITER* capture_open_segments(const char* pPrefix, long long llSegmentNs, unsigned long long ullSegmentBytes)
+{
+    CAPTURE_WRITER* pWriter;
+    SEGMENT_SET* pSet;
+
+    if (strlen(pPrefix) >= sizeof(pSet->szPrefix) - 16) return NULL;
+    if (!(pWriter = calloc(1, sizeof(CAPTURE_WRITER)))) return NULL;
+    if (!(pSet = calloc(1, sizeof(SEGMENT_SET))))
+    {
+        free(pWriter);
+        return NULL;
+    }
+    snprintf(pSet->szPrefix, sizeof(pSet->szPrefix), "%s", pPrefix);
+    pSet->llSegmentNs = llSegmentNs;
+    pSet->ullSegmentBytes = ullSegmentBytes;
+    pthread_mutex_init(&pSet->Mutex, NULL);
+    pthread_cond_init(&pSet->Cond, NULL);
+    pWriter->pSet = pSet;
+    pWriter->dCompNum = read_comp_num();
+
+    if (open_segment(pWriter) != 0)
+    {
+        capture_close(pWriter);
+        return NULL;
+    }
+    write_catalog(pSet);
+    if (pthread_create(&pSet->Thread, NULL, segment_thread, pSet) == 0) pSet->bThread = true;
+    return pWriter;
+}
+
+// Encodes the pending samples as one chunk
+static int flush_chunk(CAPTURE_WRITER* pWriter)
+{
+    CAPTURE_CHUNK_HEADER chk;
+    CAPTURE_INDEX_ENTRY* pEntry;
+    size_t ulBytes = 0;
+    unsigned long i;
+
+    if (pWriter->ulPending == 0) return 0;
+
+    for (i = 0; i < pWriter->ulPending; i += CODEC_BLOCK)
+    {
+        unsigned long n = pWriter->ulPending - i < CODEC_BLOCK ? pWriter->ulPending - i : CODEC_BLOCK;
+        ulBytes += codec_encode_block(pWriter->aPending + i, n, pWriter->aPayload + ulBytes);
+    }
+
+    chk.uiMagic = CAPTURE_CHUNK_MAGIC;
+    chk.uiBytes = (uint32_t)ulBytes;
+    chk.uiSamples = (uint32_t)pWriter->ulPending;
+    chk.uiCrc = codec_crc32c(0, pWriter->aPayload, ulBytes);
+    chk.llFirstTime = pWriter->aPending[0].llTime;
+    chk.llLastTime = pWriter->aPending[pWriter->ulPending - 1].llTime;
+    if (pWriter->pEnvelope) envelope_add(pWriter->pEnvelope, pWriter->aPending, pWriter->ulPending, UM_PER_COUNT(pWriter->dCompNum));
+    if (pWriter->pSummary) summary_add(pWriter->pSummary, pWriter->aPending, pWriter->ulPending);
+    pWriter->ulPending = 0;
+
+    if (pWriter->ulEntries == pWriter->ulIndexSize)
+    {
+        unsigned long ulSize = pWriter->ulIndexSize ? pWriter->ulIndexSize * 2 : 256;
+        CAPTURE_INDEX_ENTRY* a = realloc(pWriter->pIndex, ulSize * sizeof(CAPTURE_INDEX_ENTRY));
+        if (!a) return -1;
+        pWriter->pIndex = a;
+        pWriter->ulIndexSize = ulSize;
+    }
+    pEntry = &pWriter->pIndex[pWriter->ulEntries];
+    pEntry->llFirstTime = chk.llFirstTime;
+    pEntry->llLastTime = chk.llLastTime;
+    pEntry->ullOffset = pWriter->ullOffset;
+    pEntry->uiSamples = chk.uiSamples;
+    pEntry->uiBytes = chk.uiBytes;
+    pEntry->uiCrc = chk.uiCrc;
+    pEntry->uiComp = pWriter->uiComp;
+
+    if (sink_write(pWriter, &chk, sizeof(chk)) != 0) return -1;
+    if (sink_write(pWriter, pWriter->aPayload, ulBytes) != 0) return -1;
+    pWriter->ulEntries++;
+    return 0;
+}
+
+// Hands the completed chunks on to the file once CAPTURE_FLUSH_NS has passed since the last time, or now when
+// forced; in between the async writer fills whole buffers
+static int flush_sink(CAPTURE_WRITER* pWriter, bool bForce)
+{
+    long long llNow = monotonic_ns();
+
+    if (!bForce && llNow - pWriter->llFlushTime < CAPTURE_FLUSH_NS) return 0;
+    pWriter->llFlushTime = llNow;
+    if (pWriter->pAsync) return async_writer_flush(pWriter->pAsync);
+    return pWriter->fp ? fflush(pWriter->fp) : 0;
+}
+
+static int end_chunk(CAPTURE_WRITER* pWriter, bool bForce)
+{
+    if (flush_chunk(pWriter) != 0 || flush_sink(pWriter, bForce) != 0) return -1;
+    if (pWriter->pSet && segment_full(pWriter)) return next_segment(pWriter);
+    return 0;
+}
+
+int capture_flush(CAPTURE_WRITER* pWriter)
+{
+    return end_chunk(pWriter, true);
+}
+
+int capture_write(CAPTURE_WRITER* pWriter, const RawSample* pSamples, unsigned long ulCount)
+{
+    while (ulCount)
+    {
+        unsigned long n = CAPTURE_CHUNK_SAMPLES - pWriter->ulPending;
+        if (n > ulCount) n = ulCount;
+
+        memcpy(pWriter->aPending + pWriter->ulPending, pSamples, n * sizeof(RawSample));
+        pWriter->ulPending += n;
+        pSamples += n;
+        ulCount -= n;
+        if (pWriter->ulPending == CAPTURE_CHUNK_SAMPLES && end_chunk(pWriter, false) != 0) return -1;
+    }
+    return 0;
+}
+
+int capture_set_comp(CAPTURE_WRITER* pWriter, double dCompNum)
+{
+    CAPTURE_COMP_RECORD rec;
+
+    if (dCompNum == pWriter->dCompNum) return 0;
+    if (flush_chunk(pWriter) != 0) return -1;
+    pWriter->dCompNum = dCompNum;
+    memset(&rec, 0, sizeof(rec));
+    rec.uiMagic = CAPTURE_COMP_MAGIC;
+    rec.dCompNum = dCompNum;
+    rec.llTime = get_time_ns();
+    if (sink_write(pWriter, &rec, sizeof(rec)) != 0) return -1;
+    pWriter->uiComp++;
+    return 0;
+}
+
+int capture_close(CAPTURE_WRITER* pWriter)
+{
+    int rc;
+
+    if (!pWriter) return 0;
+    rc = flush_chunk(pWriter);
+    if (pWriter->pSet)
+    {
+        SEGMENT_SET* pSet = pWriter->pSet;
+
+        if (finish_segment(pWriter) != 0) rc = -1;
+        stop_segment_thread(pSet);
+        if (async_writer_close(pWriter->pAsync) != 0) rc = -1;
+        pWriter->pAsync = NULL;
+        write_catalog(pSet);
+        if (pSet->iCloseError) rc = -1;
+        pthread_cond_destroy(&pSet->Cond);
+        pthread_mutex_destroy(&pSet->Mutex);
+        free(pSet->aSegments);
+        free(pSet);
+    }
+    else if (end_file(pWriter) != 0) rc = -1;
+    if (pWriter->fp && fclose(pWriter->fp) != 0) rc = -1;
+    if (pWriter->pAsync && async_writer_close(pWriter->pAsync) != 0) rc = -1;
+    if (pWriter->pEnvelope && envelope_finish(pWriter->pEnvelope) != 0) rc = -1;
+    envelope_free(pWriter->pEnvelope);
+    if (pWriter->pSummary && summary_save(pWriter->pSummary, pWriter->szSummary) != 0) rc = -1;
+    summary_free(pWriter->pSummary);
+    free(pWriter->pIndex);
+    free(pWriter);
+    return rc;
+}
+
+WriterStats capture_writer_stats(CAPTURE_WRITER* pWriter)
+{
+    WriterStats ws;
+
+    if (pWriter->pAsync) return async_writer_stats(pWriter->pAsync);
+    memset(&ws, 0, sizeof(ws));
+    return ws;
+}
+
+static int read_payload(CAPTURE_READER* pReader, const CAPTURE_CHUNK_HEADER* pChk)
+{
+    if (pChk->uiBytes > pReader->ulPayloadSize)
+    {
+        unsigned char* p = realloc(pReader->pPayload, pChk->uiBytes);
+        if (!p) return -1;
+        pReader->pPayload = p;
+        pReader->ulPayloadSize = pChk->uiBytes;
+    }
+    if (fread(pReader->pPayload, 1, pChk->uiBytes, pReader->fp) != pChk->uiBytes) return -1;
+    if (pReader->Header.uiVersion >= 2 && codec_crc32c(0, pReader->pPayload, pChk->uiBytes) != pChk->uiCrc) return -1;
+    return 0;
+}
+
+static int read_footer(CAPTURE_READER* pReader)
+{
+    CAPTURE_FOOTER ftr;
+    long long llEnd;
+    size_t ulBytes;
+
+    if (file_seek(pReader->fp, 0, SEEK_END) != 0 || (llEnd = file_tell(pReader->fp)) < (long long)(pReader->ulHeaderBytes + sizeof(ftr)))
+        return -1;
+    if (file_seek(pReader->fp, llEnd - (long long)sizeof(ftr), SEEK_SET) != 0 || fread(&ftr, sizeof(ftr), 1, pReader->fp) != 1)
+        return -1;
+    ulBytes = (size_t)ftr.uiEntries * sizeof(CAPTURE_INDEX_ENTRY);
+    if (ftr.uiMagic != CAPTURE_INDEX_MAGIC || ftr.uiEntrySize != sizeof(CAPTURE_INDEX_ENTRY) ||
+        ftr.ullIndexOffset + ulBytes + sizeof(ftr) != (unsigned long long)llEnd)
+        return -1;
+
+    if (!(pReader->pIndex = malloc(ulBytes ? ulBytes : 1))) return -1;
+    if (file_seek(pReader->fp, (long long)ftr.ullIndexOffset, SEEK_SET) != 0 ||
+        fread(pReader->pIndex, 1, ulBytes, pReader->fp) != ulBytes ||
+        codec_crc32c(0, pReader->pIndex, ulBytes) != ftr.uiIndexCrc)
+        return -1;
+    pReader->ulEntries = ftr.uiEntries;
+    return 0;
+}
+
+// Scans the chunks up to the first missing or damaged one
+static int rebuild_index(CAPTURE_READER* pReader)
+{
+    unsigned long long ullPos = pReader->ulHeaderBytes;
+    unsigned long ulSize = 0;
+    uint32_t uiComp = 0;
+
+    pReader->ulEntries = 0;
+    for (;;)
+    {
+        CAPTURE_CHUNK_HEADER chk;
+        CAPTURE_INDEX_ENTRY* pEntry;
+
+        if (file_seek(pReader->fp, (long long)ullPos, SEEK_SET) != 0 || fread(&chk, sizeof(chk), 1, pReader->fp) != 1) break;
+        if (chk.uiMagic == CAPTURE_COMP_MAGIC && pReader->Header.uiVersion >= 3)
+        {
+            uiComp++;
+            ullPos += sizeof(CAPTURE_COMP_RECORD);
+            continue;
+        }
+        if (chk.uiMagic != CAPTURE_CHUNK_MAGIC || chk.uiSamples == 0 || chk.uiSamples > CAPTURE_CHUNK_SAMPLES) break;
+        if (read_payload(pReader, &chk) != 0) break;
+
+        if (pReader->ulEntries == ulSize)
+        {
+            unsigned long ulNewSize = ulSize ? ulSize * 2 : 256;
+            CAPTURE_INDEX_ENTRY* a = realloc(pReader->pIndex, ulNewSize * sizeof(CAPTURE_INDEX_ENTRY));
+            if (!a) return -1;
+            pReader->pIndex = a;
+            ulSize = ulNewSize;
+        }
+        pEntry = &pReader->pIndex[pReader->ulEntries++];
+        pEntry->llFirstTime = chk.llFirstTime;
+        pEntry->llLastTime = chk.llLastTime;
+        pEntry->ullOffset = ullPos;
+        pEntry->uiSamples = chk.uiSamples;
+        pEntry->uiBytes = chk.uiBytes;
+        pEntry->uiCrc = chk.uiCrc;
+        pEntry->uiComp = uiComp;
+        ullPos += sizeof(chk) + chk.uiBytes;
+    }
+    return 0;
+}
+
+CAPTURE_READER* capture_open_read(const char* pPath)
+{
+    CAPTURE_READER* pReader = calloc(1, sizeof(CAPTURE_READER));
+
+    if (!pReader) return NULL;
+    if (strlen(pPath) >= sizeof(pReader->szPath))
+    {
+        free(pReader);
+        return NULL;
+    }
+    memcpy(pReader->szPath, pPath, strlen(pPath) + 1);
+    if (!(pReader->fp = fopen(pPath, "rb")) ||
+        fread(&pReader->Header, CAPTURE_HEADER_V2_BYTES, 1, pReader->fp) != 1 ||
+        memcmp(pReader->Header.szMagic, CAPTURE_MAGIC, sizeof(pReader->Header.szMagic)) != 0 ||
+        pReader->Header.uiVersion > CAPTURE_VERSION ||
+        (pReader->Header.uiVersion >= 3 &&
+         fread((char*)&pReader->Header + CAPTURE_HEADER_V2_BYTES, sizeof(pReader->Header) - CAPTURE_HEADER_V2_BYTES, 1, pReader->fp) != 1))
+    {
+        capture_close_read(pReader);
+        return NULL;
+    }
+    pReader->ulHeaderBytes = pReader->Header.uiVersion >= 3 ? sizeof(pReader->Header) : CAPTURE_HEADER_V2_BYTES;
+    if (pReader->Header.uiVersion < 2 || read_footer(pReader) != 0)
+    {
+        free(pReader->pIndex);
+        pReader->pIndex = NULL;
+        if (rebuild_index(pReader) != 0)
+        {
+            capture_close_read(pReader);
+            return NULL;
+        }
+    }
+    pReader->ullPos = ~0ull;
+    return pReader;
+}
+
+// Another reader of the same file sharing a copy of the index, e.g. one per decoding thread
+CAPTURE_READER* capture_dup_read(CAPTURE_READER* pSource)
+{
+    CAPTURE_READER* pReader = calloc(1, sizeof(CAPTURE_READER));
+    size_t ulBytes = pSource->ulEntries * sizeof(CAPTURE_INDEX_ENTRY);
+
+    if (!pReader) return NULL;
+    memcpy(pReader->szPath, pSource->szPath, sizeof(pReader->szPath));
+    pReader->Header = pSource->Header;
+    pReader->ulHeaderBytes = pSource->ulHeaderBytes;
+    if (!(pReader->fp = fopen(pReader->szPath, "rb")) || !(pReader->pIndex = malloc(ulBytes ? ulBytes : 1)))
+    {
+        capture_close_read(pReader);
+        return NULL;
+    }
+    memcpy(pReader->pIndex, pSource->pIndex, ulBytes);
+    pReader->ulEntries = pSource->ulEntries;
+    pReader->ullPos = ~0ull;
+    return pReader;
+}
+
+const CAPTURE_FILE_HEADER* capture_header(CAPTURE_READER* pReader)
+{
+    return &pReader->Header;
+}
+
+const CAPTURE_INDEX_ENTRY* capture_index(CAPTURE_READER* pReader, unsigned long* pulEntries)
+{
+    *pulEntries = pReader->ulEntries;
+    return pReader->pIndex;
+}
+
+static long decode_chunk(CAPTURE_READER* pReader, unsigned long ulChunk, RawSample* pSamples)
+{
+    const CAPTURE_INDEX_ENTRY* pEntry = &pReader->pIndex[ulChunk];
+    CAPTURE_CHUNK_HEADER chk;
+    unsigned long ulCount = 0;
+    size_t ulPos = 0;
+
+    if (pReader->ullPos != pEntry->ullOffset && file_seek(pReader->fp, (long long)pEntry->ullOffset, SEEK_SET) != 0) return -1;
+    pReader->ullPos = ~0ull;
+    if (fread(&chk, sizeof(chk), 1, pReader->fp) != 1) return -1;
+    if (chk.uiMagic != CAPTURE_CHUNK_MAGIC || chk.uiSamples != pEntry->uiSamples || chk.uiBytes != pEntry->uiBytes ||
+        chk.uiSamples > CAPTURE_CHUNK_SAMPLES)
+        return -1;
+    if (read_payload(pReader, &chk) != 0) return -1;
+
+    while (ulCount < chk.uiSamples)
+    {
+        size_t ulUsed;
+        long n = codec_decode_block(pReader->pPayload + ulPos, chk.uiBytes - ulPos, pSamples + ulCount, chk.uiSamples - ulCount, &ulUsed);
+        if (n <= 0) return -1;
+        ulCount += n;
+        ulPos += ulUsed;
+    }
+    pReader->ullPos = pEntry->ullOffset + sizeof(chk) + chk.uiBytes;
+    return (long)ulCount;
+}
+
+static int read_chunk(CAPTURE_READER* pReader, unsigned long ulChunk)
+{
+    long n;
+
+    pReader->ulChunkCount = pReader->ulChunkPos = 0;
+    pReader->ulNextChunk = ulChunk + 1;
+    if ((n = decode_chunk(pReader, ulChunk, pReader->aChunk)) < 0) return -1;
+    pReader->ulChunkCount = n;
+    return 0;
+}
+
+// The record for a chunk's factor sits right before the first chunk counting it
+int capture_chunk_comp(CAPTURE_READER* pReader, unsigned long ulChunk, double* pdCompNum)
+{
+    CAPTURE_COMP_RECORD rec;
+    unsigned long ulLo = 0, ulHi = ulChunk;
+    uint32_t uiComp;
+
+    if (ulChunk >= pReader->ulEntries) return -1;
+    if ((uiComp = pReader->pIndex[ulChunk].uiComp) == 0)
+    {
+        *pdCompNum = pReader->Header.dCompNum;
+        return 0;
+    }
+    if (uiComp != pReader->uiComp)
+    {
+        while (ulLo < ulHi)
+        {
+            unsigned long ulMid = ulLo + (ulHi - ulLo) / 2;
+            if (pReader->pIndex[ulMid].uiComp < uiComp) ulLo = ulMid + 1;
+            else ulHi = ulMid;
+        }
+        pReader->ullPos = ~0ull;
+        if (pReader->pIndex[ulLo].ullOffset < pReader->ulHeaderBytes + sizeof(rec) ||
+            file_seek(pReader->fp, (long long)(pReader->pIndex[ulLo].ullOffset - sizeof(rec)), SEEK_SET) != 0 ||
+            fread(&rec, sizeof(rec), 1, pReader->fp) != 1 || rec.uiMagic != CAPTURE_COMP_MAGIC)
+            return -1;
+        pReader->uiComp = uiComp;
+        pReader->dComp = rec.dCompNum;
+    }
+    *pdCompNum = pReader->dComp;
+    return 0;
+}
+
+// Decodes one chunk by index into pSamples (CAPTURE_CHUNK_SAMPLES at most), independent of the read position
+long capture_read_chunk(CAPTURE_READER* pReader, unsigned long ulChunk, RawSample* pSamples)
+{
+    if (ulChunk >= pReader->ulEntries) return -1;
+    return decode_chunk(pReader, ulChunk, pSamples);
+}
+
+// Positions the reader on the first sample at or after llTime, binary searching the index then the chunk
+int capture_seek(CAPTURE_READER* pReader, long long llTime)
+{
+    unsigned long ulLo = 0, ulHi = pReader->ulEntries;
+
+    while (ulLo < ulHi)
+    {
+        unsigned long ulMid = ulLo + (ulHi - ulLo) / 2;
+        if (pReader->pIndex[ulMid].llLastTime < llTime) ulLo = ulMid + 1;
+        else ulHi = ulMid;
+    }
+    if (ulLo == pReader->ulEntries)
+    {
+        pReader->ulNextChunk = pReader->ulEntries;
+        pReader->ulChunkCount = pReader->ulChunkPos = 0;
+        return 0;
+    }
+    if (read_chunk(pReader, ulLo) != 0) return -1;
+
+    ulHi = pReader->ulChunkCount;
+    ulLo = 0;
+    while (ulLo < ulHi)
+    {
+        unsigned long ulMid = ulLo + (ulHi - ulLo) / 2;
+        if (pReader->aChunk[ulMid].llTime < llTime) ulLo = ulMid + 1;
+        else ulHi = ulMid;
+    }
+    pReader->ulChunkPos = ulLo;
+    return 0;
+}
+
+// With pdCompNum the read stops where the compensation factor changes and reports the factor of what it read
+static long read_samples(CAPTURE_READER* pReader, RawSample* pSamples, unsigned long ulMax, double* pdCompNum)
+{
+    unsigned long ulDone = 0;
+
+    while (ulDone < ulMax)
+    {
+        unsigned long n;
+
+        if (pReader->ulChunkPos == pReader->ulChunkCount)
+        {
+            if (pReader->ulNextChunk >= pReader->ulEntries) break;
+            if (pdCompNum && ulDone && pReader->pIndex[pReader->ulNextChunk].uiComp != pReader->pIndex[pReader->ulNextChunk - 1].uiComp) break;
+            if (read_chunk(pReader, pReader->ulNextChunk) != 0) return ulDone ? (long)ulDone : -1;
+        }
+        if (pdCompNum && !ulDone && capture_chunk_comp(pReader, pReader->ulNextChunk - 1, pdCompNum) != 0) return -1;
+        n = pReader->ulChunkCount - pReader->ulChunkPos;
+        if (n > ulMax - ulDone) n = ulMax - ulDone;
+        memcpy(pSamples + ulDone, pReader->aChunk + pReader->ulChunkPos, n * sizeof(RawSample));
+        pReader->ulChunkPos += n;
+        ulDone += n;
+    }
+    return (long)ulDone;
+}
+
+// Returns the number of samples read, 0 at the end of the capture or -1 on a damaged chunk
+long capture_read(CAPTURE_READER* pReader, RawSample* pSamples, unsigned long ulMax)
+{
+    return read_samples(pReader, pSamples, ulMax, NULL);
+}
+
+long capture_read_comp(CAPTURE_READER* pReader, RawSample* pSamples, unsigned long ulMax, double* pdCompNum)
+{
+    return read_samples(pReader, pSamples, ulMax, pdCompNum);
+}
+
+void capture_close_read(CAPTURE_READER* pReader)
+{
+    if (!pReader) return;
+    if (pReader->fp) fclose(pReader->fp);
+    free(pReader->pIndex);
+    free(pReader->pPayload);
+    free(pReader);
+}
+
+// Segments still open when the catalog was written (last_ns -1) take their range from the rebuilt index
+static void resolve_segment(CaptureSegment* pSeg)
+{
+    CAPTURE_READER* pReader = capture_open_read(pSeg->szPath);
+    unsigned long i;
+
+    pSeg->ullSamples = 0;
+    if (!pReader) return;
+    for (i = 0; i < pReader->ulEntries; i++) pSeg->ullSamples += pReader->pIndex[i].uiSamples;
+    if (pReader->ulEntries)
+    {
+        pSeg->llFirstTime = pReader->pIndex[0].llFirstTime;
+        pSeg->llLastTime = pReader->pIndex[pReader->ulEntries - 1].llLastTime;
+    }
+    capture_close_read(pReader);
+}
+
+CAPTURE_CATALOG* catalog_open(const char* pPath)
+{
+    CAPTURE_CATALOG* pCatalog;
+    char szLine[CAPTURE_PATH_MAX + 128], szName[CAPTURE_PATH_MAX];
+    size_t ulDir = 0, i;
+    unsigned long ulSize = 0;
+    FILE* fp;
+
+    if (!(fp = fopen(pPath, "r"))) return NULL;
+    if (!(pCatalog = calloc(1, sizeof(CAPTURE_CATALOG))))
+    {
+        fclose(fp);
+        return NULL;
+    }
+    for (i = 0; pPath[i]; i++) if (pPath[i] == '/' || pPath[i] == '\\') ulDir = i + 1;
+
+    while (fgets(szLine, sizeof(szLine), fp))
+    {
+        CaptureSegment seg;
+        unsigned long ulNumber;
+
+        memset(&seg, 0, sizeof(seg));
+        if (sscanf(szLine, "%lu,%lld,%lld,%llu,%259[^\r\n]", &ulNumber, &seg.llFirstTime, &seg.llLastTime, &seg.ullSamples, szName) != 5)
+            continue;
+        if (ulDir + strlen(szName) >= sizeof(seg.szPath)) continue;
+        memcpy(seg.szPath, pPath, ulDir);
+        strcpy(seg.szPath + ulDir, szName);
+        if (seg.llLastTime < 0) resolve_segment(&seg);
+        if (seg.ullSamples == 0) continue;
+
+        if (pCatalog->ulSegments == ulSize)
+        {
+            unsigned long ulNewSize = ulSize ? ulSize * 2 : 16;
+            CaptureSegment* a = realloc(pCatalog->aSegments, ulNewSize * sizeof(CaptureSegment));
+            if (!a) break;
+            pCatalog->aSegments = a;
+            ulSize = ulNewSize;
+        }
+        pCatalog->aSegments[pCatalog->ulSegments++] = seg;
+    }
+    fclose(fp);
+    return pCatalog;
+}
+
+unsigned long catalog_segments(CAPTURE_CATALOG* pCatalog, const CaptureSegment** ppSegments)
+{
+    *ppSegments = pCatalog->aSegments;
+    return pCatalog->ulSegments;
+}
+
+int catalog_seek(CAPTURE_CATALOG* pCatalog, long long llTime)
+{
+    unsigned long ulLo = 0, ulHi = pCatalog->ulSegments;
+
+    while (ulLo < ulHi)
+    {
+        unsigned long ulMid = ulLo + (ulHi - ulLo) / 2;
+        if (pCatalog->aSegments[ulMid].llLastTime < llTime) ulLo = ulMid + 1;
+        else ulHi = ulMid;
+    }
+    capture_close_read(pCatalog->pReader);
+    pCatalog->pReader = NULL;
+    pCatalog->ulNext = ulLo;
+    if (ulLo == pCatalog->ulSegments) return 0;
+
+    if (!(pCatalog->pReader = capture_open_read(pCatalog->aSegments[ulLo].szPath))) return -1;
+    pCatalog->ulNext = ulLo + 1;
+    return capture_seek(pCatalog->pReader, llTime);
+}
+
+// Reads across segment boundaries in time order
+long catalog_read(CAPTURE_CATALOG* pCatalog, RawSample* pSamples, unsigned long ulMax)
+{
+    unsigned long ulDone = 0;
+
+    while (ulDone < ulMax)
+    {
+        long n;
+
+        if (!pCatalog->pReader)
+        {
+            if (pCatalog->ulNext >= pCatalog->ulSegments) break;
+            if (!(pCatalog->pReader = capture_open_read(pCatalog->aSegments[pCatalog->ulNext].szPath))) return ulDone ? (long)ulDone : -1;
+            pCatalog->ulNext++;
+        }
+        if ((n = capture_read(pCatalog->pReader, pSamples + ulDone, ulMax - ulDone)) < 0) return ulDone ? (long)ulDone : -1;
+        if (n == 0)
+        {
+            capture_close_read(pCatalog->pReader);
+            pCatalog->pReader = NULL;
+        }
+        ulDone += n;
+    }
+    return (long)ulDone;
+}
+
+// Reads within one segment, as segments start with a factor of their own
+long catalog_read_comp(CAPTURE_CATALOG* pCatalog, RawSample* pSamples, unsigned long ulMax, double* pdCompNum)
+{
+    long n;
+
+    for (;;)
+    {
+        if (!pCatalog->pReader)
+        {
+            if (pCatalog->ulNext >= pCatalog->ulSegments) return 0;
+            if (!(pCatalog->pReader = capture_open_read(pCatalog->aSegments[pCatalog->ulNext].szPath))) return -1;
+            pCatalog->ulNext++;
+        }
+        if ((n = capture_read_comp(pCatalog->pReader, pSamples, ulMax, pdCompNum)) != 0) return n;
+        capture_close_read(pCatalog->pReader);
+        pCatalog->pReader = NULL;
+    }
+}
+
+void catalog_close(CAPTURE_CATALOG* pCatalog)
+{
+    if (!pCatalog) return;
+    capture_close_read(pCatalog->pReader);
+    free(pCatalog->aSegments);
+    free(pCatalog);
+}
+
+// The acquisition thread only copies samples into this queue; the recording thread drains it and does all the
+// encoding, sidecar, rotation and file work
+typedef struct {
+    CAPTURE_WRITER* pWriter;            // recording thread only
+    RawSample* aRaw;                    // CAPTURE_QUEUE_SAMPLES each
+    double* adComp;                     // factor each sample was converted with
+    atomic_ulong ulHead, ulTail;        // read by the recording thread, written by the acquisition thread
+    atomic_ullong ullOverruns;
+    atomic_bool bStop;
+    pthread_t Thread;
+    int iError;                         // recording thread only: first failed write, after which samples are dropped
+    unsigned long long ullDropped;      // recording thread only
+    pthread_mutex_t StatsMutex;
+    WriterStats Stats;                  // writer stats as of the last drain
+} LIVE_RECORDING;
+
+static _Atomic(LIVE_RECORDING*) pLive;
+static atomic_bool bLiveBusy;
+static pthread_mutex_t LiveMutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void pause_ns(long lNs)
+{
+    struct timespec ts = { 0, lNs };
+    nanosleep(&ts, NULL);
+}
+
+static void* live_thread(void* pArg)
+{
+    LIVE_RECORDING* pRec = pArg;
+
+    for (;;)
+    {
+        bool bStop = atomic_load(&pRec->bStop);     // before draining, so everything queued before the stop is written
+        unsigned long ulHead = atomic_load_explicit(&pRec->ulHead, memory_order_relaxed);
+        unsigned long ulTail = atomic_load_explicit(&pRec->ulTail, memory_order_acquire);
+        WriterStats ws;
+
+        if (ulHead == ulTail)
+        {
+            if (bStop) break;
+            // Chunks completed before acquisition paused still reach the file within CAPTURE_FLUSH_NS
+            errno = 0;
+            if (pRec->iError || flush_sink(pRec->pWriter, false) == 0)
+            {
+                pause_ns(CAPTURE_QUEUE_SLEEP_NS);
+                continue;
+            }
+            pRec->iError = errno ? errno : EIO;     // published below
+        }
+        while (ulHead != ulTail)
+        {
+            unsigned long ulSlot = ulHead & (CAPTURE_QUEUE_SAMPLES - 1), n = 1;
+
+            // Runs up to the end of the queue or the next factor change go out in one write
+            while (n < ulTail - ulHead && ulSlot + n < CAPTURE_QUEUE_SAMPLES && pRec->adComp[ulSlot + n] == pRec->adComp[ulSlot]) n++;
+            errno = 0;
+            if (pRec->iError) pRec->ullDropped += n;
+            else if (capture_set_comp(pRec->pWriter, pRec->adComp[ulSlot]) != 0 || capture_write(pRec->pWriter, pRec->aRaw + ulSlot, n) != 0)
+            {
+                // Stream and segment writers keep no error of their own, so the first one is kept here
+                pRec->iError = errno ? errno : EIO;
+                pRec->ullDropped += n;
+            }
+            ulHead += n;
+            atomic_store_explicit(&pRec->ulHead, ulHead, memory_order_release);
+        }
+
+        ws = capture_writer_stats(pRec->pWriter);
+        if (!ws.iError) ws.iError = pRec->iError;
+        ws.ullDropped = pRec->ullDropped;
+        pthread_mutex_lock(&pRec->StatsMutex);
+        pRec->Stats = ws;
+        pthread_mutex_unlock(&pRec->StatsMutex);
+    }
+    return NULL;
+}
+
+static void free_live(LIVE_RECORDING* pRec)
+{
+    pthread_mutex_destroy(&pRec->StatsMutex);
+    realtime_free(pRec->aRaw);
+    realtime_free(pRec->adComp);
+    free(pRec);
+}
+
+static void stop_live(void)
+{
+    LIVE_RECORDING* pRec = atomic_exchange(&pLive, NULL);
+
+    while (atomic_load(&bLiveBusy));
+    if (!pRec) return;
+    atomic_store(&pRec->bStop, true);
+    pthread_join(pRec->Thread, NULL);
+    capture_close(pRec->pWriter);
+    free_live(pRec);
+}
+
+static int start_live(CAPTURE_WRITER* pWriter)
+{
+    LIVE_RECORDING* pRec;
+
+    if (!pWriter) return -1;
+    if (!(pRec = calloc(1, sizeof(LIVE_RECORDING))))
+    {
+        capture_close(pWriter);
+        return -1;
+    }
+    pRec->pWriter = pWriter;
+    pthread_mutex_init(&pRec->StatsMutex, NULL);
+    pRec->aRaw = realtime_alloc(CAPTURE_QUEUE_SAMPLES * sizeof(RawSample));
+    pRec->adComp = realtime_alloc(CAPTURE_QUEUE_SAMPLES * sizeof(double));
+    if (!pRec->aRaw || !pRec->adComp || pthread_create(&pRec->Thread, NULL, live_thread, pRec) != 0)
+    {
+        capture_close(pWriter);
+        free_live(pRec);
+        return -1;
+    }
+
+    pthread_mutex_lock(&LiveMutex);
+    stop_live();
+    atomic_store(&pLive, pRec);
+    pthread_mutex_unlock(&LiveMutex);
+    return 0;
+}
+
+int start_recording(const char* pPath)
+{
+    return start_live(capture_open_async(pPath));
+}
+
+int start_recording_fd(int fd)
+{
+    return start_live(capture_open_fd(fd));
+}
+
+int start_recording_segments(const char* pPrefix, long long llSegmentNs, unsigned long long ullSegmentBytes)
+{
+    return start_live(capture_open_segments(pPrefix, llSegmentNs, ullSegmentBytes));
+}
+
+void stop_recording(void)
+{
+    pthread_mutex_lock(&LiveMutex);
+    stop_live();
+    pthread_mutex_unlock(&LiveMutex);
+}
+
+WriterStats read_recording_stats(void)
+{
+    LIVE_RECORDING* pRec;
+    WriterStats ws;
+
+    memset(&ws, 0, sizeof(ws));
+    pthread_mutex_lock(&LiveMutex);
+    if ((pRec = atomic_load(&pLive)) != NULL)
+    {
+        pthread_mutex_lock(&pRec->StatsMutex);
+        ws = pRec->Stats;
+        pthread_mutex_unlock(&pRec->StatsMutex);
+        ws.ullOverruns = atomic_load_explicit(&pRec->ullOverruns, memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&LiveMutex);
+    return ws;
+}
+
+// Runs on the acquisition thread: a copy into the queue, dropped and counted when the recording thread is behind
+void capture_update(const RawSample* pRaw, double dCompNum)
+{
+    LIVE_RECORDING* pRec;
+
+    atomic_store(&bLiveBusy, true);
+    if ((pRec = atomic_load(&pLive)) != NULL)
+    {
+        unsigned long ulTail = atomic_load_explicit(&pRec->ulTail, memory_order_relaxed);
+
+        if (ulTail - atomic_load_explicit(&pRec->ulHead, memory_order_acquire) == CAPTURE_QUEUE_SAMPLES)
+            atomic_fetch_add_explicit(&pRec->ullOverruns, 1, memory_order_relaxed);
+        else
+        {
+            pRec->aRaw[ulTail & (CAPTURE_QUEUE_SAMPLES - 1)] = *pRaw;
+            pRec->adComp[ulTail & (CAPTURE_QUEUE_SAMPLES - 1)] = dCompNum;
+            atomic_store_explicit(&pRec->ulTail, ulTail + 1, memory_order_release);
+        }
+    }
+    atomic_store(&bLiveBusy, false);
+}
+
+bool capture_wants_gelt(void)
+{
+    return atomic_load_explicit(&pLive, memory_order_relaxed) != NULL;
+}
@@ -0,0 +1,129 @@
+﻿// TuneExpertCapture.h: Compressed capture files and streams of raw samples
+//
+
+#pragma once
+
+#include "TuneExpertData.h"
+#include "TuneExpertWriter.h"
+#include <stdint.h>
+#include <stdio.h>
+
+#define CAPTURE_MAGIC "TECAPT1"
+#define CAPTURE_VERSION 3                   // 2 added chunk CRCs and the footer index, 3 the source and compensation records
+#define CAPTURE_CHUNK_MAGIC 0x4b484354u     // "TCHK"
+#define CAPTURE_COMP_MAGIC 0x504d4354u      // "TCMP"
+#define CAPTURE_INDEX_MAGIC 0x58444954u     // "TIDX"
+#define CAPTURE_CHUNK_SAMPLES 4096
+#define CAPTURE_PATH_MAX 260
+#define CAPTURE_QUEUE_SAMPLES (1 << 16)     // live samples waiting for the recording thread, a power of two
+#define CAPTURE_QUEUE_SLEEP_NS 1000000      // recording thread poll interval while the queue is empty
+#define CAPTURE_FLUSH_NS 250000000LL        // completed chunks are handed on to the file at most this often
+
+typedef struct {
+    char szMagic[8];
+    uint32_t uiVersion, uiFold;
+    double dLambdaNm, dCompNum;             // compensation of the first chunk, later changes are CAPTURE_COMP_RECORDs
+    int64_t llStartTime;
+    uint32_t uiSource;                      // E_CAPTURE_SOURCE, from version 3 on
+    uint32_t uiReserved;
+} CAPTURE_FILE_HEADER;
+
+#define CAPTURE_HEADER_V2_BYTES 40          // version 1 and 2 headers end after llStartTime
+
+enum E_CAPTURE_SOURCE
+{
+    CAPTURE_SOURCE_UNKNOWN,                 // version 1 and 2 files, or written with no board or replay open
+    CAPTURE_SOURCE_BOARD,
+    CAPTURE_SOURCE_SIMULATED,               // the simulated board of TuneExpertVendor.h, not measurements
+    CAPTURE_SOURCE_REPLAY
+};
+
+typedef struct {
+    uint32_t uiMagic;
+    uint32_t uiBytes;                       // encoded payload following the header
+    uint32_t uiSamples;
+    uint32_t uiCrc;                         // CRC-32C of the payload, 0 in version 1 files
+    int64_t llFirstTime, llLastTime;
+} CAPTURE_CHUNK_HEADER;
+
+// Version 3 on: written between chunks when the compensation factor changes, so no chunk mixes two factors.
+// Applies to the chunks that follow it up to the next one.
+typedef struct {
+    uint32_t uiMagic;
+    uint32_t uiReserved;
+    double dCompNum;
+    int64_t llTime;                         // when the change was recorded
+} CAPTURE_COMP_RECORD;
+
+// The index is written after the last chunk on close, followed by the footer which ends the file.
+// A file without a valid footer (crash, still being written) has its index rebuilt by scanning the chunks.
+typedef struct {
+    int64_t llFirstTime, llLastTime;
+    uint64_t ullOffset;                     // file offset of the chunk header
+    uint32_t uiSamples, uiBytes, uiCrc;
+    uint32_t uiComp;                        // compensation records before the chunk, 0 converts with the header's
+} CAPTURE_INDEX_ENTRY;
+
+typedef struct {
+    uint32_t uiMagic;
+    uint32_t uiEntries;
+    uint64_t ullIndexOffset;
+    uint32_t uiEntrySize;
+    uint32_t uiIndexCrc;
+} CAPTURE_FOOTER;
+
+typedef struct {
+    char szPath[CAPTURE_PATH_MAX];
+    long long llFirstTime, llLastTime;
+    unsigned long long ullSamples;
+} CaptureSegment;
+
+typedef struct CAPTURE_WRITER CAPTURE_WRITER;
+typedef struct CAPTURE_READER CAPTURE_READER;
+typedef struct CAPTURE_CATALOG CAPTURE_CATALOG;
+
+CAPTURE_WRITER* capture_open(const char* pPath);
+CAPTURE_WRITER* capture_open_fd(int fd);                // pipe, socket or other stream
+CAPTURE_WRITER* capture_open_async(const char* pPath);  // writes from a background thread, see TuneExpertWriter.h
+// Writes <prefix>_000001.cap, <prefix>_000002.cap, ... and the catalog <prefix>.cat, starting a new
+// segment once one spans llSegmentNs or reaches ullSegmentBytes (0 disables either limit)
+CAPTURE_WRITER* capture_open_segments(const char* pPrefix, long long llSegmentNs, unsigned long long ullSegmentBytes);
+int capture_write(CAPTURE_WRITER* pWriter, const RawSample* pSamples, unsigned long ulCount);
+// Samples written from now on were converted with dCompNum; a change ends the pending chunk and is recorded
+int capture_set_comp(CAPTURE_WRITER* pWriter, double dCompNum);
+// Writes the pending samples as a chunk and hands everything written so far on to the file now
+int capture_flush(CAPTURE_WRITER* pWriter);
+int capture_close(CAPTURE_WRITER* pWriter);
+WriterStats capture_writer_stats(CAPTURE_WRITER* pWriter);
+
+CAPTURE_READER* capture_open_read(const char* pPath);
+CAPTURE_READER* capture_dup_read(CAPTURE_READER* pSource);
+const CAPTURE_FILE_HEADER* capture_header(CAPTURE_READER* pReader);
+const CAPTURE_INDEX_ENTRY* capture_index(CAPTURE_READER* pReader, unsigned long* pulEntries);
+int capture_seek(CAPTURE_READER* pReader, long long llTime);
+long capture_read_chunk(CAPTURE_READER* pReader, unsigned long ulChunk, RawSample* pSamples);
+// Compensation factor chunk ulChunk was recorded with
+int capture_chunk_comp(CAPTURE_READER* pReader, unsigned long ulChunk, double* pdCompNum);
+long capture_read(CAPTURE_READER* pReader, RawSample* pSamples, unsigned long ulMax);
+// As capture_read, stopping where the compensation factor changes; *pdCompNum is the factor of the samples read
+long capture_read_comp(CAPTURE_READER* pReader, RawSample* pSamples, unsigned long ulMax, double* pdCompNum);
+void capture_close_read(CAPTURE_READER* pReader);
+
+CAPTURE_CATALOG* catalog_open(const char* pPath);
+unsigned long catalog_segments(CAPTURE_CATALOG* pCatalog, const CaptureSegment** ppSegments);
+int catalog_seek(CAPTURE_CATALOG* pCatalog, long long llTime);
+long catalog_read(CAPTURE_CATALOG* pCatalog, RawSample* pSamples, unsigned long ulMax);
+long catalog_read_comp(CAPTURE_CATALOG* pCatalog, RawSample* pSamples, unsigned long ulMax, double* pdCompNum);
+void catalog_close(CAPTURE_CATALOG* pCatalog);
+
+// Live recording of every acquired sample. The acquisition thread only queues samples; a recording thread
+// writes them, and samples arriving while the queue is full are counted in WriterStats.ullOverruns. The first
+// failed write is reported in iError; it and every sample after it are counted in ullDropped.
+int start_recording(const char* pPath);
+int start_recording_fd(int fd);
+int start_recording_segments(const char* pPrefix, long long llSegmentNs, unsigned long long ullSegmentBytes);
+void stop_recording(void);
+WriterStats read_recording_stats(void);
+void capture_update(const RawSample* pRaw, double dCompNum);
+// True while a live recording takes samples, so the acquisition thread reads the comparator status for it
+bool capture_wants_gelt(void);
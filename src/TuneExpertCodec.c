@@ -0,0 +1,387 @@
+﻿// TuneExpertCodec.c: Lossless codec for raw sample blocks
+//
+// Every column of a block is stored as its first value (zigzag varint), one byte holding the bit width b
+// of the largest zigzagged delta, then the remaining deltas packed at b bits each, LSB first. Constant
+// columns such as the valid bits cost two bytes per block.
+//
+// The AVX2 prefix sum and the SSE4.2 CRC are compiled for their target alone in builds without -mavx2 or
+// -msse4.2 and taken when the CPU reports them, as in TuneExpertFixed.c; the tests define CODEC_PORTABLE to
+// keep a build on its baseline paths.
+
+#include "TuneExpertCodec.h"
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__AVX2__)
+    #define CODEC_AVX2 1                    // whole build targets AVX2
+    #define CODEC_AVX2_TARGET
+#elif defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && !defined(CODEC_PORTABLE)
+    #define CODEC_AVX2 2                    // chosen at run time
+    #define CODEC_AVX2_TARGET __attribute__((target("avx2")))
+#endif
+
+#if defined(__SSE4_2__)
+    #define CODEC_SSE42 1
+    #define CODEC_SSE42_TARGET
+#elif defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && !defined(CODEC_PORTABLE)
+    #define CODEC_SSE42 2
+    #define CODEC_SSE42_TARGET __attribute__((target("sse4.2")))
+#endif
+
+#if defined(CODEC_AVX2) || defined(CODEC_SSE42)
+    #include <immintrin.h>
+#elif defined(__SSE2__)
+    #include <emmintrin.h>
+#endif
+
+size_t codec_put_varint(unsigned char* pOut, unsigned long long ullValue)
+{
+    size_t n = 0;
+
+    while (ullValue >= 0x80)
+    {
+        pOut[n++] = (unsigned char)(ullValue | 0x80);
+        ullValue >>= 7;
+    }
+    pOut[n++] = (unsigned char)ullValue;
+    return n;
+}
+
+size_t codec_get_varint(const unsigned char* pIn, size_t ulLen, unsigned long long* pullValue)
+{
+    unsigned long long ullValue = 0;
+    size_t n;
+
+    for (n = 0; n < ulLen && n < 10; n++)
+    {
+        ullValue |= (unsigned long long)(pIn[n] & 0x7f) << (7 * n);
+        if (!(pIn[n] & 0x80))
+        {
+            *pullValue = ullValue;
+            return n + 1;
+        }
+    }
+    return 0;
+}
+
+static inline uint64_t zigzag(int64_t v)
+{
+    return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static void get_column(const RawSample* p, unsigned long n, int iColumn, int64_t* pCol)
+{
+    unsigned long i;
+
+    switch (iColumn)
+    {
+    case 0: for (i = 0; i < n; i++) pCol[i] = p[i].llTime; break;
+    case 1: for (i = 0; i < n; i++) pCol[i] = p[i].llAx1Pos; break;
+    case 2: for (i = 0; i < n; i++) pCol[i] = p[i].llAx2Pos; break;
+    case 3: for (i = 0; i < n; i++) pCol[i] = p[i].llAx3Pos; break;
+    case 4: for (i = 0; i < n; i++) pCol[i] = p[i].lAx1Vel; break;
+    case 5: for (i = 0; i < n; i++) pCol[i] = p[i].lAx2Vel; break;
+    case 6: for (i = 0; i < n; i++) pCol[i] = p[i].lAx3Vel; break;
+    case 7: for (i = 0; i < n; i++) pCol[i] = p[i].uiGeLtStatus; break;
+    default: for (i = 0; i < n; i++) pCol[i] = p[i].wValid; break;
+    }
+}
+
+static void set_column(RawSample* p, unsigned long n, int iColumn, const int64_t* pCol)
+{
+    unsigned long i;
+
+    switch (iColumn)
+    {
+    case 0: for (i = 0; i < n; i++) p[i].llTime = pCol[i]; break;
+    case 1: for (i = 0; i < n; i++) p[i].llAx1Pos = pCol[i]; break;
+    case 2: for (i = 0; i < n; i++) p[i].llAx2Pos = pCol[i]; break;
+    case 3: for (i = 0; i < n; i++) p[i].llAx3Pos = pCol[i]; break;
+    case 4: for (i = 0; i < n; i++) p[i].lAx1Vel = (long)pCol[i]; break;
+    case 5: for (i = 0; i < n; i++) p[i].lAx2Vel = (long)pCol[i]; break;
+    case 6: for (i = 0; i < n; i++) p[i].lAx3Vel = (long)pCol[i]; break;
+    case 7: for (i = 0; i < n; i++) p[i].uiGeLtStatus = (unsigned int)pCol[i]; break;
+    default: for (i = 0; i < n; i++) p[i].wValid = (unsigned short)pCol[i]; break;
+    }
+}
+
+size_t codec_encode_block(const RawSample* pSamples, unsigned long ulCount, unsigned char* pOut)
+{
+    int64_t aCol[CODEC_BLOCK];
+    uint64_t aZz[CODEC_BLOCK];
+    size_t ulPos;
+    int iColumn;
+
+    if (ulCount > CODEC_BLOCK) ulCount = CODEC_BLOCK;
+    ulPos = codec_put_varint(pOut, ulCount);
+    if (ulCount == 0) return ulPos;
+
+    for (iColumn = 0; iColumn < CODEC_COLUMNS; iColumn++)
+    {
+        uint64_t ullOr = 0, ullAcc = 0;
+        unsigned int uiWidth = 0, uiBits = 0;
+        unsigned long i;
+
+        get_column(pSamples, ulCount, iColumn, aCol);
+        for (i = 1; i < ulCount; i++)
+        {
+            aZz[i] = zigzag((int64_t)((uint64_t)aCol[i] - (uint64_t)aCol[i - 1]));
+            ullOr |= aZz[i];
+        }
+        while (uiWidth < 64 && (ullOr >> uiWidth)) uiWidth++;
+
+        ulPos += codec_put_varint(pOut + ulPos, zigzag(aCol[0]));
+        pOut[ulPos++] = (unsigned char)uiWidth;
+        if (uiWidth == 0) continue;
+
+        for (i = 1; i < ulCount; i++)
+        {
+            unsigned int uiTake = uiWidth;
+            uint64_t v = aZz[i];
+
+            // Feed the value into the accumulator, spilling whole bytes as they fill
+            while (uiTake)
+            {
+                unsigned int uiRoom = 64 - uiBits;
+                unsigned int uiNow = uiTake < uiRoom ? uiTake : uiRoom;
+                uint64_t ullPart = uiNow == 64 ? v : v & ((1ull << uiNow) - 1);
+
+                ullAcc |= ullPart << uiBits;
+                uiBits += uiNow;
+                uiTake -= uiNow;
+                v = uiNow == 64 ? 0 : v >> uiNow;
+                while (uiBits >= 8)
+                {
+                    pOut[ulPos++] = (unsigned char)ullAcc;
+                    ullAcc >>= 8;
+                    uiBits -= 8;
+                }
+            }
+        }
+        if (uiBits) pOut[ulPos++] = (unsigned char)ullAcc;
+    }
+    return ulPos;
+}
+
+static void unpack(const unsigned char* pIn, size_t ulBytes, unsigned int uiWidth, unsigned long n, uint64_t* pOut)
+{
+    uint64_t ullMask = uiWidth == 64 ? ~0ull : (1ull << uiWidth) - 1;
+    size_t ulBit = 0;
+    unsigned long i;
+
+    for (i = 0; i < n; i++, ulBit += uiWidth)
+    {
+        size_t ulByte = ulBit >> 3;
+        unsigned int uiShift = ulBit & 7;
+
+        if (uiWidth + uiShift <= 64 && ulByte + 8 <= ulBytes)
+        {
+            uint64_t w;
+            memcpy(&w, pIn + ulByte, 8);        // little endian window load
+            pOut[i] = (w >> uiShift) & ullMask;
+        }
+        else
+        {
+            uint64_t v = 0;
+            unsigned int b;
+            for (b = 0; b < uiWidth; b++)
+                v |= (uint64_t)((pIn[(ulBit + b) >> 3] >> ((ulBit + b) & 7)) & 1) << b;
+            pOut[i] = v;
+        }
+    }
+}
+
+#ifdef CODEC_AVX2
+// Returns how many values it decoded, a multiple of 4
+CODEC_AVX2_TARGET static unsigned long unzigzag_avx2(const uint64_t* pZz, unsigned long n, int64_t llFirst, int64_t* pOut)
+{
+    __m256i vCarry = _mm256_set1_epi64x(llFirst);
+    const __m256i vOne = _mm256_set1_epi64x(1), vZero = _mm256_setzero_si256();
+    unsigned long i = 0;
+
+    for (; i + 4 <= n; i += 4)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(pZz + i));
+        v = _mm256_xor_si256(_mm256_srli_epi64(v, 1), _mm256_sub_epi64(vZero, _mm256_and_si256(v, vOne)));
+        v = _mm256_add_epi64(v, _mm256_blend_epi32(_mm256_permute4x64_epi64(v, 0x90), vZero, 0x03));
+        v = _mm256_add_epi64(v, _mm256_blend_epi32(_mm256_permute4x64_epi64(v, 0x40), vZero, 0x0f));
+        v = _mm256_add_epi64(v, vCarry);
+        _mm256_storeu_si256((__m256i*)(pOut + i), v);
+        vCarry = _mm256_permute4x64_epi64(v, 0xff);
+    }
+    return i;
+}
+
+static bool has_avx2(void)
+{
+#if CODEC_AVX2 == 1
+    return true;
+#else
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+#endif
+
+#ifdef __SSE2__
+// Returns how many values it decoded, a multiple of 2
+static unsigned long unzigzag_sse2(const uint64_t* pZz, unsigned long n, int64_t llFirst, int64_t* pOut)
+{
+    __m128i vCarry = _mm_set1_epi64x(llFirst);
+    const __m128i vOne = _mm_set1_epi64x(1), vZero = _mm_setzero_si128();
+    unsigned long i = 0;
+
+    for (; i + 2 <= n; i += 2)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*)(pZz + i));
+        v = _mm_xor_si128(_mm_srli_epi64(v, 1), _mm_sub_epi64(vZero, _mm_and_si128(v, vOne)));
+        v = _mm_add_epi64(v, _mm_slli_si128(v, 8));
+        v = _mm_add_epi64(v, vCarry);
+        _mm_storeu_si128((__m128i*)(pOut + i), v);
+        vCarry = _mm_unpackhi_epi64(v, v);
+    }
+    return i;
+}
+#endif
+
+// Zigzag decode the deltas and prefix sum them onto the first value; each narrower pass takes what the wider left
+static void unzigzag_scan(const uint64_t* pZz, unsigned long n, int64_t llFirst, int64_t* pOut)
+{
+    unsigned long i = 0;
+    int64_t llRun = llFirst;
+
+#ifdef CODEC_AVX2
+    if (has_avx2()) i = unzigzag_avx2(pZz, n, llFirst, pOut);
+#endif
+#ifdef __SSE2__
+    i += unzigzag_sse2(pZz + i, n - i, i ? pOut[i - 1] : llFirst, pOut + i);
+#endif
+    if (i) llRun = pOut[i - 1];
+    for (; i < n; i++)
+    {
+        llRun += (int64_t)((pZz[i] >> 1) ^ (0 - (pZz[i] & 1)));
+        pOut[i] = llRun;
+    }
+}
+
+long codec_decode_block(const unsigned char* pIn, size_t ulLen, RawSample* pSamples, unsigned long ulMax, size_t* pulUsed)
+{
+    int64_t aCol[CODEC_BLOCK];
+    uint64_t aZz[CODEC_BLOCK];
+    unsigned long long ullCount, ullFirst;
+    size_t ulPos, ulUsed;
+    int iColumn;
+
+    if (!(ulPos = codec_get_varint(pIn, ulLen, &ullCount)) || ullCount > CODEC_BLOCK || ullCount > ulMax) return -1;
+    if (ullCount == 0)
+    {
+        if (pulUsed) *pulUsed = ulPos;
+        return 0;
+    }
+
+    for (iColumn = 0; iColumn < CODEC_COLUMNS; iColumn++)
+    {
+        unsigned int uiWidth;
+        size_t ulBytes;
+
+        if (!(ulUsed = codec_get_varint(pIn + ulPos, ulLen - ulPos, &ullFirst)) || ulPos + ulUsed >= ulLen) return -1;
+        ulPos += ulUsed;
+        uiWidth = pIn[ulPos++];
+        if (uiWidth > 64) return -1;
+        ulBytes = ((ullCount - 1) * uiWidth + 7) / 8;
+        if (ulPos + ulBytes > ulLen) return -1;
+
+        aCol[0] = (int64_t)((ullFirst >> 1) ^ (0 - (ullFirst & 1)));
+        if (uiWidth == 0)
+        {
+            unsigned long i;
+            for (i = 1; i < ullCount; i++) aCol[i] = aCol[0];
+        }
+        else
+        {
+            unpack(pIn + ulPos, ulBytes, uiWidth, (unsigned long)ullCount - 1, aZz);
+            unzigzag_scan(aZz, (unsigned long)ullCount - 1, aCol[0], aCol + 1);
+        }
+        ulPos += ulBytes;
+        set_column(pSamples, (unsigned long)ullCount, iColumn, aCol);
+    }
+    if (pulUsed) *pulUsed = ulPos;
+    return (long)ullCount;
+}
+
+#if CODEC_SSE42 != 1
+static const uint32_t auiCrcTable[256] = {
+    0x00000000u, 0xf26b8303u, 0xe13b70f7u, 0x1350f3f4u, 0xc79a971fu, 0x35f1141cu, 0x26a1e7e8u, 0xd4ca64ebu,
+    0x8ad958cfu, 0x78b2dbccu, 0x6be22838u, 0x9989ab3bu, 0x4d43cfd0u, 0xbf284cd3u, 0xac78bf27u, 0x5e133c24u,
+    0x105ec76fu, 0xe235446cu, 0xf165b798u, 0x030e349bu, 0xd7c45070u, 0x25afd373u, 0x36ff2087u, 0xc494a384u,
+    0x9a879fa0u, 0x68ec1ca3u, 0x7bbcef57u, 0x89d76c54u, 0x5d1d08bfu, 0xaf768bbcu, 0xbc267848u, 0x4e4dfb4bu,
+    0x20bd8edeu, 0xd2d60dddu, 0xc186fe29u, 0x33ed7d2au, 0xe72719c1u, 0x154c9ac2u, 0x061c6936u, 0xf477ea35u,
+    0xaa64d611u, 0x580f5512u, 0x4b5fa6e6u, 0xb93425e5u, 0x6dfe410eu, 0x9f95c20du, 0x8cc531f9u, 0x7eaeb2fau,
+    0x30e349b1u, 0xc288cab2u, 0xd1d83946u, 0x23b3ba45u, 0xf779deaeu, 0x05125dadu, 0x1642ae59u, 0xe4292d5au,
+    0xba3a117eu, 0x4851927du, 0x5b016189u, 0xa96ae28au, 0x7da08661u, 0x8fcb0562u, 0x9c9bf696u, 0x6ef07595u,
+    0x417b1dbcu, 0xb3109ebfu, 0xa0406d4bu, 0x522bee48u, 0x86e18aa3u, 0x748a09a0u, 0x67dafa54u, 0x95b17957u,
+    0xcba24573u, 0x39c9c670u, 0x2a993584u, 0xd8f2b687u, 0x0c38d26cu, 0xfe53516fu, 0xed03a29bu, 0x1f682198u,
+    0x5125dad3u, 0xa34e59d0u, 0xb01eaa24u, 0x42752927u, 0x96bf4dccu, 0x64d4cecfu, 0x77843d3bu, 0x85efbe38u,
+    0xdbfc821cu, 0x2997011fu, 0x3ac7f2ebu, 0xc8ac71e8u, 0x1c661503u, 0xee0d9600u, 0xfd5d65f4u, 0x0f36e6f7u,
+    0x61c69362u, 0x93ad1061u, 0x80fde395u, 0x72966096u, 0xa65c047du, 0x5437877eu, 0x4767748au, 0xb50cf789u,
+    0xeb1fcbadu, 0x197448aeu, 0x0a24bb5au, 0xf84f3859u, 0x2c855cb2u, 0xdeeedfb1u, 0xcdbe2c45u, 0x3fd5af46u,
+    0x7198540du, 0x83f3d70eu, 0x90a324fau, 0x62c8a7f9u, 0xb602c312u, 0x44694011u, 0x5739b3e5u, 0xa55230e6u,
+    0xfb410cc2u, 0x092a8fc1u, 0x1a7a7c35u, 0xe811ff36u, 0x3cdb9bddu, 0xceb018deu, 0xdde0eb2au, 0x2f8b6829u,
+    0x82f63b78u, 0x709db87bu, 0x63cd4b8fu, 0x91a6c88cu, 0x456cac67u, 0xb7072f64u, 0xa457dc90u, 0x563c5f93u,
+    0x082f63b7u, 0xfa44e0b4u, 0xe9141340u, 0x1b7f9043u, 0xcfb5f4a8u, 0x3dde77abu, 0x2e8e845fu, 0xdce5075cu,
+    0x92a8fc17u, 0x60c37f14u, 0x73938ce0u, 0x81f80fe3u, 0x55326b08u, 0xa759e80bu, 0xb4091bffu, 0x466298fcu,
+    0x1871a4d8u, 0xea1a27dbu, 0xf94ad42fu, 0x0b21572cu, 0xdfeb33c7u, 0x2d80b0c4u, 0x3ed04330u, 0xccbbc033u,
+    0xa24bb5a6u, 0x502036a5u, 0x4370c551u, 0xb11b4652u, 0x65d122b9u, 0x97baa1bau, 0x84ea524eu, 0x7681d14du,
+    0x2892ed69u, 0xdaf96e6au, 0xc9a99d9eu, 0x3bc21e9du, 0xef087a76u, 0x1d63f975u, 0x0e330a81u, 0xfc588982u,
+    0xb21572c9u, 0x407ef1cau, 0x532e023eu, 0xa145813du, 0x758fe5d6u, 0x87e466d5u, 0x94b49521u, 0x66df1622u,
+    0x38cc2a06u, 0xcaa7a905u, 0xd9f75af1u, 0x2b9cd9f2u, 0xff56bd19u, 0x0d3d3e1au, 0x1e6dcdeeu, 0xec064eedu,
+    0xc38d26c4u, 0x31e6a5c7u, 0x22b65633u, 0xd0ddd530u, 0x0417b1dbu, 0xf67c32d8u, 0xe52cc12cu, 0x1747422fu,
+    0x49547e0bu, 0xbb3ffd08u, 0xa86f0efcu, 0x5a048dffu, 0x8ecee914u, 0x7ca56a17u, 0x6ff599e3u, 0x9d9e1ae0u,
+    0xd3d3e1abu, 0x21b862a8u, 0x32e8915cu, 0xc083125fu, 0x144976b4u, 0xe622f5b7u, 0xf5720643u, 0x07198540u,
+    0x590ab964u, 0xab613a67u, 0xb831c993u, 0x4a5a4a90u, 0x9e902e7bu, 0x6cfbad78u, 0x7fab5e8cu, 0x8dc0dd8fu,
+    0xe330a81au, 0x115b2b19u, 0x020bd8edu, 0xf0605beeu, 0x24aa3f05u, 0xd6c1bc06u, 0xc5914ff2u, 0x37faccf1u,
+    0x69e9f0d5u, 0x9b8273d6u, 0x88d28022u, 0x7ab90321u, 0xae7367cau, 0x5c18e4c9u, 0x4f48173du, 0xbd23943eu,
+    0xf36e6f75u, 0x0105ec76u, 0x12551f82u, 0xe03e9c81u, 0x34f4f86au, 0xc69f7b69u, 0xd5cf889du, 0x27a40b9eu,
+    0x79b737bau, 0x8bdcb4b9u, 0x988c474du, 0x6ae7c44eu, 0xbe2da0a5u, 0x4c4623a6u, 0x5f16d052u, 0xad7d5351u
+};
+#endif
+
+#ifdef CODEC_SSE42
+CODEC_SSE42_TARGET static uint32_t crc32c_sse42(uint32_t c, const unsigned char* p, size_t ulLen)
+{
+#if defined(__x86_64__)
+    uint64_t c64 = c;
+    for (; ulLen >= 8; ulLen -= 8, p += 8)
+    {
+        uint64_t w;
+        memcpy(&w, p, 8);
+        c64 = _mm_crc32_u64(c64, w);
+    }
+    c = (uint32_t)c64;
+#endif
+    for (; ulLen; ulLen--) c = _mm_crc32_u8(c, *p++);
+    return c;
+}
+
+static bool has_sse42(void)
+{
+#if CODEC_SSE42 == 1
+    return true;
+#else
+    return __builtin_cpu_supports("sse4.2");
+#endif
+}
+#endif
+
+unsigned int codec_crc32c(unsigned int uiCrc, const void* pData, size_t ulLen)
+{
+    const unsigned char* p = pData;
+    uint32_t c = ~(uint32_t)uiCrc;
+
+#ifdef CODEC_SSE42
+    if (has_sse42()) return ~crc32c_sse42(c, p, ulLen);
+#endif
+#if CODEC_SSE42 != 1
+    for (; ulLen; ulLen--) c = auiCrcTable[(c ^ *p++) & 0xff] ^ (c >> 8);
+#endif
+    return ~c;
+}
@@ -0,0 +1,22 @@
+﻿// TuneExpertCodec.h: Lossless delta / zigzag / bit-packed codec for raw sample blocks
+//
+
+#pragma once
+
+#include "TuneExpertData.h"
+#include <stddef.h>
+
+#define CODEC_BLOCK 256             // samples per block, each block decodes on its own
+#define CODEC_COLUMNS 9             // time, 3 positions, 3 velocities, comparator status, valid
+
+// Upper bound on the encoded size of a block of ulCount samples
+#define CODEC_MAX_BYTES(ulCount) (10 + CODEC_COLUMNS * (11 + ((size_t)(ulCount) * 64 + 7) / 8))
+
+size_t codec_encode_block(const RawSample* pSamples, unsigned long ulCount, unsigned char* pOut);
+long codec_decode_block(const unsigned char* pIn, size_t ulLen, RawSample* pSamples, unsigned long ulMax, size_t* pulUsed);
+
+// CRC-32C (Castagnoli), pass 0 to start or a previous result to continue
+unsigned int codec_crc32c(unsigned int uiCrc, const void* pData, size_t ulLen);
+
+size_t codec_put_varint(unsigned char* pOut, unsigned long long ullValue);
+size_t codec_get_varint(const unsigned char* pIn, size_t ulLen, unsigned long long* pullValue);
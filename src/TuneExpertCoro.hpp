@@ -0,0 +1,350 @@
+﻿// TuneExpertCoro.hpp: C++20 coroutine streams of acquired samples, multiplexed with timers on one thread
+//
+// A SampleStream is a broadcast consumer whose awaits park the coroutine with an Executor instead of blocking
+// a thread. The stream arms the sample count it still needs and the acquisition thread signals the stream's
+// eventfd once that many have arrived, so the executor sleeps in ppoll() over every stream and the nearest
+// timer. Waiting costs the acquisition path one atomic load per sample and one write per wakeup.
+
+#pragma once
+
+extern "C" {
+#include "TuneExpertBroadcast.h"
+}
+
+#include <algorithm>
+#include <chrono>
+#include <coroutine>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <optional>
+#include <queue>
+#include <span>
+#include <utility>
+#include <vector>
+
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+
+namespace TuneExpert {
+
+template <class T = void> class Task;
+
+namespace detail {
+
+struct PromiseBase {
+    std::coroutine_handle<> Continuation;
+    std::exception_ptr pException;
+    std::exception_ptr* ppSink = nullptr;   // set for tasks spawned on an executor, which own themselves
+
+    struct FinalAwaiter {
+        bool await_ready() noexcept { return false; }
+        template <class P> std::coroutine_handle<> await_suspend(std::coroutine_handle<P> h) noexcept
+        {
+            PromiseBase& p = h.promise();
+
+            if (p.Continuation) return p.Continuation;
+            if (p.ppSink)
+            {
+                if (p.pException && !*p.ppSink) *p.ppSink = p.pException;
+                h.destroy();
+            }
+            return std::noop_coroutine();
+        }
+        void await_resume() noexcept {}
+    };
+
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    FinalAwaiter final_suspend() noexcept { return {}; }
+    void unhandled_exception() noexcept { pException = std::current_exception(); }
+};
+
+template <class T> struct Result {
+    std::optional<T> Value;
+    template <class U> void return_value(U&& v) { Value.emplace(std::forward<U>(v)); }
+    T take() { return std::move(*Value); }
+};
+
+template <> struct Result<void> {
+    void return_void() noexcept {}
+    void take() noexcept {}
+};
+
+} // namespace detail
+
+// Lazily started coroutine; co_await it from another task or hand it to Executor::spawn
+template <class T> class Task {
+public:
+    struct promise_type : detail::PromiseBase, detail::Result<T> {
+        Task get_return_object() { return Task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+    };
+
+    Task(Task&& o) noexcept : h(std::exchange(o.h, {})) {}
+    Task(const Task&) = delete;
+    Task& operator=(const Task&) = delete;
+    ~Task() { if (h) h.destroy(); }
+
+    bool await_ready() const noexcept { return false; }
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> c) noexcept
+    {
+        h.promise().Continuation = c;
+        return h;
+    }
+    T await_resume()
+    {
+        if (h.promise().pException) std::rethrow_exception(h.promise().pException);
+        return h.promise().take();
+    }
+
+    std::coroutine_handle<promise_type> release() noexcept { return std::exchange(h, {}); }
+
+private:
+    explicit Task(std::coroutine_handle<promise_type> h) : h(h) {}
+    std::coroutine_handle<promise_type> h;
+};
+
+// Single threaded: tasks, timers and streams all run on the thread calling run()
+class Executor {
+public:
+    using Clock = std::chrono::steady_clock;
+
+    // Something a coroutine waits on outside the executor; poll() returns true once it can resume
+    struct Waiter {
+        std::coroutine_handle<> Handle;
+        virtual bool poll() = 0;
+        virtual int fd() const = 0;         // readable when poll() is worth calling, -1 to be polled on a timer
+    protected:
+        ~Waiter() = default;
+    };
+
+    Executor() = default;
+    Executor(const Executor&) = delete;
+    Executor& operator=(const Executor&) = delete;
+    template <class T> void spawn(Task<T> task)
+    {
+        auto h = task.release();
+        h.promise().ppSink = &pException;
+        Ready.push_back(h);
+    }
+
+    void post(std::coroutine_handle<> h) { Ready.push_back(h); }
+    void wait(Waiter* pWaiter) { Waiters.push_back(pWaiter); }
+    void stop() { bStop = true; }
+
+    auto sleep_until(Clock::time_point tp)
+    {
+        struct Awaiter {
+            Executor& Ex;
+            Clock::time_point Tp;
+            bool await_ready() const { return Tp <= Clock::now(); }
+            void await_suspend(std::coroutine_handle<> h) { Ex.Timers.push(Timer{ Tp, Ex.ullTimerSeq++, h }); }
+            void await_resume() const noexcept {}
+        };
+        return Awaiter{ *this, tp };
+    }
+    auto sleep_for(Clock::duration d) { return sleep_until(Clock::now() + d); }
+
+    // Returns when nothing is left to run or wait for, or after stop(); rethrows the first exception a spawned task let escape
+    void run()
+    {
+        bStop = false;
+        while (!bStop)
+        {
+            while (!Ready.empty() && !bStop)
+            {
+                std::coroutine_handle<> h = Ready.front();
+                Ready.pop_front();
+                h.resume();
+                if (pException) std::rethrow_exception(std::exchange(pException, nullptr));
+            }
+            if (bStop) break;
+
+            for (Clock::time_point now = Clock::now(); !Timers.empty() && Timers.top().Tp <= now; Timers.pop()) Ready.push_back(Timers.top().Handle);
+            // Waiter::poll may resume nothing but re-arm, so it runs before sleeping every time
+            for (size_t i = 0; i < Waiters.size();)
+                if (Waiters[i]->poll())
+                {
+                    Ready.push_back(Waiters[i]->Handle);
+                    Waiters.erase(Waiters.begin() + i);
+                }
+                else i++;
+            if (!Ready.empty()) continue;
+            if (Waiters.empty() && Timers.empty()) break;
+            sleep();
+        }
+    }
+
+private:
+    static constexpr auto POLL_INTERVAL = std::chrono::microseconds(100);   // waiters without an fd
+
+    struct Timer {
+        Clock::time_point Tp;
+        unsigned long long ullSeq;          // keeps timers with equal deadlines in order
+        std::coroutine_handle<> Handle;
+        bool operator>(const Timer& o) const { return Tp != o.Tp ? Tp > o.Tp : ullSeq > o.ullSeq; }
+    };
+
+    void sleep()
+    {
+        Clock::duration Wait = Clock::duration::max();
+        bool bBlind = false;
+
+        if (!Timers.empty()) Wait = std::max(Clock::duration::zero(), Timers.top().Tp - Clock::now());
+        aFds.clear();
+        for (Waiter* pWaiter : Waiters)
+            if (pWaiter->fd() >= 0) aFds.push_back(pollfd{ pWaiter->fd(), POLLIN, 0 });
+            else bBlind = true;
+        if (bBlind) Wait = std::min<Clock::duration>(Wait, POLL_INTERVAL);
+        if (Wait == Clock::duration::max()) ppoll(aFds.data(), aFds.size(), nullptr, nullptr);
+        else
+        {
+            auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(Wait).count();
+            timespec ts{ static_cast<time_t>(ns / 1000000000), static_cast<long>(ns % 1000000000) };
+            ppoll(aFds.data(), aFds.size(), &ts, nullptr);
+        }
+    }
+
+    std::deque<std::coroutine_handle<>> Ready;
+    std::priority_queue<Timer, std::vector<Timer>, std::greater<Timer>> Timers;
+    unsigned long long ullTimerSeq = 0;
+    std::vector<Waiter*> Waiters;
+    std::exception_ptr pException;
+    bool bStop = false;
+    std::vector<pollfd> aFds;
+};
+
+// One broadcast consumer. Only one await per stream may be outstanding; the stream must outlive it.
+class SampleStream {
+public:
+    SampleStream(Executor& ex, const BroadcastConfig& config) : Ex(ex), pConsumer(broadcast_subscribe_config(&config)) {}
+    explicit SampleStream(Executor& ex, int iPolicy = BROADCAST_BLOCK) : Ex(ex), pConsumer(broadcast_subscribe(iPolicy)) {}
+    SampleStream(const SampleStream&) = delete;
+    SampleStream& operator=(const SampleStream&) = delete;
+    ~SampleStream() { broadcast_unsubscribe(pConsumer); }
+
+    // False when no broadcast was started or all consumer slots are taken
+    bool valid() const { return pConsumer != nullptr; }
+    BroadcastStats stats() const { return read_broadcast_stats(pConsumer); }
+
+    // The next ulCount samples, fewer only once the broadcast has stopped. The span is valid until the
+    // next await on this stream. A DROP_OLDEST stream that gets lapped loses the samples it was reading.
+    auto next(size_t ulCount)
+    {
+        struct Awaiter : Executor::Waiter {
+            SampleStream& Stream;
+            size_t ulCount;
+            Awaiter(SampleStream& s, size_t n) : Stream(s), ulCount(n) { Stream.Block.clear(); }
+            bool consume(const LatestSample* p, unsigned long n, unsigned long* pulUsed)
+            {
+                size_t ulTake = std::min<size_t>(n, ulCount - Stream.Block.size());
+                Stream.Block.insert(Stream.Block.end(), p, p + ulTake);
+                *pulUsed = static_cast<unsigned long>(ulTake);
+                return Stream.Block.size() == ulCount;
+            }
+            void discard(unsigned long ulUsed) { Stream.Block.resize(Stream.Block.size() - ulUsed); }
+            size_t remaining() const { return ulCount - Stream.Block.size(); }
+            bool poll() override { return Stream.poll(*this); }
+            int fd() const override { return Stream.fd(); }
+            bool await_ready() { return ulCount == 0 || poll(); }
+            void await_suspend(std::coroutine_handle<> h)
+            {
+                Handle = h;
+                Stream.Ex.wait(this);
+            }
+            std::span<const LatestSample> await_resume() const { return Stream.Block; }
+        };
+        return Awaiter(*this, ulCount);
+    }
+
+    // The next sample with one of uiGeLtMask's comparator bits set that was clear in the sample before it,
+    // nullopt once the broadcast has stopped. The stream must have been subscribed with bGeLt.
+    auto next_event(unsigned int uiGeLtMask)
+    {
+        struct Awaiter : Executor::Waiter {
+            SampleStream& Stream;
+            unsigned int uiMask;
+            std::optional<LatestSample> Event;
+            unsigned int uiPrevious = 0;
+            Awaiter(SampleStream& s, unsigned int m) : Stream(s), uiMask(m) { uiPrevious = Stream.uiGeLt & m; }
+            bool consume(const LatestSample* p, unsigned long n, unsigned long* pulUsed)
+            {
+                unsigned long i;
+
+                for (i = 0; i < n; i++)
+                {
+                    unsigned int uiBits = p[i].Raw.uiGeLtStatus & uiMask;
+                    bool bRose = (uiBits & ~uiPrevious) != 0;
+
+                    uiPrevious = uiBits;
+                    if (bRose)
+                    {
+                        Event = p[i];
+                        *pulUsed = i + 1;
+                        return true;
+                    }
+                }
+                *pulUsed = n;
+                return false;
+            }
+            void discard(unsigned long) { Event.reset(); }
+            size_t remaining() const { return 1; }
+            bool poll() override { return Stream.poll(*this); }
+            int fd() const override { return Stream.fd(); }
+            bool await_ready() { return poll(); }
+            void await_suspend(std::coroutine_handle<> h)
+            {
+                Handle = h;
+                Stream.Ex.wait(this);
+            }
+            std::optional<LatestSample> await_resume()
+            {
+                Stream.uiGeLt = (Stream.uiGeLt & ~uiMask) | uiPrevious;
+                return Event;
+            }
+        };
+        return Awaiter(*this, uiGeLtMask);
+    }
+
+private:
+    int fd() const { return pConsumer ? broadcast_notify_fd(pConsumer) : -1; }
+
+    // Feeds whatever is available to the awaiter; true once it is satisfied or the stream has ended,
+    // otherwise arms the consumer for the samples it still needs
+    template <class A> bool poll(A& awaiter)
+    {
+        const LatestSample* p;
+        long n;
+
+        if (!pConsumer) return true;
+        uint64_t ullDrain;
+        if (fd() >= 0 && read(fd(), &ullDrain, sizeof(ullDrain)) < 0) ullDrain = 0;
+        while (true)
+        {
+            unsigned long ulUsed = 0;
+            bool bDone;
+
+            if ((n = broadcast_wait(pConsumer, &p, 0)) < 0) return true;
+            if (n == 0)
+            {
+                if (broadcast_arm(pConsumer, static_cast<unsigned long>(awaiter.remaining())) == 0) return false;
+                continue;
+            }
+            bDone = awaiter.consume(p, static_cast<unsigned long>(n), &ulUsed);
+            if (broadcast_release(pConsumer, ulUsed) != 0)
+            {
+                awaiter.discard(ulUsed);
+                bDone = false;
+            }
+            if (bDone) return true;
+        }
+    }
+
+    Executor& Ex;
+    BROADCAST_CONSUMER* pConsumer;
+    std::vector<LatestSample> Block;
+    unsigned int uiGeLt = 0;                // comparator bits of the last sample seen by next_event
+};
+
+} // namespace TuneExpert
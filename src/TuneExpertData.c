@@ -2,104 +2,344 @@
 //
 
 #include "TuneExpertData.h"
+#include "TuneExpertStats.h"
+#include "TuneExpertAllan.h"
+#include "TuneExpertEnv.h"
+#include "TuneExpertTrigger.h"
+#include "TuneExpertCapture.h"
+#include "TuneExpertReplay.h"
+#include "TuneExpertRealtime.h"
+#include "TuneExpertSeqlock.h"
+#include "TuneExpertBroadcast.h"
+#include "TuneExpertHealth.h"
+#include "TuneExpertVendor.h"
+#include "TuneExpertPool.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <fcntl.h>
 #include <memory.h>
+#include <pthread.h>
+#include <time.h>
 
 N1231B_HANDLE hBrd = (N1231B_HANDLE)0;
 
 LASER_DATA LsrData;
 
+static unsigned long long ullSampleCount;
+
+// The seqlock takes one writer; the mutex keeps that true should two threads sample at once
+static pthread_mutex_t PublishMutex = PTHREAD_MUTEX_INITIALIZER;
+static SEQLOCK LatestLock;
+static LatestSample Latest;
+static double dScaleComp;                   // factor behind LsrData's scales, acquisition thread only
+
+static void set_scale(double dCompNum)
+{
+    dScaleComp = dCompNum;
+    LsrData.dPCnvrt2um = UM_PER_COUNT(dCompNum);
+    LsrData.dVCnvrt2umps = UMPS_PER_COUNT(LsrData.dPCnvrt2um);
+}
+
 long test()
 {
     return 9;
 }
 
+// The driver library is loaded here rather than at startup; without it a replay runs boardless, else opening fails
+// as it always has unless the simulated board was opted into (see TuneExpertVendor.h)
 void open_device()
 {
     N1231B_LOCATION sDevice;
-    N1231BDefaultDevice(&sDevice);
-    check(N1231BOpen(&sDevice, &hBrd, NULL), true, (char*)"Open Default Board");
-    LsrData.dPCnvrt2um = LAMBDA_NM * COMP_NUM / (FOLD * 1024 * 1000);
-    LsrData.dVCnvrt2umps = LsrData.dPCnvrt2um * N1231B_CLOCK / (4194304 / 1024);
+
+    set_scale(read_comp_num());
+    if (vendor_load() != 0)
+    {
+        if (read_replay_status().bActive)
+        {
+            printf("N1231B driver unavailable (%s), replaying without a board\n", read_vendor_error());
+            return;
+        }
+        printf("N1231B driver unavailable (%s), set %s to simulate the board\n", read_vendor_error(), VENDOR_SIMULATE_ENV);
+        check(N1231B_ERR_DRIVER, true, (char*)"Loading the N1231B driver");
+    }
+    if (read_vendor_backend() == VENDOR_SIMULATED) printf("Simulating the N1231B board\n");
+    vendor_api()->pfnDefaultDevice(&sDevice);
+    check(vendor_api()->pfnOpen(&sDevice, &hBrd, NULL), true, (char*)"Open Default Board");
     setup_device();
 }
 
+long long get_time_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Every sample taken from the board passes through here so the live processing stages see it
+static void acquire_sample(LatestSample* pSample, bool bReadGeLt)
+{
+    PosVelSample* pvs = &pSample->Pos;
+    RawSample raw;
+    double dCompNum;
+    int iReplay;
+    long long llStart = latency_start();
+
+    // Compensation changes land between samples, never inside one; taken after replay_next, which posts the
+    // factor of recorded samples as it reaches them
+    iReplay = replay_next(&raw);
+    if (env_take_update(ullSampleCount, &dCompNum)) set_scale(dCompNum);
+
+    if (iReplay == REPLAY_OFF)
+    {
+        const VENDOR_API* pApi = vendor_api();
+
+        vendor_lock();
+        LsrData.rc1 = pApi->pfnGetRawPosVelAll(hBrd, &LsrData.uAx1Pos.s, &LsrData.iAx1Vel, &LsrData.uAx2Pos.s, &LsrData.iAx2Vel, &LsrData.uAx3Pos.s, &LsrData.iAx3Vel, &LsrData.wValid);
+        // Comparator bits nobody asked for read as clear rather than as whatever was last read
+        if (bReadGeLt || trigger_wants_gelt() || broadcast_wants_gelt() || capture_wants_gelt())
+            LsrData.rc2 = pApi->pfnGetGeLtStatus(hBrd, (unsigned long*)&LsrData.uiGeLtStatus);
+        else
+            LsrData.uiGeLtStatus = 0;
+        vendor_unlock();
+
+        raw.llTime = get_time_ns();
+        raw.llAx1Pos = LsrData.uAx1Pos.i64;
+        raw.llAx2Pos = LsrData.uAx2Pos.i64;
+        raw.llAx3Pos = LsrData.uAx3Pos.i64;
+        raw.lAx1Vel = LsrData.iAx1Vel;
+        raw.lAx2Vel = LsrData.iAx2Vel;
+        raw.lAx3Vel = LsrData.iAx3Vel;
+        raw.uiGeLtStatus = LsrData.uiGeLtStatus;
+        raw.wValid = LsrData.wValid;
+    }
+    else
+    {
+        LsrData.rc1 = LsrData.rc2 = N1231B_SUCCESS;
+        LsrData.uAx1Pos.i64 = raw.llAx1Pos;
+        LsrData.uAx2Pos.i64 = raw.llAx2Pos;
+        LsrData.uAx3Pos.i64 = raw.llAx3Pos;
+        LsrData.iAx1Vel = raw.lAx1Vel;
+        LsrData.iAx2Vel = raw.lAx2Vel;
+        LsrData.iAx3Vel = raw.lAx3Vel;
+        LsrData.uiGeLtStatus = raw.uiGeLtStatus;
+        LsrData.wValid = raw.wValid;
+    }
+    // Axes the health watchdog gave up on read as invalid until cleared
+    raw.wValid = health_filter_valid(raw.wValid);
+    LsrData.wValid = raw.wValid;
+
+    pvs->p1 = LsrData.dPCnvrt2um * raw.llAx1Pos - START_MM * 1000;
+    pvs->p2 = LsrData.dPCnvrt2um * raw.llAx2Pos - START_MM * 1000;
+    pvs->p3 = LsrData.dPCnvrt2um * raw.llAx3Pos - START_MM * 1000;
+    pvs->v1 = LsrData.dVCnvrt2umps * raw.lAx1Vel;
+    pvs->v2 = LsrData.dVCnvrt2umps * raw.lAx2Vel;
+    pvs->v3 = LsrData.dVCnvrt2umps * raw.lAx3Vel;
+    pSample->Raw = raw;
+    pSample->dCompNum = dScaleComp;
+
+    // A finished replay keeps returning its last sample without feeding it to the stages again
+    if (iReplay == REPLAY_END)
+    {
+        pSample->ullSequence = ullSampleCount;
+        return;
+    }
+    pthread_mutex_lock(&PublishMutex);
+    pSample->ullSequence = ++ullSampleCount;
+    seqlock_write_begin(&LatestLock);
+    Latest = *pSample;
+    seqlock_write_end(&LatestLock);
+    pthread_mutex_unlock(&PublishMutex);
+    stats_update(pvs->p1, pvs->p2, pvs->p3);
+    allan_update(pvs->p1, pvs->p2, pvs->p3);
+    trigger_update(&raw, pvs, dScaleComp);
+    capture_update(&raw, dScaleComp);
+    broadcast_update(pSample);
+    latency_update(llStart);
+}
+
 PosVelSample read_data_struct()
 {
-    PosVelSample pvs;
+    LatestSample s;
 
-    LsrData.rc1 = N1231BGetRawPosVelAll(hBrd, &LsrData.uAx1Pos.s, &LsrData.iAx1Vel, &LsrData.uAx2Pos.s, &LsrData.iAx2Vel, &LsrData.uAx3Pos.s, &LsrData.iAx3Vel, &LsrData.wValid);
+    acquire_sample(&s, false);
+    return s.Pos;
+}
 
-    pvs.p1 = LsrData.dPCnvrt2um * LsrData.uAx1Pos.i64 - START_MM * 1000;
-    pvs.p2 = LsrData.dPCnvrt2um * LsrData.uAx2Pos.i64 - START_MM * 1000;
-    pvs.p3 = LsrData.dPCnvrt2um * LsrData.uAx3Pos.i64 - START_MM * 1000;
-    pvs.v1 = LsrData.dVCnvrt2umps * LsrData.iAx1Vel;
-    pvs.v2 = LsrData.dVCnvrt2umps * LsrData.iAx2Vel;
-    pvs.v3 = LsrData.dVCnvrt2umps * LsrData.iAx3Vel;
-    return pvs;
+RawSample read_data_raw(void)
+{
+    LatestSample s;
+
+    acquire_sample(&s, false);
+    return s.Raw;
+}
+
+LatestSample read_data_sample(void)
+{
+    LatestSample s;
+
+    acquire_sample(&s, false);
+    return s;
 }
 
 void read_data_pointer(double* pvs)
 {
-    LsrData.rc1 = N1231BGetRawPosVelAll(hBrd, &LsrData.uAx1Pos.s, &LsrData.iAx1Vel, &LsrData.uAx2Pos.s, &LsrData.iAx2Vel, &LsrData.uAx3Pos.s, &LsrData.iAx3Vel, &LsrData.wValid);
+    LatestSample s;
 
-    pvs[0] = LsrData.dPCnvrt2um * LsrData.uAx1Pos.i64 - START_MM * 1000;
-    pvs[1] = LsrData.dPCnvrt2um * LsrData.uAx2Pos.i64 - START_MM * 1000;
-    pvs[2] = LsrData.dPCnvrt2um * LsrData.uAx3Pos.i64 - START_MM * 1000;
+    acquire_sample(&s, false);
+    pvs[0] = s.Pos.p1;
+    pvs[1] = s.Pos.p2;
+    pvs[2] = s.Pos.p3;
 }
 
 void begin_read() {
-    double sample = 0;
-    LsrData.rc1 = N1231BGetRawPosVelAll(hBrd, &LsrData.uAx1Pos.s, &LsrData.iAx1Vel, &LsrData.uAx2Pos.s, &LsrData.iAx2Vel, &LsrData.uAx3Pos.s, &LsrData.iAx3Vel, &LsrData.wValid);
-    LsrData.rc2 = N1231BGetGeLtStatus(hBrd, (unsigned long*)&LsrData.uiGeLtStatus);
+    LatestSample s;
+
+    acquire_sample(&s, true);
+}
+
+typedef struct {
+    const RawSample* pRaw;
+    PosVelSample* pvs;
+    double dScale, dOffset;                 // um per count for conversion, the factor ratio for rescaling
+} BLOCK_JOB;
+
+static void convert_range(void* pArg, unsigned long ulBegin, unsigned long ulEnd, unsigned int uiWorker)
+{
+    const BLOCK_JOB* pJob = pArg;
+    const RawSample* pRaw = pJob->pRaw;
+    PosVelSample* pvs = pJob->pvs;
+    const double dPos = pJob->dScale;
+    const double dVel = UMPS_PER_COUNT(dPos);
+    const double dOffset = pJob->dOffset;
+    unsigned long i;
+
+    (void)uiWorker;
+    for (i = ulBegin; i < ulEnd; i++)
+    {
+        pvs[i].p1 = dPos * pRaw[i].llAx1Pos - dOffset;
+        pvs[i].p2 = dPos * pRaw[i].llAx2Pos - dOffset;
+        pvs[i].p3 = dPos * pRaw[i].llAx3Pos - dOffset;
+        pvs[i].v1 = dVel * pRaw[i].lAx1Vel;
+        pvs[i].v2 = dVel * pRaw[i].lAx2Vel;
+        pvs[i].v3 = dVel * pRaw[i].lAx3Vel;
+    }
+}
+
+// Batches of several pool grains are split over the shared pool
+void convert_block_comp(const RawSample* pRaw, PosVelSample* pvs, unsigned long ulCount, double dCompNum)
+{
+    BLOCK_JOB job = { pRaw, pvs, UM_PER_COUNT(dCompNum), START_MM * 1000 };
+
+    pool_batch(ulCount, sizeof(RawSample) + sizeof(PosVelSample), convert_range, &job);
+}
+
+void convert_block(const RawSample* pRaw, PosVelSample* pvs, unsigned long ulCount)
+{
+    convert_block_comp(pRaw, pvs, ulCount, read_comp_num());
+}
+
+static void rescale_range(void* pArg, unsigned long ulBegin, unsigned long ulEnd, unsigned int uiWorker)
+{
+    const BLOCK_JOB* pJob = pArg;
+    PosVelSample* pvs = pJob->pvs;
+    const double dRatio = pJob->dScale;
+    const double dOffset = pJob->dOffset;
+    unsigned long i;
+
+    (void)uiWorker;
+    for (i = ulBegin; i < ulEnd; i++)
+    {
+        pvs[i].p1 = pvs[i].p1 * dRatio + dOffset;
+        pvs[i].p2 = pvs[i].p2 * dRatio + dOffset;
+        pvs[i].p3 = pvs[i].p3 * dRatio + dOffset;
+        pvs[i].v1 *= dRatio;
+        pvs[i].v2 *= dRatio;
+        pvs[i].v3 *= dRatio;
+    }
+}
+
+// Re-scales samples converted with one compensation factor to another, e.g. from the env log
+void rescale_block(PosVelSample* pvs, unsigned long ulCount, double dFromComp, double dToComp)
+{
+    BLOCK_JOB job = { NULL, pvs, dToComp / dFromComp, 0 };
+
+    job.dOffset = START_MM * 1000 * (job.dScale - 1);
+    pool_batch(ulCount, sizeof(PosVelSample), rescale_range, &job);
+}
+
+// Lock free for any number of readers; retries only while the acquisition thread is mid-update
+LatestSample read_latest(void)
+{
+    LatestSample s;
+    unsigned int uiSeq;
+
+    do {
+        uiSeq = seqlock_read_begin(&LatestLock);
+        s = Latest;
+    } while (seqlock_read_retry(&LatestLock, uiSeq));
+    return s;
+}
+
+void read_latest_pointer(double* pvs)
+{
+    LatestSample s = read_latest();
+
+    pvs[0] = s.Pos.p1;
+    pvs[1] = s.Pos.p2;
+    pvs[2] = s.Pos.p3;
 }
 
 double read_ax1()
 {
-    return LsrData.dPCnvrt2um * LsrData.uAx1Pos.i64 - START_MM * 1000;
+    return read_latest().Pos.p1;
 }
 
 double read_ax2()
 {
-    return LsrData.dPCnvrt2um * LsrData.uAx2Pos.i64 - START_MM * 1000;
+    return read_latest().Pos.p2;
 }
 
 double read_ax3()
 {
-    return LsrData.dPCnvrt2um * LsrData.uAx3Pos.i64 - START_MM * 1000;
+    return read_latest().Pos.p3;
 }
 
 void setup_device(void)
 {
     union { N1231B_INT64 s; long i64; } uStart, uMax, uMin;
+    double dCompNum = read_comp_num();
 
-    uStart.i64 = START_MM * 1000000 / (LAMBDA_NM * COMP_NUM / (FOLD * 1024));
-    uMax.i64 = MAX_MM * 1000000 / (LAMBDA_NM * COMP_NUM / (FOLD * 1024));
-    uMin.i64 = MIN_MM * 1000000 / (LAMBDA_NM * COMP_NUM / (FOLD * 1024));
+    uStart.i64 = MM_TO_COUNTS(START_MM, dCompNum);
+    uMax.i64 = MM_TO_COUNTS(MAX_MM, dCompNum);
+    uMin.i64 = MM_TO_COUNTS(MIN_MM, dCompNum);
 
-    check(N1231BPresetRawAll(hBrd, uStart.s, uStart.s, uStart.s, NULL), false, (char*)"Presetting Position Values");
-    check(N1231BSetGeLtThresholds(hBrd, AXIS_1, uMax.s, uMin.s), false, (char*)"Setting Axis 1 Compare Thresholds");
-    check(N1231BSetGeLtThresholds(hBrd, AXIS_2, uMax.s, uMin.s), false, (char*)"Setting Axis 2 Compare Thresholds");
-    check(N1231BSetGeLtThresholds(hBrd, AXIS_3, uMax.s, uMin.s), false, (char*)"Setting Axis 3 Compare Thresholds");
-    check(N1231BSetGeLtDirections(hBrd, 0), false, (char*)"Setting Compare Directions");
-    check(N1231BSetConfig(hBrd, N1231B_BUS_MODE_DIRECT), false, (char*)"Setting Configuration");
-    check(N1231BSetFilter(hBrd, N1231B_FILTER_ENB | N1231B_KP2 | N1231B_KV1), false, (char*)"Setting Filter");
-    check(N1231BSetHdwIoSetup(hBrd, N1231B_HWIO_DISA1H | N1231B_HWIO_DISA2H | N1231B_HWIO_DISA3H), false, (char*)"Setting Hw IO Config");
+    vendor_lock();
+    check(vendor_api()->pfnPresetRawAll(hBrd, uStart.s, uStart.s, uStart.s, NULL), false, (char*)"Presetting Position Values");
+    check(vendor_api()->pfnSetGeLtThresholds(hBrd, AXIS_1, uMax.s, uMin.s), false, (char*)"Setting Axis 1 Compare Thresholds");
+    check(vendor_api()->pfnSetGeLtThresholds(hBrd, AXIS_2, uMax.s, uMin.s), false, (char*)"Setting Axis 2 Compare Thresholds");
+    check(vendor_api()->pfnSetGeLtThresholds(hBrd, AXIS_3, uMax.s, uMin.s), false, (char*)"Setting Axis 3 Compare Thresholds");
+    check(vendor_api()->pfnSetGeLtDirections(hBrd, 0), false, (char*)"Setting Compare Directions");
+    check(vendor_api()->pfnSetConfig(hBrd, N1231B_BUS_MODE_DIRECT), false, (char*)"Setting Configuration");
+    check(vendor_api()->pfnSetFilter(hBrd, N1231B_FILTER_ENB | N1231B_KP2 | N1231B_KV1), false, (char*)"Setting Filter");
+    check(vendor_api()->pfnSetHdwIoSetup(hBrd, N1231B_HWIO_DISA1H | N1231B_HWIO_DISA2H | N1231B_HWIO_DISA3H), false, (char*)"Setting Hw IO Config");
+    vendor_unlock();
 }
 void clear_pos_errors(void)
 {
-    check(N1231BClearPathErrorAll(hBrd, NULL), false, (char*)"Clearing Path Errors");
+    vendor_lock();
+    check(vendor_api()->pfnClearPathErrorAll(hBrd, NULL), false, (char*)"Clearing Path Errors");
+    vendor_unlock();
 }
 
 void reset_laser(void)
 {
     union { N1231B_INT64 s; long i64; } uStart;
-    uStart.i64 = START_MM * 1000000 / (LAMBDA_NM * COMP_NUM / (FOLD * 1024));
+    uStart.i64 = MM_TO_COUNTS(START_MM, read_comp_num());
 
-    check(N1231BPresetRawAll(hBrd, uStart.s, uStart.s, uStart.s, NULL), false, (char*)"Presetting Position Values");
+    vendor_lock();
+    check(vendor_api()->pfnPresetRawAll(hBrd, uStart.s, uStart.s, uStart.s, NULL), false, (char*)"Presetting Position Values");
+    vendor_unlock();
 }
 
 void PaintScreen(void)
@@ -114,9 +354,27 @@ void PaintScreen(void)
 
 void UpdateScreen(LASER_DATA* pLsrDta)
 {
-    printf("\033[3J\033[1;1H\033[0J");
-    long double pos1 = pLsrDta->dPCnvrt2um * pLsrDta->uAx1Pos.i64 - START_MM * 1000;
-    printf("%Le\n", pos1);
+    long axis;
+    long double pos[3] = {
+        pLsrDta->dPCnvrt2um * pLsrDta->uAx1Pos.i64 - START_MM * 1000,
+        pLsrDta->dPCnvrt2um * pLsrDta->uAx2Pos.i64 - START_MM * 1000,
+        pLsrDta->dPCnvrt2um * pLsrDta->uAx3Pos.i64 - START_MM * 1000
+    };
+    double vel[3] = {
+        pLsrDta->dVCnvrt2umps * pLsrDta->iAx1Vel,
+        pLsrDta->dVCnvrt2umps * pLsrDta->iAx2Vel,
+        pLsrDta->dVCnvrt2umps * pLsrDta->iAx3Vel
+    };
+
+    for (axis = AXIS_1; axis <= AXIS_3; axis++)
+    {
+        AxisStats as = read_stats((short)axis);
+        printf("\033[%ld;18H%16.4Lf", 5 + axis, pos[axis]);
+        printf("\033[%ld;44H%11.2f", 5 + axis, vel[axis]);
+        printf("\033[%ld;1H\033[K   Axis %ld:   Mean: %14.4f um   StdDev: %10.4f um   Pk-Pk: %10.4f um   (%lu)",
+            9 + axis, axis + 1, as.dMean, as.dStdDev, as.dPkPk, as.ulCount);
+    }
+    fflush(stdout);
 }
 
 N1231B_RETURN check(N1231B_RETURN rc, bool bFatal, char* pMessage)
@@ -126,13 +384,13 @@ N1231B_RETURN check(N1231B_RETURN rc, bool bFatal, char* pMessage)
     printf("\033[12;1H\033[K");
     printf("%sError '%s' when %s%s\n",
         (bFatal ? "Fatal " : ""),
-        N1231BGetErrStr(rc), pMessage,
+        vendor_api()->pfnGetErrStr(rc), pMessage,
         (bFatal ? "\n\tTerminating Program" : "")
     );
 
     if (bFatal)
     {
-        if (hBrd) N1231BClose(&hBrd);
+        if (hBrd) vendor_api()->pfnClose(&hBrd);
         exit(rc);
     }
 
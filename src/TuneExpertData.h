@@ -8,7 +8,7 @@
     #include <windows.h>
 #endif
 
-#ifdef linux
+#if defined(linux) || defined(__linux__)
 	#include "../include/TypesForN1231B.h"
 	#include "../include/WinTypes.h"
 #endif
@@ -25,6 +25,12 @@
 #define MIN_MM 45
 #define FOLD 2
 
+// Conversions from raw counts; with a constant dCompNum (e.g. COMP_NUM) they fold to constants at compile time
+#define UM_PER_COUNT_AT(dLambdaNm, uiFold, dCompNum) ((dLambdaNm) * (dCompNum) / ((uiFold) * 1024 * 1000))
+#define UM_PER_COUNT(dCompNum) UM_PER_COUNT_AT(LAMBDA_NM, FOLD, dCompNum)
+#define UMPS_PER_COUNT(dUmPerCount) ((dUmPerCount) * N1231B_CLOCK / (4194304 / 1024))
+#define MM_TO_COUNTS(dMm, dCompNum) ((dMm) * 1000000 / (LAMBDA_NM * (dCompNum) / (FOLD * 1024)))
+
 typedef struct {
     double dPCnvrt2um, dVCnvrt2umps;
     union { N1231B_INT64 s; long i64; } uAx1Pos, uAx2Pos, uAx3Pos;
@@ -39,12 +45,43 @@ typedef struct {
     double v1, v2, v3;
 } PosVelSample;
 
+typedef struct {
+    long long llTime;                       // ns since the epoch
+    long long llAx1Pos, llAx2Pos, llAx3Pos; // raw 36 bit counts
+    long lAx1Vel, lAx2Vel, lAx3Vel;
+    unsigned int uiGeLtStatus;
+    unsigned short wValid;
+} RawSample;
+
+// Last acquired sample as one consistent unit, whichever thread is sampling
+typedef struct {
+    unsigned long long ullSequence;         // samples acquired so far, 0 before the first
+    RawSample Raw;
+    PosVelSample Pos;                       // converted with the compensation in effect for that sample
+    double dCompNum;                        // that compensation
+} LatestSample;
+
+extern N1231B_HANDLE hBrd;
+
+// Every sample goes through the live stages (statistics, capture, broadcast, ...), which expect one acquiring
+// thread: call begin_read() and the read_data_*() functions from one thread at a time.
 void begin_read();
+// Each read_ax*() takes its own snapshot of the latest sample, so three calls may see different samples;
+// read_latest() and read_latest_pointer() return all three axes of one sample.
 double read_ax1();
 double read_ax2();
 double read_ax3();
 PosVelSample read_data_struct();
+RawSample read_data_raw(void);              // counts as acquired, see TuneExpertFixed.h for integer units
+LatestSample read_data_sample(void);        // acquires a sample and returns it as read_latest() would
 void read_data_pointer(double* pvs);
+LatestSample read_latest(void);
+void read_latest_pointer(double* pvs);
+
+long long get_time_ns(void);
+void convert_block(const RawSample* pRaw, PosVelSample* pvs, unsigned long ulCount);
+void convert_block_comp(const RawSample* pRaw, PosVelSample* pvs, unsigned long ulCount, double dCompNum);
+void rescale_block(PosVelSample* pvs, unsigned long ulCount, double dFromComp, double dToComp);
 
 long test();
 void open_device();
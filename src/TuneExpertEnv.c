@@ -0,0 +1,220 @@
+﻿// TuneExpertEnv.c: Air refractive index compensation, applied between samples without stopping acquisition
+//
+
+#include "TuneExpertData.h"
+#include "TuneExpertEnv.h"
+#include "TuneExpertSeqlock.h"
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+typedef struct {
+    double dTempC, dPressPa, dHumidity, dCompNum;
+} ENV_UPDATE;
+
+// Generation 1 is the default factor, so the first sample logs the factor acquisition starts with
+static pthread_mutex_t UpdateMutex = PTHREAD_MUTEX_INITIALIZER;
+static SEQLOCK PendingLock;
+static ENV_UPDATE Pending = { NAN, NAN, NAN, COMP_NUM };
+static atomic_uint uiPendingGen = 1;
+static unsigned int uiAppliedGen;
+static _Atomic double dCurrentComp = COMP_NUM;
+
+static SEQLOCK LogLock;
+static EnvCompRecord aLog[ENV_LOG_SIZE];
+static unsigned long ulLogCount;
+
+// Edlen equation as revised by Birch and Downs (1993, 1994), vacuum wavelength LAMBDA_NM
+double edlen_refractive_index(double dTempC, double dPressPa, double dHumidity)
+{
+    double dSigma2 = 1.0e6 / (LAMBDA_NM * LAMBDA_NM);   // (1 / lambda in um)^2
+    double dNs = (8342.54 + 2406147.0 / (130.0 - dSigma2) + 15998.0 / (38.9 - dSigma2)) * 1e-8;
+    double dNtp = dPressPa * dNs / 96095.43 * (1 + 1e-8 * (0.601 - 0.00972 * dTempC) * dPressPa) / (1 + 0.0036610 * dTempC);
+    double dVapour = dHumidity / 100.0 * 611.2 * exp(17.62 * dTempC / (243.12 + dTempC));    // Magnus saturation pressure, Pa
+
+    return 1.0 + dNtp - dVapour * (3.7345 - 0.0401 * dSigma2) * 1e-10;
+}
+
+static void post_update(double dTempC, double dPressPa, double dHumidity, double dCompNum)
+{
+    pthread_mutex_lock(&UpdateMutex);
+    seqlock_write_begin(&PendingLock);
+    Pending.dTempC = dTempC;
+    Pending.dPressPa = dPressPa;
+    Pending.dHumidity = dHumidity;
+    Pending.dCompNum = dCompNum;
+    seqlock_write_end(&PendingLock);
+    // Device setup, presets and block conversion use the new factor from here on, the acquisition path from its next sample
+    atomic_store(&dCurrentComp, dCompNum);
+    atomic_fetch_add_explicit(&uiPendingGen, 1, memory_order_release);
+    pthread_mutex_unlock(&UpdateMutex);
+}
+
+void set_environment(double dTempC, double dPressPa, double dHumidity)
+{
+    post_update(dTempC, dPressPa, dHumidity, 1.0 / edlen_refractive_index(dTempC, dPressPa, dHumidity));
+}
+
+void set_comp_num(double dCompNum)
+{
+    if (dCompNum <= 0) return;
+    post_update(NAN, NAN, NAN, dCompNum);
+}
+
+double read_comp_num(void)
+{
+    return atomic_load(&dCurrentComp);
+}
+
+// Runs on the acquisition thread only, so the log has a single writer
+bool env_take_update(unsigned long long ullSample, double* pdCompNum)
+{
+    unsigned int uiGen = atomic_load_explicit(&uiPendingGen, memory_order_acquire);
+    ENV_UPDATE update;
+    unsigned int uiSeq;
+    EnvCompRecord* pRec;
+
+    if (uiGen == uiAppliedGen) return false;
+    uiAppliedGen = uiGen;
+
+    do {
+        uiSeq = seqlock_read_begin(&PendingLock);
+        update = Pending;
+    } while (seqlock_read_retry(&PendingLock, uiSeq));
+
+    *pdCompNum = update.dCompNum;
+
+    seqlock_write_begin(&LogLock);
+    pRec = &aLog[ulLogCount % ENV_LOG_SIZE];
+    pRec->llTime = get_time_ns();
+    pRec->ullSample = ullSample;
+    pRec->dTempC = update.dTempC;
+    pRec->dPressPa = update.dPressPa;
+    pRec->dHumidity = update.dHumidity;
+    pRec->dCompNum = update.dCompNum;
+    ulLogCount++;
+    seqlock_write_end(&LogLock);
+    return true;
+}
+
+// Copies the retained log, oldest first
+int read_env_log(EnvCompRecord* pRecords, int iMax)
+{
+    unsigned long ulCount, ulFirst, i;
+    unsigned int uiSeq;
+    int n;
+
+    do {
+        uiSeq = seqlock_read_begin(&LogLock);
+        ulCount = ulLogCount;
+        ulFirst = ulCount > ENV_LOG_SIZE ? ulCount - ENV_LOG_SIZE : 0;
+        if (ulCount - ulFirst > (unsigned long)iMax) ulFirst = ulCount - iMax;
+        for (i = ulFirst, n = 0; i < ulCount; i++, n++) pRecords[n] = aLog[i % ENV_LOG_SIZE];
+    } while (seqlock_read_retry(&LogLock, uiSeq));
+    return n;
+}
+
+int save_env_log(const char* pPath)
+{
+    static EnvCompRecord aCopy[ENV_LOG_SIZE];
+    FILE* fp = fopen(pPath, "w");
+    int i, n;
+
+    if (!fp) return -1;
+    n = read_env_log(aCopy, ENV_LOG_SIZE);
+    fprintf(fp, "time_ns,sample,temp_c,pressure_pa,humidity_pct,comp_num\n");
+    for (i = 0; i < n; i++)
+        fprintf(fp, "%lld,%llu,%.4f,%.2f,%.2f,%.10f\n", aCopy[i].llTime, aCopy[i].ullSample,
+            aCopy[i].dTempC, aCopy[i].dPressPa, aCopy[i].dHumidity, aCopy[i].dCompNum);
+    fclose(fp);
+    return n;
+}
+
+static pthread_t WatchThread;
+static atomic_bool bWatching;
+static char szWatchPath[4096];
+
+static void parse_env_line(char* pLine)
+{
+    double dTempC, dPressPa, dHumidity;
+    char* p;
+
+    for (p = pLine; *p; p++) if (*p == ',' || *p == ';') *p = ' ';
+    if (pLine[0] == '#') return;
+    if (sscanf(pLine, "%lf %lf %lf", &dTempC, &dPressPa, &dHumidity) == 3)
+        set_environment(dTempC, dPressPa, dHumidity);
+}
+
+// Tails a regular file or reads a FIFO; polls with a timeout so stop_environment_watch() is honoured
+static void* watch_thread(void* pArg)
+{
+    char szLine[256];
+    size_t ulLen = 0;
+    int fd = -1;
+
+    (void)pArg;
+    while (atomic_load(&bWatching))
+    {
+        struct pollfd pfd;
+        char szBuf[256];
+        ssize_t lRead;
+        ssize_t i;
+
+        if (fd < 0 && (fd = open(szWatchPath, O_RDONLY | O_NONBLOCK)) < 0)
+        {
+            usleep(200000);
+            continue;
+        }
+
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+        if (poll(&pfd, 1, 200) <= 0 || !(pfd.revents & POLLIN))
+        {
+            if (pfd.revents & POLLHUP) usleep(200000);
+            continue;
+        }
+
+        lRead = read(fd, szBuf, sizeof(szBuf));
+        if (lRead <= 0)
+        {
+            usleep(200000);
+            continue;
+        }
+        for (i = 0; i < lRead; i++)
+        {
+            if (szBuf[i] == '\n' || ulLen == sizeof(szLine) - 1)
+            {
+                szLine[ulLen] = 0;
+                parse_env_line(szLine);
+                ulLen = 0;
+            }
+            else szLine[ulLen++] = szBuf[i];
+        }
+    }
+    if (fd >= 0) close(fd);
+    return NULL;
+}
+
+int watch_environment_file(const char* pPath)
+{
+    if (atomic_load(&bWatching)) stop_environment_watch();
+    snprintf(szWatchPath, sizeof(szWatchPath), "%s", pPath);
+    atomic_store(&bWatching, true);
+    if (pthread_create(&WatchThread, NULL, watch_thread, NULL) != 0)
+    {
+        atomic_store(&bWatching, false);
+        return -1;
+    }
+    return 0;
+}
+
+void stop_environment_watch(void)
+{
+    if (!atomic_exchange(&bWatching, false)) return;
+    pthread_join(WatchThread, NULL);
+}
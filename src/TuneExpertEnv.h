@@ -0,0 +1,32 @@
+﻿// TuneExpertEnv.h: Live air refractive index (wavelength) compensation from weather station data
+//
+
+#pragma once
+
+#include <stdbool.h>
+
+#define ENV_LOG_SIZE 1024
+
+typedef struct {
+    long long llTime;                       // ns since the epoch when the factor took effect
+    unsigned long long ullSample;           // first sample converted with this factor
+    double dTempC, dPressPa, dHumidity;     // NaN when the factor was set directly
+    double dCompNum;                        // 1 / refractive index
+} EnvCompRecord;
+
+double edlen_refractive_index(double dTempC, double dPressPa, double dHumidity);
+
+void set_environment(double dTempC, double dPressPa, double dHumidity);
+void set_comp_num(double dCompNum);
+double read_comp_num(void);
+
+// Follow a file or FIFO of "temperature pressure humidity" lines (degC, Pa, %RH)
+int watch_environment_file(const char* pPath);
+void stop_environment_watch(void);
+
+int read_env_log(EnvCompRecord* pRecords, int iMax);
+int save_env_log(const char* pPath);
+
+// Acquisition side: returns true with the factor to convert from ullSample on when it changed since the last
+// call, and records the change in the log. read_comp_num() has the new factor as soon as it is set.
+bool env_take_update(unsigned long long ullSample, double* pdCompNum);
@@ -0,0 +1,532 @@
+﻿// TuneExpertEnvelope.c: Envelope pyramid building and pixel queries
+//
+// Level 0 buckets summarise ENVELOPE_BASE samples, every bucket of level k+1 merges two of level k. A query
+// picks the coarsest level whose buckets are still under half a pixel wide, so a redraw reads about two
+// buckets per pixel whatever the zoom. Only pixels narrower than a level 0 bucket need the samples decoded.
+// The builder writes each level's buckets a block at a time as they fill, and the reader finds them through
+// the block table.
+
+#include "TuneExpertEnvelope.h"
+#include "TuneExpertCodec.h"
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <math.h>
+
+#define file_seek fseeko
+
+#define ENVELOPE_READ_BATCH 256
+
+typedef struct {
+    uint64_t ullOffset;
+    int iLevel;
+} ENVELOPE_BLOCK_ENTRY;
+
+struct ENVELOPE_BUILDER {
+    FILE* fp;
+    unsigned long long ullOffset;           // end of the sidecar written so far
+    ENVELOPE_BUCKET* apBlock[ENVELOPE_LEVELS];  // block being filled, allocated with the level's first bucket
+    unsigned long long aullCount[ENVELOPE_LEVELS];
+    ENVELOPE_BLOCK_ENTRY* pBlocks;          // written blocks in file order
+    unsigned long ulBlocks, ulBlocksSize;
+    ENVELOPE_BUCKET Partial;                // level 0 bucket being filled, dMean holds the sum
+    int iError;
+};
+
+struct ENVELOPE_READER {
+    FILE* fp;
+    ENVELOPE_FILE_HEADER Header;
+    unsigned long long ullBlock;            // buckets per block, ULLONG_MAX for version 1's one block per level
+    uint64_t* pullBlocks;                   // block offsets, level by level
+    unsigned long long aullFirstBlock[ENVELOPE_LEVELS];
+    long long llFirstTime, llLastTime;
+    CAPTURE_READER* pCapture;
+    double dPos;                            // counts to um with the header factor, for version 1 and 2 buckets
+};
+
+static void merge(ENVELOPE_BUCKET* pTo, const ENVELOPE_BUCKET* pFrom)
+{
+    double dTotal = (double)pTo->uiCount + pFrom->uiCount;
+    int i;
+
+    for (i = 0; i < 3; i++)
+    {
+        if (pFrom->aAxis[i].dMin < pTo->aAxis[i].dMin) pTo->aAxis[i].dMin = pFrom->aAxis[i].dMin;
+        if (pFrom->aAxis[i].dMax > pTo->aAxis[i].dMax) pTo->aAxis[i].dMax = pFrom->aAxis[i].dMax;
+        pTo->aAxis[i].dMean = (pTo->aAxis[i].dMean * pTo->uiCount + pFrom->aAxis[i].dMean * pFrom->uiCount) / dTotal;
+    }
+    pTo->llLastTime = pFrom->llLastTime;
+    pTo->uiCount += pFrom->uiCount;
+}
+
+static void write_block(ENVELOPE_BUILDER* pEnv, int iLevel, unsigned long ulCount)
+{
+    if (pEnv->iError) return;
+    if (pEnv->ulBlocks == pEnv->ulBlocksSize)
+    {
+        unsigned long ulSize = pEnv->ulBlocksSize ? pEnv->ulBlocksSize * 2 : 64;
+        ENVELOPE_BLOCK_ENTRY* a = realloc(pEnv->pBlocks, ulSize * sizeof(ENVELOPE_BLOCK_ENTRY));
+        if (!a)
+        {
+            pEnv->iError = -1;
+            return;
+        }
+        pEnv->pBlocks = a;
+        pEnv->ulBlocksSize = ulSize;
+    }
+    if (fwrite(pEnv->apBlock[iLevel], sizeof(ENVELOPE_BUCKET), ulCount, pEnv->fp) != ulCount)
+    {
+        pEnv->iError = -1;
+        return;
+    }
+    pEnv->pBlocks[pEnv->ulBlocks].ullOffset = pEnv->ullOffset;
+    pEnv->pBlocks[pEnv->ulBlocks].iLevel = iLevel;
+    pEnv->ulBlocks++;
+    pEnv->ullOffset += ulCount * sizeof(ENVELOPE_BUCKET);
+}
+
+// ENVELOPE_BLOCK is even, so the two buckets merged into the level above always share a block
+static void push(ENVELOPE_BUILDER* pEnv, int iLevel, const ENVELOPE_BUCKET* pBucket)
+{
+    ENVELOPE_BUCKET* pBlock;
+    ENVELOPE_BUCKET up;
+    unsigned long ulPos;
+
+    if (iLevel >= ENVELOPE_LEVELS) return;
+    if (!(pBlock = pEnv->apBlock[iLevel]) && !(pBlock = pEnv->apBlock[iLevel] = malloc(ENVELOPE_BLOCK * sizeof(ENVELOPE_BUCKET))))
+    {
+        pEnv->iError = -1;
+        return;
+    }
+    ulPos = (unsigned long)(pEnv->aullCount[iLevel]++ % ENVELOPE_BLOCK);
+    pBlock[ulPos] = *pBucket;
+
+    if (ulPos % 2)
+    {
+        up = pBlock[ulPos - 1];
+        merge(&up, pBucket);
+        push(pEnv, iLevel + 1, &up);
+    }
+    if (ulPos + 1 == ENVELOPE_BLOCK) write_block(pEnv, iLevel, ENVELOPE_BLOCK);
+}
+
+// The header written here only marks the sidecar as unfinished until envelope_finish() rewrites it
+ENVELOPE_BUILDER* envelope_new(const char* pPath)
+{
+    ENVELOPE_BUILDER* pEnv = calloc(1, sizeof(ENVELOPE_BUILDER));
+    ENVELOPE_FILE_HEADER hdr;
+
+    if (!pEnv) return NULL;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.szMagic, ENVELOPE_MAGIC, sizeof(ENVELOPE_MAGIC));
+    hdr.uiVersion = ENVELOPE_VERSION;
+    if (!(pEnv->fp = fopen(pPath, "wb")) || fwrite(&hdr, sizeof(hdr), 1, pEnv->fp) != 1)
+    {
+        envelope_free(pEnv);
+        return NULL;
+    }
+    pEnv->ullOffset = sizeof(hdr);
+    return pEnv;
+}
+
+void envelope_free(ENVELOPE_BUILDER* pEnv)
+{
+    int i;
+
+    if (!pEnv) return;
+    if (pEnv->fp) fclose(pEnv->fp);
+    for (i = 0; i < ENVELOPE_LEVELS; i++) free(pEnv->apBlock[i]);
+    free(pEnv->pBlocks);
+    free(pEnv);
+}
+
+// Samples are converted as they come in, so a bucket spanning a compensation change still holds true um values
+void envelope_add(ENVELOPE_BUILDER* pEnv, const RawSample* pSamples, unsigned long ulCount, double dUmPerCount)
+{
+    ENVELOPE_BUCKET* b = &pEnv->Partial;
+    const double dOffset = START_MM * 1000;
+    unsigned long i;
+
+    for (i = 0; i < ulCount; i++)
+    {
+        const double adPos[3] = {
+            dUmPerCount * pSamples[i].llAx1Pos - dOffset, dUmPerCount * pSamples[i].llAx2Pos - dOffset, dUmPerCount * pSamples[i].llAx3Pos - dOffset
+        };
+        int j;
+
+        if (b->uiCount == 0)
+        {
+            b->llFirstTime = pSamples[i].llTime;
+            for (j = 0; j < 3; j++)
+            {
+                b->aAxis[j].dMin = b->aAxis[j].dMax = adPos[j];
+                b->aAxis[j].dMean = 0;
+            }
+        }
+        for (j = 0; j < 3; j++)
+        {
+            if (adPos[j] < b->aAxis[j].dMin) b->aAxis[j].dMin = adPos[j];
+            if (adPos[j] > b->aAxis[j].dMax) b->aAxis[j].dMax = adPos[j];
+            b->aAxis[j].dMean += adPos[j];
+        }
+        b->llLastTime = pSamples[i].llTime;
+        if (++b->uiCount == ENVELOPE_BASE)
+        {
+            for (j = 0; j < 3; j++) b->aAxis[j].dMean /= b->uiCount;
+            push(pEnv, 0, b);
+            b->uiCount = 0;
+        }
+    }
+}
+
+// Pushes the partial bucket and carries the odd last bucket of every level up, so each level covers every sample.
+// An odd count never ends on a block boundary, so that bucket is still in the level's block.
+static void finish(ENVELOPE_BUILDER* pEnv)
+{
+    ENVELOPE_BUCKET* b = &pEnv->Partial;
+    int i;
+
+    if (b->uiCount)
+    {
+        for (i = 0; i < 3; i++) b->aAxis[i].dMean /= b->uiCount;
+        push(pEnv, 0, b);
+        b->uiCount = 0;
+    }
+    for (i = 0; i + 1 < ENVELOPE_LEVELS && pEnv->aullCount[i] > 1; i++)
+        if (pEnv->aullCount[i] % 2) push(pEnv, i + 1, &pEnv->apBlock[i][(pEnv->aullCount[i] - 1) % ENVELOPE_BLOCK]);
+}
+
+int envelope_finish(ENVELOPE_BUILDER* pEnv)
+{
+    ENVELOPE_FILE_HEADER hdr;
+    unsigned long j;
+    int i, rc = 0;
+
+    finish(pEnv);
+    for (i = 0; i < ENVELOPE_LEVELS && pEnv->aullCount[i]; i++)
+        if (pEnv->aullCount[i] % ENVELOPE_BLOCK) write_block(pEnv, i, (unsigned long)(pEnv->aullCount[i] % ENVELOPE_BLOCK));
+    if (pEnv->iError) return -1;
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.szMagic, ENVELOPE_MAGIC, sizeof(ENVELOPE_MAGIC));
+    hdr.uiVersion = ENVELOPE_VERSION;
+    hdr.uiBase = ENVELOPE_BASE;
+    hdr.uiBlock = ENVELOPE_BLOCK;
+    for (i = 0; i < ENVELOPE_LEVELS && pEnv->aullCount[i]; i++) hdr.aullCount[i] = pEnv->aullCount[i];
+    hdr.uiLevels = i;
+    hdr.ullTableOffset = pEnv->ullOffset;
+
+    for (i = 0; rc == 0 && i < (int)hdr.uiLevels; i++)
+        for (j = 0; rc == 0 && j < pEnv->ulBlocks; j++)
+            if (pEnv->pBlocks[j].iLevel == i && fwrite(&pEnv->pBlocks[j].ullOffset, sizeof(uint64_t), 1, pEnv->fp) != 1) rc = -1;
+    if (rc == 0 && (file_seek(pEnv->fp, 0, SEEK_SET) != 0 || fwrite(&hdr, sizeof(hdr), 1, pEnv->fp) != 1)) rc = -1;
+    if (fclose(pEnv->fp) != 0) rc = -1;
+    pEnv->fp = NULL;
+    return rc;
+}
+
+int envelope_build(const char* pCapturePath)
+{
+    RawSample* aBuf;
+    char szPath[CAPTURE_PATH_MAX + 8];
+    CAPTURE_READER* pReader;
+    const CAPTURE_FILE_HEADER* pHeader;
+    ENVELOPE_BUILDER* pEnv;
+    double dCompNum;
+    long n;
+    int rc;
+
+    snprintf(szPath, sizeof(szPath), "%s%s", pCapturePath, ENVELOPE_SUFFIX);
+    if (!(pReader = capture_open_read(pCapturePath))) return -1;
+    pEnv = envelope_new(szPath);
+    aBuf = malloc(CAPTURE_CHUNK_SAMPLES * sizeof(RawSample));
+    if (!pEnv || !aBuf)
+    {
+        envelope_free(pEnv);
+        free(aBuf);
+        capture_close_read(pReader);
+        return -1;
+    }
+    pHeader = capture_header(pReader);
+    while ((n = capture_read_comp(pReader, aBuf, CAPTURE_CHUNK_SAMPLES, &dCompNum)) > 0)
+        envelope_add(pEnv, aBuf, n, UM_PER_COUNT_AT(pHeader->dLambdaNm, pHeader->uiFold, dCompNum));
+    rc = n < 0 ? -1 : envelope_finish(pEnv);
+    envelope_free(pEnv);
+    free(aBuf);
+    capture_close_read(pReader);
+    return rc;
+}
+
+// Buckets of version 1 and 2 files hold counts, converted here with the only factor they knew of
+static void counts_to_um(const ENVELOPE_READER* pReader, ENVELOPE_BUCKET* pBuckets, unsigned long ulCount)
+{
+    unsigned long i;
+    int j;
+
+    for (i = 0; i < ulCount; i++)
+        for (j = 0; j < 3; j++)
+        {
+            ENVELOPE_AXIS* a = &pBuckets[i].aAxis[j];
+            int64_t llMin, llMax;
+
+            memcpy(&llMin, &a->dMin, sizeof(llMin));
+            memcpy(&llMax, &a->dMax, sizeof(llMax));
+            a->dMin = pReader->dPos * llMin - START_MM * 1000;
+            a->dMax = pReader->dPos * llMax - START_MM * 1000;
+            a->dMean = pReader->dPos * a->dMean - START_MM * 1000;
+        }
+}
+
+static int read_buckets(ENVELOPE_READER* pReader, int iLevel, unsigned long long ullIndex, ENVELOPE_BUCKET* pBuckets, unsigned long ulCount)
+{
+    while (ulCount)
+    {
+        unsigned long long ullBlock = ullIndex / pReader->ullBlock, ullIn = ullIndex % pReader->ullBlock;
+        unsigned long n = pReader->ullBlock - ullIn < ulCount ? (unsigned long)(pReader->ullBlock - ullIn) : ulCount;
+        uint64_t ullOffset = pReader->pullBlocks[pReader->aullFirstBlock[iLevel] + ullBlock] + ullIn * sizeof(ENVELOPE_BUCKET);
+
+        if (file_seek(pReader->fp, (long long)ullOffset, SEEK_SET) != 0 ||
+            fread(pBuckets, sizeof(ENVELOPE_BUCKET), n, pReader->fp) != n) return -1;
+        if (pReader->Header.uiVersion < 3) counts_to_um(pReader, pBuckets, n);
+        pBuckets += n;
+        ullIndex += n;
+        ulCount -= n;
+    }
+    return 0;
+}
+
+// Version 1 files become one block per level, so reads go through the same table
+static int read_block_table(ENVELOPE_READER* pReader)
+{
+    const ENVELOPE_FILE_HEADER* pHdr = &pReader->Header;
+    unsigned long long ullBlocks = 0, ullOffset = ENVELOPE_HEADER_V1_BYTES;
+    unsigned int i;
+
+    for (i = 0; i < pHdr->uiLevels; i++)
+    {
+        pReader->aullFirstBlock[i] = ullBlocks;
+        ullBlocks += pHdr->uiVersion >= 2 ? (pHdr->aullCount[i] + pHdr->uiBlock - 1) / pHdr->uiBlock : 1;
+    }
+    if (!(pReader->pullBlocks = malloc((size_t)(ullBlocks ? ullBlocks : 1) * sizeof(uint64_t)))) return -1;
+    if (pHdr->uiVersion < 2)
+    {
+        pReader->ullBlock = ULLONG_MAX;
+        for (i = 0; i < pHdr->uiLevels; i++)
+        {
+            pReader->pullBlocks[i] = ullOffset;
+            ullOffset += pHdr->aullCount[i] * sizeof(ENVELOPE_BUCKET);
+        }
+        return 0;
+    }
+    pReader->ullBlock = pHdr->uiBlock;
+    if (file_seek(pReader->fp, (long long)pHdr->ullTableOffset, SEEK_SET) != 0 ||
+        fread(pReader->pullBlocks, sizeof(uint64_t), (size_t)ullBlocks, pReader->fp) != ullBlocks) return -1;
+    return 0;
+}
+
+ENVELOPE_READER* envelope_open(const char* pCapturePath)
+{
+    char szPath[CAPTURE_PATH_MAX + 8];
+    ENVELOPE_READER* pReader;
+    ENVELOPE_BUCKET first, last;
+    const CAPTURE_FILE_HEADER* pHeader;
+
+    snprintf(szPath, sizeof(szPath), "%s%s", pCapturePath, ENVELOPE_SUFFIX);
+    if (!(pReader = calloc(1, sizeof(ENVELOPE_READER)))) return NULL;
+    if (!(pReader->pCapture = capture_open_read(pCapturePath)) ||
+        !(pReader->fp = fopen(szPath, "rb")) ||
+        fread(&pReader->Header, ENVELOPE_HEADER_V1_BYTES, 1, pReader->fp) != 1 ||
+        memcmp(pReader->Header.szMagic, ENVELOPE_MAGIC, sizeof(ENVELOPE_MAGIC)) != 0 ||
+        pReader->Header.uiVersion == 0 || pReader->Header.uiVersion > ENVELOPE_VERSION || pReader->Header.uiLevels > ENVELOPE_LEVELS ||
+        (pReader->Header.uiVersion >= 2 &&
+         (fread((char*)&pReader->Header + ENVELOPE_HEADER_V1_BYTES, sizeof(pReader->Header) - ENVELOPE_HEADER_V1_BYTES, 1, pReader->fp) != 1 ||
+          pReader->Header.ullTableOffset == 0 || pReader->Header.uiBlock == 0)) ||
+        read_block_table(pReader) != 0)
+    {
+        envelope_close(pReader);
+        return NULL;
+    }
+    pHeader = capture_header(pReader->pCapture);
+    pReader->dPos = UM_PER_COUNT_AT(pHeader->dLambdaNm, pHeader->uiFold, pHeader->dCompNum);
+    if (pReader->Header.uiLevels)
+    {
+        if (read_buckets(pReader, 0, 0, &first, 1) != 0 || read_buckets(pReader, 0, pReader->Header.aullCount[0] - 1, &last, 1) != 0)
+        {
+            envelope_close(pReader);
+            return NULL;
+        }
+        pReader->llFirstTime = first.llFirstTime;
+        pReader->llLastTime = last.llLastTime;
+    }
+    return pReader;
+}
+
+void envelope_close(ENVELOPE_READER* pReader)
+{
+    if (!pReader) return;
+    if (pReader->fp) fclose(pReader->fp);
+    capture_close_read(pReader->pCapture);
+    free(pReader->pullBlocks);
+    free(pReader);
+}
+
+static void clear_pixels(EnvelopePixel* pPixels, unsigned int uiWidth, long long llStart, long long llEnd)
+{
+    unsigned int i;
+    int j;
+
+    for (i = 0; i < uiWidth; i++)
+    {
+        pPixels[i].llStartTime = llStart + (long long)((double)(llEnd - llStart) * i / uiWidth);
+        pPixels[i].llEndTime = llStart + (long long)((double)(llEnd - llStart) * (i + 1) / uiWidth);
+        pPixels[i].ullSamples = 0;
+        for (j = 0; j < 3; j++)
+        {
+            pPixels[i].aAxis[j].dMin = INFINITY;
+            pPixels[i].aAxis[j].dMax = -INFINITY;
+            pPixels[i].aAxis[j].dMean = 0;   // sum until finish_pixels
+        }
+    }
+}
+
+static void finish_pixels(EnvelopePixel* pPixels, unsigned int uiWidth)
+{
+    unsigned int i;
+    int j;
+
+    for (i = 0; i < uiWidth; i++)
+        for (j = 0; j < 3; j++)
+        {
+            if (pPixels[i].ullSamples) pPixels[i].aAxis[j].dMean /= pPixels[i].ullSamples;
+            else pPixels[i].aAxis[j].dMin = pPixels[i].aAxis[j].dMax = pPixels[i].aAxis[j].dMean = NAN;
+        }
+}
+
+static void add_bucket(EnvelopePixel* pPixels, unsigned int uiWidth, long long llStart, long long llEnd, const ENVELOPE_BUCKET* b)
+{
+    long long llTime = b->llFirstTime < llStart ? llStart : b->llFirstTime;    // a bucket straddling llStart goes to pixel 0
+    EnvelopePixel* p;
+    int j;
+
+    if (b->llLastTime < llStart || llTime >= llEnd) return;
+    p = &pPixels[(unsigned int)((double)(llTime - llStart) * uiWidth / (llEnd - llStart))];
+    for (j = 0; j < 3; j++)
+    {
+        if (b->aAxis[j].dMin < p->aAxis[j].dMin) p->aAxis[j].dMin = b->aAxis[j].dMin;
+        if (b->aAxis[j].dMax > p->aAxis[j].dMax) p->aAxis[j].dMax = b->aAxis[j].dMax;
+        p->aAxis[j].dMean += b->aAxis[j].dMean * b->uiCount;
+    }
+    p->ullSamples += b->uiCount;
+}
+
+// Zoomed in past level 0: every sample goes to its own pixel
+static int add_samples(ENVELOPE_READER* pReader, EnvelopePixel* pPixels, unsigned int uiWidth, long long llStart, long long llEnd)
+{
+    const CAPTURE_FILE_HEADER* pHeader = capture_header(pReader->pCapture);
+    RawSample aBuf[CODEC_BLOCK];
+    ENVELOPE_BUCKET b;
+    double dCompNum;
+    long n, i;
+
+    if (capture_seek(pReader->pCapture, llStart) != 0) return -1;
+    memset(&b, 0, sizeof(b));
+    b.uiCount = 1;
+    while ((n = capture_read_comp(pReader->pCapture, aBuf, CODEC_BLOCK, &dCompNum)) > 0)
+    {
+        const double dPos = UM_PER_COUNT_AT(pHeader->dLambdaNm, pHeader->uiFold, dCompNum);
+
+        for (i = 0; i < n; i++)
+        {
+            if (aBuf[i].llTime >= llEnd) return 0;
+            b.llFirstTime = b.llLastTime = aBuf[i].llTime;
+            b.aAxis[0].dMin = b.aAxis[0].dMax = b.aAxis[0].dMean = dPos * aBuf[i].llAx1Pos - START_MM * 1000;
+            b.aAxis[1].dMin = b.aAxis[1].dMax = b.aAxis[1].dMean = dPos * aBuf[i].llAx2Pos - START_MM * 1000;
+            b.aAxis[2].dMin = b.aAxis[2].dMax = b.aAxis[2].dMean = dPos * aBuf[i].llAx3Pos - START_MM * 1000;
+            add_bucket(pPixels, uiWidth, llStart, llEnd, &b);
+        }
+    }
+    return n < 0 ? -1 : 0;
+}
+
+static int accumulate(ENVELOPE_READER* pReader, long long llStart, long long llEnd, EnvelopePixel* pPixels, unsigned int uiWidth)
+{
+    ENVELOPE_BUCKET aBatch[ENVELOPE_READ_BATCH];
+    double dPixelNs = (double)(llEnd - llStart) / uiWidth;
+    double dSpan = (double)(pReader->llLastTime - pReader->llFirstTime);
+    unsigned long long ullLo, ullHi, ullCount;
+    int iLevel = -1, i;
+
+    if (pReader->Header.uiLevels == 0 || llEnd <= pReader->llFirstTime || llStart > pReader->llLastTime) return 0;
+    for (i = 0; i < (int)pReader->Header.uiLevels; i++)
+        if (dSpan / pReader->Header.aullCount[i] <= dPixelNs / 2) iLevel = i;
+    if (iLevel < 0 && dSpan / pReader->Header.aullCount[0] <= dPixelNs) iLevel = 0;
+    if (iLevel < 0) return add_samples(pReader, pPixels, uiWidth, llStart, llEnd);
+
+    ullCount = pReader->Header.aullCount[iLevel];
+    ullLo = 0;
+    ullHi = ullCount;
+    while (ullLo < ullHi)
+    {
+        unsigned long long ullMid = ullLo + (ullHi - ullLo) / 2;
+        if (read_buckets(pReader, iLevel, ullMid, aBatch, 1) != 0) return -1;
+        if (aBatch[0].llFirstTime < llStart) ullLo = ullMid + 1;
+        else ullHi = ullMid;
+    }
+    // The bucket before may still run past llStart
+    if (ullLo > 0)
+    {
+        if (read_buckets(pReader, iLevel, ullLo - 1, aBatch, 1) != 0) return -1;
+        if (aBatch[0].llLastTime >= llStart) ullLo--;
+    }
+    while (ullLo < ullCount)
+    {
+        unsigned long n = ullCount - ullLo < ENVELOPE_READ_BATCH ? (unsigned long)(ullCount - ullLo) : ENVELOPE_READ_BATCH;
+        unsigned long k;
+
+        if (read_buckets(pReader, iLevel, ullLo, aBatch, n) != 0) return -1;
+        for (k = 0; k < n; k++)
+        {
+            if (aBatch[k].llFirstTime >= llEnd) return 0;
+            add_bucket(pPixels, uiWidth, llStart, llEnd, &aBatch[k]);
+        }
+        ullLo += n;
+    }
+    return 0;
+}
+
+int envelope_query(ENVELOPE_READER* pReader, long long llStart, long long llEnd, EnvelopePixel* pPixels, unsigned int uiWidth)
+{
+    int rc;
+
+    if (uiWidth == 0 || llEnd <= llStart) return -1;
+    clear_pixels(pPixels, uiWidth, llStart, llEnd);
+    rc = accumulate(pReader, llStart, llEnd, pPixels, uiWidth);
+    finish_pixels(pPixels, uiWidth);
+    return rc;
+}
+
+// Each segment overlapping the range contributes through its own sidecar
+int catalog_envelope(CAPTURE_CATALOG* pCatalog, long long llStart, long long llEnd, EnvelopePixel* pPixels, unsigned int uiWidth)
+{
+    const CaptureSegment* aSegments;
+    unsigned long ulSegments = catalog_segments(pCatalog, &aSegments), i;
+    int rc = 0;
+
+    if (uiWidth == 0 || llEnd <= llStart) return -1;
+    clear_pixels(pPixels, uiWidth, llStart, llEnd);
+    for (i = 0; i < ulSegments; i++)
+    {
+        ENVELOPE_READER* pReader;
+
+        if (aSegments[i].llLastTime < llStart || aSegments[i].llFirstTime >= llEnd) continue;
+        if (!(pReader = envelope_open(aSegments[i].szPath)))
+        {
+            rc = -1;
+            continue;
+        }
+        if (accumulate(pReader, llStart, llEnd, pPixels, uiWidth) != 0) rc = -1;
+        envelope_close(pReader);
+    }
+    finish_pixels(pPixels, uiWidth);
+    return rc;
+}
@@ -0,0 +1,70 @@
+﻿// TuneExpertEnvelope.h: Min/max/mean envelope pyramid stored next to a capture for fast plotting
+//
+
+#pragma once
+
+#include "TuneExpertCapture.h"
+#include <stdint.h>
+
+#define ENVELOPE_MAGIC "TEENV1"
+#define ENVELOPE_VERSION 3                  // 2 writes the levels in blocks as they fill, 3 stores um values
+#define ENVELOPE_BASE 1024                  // samples per level 0 bucket, each level above doubles it
+#define ENVELOPE_BLOCK 256                  // buckets per block, even; the most of a level a builder holds
+#define ENVELOPE_LEVELS 32
+#define ENVELOPE_SUFFIX ".env"              // sidecar file is the capture path plus this
+
+// Version 3 stores um, each sample converted with the compensation it was recorded under. Versions 1 and 2 hold
+// dMin and dMax as int64_t raw counts and dMean in counts, converted on reading with the header factor.
+typedef struct {
+    double dMin, dMax, dMean;
+} ENVELOPE_AXIS;
+
+typedef struct {
+    int64_t llFirstTime, llLastTime;
+    uint32_t uiCount, uiReserved;
+    ENVELOPE_AXIS aAxis[3];
+} ENVELOPE_BUCKET;
+
+// Version 1: the levels follow the header in order, level 0 first. Version 2: blocks of uiBlock buckets follow
+// in the order they filled, then the offsets of every level's blocks, level 0's first. The header is rewritten
+// last, so the sidecar of a capture that never closed has ullTableOffset 0 and is not used.
+typedef struct {
+    char szMagic[8];
+    uint32_t uiVersion, uiBase;
+    uint32_t uiLevels, uiBlock;             // uiBlock from version 2 on
+    uint64_t aullCount[ENVELOPE_LEVELS];
+    uint64_t ullTableOffset;                // version 2 on
+} ENVELOPE_FILE_HEADER;
+
+#define ENVELOPE_HEADER_V1_BYTES 280        // version 1 headers end after aullCount
+
+typedef struct {
+    double dMin, dMax, dMean;               // um, NaN for an empty pixel
+} EnvelopeValue;
+
+typedef struct {
+    long long llStartTime, llEndTime;
+    unsigned long long ullSamples;
+    EnvelopeValue aAxis[3];
+} EnvelopePixel;
+
+typedef struct ENVELOPE_BUILDER ENVELOPE_BUILDER;
+typedef struct ENVELOPE_READER ENVELOPE_READER;
+
+// Writer side, fed by the capture writer. Full blocks go to the sidecar at pPath as they fill, so a builder
+// holds at most one block per level however long the capture runs.
+ENVELOPE_BUILDER* envelope_new(const char* pPath);
+// dUmPerCount is UM_PER_COUNT_AT with the optics and compensation the samples were recorded with
+void envelope_add(ENVELOPE_BUILDER* pEnv, const RawSample* pSamples, unsigned long ulCount, double dUmPerCount);
+int envelope_finish(ENVELOPE_BUILDER* pEnv);   // writes the partial blocks, the table and the header
+void envelope_free(ENVELOPE_BUILDER* pEnv);
+
+// Creates the sidecar for a capture recorded without one (stream, crash, version 1 file)
+int envelope_build(const char* pCapturePath);
+
+ENVELOPE_READER* envelope_open(const char* pCapturePath);
+// Fills uiWidth pixels evenly spanning [llStart, llEnd); zoomed in past level 0 it decodes the samples instead
+int envelope_query(ENVELOPE_READER* pReader, long long llStart, long long llEnd, EnvelopePixel* pPixels, unsigned int uiWidth);
+void envelope_close(ENVELOPE_READER* pReader);
+
+int catalog_envelope(CAPTURE_CATALOG* pCatalog, long long llStart, long long llEnd, EnvelopePixel* pPixels, unsigned int uiWidth);
@@ -0,0 +1,205 @@
+﻿// TuneExpertFixed.c: Fixed point conversion of raw counts, scalar and AVX2 column passes
+//
+// AVX2 lanes only have 32 x 32 bit unsigned multiplies, so a raw value is biased by 2^35 to be non-negative,
+// split at bit 18 and multiplied in two halves; the bias times the scale is subtracted again afterwards.
+// Arithmetic shifts are done as logical shifts of the value with its sign bit flipped. Every intermediate
+// equals the scalar one exactly, which is what keeps both paths bit identical. Builds without -mavx2 compile
+// the AVX2 pass for that target alone and take it when the CPU reports AVX2.
+
+#include "TuneExpertFixed.h"
+#include "TuneExpertEnv.h"
+#include "TuneExpertPool.h"
+#include <math.h>
+
+#if defined(__AVX2__)
+    #define FIXED_AVX2 1                    // whole build targets AVX2
+    #define FIXED_AVX2_TARGET
+#elif defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    #define FIXED_AVX2 2                    // chosen at run time
+    #define FIXED_AVX2_TARGET __attribute__((target("avx2")))
+#endif
+
+#ifdef FIXED_AVX2
+    #include <immintrin.h>
+#endif
+
+#define FIXED_BIAS (1LL << 35)
+#define FIXED_SPLIT 18
+
+static void split_scale(FixedScale* pScale, double dPerCount)
+{
+    double dFrac, dRest;
+
+    pScale->llInt = (long long)floor(dPerCount);
+    dFrac = ldexp(dPerCount - (double)pScale->llInt, FIXED_FRACTION_BITS);
+    pScale->llFrac1 = (long long)floor(dFrac);
+    dRest = ldexp(dFrac - (double)pScale->llFrac1, FIXED_FRACTION_BITS);
+    pScale->llFrac2 = (long long)floor(dRest + 0.5);
+    if (pScale->llFrac2 == 1LL << FIXED_FRACTION_BITS)
+    {
+        pScale->llFrac2 = 0;
+        if (++pScale->llFrac1 == 1LL << FIXED_FRACTION_BITS)
+        {
+            pScale->llFrac1 = 0;
+            pScale->llInt++;
+        }
+    }
+}
+
+void fixed_conversion(FixedConversion* pConv, double dCompNum, int iUnit)
+{
+    const double dUnit = iUnit == FIXED_NM ? 1.0e3 : 1.0e6;
+    const double dPos = UM_PER_COUNT(dCompNum);
+
+    split_scale(&pConv->Pos, dPos * dUnit);
+    split_scale(&pConv->Vel, UMPS_PER_COUNT(dPos) * dUnit);
+    pConv->llOffset = START_MM * 1000LL * (long long)dUnit;
+}
+
+long long fixed_apply(long long llRaw, const FixedScale* pScale)
+{
+    long long llFrac = llRaw * pScale->llFrac1 + ((llRaw * pScale->llFrac2) >> FIXED_FRACTION_BITS);
+
+    return llRaw * pScale->llInt + (llFrac >> FIXED_FRACTION_BITS);
+}
+
+#ifdef FIXED_AVX2
+// u * f for u < 2^36, f < 2^27
+FIXED_AVX2_TARGET static inline __m256i mul36(__m256i vHi, __m256i vLo, __m256i vF)
+{
+    return _mm256_add_epi64(_mm256_slli_epi64(_mm256_mul_epu32(vHi, vF), FIXED_SPLIT), _mm256_mul_epu32(vLo, vF));
+}
+
+FIXED_AVX2_TARGET static inline __m256i sra_fraction(__m256i v, __m256i vSign, __m256i vUnbias)
+{
+    return _mm256_sub_epi64(_mm256_srli_epi64(_mm256_xor_si256(v, vSign), FIXED_FRACTION_BITS), vUnbias);
+}
+
+// Returns how many values it converted, a multiple of 4
+FIXED_AVX2_TARGET static unsigned long apply_column_avx2(const long long* pRaw, long long* pOut, unsigned long ulCount, const FixedScale* pScale, long long llOffset)
+{
+    unsigned long i = 0;
+
+    const __m256i vBias = _mm256_set1_epi64x(FIXED_BIAS), vMask = _mm256_set1_epi64x((1LL << FIXED_SPLIT) - 1);
+    const __m256i vSign = _mm256_set1_epi64x((long long)(1ULL << 63)), vUnbias = _mm256_set1_epi64x(1LL << (63 - FIXED_FRACTION_BITS));
+    const __m256i vInt = _mm256_set1_epi64x(pScale->llInt), vF1 = _mm256_set1_epi64x(pScale->llFrac1), vF2 = _mm256_set1_epi64x(pScale->llFrac2);
+    const __m256i vBInt = _mm256_set1_epi64x(FIXED_BIAS * pScale->llInt + llOffset);
+    const __m256i vBF1 = _mm256_set1_epi64x(FIXED_BIAS * pScale->llFrac1), vBF2 = _mm256_set1_epi64x(FIXED_BIAS * pScale->llFrac2);
+
+    for (; i + 4 <= ulCount; i += 4)
+    {
+        __m256i vU = _mm256_add_epi64(_mm256_loadu_si256((const __m256i*)(pRaw + i)), vBias);
+        __m256i vHi = _mm256_srli_epi64(vU, FIXED_SPLIT), vLo = _mm256_and_si256(vU, vMask);
+        __m256i vFrac = sra_fraction(_mm256_sub_epi64(mul36(vHi, vLo, vF2), vBF2), vSign, vUnbias);
+
+        vFrac = _mm256_add_epi64(_mm256_sub_epi64(mul36(vHi, vLo, vF1), vBF1), vFrac);
+        vFrac = sra_fraction(vFrac, vSign, vUnbias);
+        _mm256_storeu_si256((__m256i*)(pOut + i), _mm256_add_epi64(_mm256_sub_epi64(mul36(vHi, vLo, vInt), vBInt), vFrac));
+    }
+    return i;
+}
+
+static bool has_avx2(void)
+{
+#if FIXED_AVX2 == 1
+    return true;
+#else
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+#endif
+
+// For columns, e.g. from a transposed capture. Emulating the multiplies on SSE2 lanes is no faster than the
+// scalar loop, so only AVX2 gets a vector path; it needs llInt below 2^27, true for every unit here.
+static void apply_column(const long long* pRaw, long long* pOut, unsigned long ulCount, const FixedScale* pScale, long long llOffset)
+{
+    unsigned long i = 0;
+
+#ifdef FIXED_AVX2
+    if (pScale->llInt < 1LL << FIXED_FRACTION_BITS && has_avx2()) i = apply_column_avx2(pRaw, pOut, ulCount, pScale, llOffset);
+#endif
+    for (; i < ulCount; i++) pOut[i] = fixed_apply(pRaw[i], pScale) - llOffset;
+}
+
+typedef struct {
+    const void* pIn;                        // long long column or RawSample block
+    void* pOut;
+    FixedConversion Conv;                   // Pos and llOffset are the column's scale and offset
+} FIXED_JOB;
+
+static void column_range(void* pArg, unsigned long ulBegin, unsigned long ulEnd, unsigned int uiWorker)
+{
+    const FIXED_JOB* pJob = pArg;
+
+    (void)uiWorker;
+    apply_column((const long long*)pJob->pIn + ulBegin, (long long*)pJob->pOut + ulBegin, ulEnd - ulBegin, &pJob->Conv.Pos, pJob->Conv.llOffset);
+}
+
+void fixed_apply_column(const long long* pRaw, long long* pOut, unsigned long ulCount, const FixedScale* pScale, long long llOffset)
+{
+    FIXED_JOB job;
+
+    job.pIn = pRaw;
+    job.pOut = pOut;
+    job.Conv.Pos = *pScale;
+    job.Conv.llOffset = llOffset;
+    pool_batch(ulCount, 2 * sizeof(long long), column_range, &job);
+}
+
+static void block_range(void* pArg, unsigned long ulBegin, unsigned long ulEnd, unsigned int uiWorker)
+{
+    const FIXED_JOB* pJob = pArg;
+    const RawSample* pRaw = pJob->pIn;
+    FixedSample* pOut = pJob->pOut;
+    const FixedScale Pos = pJob->Conv.Pos, Vel = pJob->Conv.Vel;
+    const long long llOffset = pJob->Conv.llOffset;
+    unsigned long i;
+
+    (void)uiWorker;
+    for (i = ulBegin; i < ulEnd; i++)
+    {
+        pOut[i].llP1 = fixed_apply(pRaw[i].llAx1Pos, &Pos) - llOffset;
+        pOut[i].llP2 = fixed_apply(pRaw[i].llAx2Pos, &Pos) - llOffset;
+        pOut[i].llP3 = fixed_apply(pRaw[i].llAx3Pos, &Pos) - llOffset;
+        pOut[i].llV1 = fixed_apply(pRaw[i].lAx1Vel, &Vel);
+        pOut[i].llV2 = fixed_apply(pRaw[i].lAx2Vel, &Vel);
+        pOut[i].llV3 = fixed_apply(pRaw[i].lAx3Vel, &Vel);
+    }
+}
+
+// Transposing samples into columns for the vector path costs more than it saves, so this stays scalar
+void convert_block_fixed(const RawSample* pRaw, FixedSample* pOut, unsigned long ulCount, const FixedConversion* pConv)
+{
+    FIXED_JOB job;
+
+    job.pIn = pRaw;
+    job.pOut = pOut;
+    job.Conv = *pConv;
+    pool_batch(ulCount, sizeof(RawSample) + sizeof(FixedSample), block_range, &job);
+}
+
+// Scales are rebuilt only when the compensation changes; per thread, as any thread may sample. The factor
+// comes with the sample, so a change landing meanwhile is not applied to counts taken before it.
+FixedSample read_data_fixed(int iUnit)
+{
+    static _Thread_local FixedConversion aConv[2];
+    static _Thread_local double adCompNum[2];
+    LatestSample s = read_data_sample();
+    const RawSample raw = s.Raw;
+    const double dCompNum = s.dCompNum;
+    FixedConversion* pConv = &aConv[iUnit == FIXED_NM];
+    FixedSample fs;
+
+    if (adCompNum[iUnit == FIXED_NM] != dCompNum)
+    {
+        fixed_conversion(pConv, dCompNum, iUnit);
+        adCompNum[iUnit == FIXED_NM] = dCompNum;
+    }
+    fs.llP1 = fixed_apply(raw.llAx1Pos, &pConv->Pos) - pConv->llOffset;
+    fs.llP2 = fixed_apply(raw.llAx2Pos, &pConv->Pos) - pConv->llOffset;
+    fs.llP3 = fixed_apply(raw.llAx3Pos, &pConv->Pos) - pConv->llOffset;
+    fs.llV1 = fixed_apply(raw.lAx1Vel, &pConv->Vel);
+    fs.llV2 = fixed_apply(raw.lAx2Vel, &pConv->Vel);
+    fs.llV3 = fixed_apply(raw.lAx3Vel, &pConv->Vel);
+    return fs;
+}
@@ -0,0 +1,39 @@
+﻿// TuneExpertFixed.h: Integer pm/nm positions and velocities from raw counts, identical on every machine
+//
+// Each scale is split as llInt + (llFrac1 + llFrac2 / 2^27) / 2^27 units per count, so a conversion is three
+// 64 bit integer multiplies with no rounding mode or FPU in the way. The AVX2 column path computes the same
+// integers as the scalar one. Raw inputs must fit the board's 36 bit signed range.
+
+#pragma once
+
+#include "TuneExpertData.h"
+
+#define FIXED_FRACTION_BITS 27
+
+enum E_FIXED_UNIT
+{
+    FIXED_PM,                               // picometres, pm/s
+    FIXED_NM                                // nanometres, nm/s
+};
+
+typedef struct {
+    long long llInt, llFrac1, llFrac2;
+} FixedScale;
+
+typedef struct {
+    FixedScale Pos, Vel;
+    long long llOffset;                     // START_MM in the output unit, subtracted from positions
+} FixedConversion;
+
+typedef struct {
+    long long llP1, llP2, llP3;             // from START_MM, as PosVelSample, rounded down
+    long long llV1, llV2, llV3;
+} FixedSample;
+
+void fixed_conversion(FixedConversion* pConv, double dCompNum, int iUnit);
+long long fixed_apply(long long llRaw, const FixedScale* pScale);
+void fixed_apply_column(const long long* pRaw, long long* pOut, unsigned long ulCount, const FixedScale* pScale, long long llOffset);
+void convert_block_fixed(const RawSample* pRaw, FixedSample* pOut, unsigned long ulCount, const FixedConversion* pConv);
+
+// Acquires a sample as read_data_struct() does, converted with the compensation in effect for it
+FixedSample read_data_fixed(int iUnit);
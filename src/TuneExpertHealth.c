@@ -0,0 +1,336 @@
+﻿// TuneExpertHealth.c: Path error watchdog thread with per axis recovery policies
+//
+// Every period the watchdog reads the board status and runs each axis through OK -> FAULTED -> OK or INVALID.
+// A faulted axis gets its first recovery attempt after the holdoff and further ones every retry interval.
+// Invalidating only touches the valid bits the acquisition thread publishes, never the board. Board calls hold
+// the vendor lock, so they land between the acquisition thread's reads.
+
+#include "TuneExpertHealth.h"
+#include "TuneExpertEnv.h"
+#include "TuneExpertReplay.h"
+#include "TuneExpertSeqlock.h"
+#include "TuneExpertVendor.h"
+#include <stdatomic.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+typedef struct {
+    int iState;
+    unsigned int uiAttempts;
+    long long llNextTryNs;
+    long long llLastGood;
+    bool bHaveGood;
+} HEALTH_AXIS;
+
+static const unsigned long aulPathError[3] = { N1231B_PATH_ERROR_1, N1231B_PATH_ERROR_2, N1231B_PATH_ERROR_3 };
+static const unsigned long aulNoSig[3] = { N1231B_NO_SIG_1, N1231B_NO_SIG_2, N1231B_NO_SIG_3 };
+static const unsigned short awValid[3] = { N1231B_VALID_1, N1231B_VALID_2, N1231B_VALID_3 };
+
+static pthread_t WatchdogThread;
+static atomic_bool bRunning;
+static HealthConfig Config;
+static HEALTH_AXIS aAxis[3];
+static atomic_int aiState[3];
+static atomic_ullong aullFaults[3], aullRecoveries[3];
+static atomic_ushort wInvalid;
+static atomic_ushort wSampleValid = N1231B_VALID_1 | N1231B_VALID_2 | N1231B_VALID_3;   // as acquired, before wInvalid
+static atomic_uint uiRestore;               // axes health_clear_axis() asked for, handled by the watchdog
+
+static SEQLOCK LogLock;
+static HealthEvent aLog[HEALTH_LOG_SIZE];
+static unsigned long ulLogCount;
+
+static long long monotonic_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Only the watchdog thread writes the log
+static void log_event(int iAxis, int iEvent, int iAction, unsigned long ulStatus, long long llPresetRaw)
+{
+    HealthEvent* pEvent;
+
+    seqlock_write_begin(&LogLock);
+    pEvent = &aLog[ulLogCount % HEALTH_LOG_SIZE];
+    pEvent->llTime = get_time_ns();
+    pEvent->ullSample = read_latest().ullSequence;
+    pEvent->iAxis = iAxis;
+    pEvent->iEvent = iEvent;
+    pEvent->iAction = iAction;
+    pEvent->uiAttempt = aAxis[iAxis].uiAttempts;
+    pEvent->ulStatus = ulStatus & aulPathError[iAxis];
+    pEvent->llPresetRaw = llPresetRaw;
+    ulLogCount++;
+    seqlock_write_end(&LogLock);
+}
+
+static void set_state(int iAxis, int iState)
+{
+    aAxis[iAxis].iState = iState;
+    atomic_store(&aiState[iAxis], iState);
+    if (iState == HEALTH_INVALID) atomic_fetch_or(&wInvalid, awValid[iAxis]);
+    else atomic_fetch_and(&wInvalid, (unsigned short)~awValid[iAxis]);
+}
+
+// While replaying there is no board, so a clear valid bit stands in for a path error
+static bool read_status(bool bReplay, unsigned long* pulStatus)
+{
+    unsigned short wValid;
+    bool bRead;
+    int i;
+
+    if (!bReplay)
+    {
+        vendor_lock();
+        bRead = hBrd && vendor_api()->pfnGetStatus(hBrd, pulStatus, &wValid) == N1231B_SUCCESS;
+        vendor_unlock();
+        return bRead;
+    }
+
+    wValid = atomic_load(&wSampleValid);
+    *pulStatus = 0;
+    for (i = 0; i < 3; i++)
+        if (!(wValid & awValid[i])) *pulStatus |= aulNoSig[i];
+    return true;
+}
+
+static long long preset_value(int iAxis)
+{
+    const HealthAxisConfig* pAxis = &Config.aAxis[iAxis];
+
+    if (pAxis->iPreset == HEALTH_PRESET_VALUE) return pAxis->llPresetRaw;
+    if (pAxis->iPreset == HEALTH_PRESET_LAST_GOOD && aAxis[iAxis].bHaveGood) return aAxis[iAxis].llLastGood;
+    return (long long)MM_TO_COUNTS(START_MM, read_comp_num());
+}
+
+// Returns the status after the action
+static unsigned long recover(int iAxis, bool bReplay, unsigned long ulStatus, long long* pllPreset)
+{
+    union { N1231B_INT64 s; long long i64; } uPreset;
+    unsigned long ulAfter = ulStatus;
+
+    if (!bReplay) vendor_lock();
+    if (Config.aAxis[iAxis].iPolicy == HEALTH_CLEAR)
+    {
+        if (!bReplay && vendor_api()->pfnClearStatusBits(hBrd, aulPathError[iAxis], &ulAfter) != N1231B_SUCCESS) ulAfter = ulStatus;
+    }
+    else if (Config.aAxis[iAxis].iPolicy == HEALTH_PRESET)
+    {
+        uPreset.i64 = *pllPreset = preset_value(iAxis);
+        if (!bReplay && vendor_api()->pfnPresetRaw(hBrd, (N1231B_AXIS)iAxis, uPreset.s, &ulAfter) != N1231B_SUCCESS) ulAfter = ulStatus;
+    }
+    if (bReplay) read_status(true, &ulAfter);
+    else vendor_unlock();
+    return ulAfter;
+}
+
+static void watch_axis(int iAxis, bool bReplay, unsigned long ulStatus, long long llNow)
+{
+    HEALTH_AXIS* pAxis = &aAxis[iAxis];
+    int iPolicy = Config.aAxis[iAxis].iPolicy;
+    bool bError = (ulStatus & aulPathError[iAxis]) != 0;
+    long long llPreset = 0;
+
+    if (atomic_fetch_and(&uiRestore, ~(1u << iAxis)) & (1u << iAxis) && pAxis->iState == HEALTH_INVALID)
+    {
+        set_state(iAxis, HEALTH_OK);
+        log_event(iAxis, HEALTH_RESTORED, HEALTH_REPORT, ulStatus, 0);
+        return;
+    }
+    switch (pAxis->iState)
+    {
+    case HEALTH_OK:
+        if (!bError)
+        {
+            LatestSample ls = read_latest();
+            long long allPos[3] = { ls.Raw.llAx1Pos, ls.Raw.llAx2Pos, ls.Raw.llAx3Pos };
+
+            if (ls.ullSequence && (ls.Raw.wValid & awValid[iAxis]))
+            {
+                pAxis->llLastGood = allPos[iAxis];
+                pAxis->bHaveGood = true;
+            }
+            break;
+        }
+        atomic_fetch_add(&aullFaults[iAxis], 1);
+        pAxis->uiAttempts = 0;
+        log_event(iAxis, HEALTH_FAULT, HEALTH_REPORT, ulStatus, 0);
+        if (iPolicy == HEALTH_INVALIDATE)
+        {
+            set_state(iAxis, HEALTH_INVALID);
+            log_event(iAxis, HEALTH_INVALIDATED, iPolicy, ulStatus, 0);
+            break;
+        }
+        set_state(iAxis, HEALTH_FAULTED);
+        pAxis->llNextTryNs = llNow + Config.llHoldoffNs;
+        break;
+
+    case HEALTH_FAULTED:
+        // Cleared by someone else, or the policy is only to watch
+        if (!bError)
+        {
+            set_state(iAxis, HEALTH_OK);
+            atomic_fetch_add(&aullRecoveries[iAxis], 1);
+            log_event(iAxis, HEALTH_RECOVERED, HEALTH_REPORT, ulStatus, 0);
+            break;
+        }
+        if (iPolicy == HEALTH_REPORT || llNow < pAxis->llNextTryNs) break;
+
+        pAxis->uiAttempts++;
+        ulStatus = recover(iAxis, bReplay, ulStatus, &llPreset);
+        if (!(ulStatus & aulPathError[iAxis]))
+        {
+            set_state(iAxis, HEALTH_OK);
+            atomic_fetch_add(&aullRecoveries[iAxis], 1);
+            log_event(iAxis, HEALTH_RECOVERED, iPolicy, ulStatus, llPreset);
+            break;
+        }
+        if (!(pAxis->uiAttempts & (pAxis->uiAttempts - 1))) log_event(iAxis, HEALTH_ATTEMPT_FAILED, iPolicy, ulStatus, llPreset);
+        if (Config.uiMaxAttempts && pAxis->uiAttempts >= Config.uiMaxAttempts)
+        {
+            set_state(iAxis, HEALTH_INVALID);
+            log_event(iAxis, HEALTH_GAVE_UP, iPolicy, ulStatus, llPreset);
+            break;
+        }
+        pAxis->llNextTryNs = llNow + Config.llRetryNs;
+        break;
+
+    default:
+        break;
+    }
+}
+
+static void* watchdog_thread(void* pArg)
+{
+    bool bStatusError = false;
+    int i;
+
+    (void)pArg;
+    while (atomic_load(&bRunning))
+    {
+        struct timespec ts = { (time_t)(Config.llPeriodNs / 1000000000), (long)(Config.llPeriodNs % 1000000000) };
+        bool bReplay = read_replay_status().bActive;
+        unsigned long ulStatus;
+
+        if (read_status(bReplay, &ulStatus))
+        {
+            long long llNow = monotonic_ns();
+
+            bStatusError = false;
+            for (i = 0; i < 3; i++) watch_axis(i, bReplay, ulStatus, llNow);
+        }
+        else if (!bStatusError)
+        {
+            // Logged once per outage
+            bStatusError = true;
+            for (i = 0; i < 3; i++) log_event(i, HEALTH_STATUS_ERROR, HEALTH_REPORT, 0, 0);
+        }
+        nanosleep(&ts, NULL);
+    }
+    return NULL;
+}
+
+int start_health_watchdog(const HealthConfig* pConfig)
+{
+    int i;
+
+    stop_health_watchdog();
+    Config = *pConfig;
+    if (Config.llPeriodNs <= 0) Config.llPeriodNs = HEALTH_DEFAULT_PERIOD_NS;
+    if (Config.llRetryNs <= 0) Config.llRetryNs = Config.llPeriodNs;
+    memset(aAxis, 0, sizeof(aAxis));
+    for (i = 0; i < 3; i++) set_state(i, HEALTH_OK);
+    atomic_store(&uiRestore, 0);
+    atomic_store(&bRunning, true);
+    if (pthread_create(&WatchdogThread, NULL, watchdog_thread, NULL) != 0)
+    {
+        atomic_store(&bRunning, false);
+        return -1;
+    }
+    return 0;
+}
+
+// Invalidated axes stay invalid, a stopped watchdog cannot tell when they recover
+void stop_health_watchdog(void)
+{
+    if (!atomic_exchange(&bRunning, false)) return;
+    pthread_join(WatchdogThread, NULL);
+}
+
+HealthStatus read_health_status(void)
+{
+    HealthStatus hs;
+    int i;
+
+    hs.bRunning = atomic_load(&bRunning);
+    for (i = 0; i < 3; i++)
+    {
+        hs.aiState[i] = atomic_load(&aiState[i]);
+        hs.aullFaults[i] = atomic_load(&aullFaults[i]);
+        hs.aullRecoveries[i] = atomic_load(&aullRecoveries[i]);
+    }
+    hs.wInvalidMask = atomic_load(&wInvalid);
+    return hs;
+}
+
+void health_clear_axis(int iAxis)
+{
+    if (iAxis < AXIS_1 || iAxis > AXIS_3) return;
+    if (atomic_load(&bRunning)) atomic_fetch_or(&uiRestore, 1u << iAxis);
+    else
+    {
+        atomic_store(&aiState[iAxis], HEALTH_OK);
+        atomic_fetch_and(&wInvalid, (unsigned short)~awValid[iAxis]);
+    }
+}
+
+// Copies the retained log, oldest first
+int read_health_log(HealthEvent* pEvents, int iMax)
+{
+    unsigned long ulCount, ulFirst, i;
+    unsigned int uiSeq;
+    int n;
+
+    do {
+        uiSeq = seqlock_read_begin(&LogLock);
+        ulCount = ulLogCount;
+        ulFirst = ulCount > HEALTH_LOG_SIZE ? ulCount - HEALTH_LOG_SIZE : 0;
+        if (ulCount - ulFirst > (unsigned long)iMax) ulFirst = ulCount - iMax;
+        for (i = ulFirst, n = 0; i < ulCount; i++, n++) pEvents[n] = aLog[i % HEALTH_LOG_SIZE];
+    } while (seqlock_read_retry(&LogLock, uiSeq));
+    return n;
+}
+
+int save_health_log(const char* pPath)
+{
+    static const char* apEvent[] = { "fault", "recovered", "attempt_failed", "gave_up", "invalidated", "restored", "status_error" };
+    static const char* apAction[] = { "none", "clear", "preset", "invalidate" };
+    HealthEvent* aCopy = malloc(HEALTH_LOG_SIZE * sizeof(HealthEvent));
+    FILE* fp = aCopy ? fopen(pPath, "w") : NULL;
+    int i, n;
+
+    if (!fp)
+    {
+        free(aCopy);
+        return -1;
+    }
+    n = read_health_log(aCopy, HEALTH_LOG_SIZE);
+    fprintf(fp, "time_ns,sample,axis,event,action,attempt,status,preset_raw\n");
+    for (i = 0; i < n; i++)
+        fprintf(fp, "%lld,%llu,%d,%s,%s,%u,0x%08lx,%lld\n", aCopy[i].llTime, aCopy[i].ullSample, aCopy[i].iAxis + 1,
+            apEvent[aCopy[i].iEvent], apAction[aCopy[i].iAction], aCopy[i].uiAttempt, aCopy[i].ulStatus, aCopy[i].llPresetRaw);
+    fclose(fp);
+    free(aCopy);
+    return n;
+}
+
+unsigned short health_filter_valid(unsigned short wValid)
+{
+    atomic_store_explicit(&wSampleValid, wValid, memory_order_relaxed);
+    return wValid & ~atomic_load_explicit(&wInvalid, memory_order_relaxed);
+}
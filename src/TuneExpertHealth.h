@@ -0,0 +1,87 @@
+﻿// TuneExpertHealth.h: Watchdog for beam path errors with automatic recovery
+//
+
+#pragma once
+
+#include "TuneExpertData.h"
+
+#define HEALTH_LOG_SIZE 1024
+#define HEALTH_DEFAULT_PERIOD_NS 10000000LL
+
+// What the watchdog does once an axis shows NO_SIG or GLITCH (its own or the reference's)
+enum E_HEALTH_POLICY
+{
+    HEALTH_REPORT,                          // only log; the axis recovers when someone else clears it
+    HEALTH_CLEAR,                           // clear the path error bits
+    HEALTH_PRESET,                          // preset the axis, which also clears its errors
+    HEALTH_INVALIDATE                       // keep the axis' valid bit clear until health_clear_axis()
+};
+
+enum E_HEALTH_PRESET
+{
+    HEALTH_PRESET_START,                    // START_MM, as reset_laser()
+    HEALTH_PRESET_LAST_GOOD,                // last raw position read while the axis was healthy
+    HEALTH_PRESET_VALUE                     // llPresetRaw
+};
+
+enum E_HEALTH_EVENT
+{
+    HEALTH_FAULT,                           // path error seen, ulStatus has the bits
+    HEALTH_RECOVERED,
+    HEALTH_ATTEMPT_FAILED,                  // logged for attempts 1, 2, 4, 8, ... so a long outage stays readable
+    HEALTH_GAVE_UP,                         // uiMaxAttempts reached, the axis is invalidated
+    HEALTH_INVALIDATED,
+    HEALTH_RESTORED,                        // health_clear_axis() lifted the invalid mark
+    HEALTH_STATUS_ERROR                     // the board status could not be read
+};
+
+enum E_HEALTH_STATE
+{
+    HEALTH_OK,
+    HEALTH_FAULTED,                         // recovering
+    HEALTH_INVALID
+};
+
+typedef struct {
+    int iPolicy;                            // E_HEALTH_POLICY
+    int iPreset;                            // E_HEALTH_PRESET for HEALTH_PRESET
+    long long llPresetRaw;
+} HealthAxisConfig;
+
+typedef struct {
+    long long llPeriodNs;                   // status poll period, 0 = HEALTH_DEFAULT_PERIOD_NS
+    long long llHoldoffNs;                  // wait after a fault before the first attempt, lets a glitch settle
+    long long llRetryNs;                    // between attempts, 0 = llPeriodNs
+    unsigned int uiMaxAttempts;             // then invalidate the axis, 0 = keep trying
+    HealthAxisConfig aAxis[3];
+} HealthConfig;
+
+typedef struct {
+    long long llTime;
+    unsigned long long ullSample;           // last sample acquired when the event happened
+    int iAxis;                              // AXIS_1..AXIS_3
+    int iEvent;                             // E_HEALTH_EVENT
+    int iAction;                            // E_HEALTH_POLICY applied, HEALTH_REPORT for none
+    unsigned int uiAttempt;
+    unsigned long ulStatus;                 // N1231B_PATH_ERROR_* bits of the axis at the event
+    long long llPresetRaw;                  // for HEALTH_PRESET
+} HealthEvent;
+
+typedef struct {
+    bool bRunning;
+    int aiState[3];                         // E_HEALTH_STATE
+    unsigned long long aullFaults[3], aullRecoveries[3];
+    unsigned short wInvalidMask;            // N1231B_VALID_* bits forced clear in acquired samples
+} HealthStatus;
+
+// The status is read from the board, or from the samples' valid bits while a replay is open
+int start_health_watchdog(const HealthConfig* pConfig);
+void stop_health_watchdog(void);
+HealthStatus read_health_status(void);
+void health_clear_axis(int iAxis);
+
+int read_health_log(HealthEvent* pEvents, int iMax);
+int save_health_log(const char* pPath);
+
+// Acquisition side, returns wValid with the invalidated axes cleared
+unsigned short health_filter_valid(unsigned short wValid);
@@ -0,0 +1,118 @@
+﻿// TuneExpertKinematics.c: Batched kinematic transform of converted samples to stage coordinates
+//
+
+#include "TuneExpertKinematics.h"
+#include "TuneExpertSeqlock.h"
+#include "TuneExpertPool.h"
+#include <pthread.h>
+
+typedef struct {
+    double adM[9];
+    double adOffset[3];
+} KINEMATICS;
+
+static pthread_mutex_t WriteMutex = PTHREAD_MUTEX_INITIALIZER;
+static SEQLOCK KinLock;
+static KINEMATICS Kin = { { 1, 0, 0, 0, 1, 0, 0, 0, 1 }, { 0, 0, 0 } };
+
+void set_kinematics(const double* pdMatrix, const double* pdOffset)
+{
+    int i;
+
+    pthread_mutex_lock(&WriteMutex);
+    seqlock_write_begin(&KinLock);
+    for (i = 0; i < 9; i++) Kin.adM[i] = pdMatrix[i];
+    for (i = 0; i < 3; i++) Kin.adOffset[i] = pdOffset ? pdOffset[i] : 0;
+    seqlock_write_end(&KinLock);
+    pthread_mutex_unlock(&WriteMutex);
+}
+
+int set_kinematics_xy_yaw(double dSpacingUm, double dAbbeXUm, double dAbbeYUm)
+{
+    // yaw = (p2 - p1) / d, x = (p1 + p2) / 2 - AbbeY * yaw, y = p3 + AbbeX * yaw
+    double d = dSpacingUm;
+    double adM[9];
+
+    // Coincident beams give no yaw, and the matrix would fill with inf and NaN
+    if (!(d > 0)) return -1;
+    adM[0] = 0.5 + dAbbeYUm / d;    adM[1] = 0.5 - dAbbeYUm / d;    adM[2] = 0;
+    adM[3] = -dAbbeXUm / d;         adM[4] = dAbbeXUm / d;          adM[5] = 1;
+    adM[6] = -1 / d;                adM[7] = 1 / d;                 adM[8] = 0;
+    set_kinematics(adM, NULL);
+    return 0;
+}
+
+static KINEMATICS read_kinematics(void)
+{
+    KINEMATICS k;
+    unsigned int uiSeq;
+
+    do {
+        uiSeq = seqlock_read_begin(&KinLock);
+        k = Kin;
+    } while (seqlock_read_retry(&KinLock, uiSeq));
+    return k;
+}
+
+typedef struct {
+    KINEMATICS k;
+    const PosVelSample* pvs;
+    StageSample* pss;
+} TRANSFORM_JOB;
+
+static void transform_range(void* pArg, unsigned long ulBegin, unsigned long ulEnd, unsigned int uiWorker)
+{
+    // Geometry held in locals so the loop stays in registers
+    const TRANSFORM_JOB* pJob = pArg;
+    const KINEMATICS k = pJob->k;
+    const PosVelSample* pvs = pJob->pvs;
+    StageSample* pss = pJob->pss;
+    const double m0 = k.adM[0], m1 = k.adM[1], m2 = k.adM[2];
+    const double m3 = k.adM[3], m4 = k.adM[4], m5 = k.adM[5];
+    const double m6 = k.adM[6], m7 = k.adM[7], m8 = k.adM[8];
+    const double o0 = k.adOffset[0], o1 = k.adOffset[1], o2 = k.adOffset[2];
+    unsigned long i;
+
+    (void)uiWorker;
+    for (i = ulBegin; i < ulEnd; i++)
+    {
+        const double p1 = pvs[i].p1, p2 = pvs[i].p2, p3 = pvs[i].p3;
+        const double v1 = pvs[i].v1, v2 = pvs[i].v2, v3 = pvs[i].v3;
+
+        pss[i].x = m0 * p1 + m1 * p2 + m2 * p3 + o0;
+        pss[i].y = m3 * p1 + m4 * p2 + m5 * p3 + o1;
+        pss[i].yaw = m6 * p1 + m7 * p2 + m8 * p3 + o2;
+        pss[i].vx = m0 * v1 + m1 * v2 + m2 * v3;
+        pss[i].vy = m3 * v1 + m4 * v2 + m5 * v3;
+        pss[i].vyaw = m6 * v1 + m7 * v2 + m8 * v3;
+    }
+}
+
+void transform_block(const PosVelSample* pvs, StageSample* pss, unsigned long ulCount)
+{
+    // One consistent copy of the geometry per block, shared by every range of it
+    TRANSFORM_JOB job;
+
+    job.k = read_kinematics();
+    job.pvs = pvs;
+    job.pss = pss;
+    pool_batch(ulCount, sizeof(PosVelSample) + sizeof(StageSample), transform_range, &job);
+}
+
+StageSample read_stage_struct(void)
+{
+    PosVelSample pvs = read_data_struct();
+    StageSample ss;
+
+    transform_block(&pvs, &ss, 1);
+    return ss;
+}
+
+void read_stage_pointer(double* pss)
+{
+    StageSample ss = read_stage_struct();
+
+    pss[0] = ss.x;
+    pss[1] = ss.y;
+    pss[2] = ss.yaw;
+}
@@ -0,0 +1,23 @@
+﻿// TuneExpertKinematics.h: Affine transform from the three axis readings to stage X, Y and yaw
+//
+
+#pragma once
+
+#include "TuneExpertData.h"
+
+typedef struct {
+    double x, y, yaw;           // um, um, rad
+    double vx, vy, vyaw;        // um/s, um/s, rad/s
+} StageSample;
+
+// out = M * (p1, p2, p3) + offset, M row major with rows x, y, yaw. Velocities use M only.
+void set_kinematics(const double* pdMatrix, const double* pdOffset);
+
+// Axes 1 and 2 are parallel X beams dSpacingUm apart and axis 3 is Y. The Abbe offsets place the point
+// of interest dAbbeYUm from the X beam midline and dAbbeXUm from the Y beam. Returns -1, leaving the
+// transform as it was, unless dSpacingUm is above 0.
+int set_kinematics_xy_yaw(double dSpacingUm, double dAbbeXUm, double dAbbeYUm);
+
+void transform_block(const PosVelSample* pvs, StageSample* pss, unsigned long ulCount);
+StageSample read_stage_struct(void);
+void read_stage_pointer(double* pss);
@@ -0,0 +1,236 @@
+﻿// TuneExpertParallel.c: Capture chunks decoded, converted and filtered on the task pool
+//
+// Block b is decoded into slot (b % slots) by a pool task, which never waits: the block taking a slot over is
+// only submitted once the consumer has moved past the block it held. That bounds memory, keeps the output in
+// order and lets several readers and other batch work share the pool without tying up its workers.
+
+#include "TuneExpertParallel.h"
+#include "TuneExpertCapture.h"
+#include "TuneExpertPool.h"
+#include <stdatomic.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+    PARALLEL_READER* pOwner;
+    unsigned long ulBlock;                  // block this slot holds or is decoding
+    bool bReady;
+    int iError;
+    unsigned long ulCount;
+    RawSample* pRaw;
+    PosVelSample* pvs;
+} PARALLEL_SLOT;
+
+struct PARALLEL_READER {
+    ParallelConfig Config;
+    TASK_POOL* pPool;
+    POOL_GROUP* pGroup;
+    CAPTURE_READER* pCapture;
+    CAPTURE_READER** apCapture;             // one per pool worker, opened by the worker on first use
+    const CAPTURE_INDEX_ENTRY* pIndex;
+    unsigned long ulFirstChunk, ulChunks, ulBlocks;
+    PARALLEL_SLOT* aSlots;
+    unsigned int uiSlots;
+    unsigned long ulSubmitted, ulConsume;
+    bool bHolding;                          // consumer holds block ulConsume
+    atomic_bool bStop;
+    pthread_mutex_t Mutex;
+    pthread_cond_t ReadyCond;
+};
+
+static unsigned long keep_range(RawSample* pRaw, unsigned long ulCount, long long llStart, long long llEnd)
+{
+    unsigned long i, n = 0;
+
+    for (i = 0; i < ulCount; i++)
+        if (pRaw[i].llTime >= llStart && pRaw[i].llTime < llEnd) pRaw[n++] = pRaw[i];
+    return n;
+}
+
+static int decode_block(PARALLEL_READER* pReader, CAPTURE_READER* pCapture, unsigned long ulBlock, PARALLEL_SLOT* pSlot)
+{
+    const ParallelConfig* pConfig = &pReader->Config;
+    unsigned long ulChunk = pReader->ulFirstChunk + ulBlock * PARALLEL_BLOCK_CHUNKS;
+    unsigned long ulEnd = pReader->ulFirstChunk + pReader->ulChunks;
+    unsigned long ulCount = 0;
+
+    if (ulEnd > ulChunk + PARALLEL_BLOCK_CHUNKS) ulEnd = ulChunk + PARALLEL_BLOCK_CHUNKS;
+    for (; ulChunk < ulEnd; ulChunk++)
+    {
+        const CAPTURE_INDEX_ENTRY* pEntry = &pReader->pIndex[ulChunk];
+        long n = capture_read_chunk(pCapture, ulChunk, pSlot->pRaw + ulCount);
+        double dCompNum;
+
+        if (n < 0) return -1;
+        // Only the chunks on the edges of the range need their samples checked
+        if (pEntry->llFirstTime < pConfig->llStart || pEntry->llLastTime >= pConfig->llEnd)
+            n = (long)keep_range(pSlot->pRaw + ulCount, n, pConfig->llStart, pConfig->llEnd);
+        // Each chunk is converted with the factor it was recorded under
+        if (pConfig->bConvert)
+        {
+            if (capture_chunk_comp(pCapture, ulChunk, &dCompNum) != 0) return -1;
+            convert_block_comp(pSlot->pRaw + ulCount, pSlot->pvs + ulCount, n, dCompNum);
+        }
+        ulCount += n;
+    }
+    if (pConfig->pfnFilter) ulCount = pConfig->pfnFilter(pSlot->pRaw, pConfig->bConvert ? pSlot->pvs : NULL, ulCount, pConfig->pFilterArg);
+    pSlot->ulCount = ulCount;
+    return 0;
+}
+
+static void decode_task(void* pArg, unsigned int uiWorker)
+{
+    PARALLEL_SLOT* pSlot = pArg;
+    PARALLEL_READER* pReader = pSlot->pOwner;
+    CAPTURE_READER** ppCapture = &pReader->apCapture[uiWorker];
+    int iError = -1;
+
+    if (!atomic_load(&pReader->bStop) && (*ppCapture || (*ppCapture = capture_dup_read(pReader->pCapture)) != NULL))
+        iError = decode_block(pReader, *ppCapture, pSlot->ulBlock, pSlot);
+
+    pthread_mutex_lock(&pReader->Mutex);
+    pSlot->iError = iError;
+    pSlot->bReady = true;
+    pthread_cond_broadcast(&pReader->ReadyCond);
+    pthread_mutex_unlock(&pReader->Mutex);
+}
+
+static void submit_block(PARALLEL_READER* pReader, PARALLEL_SLOT* pSlot)
+{
+    pSlot->ulBlock = pReader->ulSubmitted++;
+    pSlot->bReady = false;
+    if (pool_submit(pReader->pGroup, decode_task, pSlot) == 0) return;
+    pSlot->iError = -1;
+    pSlot->bReady = true;
+}
+
+PARALLEL_READER* parallel_open(const char* pPath, const ParallelConfig* pConfig)
+{
+    PARALLEL_READER* pReader;
+    unsigned long ulEntries, ulLo, ulHi;
+    unsigned int i;
+
+    if (!(pReader = calloc(1, sizeof(PARALLEL_READER)))) return NULL;
+    pthread_mutex_init(&pReader->Mutex, NULL);
+    pthread_cond_init(&pReader->ReadyCond, NULL);
+    if (pConfig) pReader->Config = *pConfig;
+    if (!pReader->Config.llEnd) pReader->Config.llEnd = LLONG_MAX;
+    if (!(pReader->pCapture = capture_open_read(pPath)))
+    {
+        parallel_close(pReader);
+        return NULL;
+    }
+    pReader->pIndex = capture_index(pReader->pCapture, &ulEntries);
+
+    // Chunks overlapping [llStart, llEnd) from the index alone
+    ulLo = 0;
+    ulHi = ulEntries;
+    while (ulLo < ulHi)
+    {
+        unsigned long ulMid = ulLo + (ulHi - ulLo) / 2;
+        if (pReader->pIndex[ulMid].llLastTime < pReader->Config.llStart) ulLo = ulMid + 1;
+        else ulHi = ulMid;
+    }
+    pReader->ulFirstChunk = ulLo;
+    ulHi = ulEntries;
+    while (ulLo < ulHi)
+    {
+        unsigned long ulMid = ulLo + (ulHi - ulLo) / 2;
+        if (pReader->pIndex[ulMid].llFirstTime < pReader->Config.llEnd) ulLo = ulMid + 1;
+        else ulHi = ulMid;
+    }
+    pReader->ulChunks = ulLo - pReader->ulFirstChunk;
+    pReader->ulBlocks = (pReader->ulChunks + PARALLEL_BLOCK_CHUNKS - 1) / PARALLEL_BLOCK_CHUNKS;
+
+    if (pReader->Config.uiThreads)
+    {
+        PoolConfig pc;
+
+        memset(&pc, 0, sizeof(pc));
+        pc.uiThreads = pReader->Config.uiThreads < PARALLEL_MAX_THREADS ? pReader->Config.uiThreads : PARALLEL_MAX_THREADS;
+        pReader->pPool = pool_create(&pc);
+    }
+    else pReader->pPool = pool_acquire();
+    if (!pReader->pPool || !(pReader->pGroup = pool_group_new(pReader->pPool)))
+    {
+        parallel_close(pReader);
+        return NULL;
+    }
+    pReader->uiSlots = 2 * pool_threads(pReader->pPool);
+    pReader->aSlots = calloc(pReader->uiSlots, sizeof(PARALLEL_SLOT));
+    pReader->apCapture = calloc(pool_threads(pReader->pPool), sizeof(CAPTURE_READER*));
+    if (!pReader->aSlots || !pReader->apCapture)
+    {
+        parallel_close(pReader);
+        return NULL;
+    }
+    for (i = 0; i < pReader->uiSlots; i++)
+    {
+        pReader->aSlots[i].pOwner = pReader;
+        pReader->aSlots[i].pRaw = malloc(PARALLEL_BLOCK_CHUNKS * CAPTURE_CHUNK_SAMPLES * sizeof(RawSample));
+        if (pReader->Config.bConvert) pReader->aSlots[i].pvs = malloc(PARALLEL_BLOCK_CHUNKS * CAPTURE_CHUNK_SAMPLES * sizeof(PosVelSample));
+        if (!pReader->aSlots[i].pRaw || (pReader->Config.bConvert && !pReader->aSlots[i].pvs))
+        {
+            parallel_close(pReader);
+            return NULL;
+        }
+    }
+    for (i = 0; i < pReader->uiSlots && pReader->ulSubmitted < pReader->ulBlocks; i++) submit_block(pReader, &pReader->aSlots[i]);
+    return pReader;
+}
+
+static void release_block(PARALLEL_READER* pReader)
+{
+    PARALLEL_SLOT* pSlot = &pReader->aSlots[pReader->ulConsume % pReader->uiSlots];
+
+    // The slot is free again, so the block uiSlots ahead can be decoded into it
+    if (pReader->ulSubmitted < pReader->ulBlocks) submit_block(pReader, pSlot);
+    pReader->ulConsume++;
+    pReader->bHolding = false;
+}
+
+int parallel_next(PARALLEL_READER* pReader, ParallelBlock* pBlock)
+{
+    PARALLEL_SLOT* pSlot;
+
+    if (pReader->bHolding) release_block(pReader);
+    if (pReader->ulConsume >= pReader->ulBlocks) return 0;
+
+    pSlot = &pReader->aSlots[pReader->ulConsume % pReader->uiSlots];
+    pthread_mutex_lock(&pReader->Mutex);
+    while (!pSlot->bReady) pthread_cond_wait(&pReader->ReadyCond, &pReader->Mutex);
+    pthread_mutex_unlock(&pReader->Mutex);
+    if (pSlot->iError) return -1;
+
+    pReader->bHolding = true;
+    pBlock->ulIndex = pReader->ulConsume;
+    pBlock->ulCount = pSlot->ulCount;
+    pBlock->pRaw = pSlot->pRaw;
+    pBlock->pSamples = pSlot->pvs;
+    return 1;
+}
+
+void parallel_close(PARALLEL_READER* pReader)
+{
+    unsigned int i;
+
+    if (!pReader) return;
+    // Blocks still queued finish without decoding
+    atomic_store(&pReader->bStop, true);
+    pool_group_free(pReader->pGroup);
+    for (i = 0; pReader->apCapture && i < pool_threads(pReader->pPool); i++) capture_close_read(pReader->apCapture[i]);
+    for (i = 0; pReader->aSlots && i < pReader->uiSlots; i++)
+    {
+        free(pReader->aSlots[i].pRaw);
+        free(pReader->aSlots[i].pvs);
+    }
+    free(pReader->aSlots);
+    free(pReader->apCapture);
+    pool_release(pReader->pPool);
+    capture_close_read(pReader->pCapture);
+    pthread_mutex_destroy(&pReader->Mutex);
+    pthread_cond_destroy(&pReader->ReadyCond);
+    free(pReader);
+}
@@ -0,0 +1,34 @@
+﻿// TuneExpertParallel.h: Multi-threaded decoding of capture files with ordered output
+//
+
+#pragma once
+
+#include "TuneExpertData.h"
+
+#define PARALLEL_BLOCK_CHUNKS 4             // capture chunks per output block
+#define PARALLEL_MAX_THREADS 256
+
+// Runs on the decoding threads; compacts the block in place and returns the samples kept. pvs is NULL when not converting.
+typedef unsigned long (*ParallelFilter)(RawSample* pRaw, PosVelSample* pvs, unsigned long ulCount, void* pArg);
+
+typedef struct {
+    unsigned int uiThreads;                 // 0 = the library pool, see TuneExpertPool.h, else a private pool this size
+    long long llStart, llEnd;               // time range [llStart, llEnd), llEnd 0 = to the end of the capture
+    bool bConvert;                          // fill pSamples with um values, each chunk with its recorded compensation
+    ParallelFilter pfnFilter;
+    void* pFilterArg;
+} ParallelConfig;
+
+typedef struct {
+    unsigned long ulIndex;                  // blocks arrive in capture order 0, 1, 2, ...
+    unsigned long ulCount;
+    const RawSample* pRaw;
+    const PosVelSample* pSamples;           // NULL when bConvert is false
+} ParallelBlock;
+
+typedef struct PARALLEL_READER PARALLEL_READER;
+
+PARALLEL_READER* parallel_open(const char* pPath, const ParallelConfig* pConfig);
+// Returns 1 with the next block, valid until the next call, 0 at the end or -1 on a damaged chunk
+int parallel_next(PARALLEL_READER* pReader, ParallelBlock* pBlock);
+void parallel_close(PARALLEL_READER* pReader);
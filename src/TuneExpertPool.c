@@ -0,0 +1,647 @@
+﻿// TuneExpertPool.c: Work-stealing pool with NUMA aware worker placement
+//
+// Each worker owns a Chase-Lev deque: it pushes and takes at the bottom, idle workers steal from the top,
+// trying workers on their own NUMA node first. Tasks from outside the pool go through a locked injection
+// queue. A range task keeps splitting off its upper half until it is one grain long, so thieves take the
+// largest pieces while the owner works through the cache-warm neighbouring ones.
+
+#ifndef _GNU_SOURCE
+    #define _GNU_SOURCE
+#endif
+
+#include "TuneExpertPool.h"
+#include <stdatomic.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+
+#include <sched.h>
+#include <unistd.h>
+#define yield_thread sched_yield
+
+#define POOL_SPIN 64                        // empty searches before a worker sleeps
+#define POOL_MAX_NODES 64
+#define POOL_DEFAULT_L2 (256 * 1024)
+
+typedef struct POOL_TASK {
+    PoolTask pfnTask;
+    PoolRange pfnRange;
+    void* pArg;
+    unsigned long ulBegin, ulEnd, ulGrain;
+    POOL_GROUP* pGroup;
+} POOL_TASK;
+
+typedef struct {
+    _Alignas(64) atomic_llong llTop;
+    _Alignas(64) atomic_llong llBottom;
+    _Atomic(POOL_TASK*)* apTasks;           // allocated by the worker after pinning, so on its node
+} POOL_DEQUE;
+
+typedef struct {
+    TASK_POOL* pPool;
+    POOL_DEQUE Deque;
+    unsigned int uiIndex;
+    int iCpu, iNode;
+    unsigned int* auiVictims;               // steal order, own node first
+    pthread_t Thread;
+    bool bStarted;
+} POOL_WORKER;
+
+struct POOL_GROUP {
+    TASK_POOL* pPool;
+    atomic_ulong ulPending;
+    pthread_mutex_t Mutex;
+    pthread_cond_t DoneCond;
+};
+
+struct TASK_POOL {
+    POOL_WORKER* aWorkers;
+    unsigned int uiWorkers;
+    atomic_int iRefs;
+    atomic_bool bStop;
+    pthread_mutex_t Mutex;                  // injection queue and sleeping workers
+    pthread_cond_t WorkCond;
+    POOL_TASK** apInject;
+    unsigned long ulInjectHead, ulInjectSize;
+    atomic_ulong ulInjected;
+    atomic_uint uiEpoch, uiSleeping;
+};
+
+static _Thread_local POOL_WORKER* pCurrentWorker;
+
+static TASK_POOL* pSharedPool;
+static pthread_mutex_t SharedMutex = PTHREAD_MUTEX_INITIALIZER;
+
+static bool deque_push(POOL_DEQUE* d, POOL_TASK* pTask)
+{
+    long long b = atomic_load_explicit(&d->llBottom, memory_order_relaxed);
+    long long t = atomic_load_explicit(&d->llTop, memory_order_acquire);
+
+    if (b - t >= POOL_DEQUE_TASKS) return false;
+    atomic_store_explicit(&d->apTasks[b & (POOL_DEQUE_TASKS - 1)], pTask, memory_order_relaxed);
+    atomic_store_explicit(&d->llBottom, b + 1, memory_order_release);
+    return true;
+}
+
+static POOL_TASK* deque_take(POOL_DEQUE* d)
+{
+    long long b = atomic_load_explicit(&d->llBottom, memory_order_relaxed) - 1;
+    long long t;
+    POOL_TASK* pTask = NULL;
+
+    atomic_store_explicit(&d->llBottom, b, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    t = atomic_load_explicit(&d->llTop, memory_order_relaxed);
+    if (t <= b)
+    {
+        pTask = atomic_load_explicit(&d->apTasks[b & (POOL_DEQUE_TASKS - 1)], memory_order_relaxed);
+        // The last task may be stolen at the same time
+        if (t == b)
+        {
+            if (!atomic_compare_exchange_strong_explicit(&d->llTop, &t, t + 1, memory_order_seq_cst, memory_order_relaxed)) pTask = NULL;
+            atomic_store_explicit(&d->llBottom, b + 1, memory_order_relaxed);
+        }
+    }
+    else atomic_store_explicit(&d->llBottom, b + 1, memory_order_relaxed);
+    return pTask;
+}
+
+// NULL when empty or when another thief won
+static POOL_TASK* deque_steal(POOL_DEQUE* d)
+{
+    long long t = atomic_load_explicit(&d->llTop, memory_order_acquire);
+    long long b;
+    POOL_TASK* pTask;
+
+    atomic_thread_fence(memory_order_seq_cst);
+    b = atomic_load_explicit(&d->llBottom, memory_order_acquire);
+    if (t >= b) return NULL;
+    pTask = atomic_load_explicit(&d->apTasks[t & (POOL_DEQUE_TASKS - 1)], memory_order_relaxed);
+    if (!atomic_compare_exchange_strong_explicit(&d->llTop, &t, t + 1, memory_order_seq_cst, memory_order_relaxed)) return NULL;
+    return pTask;
+}
+
+static void wake_workers(TASK_POOL* pPool, bool bAll)
+{
+    atomic_fetch_add(&pPool->uiEpoch, 1);
+    if (!atomic_load(&pPool->uiSleeping)) return;
+    pthread_mutex_lock(&pPool->Mutex);
+    if (bAll) pthread_cond_broadcast(&pPool->WorkCond);
+    else pthread_cond_signal(&pPool->WorkCond);
+    pthread_mutex_unlock(&pPool->Mutex);
+}
+
+static int inject(TASK_POOL* pPool, POOL_TASK* pTask)
+{
+    unsigned long ulCount;
+
+    pthread_mutex_lock(&pPool->Mutex);
+    ulCount = atomic_load(&pPool->ulInjected);
+    if (ulCount == pPool->ulInjectSize)
+    {
+        unsigned long ulSize = pPool->ulInjectSize ? pPool->ulInjectSize * 2 : 64, i;
+        POOL_TASK** a = malloc(ulSize * sizeof(POOL_TASK*));
+
+        if (!a)
+        {
+            pthread_mutex_unlock(&pPool->Mutex);
+            return -1;
+        }
+        for (i = 0; i < ulCount; i++) a[i] = pPool->apInject[(pPool->ulInjectHead + i) % pPool->ulInjectSize];
+        free(pPool->apInject);
+        pPool->apInject = a;
+        pPool->ulInjectHead = 0;
+        pPool->ulInjectSize = ulSize;
+    }
+    pPool->apInject[(pPool->ulInjectHead + ulCount) % pPool->ulInjectSize] = pTask;
+    atomic_store(&pPool->ulInjected, ulCount + 1);
+    pthread_mutex_unlock(&pPool->Mutex);
+    wake_workers(pPool, false);
+    return 0;
+}
+
+static POOL_TASK* take_injected(TASK_POOL* pPool)
+{
+    POOL_TASK* pTask = NULL;
+
+    if (!atomic_load_explicit(&pPool->ulInjected, memory_order_relaxed)) return NULL;
+    pthread_mutex_lock(&pPool->Mutex);
+    if (atomic_load(&pPool->ulInjected))
+    {
+        pTask = pPool->apInject[pPool->ulInjectHead];
+        pPool->ulInjectHead = (pPool->ulInjectHead + 1) % pPool->ulInjectSize;
+        atomic_fetch_sub(&pPool->ulInjected, 1);
+    }
+    pthread_mutex_unlock(&pPool->Mutex);
+    return pTask;
+}
+
+static POOL_TASK* find_task(POOL_WORKER* pWorker)
+{
+    TASK_POOL* pPool = pWorker->pPool;
+    POOL_TASK* pTask;
+    unsigned int i;
+
+    if ((pTask = deque_take(&pWorker->Deque)) != NULL) return pTask;
+    for (i = 0; i + 1 < pPool->uiWorkers; i++)
+        if ((pTask = deque_steal(&pPool->aWorkers[pWorker->auiVictims[i]].Deque)) != NULL) return pTask;
+    return take_injected(pPool);
+}
+
+// The group mutex is held for the decrement so a waiter cannot free the group under the last completion
+static void complete(POOL_GROUP* pGroup)
+{
+    pthread_mutex_lock(&pGroup->Mutex);
+    if (atomic_fetch_sub(&pGroup->ulPending, 1) == 1) pthread_cond_broadcast(&pGroup->DoneCond);
+    pthread_mutex_unlock(&pGroup->Mutex);
+}
+
+static void run_range(POOL_WORKER* pWorker, POOL_TASK* pTask)
+{
+    unsigned long ulBegin = pTask->ulBegin, ulEnd = pTask->ulEnd, ulGrain = pTask->ulGrain;
+
+    while (ulEnd - ulBegin > ulGrain)
+    {
+        unsigned long ulMid = ulBegin + (ulEnd - ulBegin) / ulGrain / 2 * ulGrain;
+        POOL_TASK* pSplit;
+
+        if (ulMid == ulBegin) ulMid += ulGrain;
+        if (!(pSplit = malloc(sizeof(POOL_TASK)))) break;
+        *pSplit = *pTask;
+        pSplit->ulBegin = ulMid;
+        pSplit->ulEnd = ulEnd;
+        atomic_fetch_add(&pTask->pGroup->ulPending, 1);
+        if (!deque_push(&pWorker->Deque, pSplit))
+        {
+            atomic_fetch_sub(&pTask->pGroup->ulPending, 1);
+            free(pSplit);
+            break;
+        }
+        wake_workers(pWorker->pPool, false);
+        ulEnd = ulMid;
+    }
+    // Whatever could not be split off runs here one grain at a time
+    for (; ulBegin < ulEnd; ulBegin += ulGrain)
+        pTask->pfnRange(pTask->pArg, ulBegin, ulEnd - ulBegin < ulGrain ? ulEnd : ulBegin + ulGrain, pWorker->uiIndex);
+}
+
+static void run_task(POOL_WORKER* pWorker, POOL_TASK* pTask)
+{
+    POOL_GROUP* pGroup = pTask->pGroup;
+
+    if (pTask->pfnRange) run_range(pWorker, pTask);
+    else pTask->pfnTask(pTask->pArg, pWorker->uiIndex);
+    free(pTask);
+    complete(pGroup);
+}
+
+static void* pool_worker(void* pArg)
+{
+    POOL_WORKER* pWorker = pArg;
+    TASK_POOL* pPool = pWorker->pPool;
+    int iSpin = 0;
+
+    if (pWorker->iCpu >= 0)
+    {
+        cpu_set_t set;
+
+        CPU_ZERO(&set);
+        CPU_SET(pWorker->iCpu, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+    pCurrentWorker = pWorker;
+    while (true)
+    {
+        unsigned int uiEpoch = atomic_load(&pPool->uiEpoch);
+        POOL_TASK* pTask = find_task(pWorker);
+
+        if (pTask)
+        {
+            run_task(pWorker, pTask);
+            iSpin = 0;
+            continue;
+        }
+        if (atomic_load(&pPool->bStop)) break;
+        if (++iSpin < POOL_SPIN) continue;
+
+        // Sleeps only if nothing was queued since the search began; queuing bumps the epoch before checking for sleepers
+        pthread_mutex_lock(&pPool->Mutex);
+        atomic_fetch_add(&pPool->uiSleeping, 1);
+        if (atomic_load(&pPool->uiEpoch) == uiEpoch && !atomic_load(&pPool->bStop)) pthread_cond_wait(&pPool->WorkCond, &pPool->Mutex);
+        atomic_fetch_sub(&pPool->uiSleeping, 1);
+        pthread_mutex_unlock(&pPool->Mutex);
+        iSpin = 0;
+    }
+    return NULL;
+}
+
+static void parse_cpu_list(const char* p, cpu_set_t* pSet)
+{
+    while (*p)
+    {
+        char* pEnd;
+        long lFirst = strtol(p, &pEnd, 10), lLast = lFirst;
+
+        if (pEnd == p) break;
+        if (*pEnd == '-') lLast = strtol(pEnd + 1, &pEnd, 10);
+        for (; lFirst <= lLast && lFirst < CPU_SETSIZE; lFirst++) CPU_SET((int)lFirst, pSet);
+        p = *pEnd == ',' ? pEnd + 1 : pEnd;
+    }
+}
+
+static int cpu_node(int iCpu)
+{
+    char szPath[64], szList[1024];
+    int iNode;
+
+    for (iNode = 0; iNode < POOL_MAX_NODES; iNode++)
+    {
+        FILE* fp;
+        cpu_set_t set;
+
+        snprintf(szPath, sizeof(szPath), "/sys/devices/system/node/node%d/cpulist", iNode);
+        if (!(fp = fopen(szPath, "r"))) continue;
+        CPU_ZERO(&set);
+        if (fgets(szList, sizeof(szList), fp)) parse_cpu_list(szList, &set);
+        fclose(fp);
+        if (CPU_ISSET(iCpu, &set)) return iNode;
+    }
+    return -1;
+}
+
+// Pins the workers and orders every worker's victims by node, nearest first
+static void place_workers(TASK_POOL* pPool, int iPlacement)
+{
+    unsigned int i, j, n;
+
+    for (i = 0; i < pPool->uiWorkers; i++)
+    {
+        pPool->aWorkers[i].iCpu = -1;
+        pPool->aWorkers[i].iNode = -1;
+    }
+    if (iPlacement != POOL_PLACE_NONE)
+    {
+        int aiCpu[CPU_SETSIZE], aiNode[CPU_SETSIZE], aiOrder[CPU_SETSIZE];
+        unsigned int uiCpus = 0, uiOrder = 0;
+        cpu_set_t set;
+        int iNode, iRound;
+
+        if (sched_getaffinity(0, sizeof(set), &set) != 0) return;
+        for (i = 0; i < CPU_SETSIZE; i++)
+            if (CPU_ISSET(i, &set))
+            {
+                aiCpu[uiCpus] = (int)i;
+                aiNode[uiCpus++] = cpu_node((int)i);
+            }
+        if (!uiCpus) return;
+        if (iPlacement == POOL_PLACE_COMPACT)
+        {
+            for (iNode = -1; iNode < POOL_MAX_NODES; iNode++)
+                for (i = 0; i < uiCpus; i++)
+                    if (aiNode[i] == iNode) aiOrder[uiOrder++] = (int)i;
+        }
+        else
+        {
+            // Round r takes the r-th core of every node
+            for (iRound = 0; uiOrder < uiCpus; iRound++)
+                for (iNode = -1; iNode < POOL_MAX_NODES; iNode++)
+                {
+                    int iSeen = 0;
+                    for (i = 0; i < uiCpus; i++)
+                        if (aiNode[i] == iNode && iSeen++ == iRound)
+                        {
+                            aiOrder[uiOrder++] = (int)i;
+                            break;
+                        }
+                }
+        }
+        for (i = 0; i < pPool->uiWorkers; i++)
+        {
+            pPool->aWorkers[i].iCpu = aiCpu[aiOrder[i % uiCpus]];
+            pPool->aWorkers[i].iNode = aiNode[aiOrder[i % uiCpus]];
+        }
+    }
+    for (i = 0; i < pPool->uiWorkers; i++)
+    {
+        POOL_WORKER* pWorker = &pPool->aWorkers[i];
+
+        n = 0;
+        for (j = 1; j < pPool->uiWorkers; j++)
+        {
+            unsigned int v = (i + j) % pPool->uiWorkers;
+            if (pPool->aWorkers[v].iNode == pWorker->iNode) pWorker->auiVictims[n++] = v;
+        }
+        for (j = 1; j < pPool->uiWorkers; j++)
+        {
+            unsigned int v = (i + j) % pPool->uiWorkers;
+            if (pPool->aWorkers[v].iNode != pWorker->iNode) pWorker->auiVictims[n++] = v;
+        }
+    }
+}
+
+static unsigned int allowed_cores(void)
+{
+    cpu_set_t set;
+    long n;
+
+    if (sched_getaffinity(0, sizeof(set), &set) == 0 && CPU_COUNT(&set) > 0) return (unsigned int)CPU_COUNT(&set);
+    n = sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (unsigned int)n : 1;
+}
+
+static void destroy_pool(TASK_POOL* pPool)
+{
+    unsigned int i;
+
+    pthread_mutex_lock(&pPool->Mutex);
+    atomic_store(&pPool->bStop, true);
+    pthread_cond_broadcast(&pPool->WorkCond);
+    pthread_mutex_unlock(&pPool->Mutex);
+    for (i = 0; pPool->aWorkers && i < pPool->uiWorkers; i++)
+    {
+        if (pPool->aWorkers[i].bStarted) pthread_join(pPool->aWorkers[i].Thread, NULL);
+        free(pPool->aWorkers[i].Deque.apTasks);
+        free(pPool->aWorkers[i].auiVictims);
+    }
+    free(pPool->aWorkers);
+    free(pPool->apInject);
+    pthread_mutex_destroy(&pPool->Mutex);
+    pthread_cond_destroy(&pPool->WorkCond);
+    free(pPool);
+}
+
+TASK_POOL* pool_create(const PoolConfig* pConfig)
+{
+    TASK_POOL* pPool;
+    PoolConfig pc;
+    unsigned int i;
+
+    if (pConfig) pc = *pConfig;
+    else memset(&pc, 0, sizeof(pc));
+    if (!(pPool = calloc(1, sizeof(TASK_POOL)))) return NULL;
+    pthread_mutex_init(&pPool->Mutex, NULL);
+    pthread_cond_init(&pPool->WorkCond, NULL);
+    atomic_store(&pPool->iRefs, 1);
+    pPool->uiWorkers = pc.uiThreads ? pc.uiThreads : allowed_cores();
+    if (pPool->uiWorkers > POOL_MAX_THREADS) pPool->uiWorkers = POOL_MAX_THREADS;
+    if (!(pPool->aWorkers = calloc(pPool->uiWorkers, sizeof(POOL_WORKER))))
+    {
+        destroy_pool(pPool);
+        return NULL;
+    }
+    for (i = 0; i < pPool->uiWorkers; i++)
+    {
+        POOL_WORKER* pWorker = &pPool->aWorkers[i];
+
+        pWorker->pPool = pPool;
+        pWorker->uiIndex = i;
+        if (!(pWorker->auiVictims = malloc(pPool->uiWorkers * sizeof(unsigned int))))
+        {
+            destroy_pool(pPool);
+            return NULL;
+        }
+    }
+    place_workers(pPool, pc.iPlacement);
+    for (i = 0; i < pPool->uiWorkers; i++)
+    {
+        POOL_WORKER* pWorker = &pPool->aWorkers[i];
+
+        // Only the owner writes its deque; thieves read a slot only after seeing it pushed
+        if (!(pWorker->Deque.apTasks = calloc(POOL_DEQUE_TASKS, sizeof(*pWorker->Deque.apTasks))) ||
+            pthread_create(&pWorker->Thread, NULL, pool_worker, pWorker) != 0)
+        {
+            destroy_pool(pPool);
+            return NULL;
+        }
+        pWorker->bStarted = true;
+    }
+    return pPool;
+}
+
+void pool_release(TASK_POOL* pPool)
+{
+    if (pPool && atomic_fetch_sub(&pPool->iRefs, 1) == 1) destroy_pool(pPool);
+}
+
+unsigned int pool_threads(TASK_POOL* pPool)
+{
+    return pPool->uiWorkers;
+}
+
+int pool_worker_cpu(TASK_POOL* pPool, unsigned int uiWorker)
+{
+    return uiWorker < pPool->uiWorkers ? pPool->aWorkers[uiWorker].iCpu : -1;
+}
+
+int pool_worker_node(TASK_POOL* pPool, unsigned int uiWorker)
+{
+    return uiWorker < pPool->uiWorkers ? pPool->aWorkers[uiWorker].iNode : -1;
+}
+
+TASK_POOL* pool_acquire(void)
+{
+    TASK_POOL* pPool;
+
+    pthread_mutex_lock(&SharedMutex);
+    if (!pSharedPool) pSharedPool = pool_create(NULL);
+    if ((pPool = pSharedPool) != NULL) atomic_fetch_add(&pPool->iRefs, 1);
+    pthread_mutex_unlock(&SharedMutex);
+    return pPool;
+}
+
+// Operations already running keep their reference to the old pool
+static void replace_shared(TASK_POOL* pPool)
+{
+    TASK_POOL* pOld;
+
+    pthread_mutex_lock(&SharedMutex);
+    pOld = pSharedPool;
+    pSharedPool = pPool;
+    pthread_mutex_unlock(&SharedMutex);
+    pool_release(pOld);
+}
+
+int start_pool(const PoolConfig* pConfig)
+{
+    TASK_POOL* pPool = pool_create(pConfig);
+
+    if (!pPool) return -1;
+    replace_shared(pPool);
+    return 0;
+}
+
+int share_pool(TASK_POOL* pPool)
+{
+    if (!pPool) return -1;
+    atomic_fetch_add(&pPool->iRefs, 1);
+    replace_shared(pPool);
+    return 0;
+}
+
+void stop_pool(void)
+{
+    replace_shared(NULL);
+}
+
+POOL_GROUP* pool_group_new(TASK_POOL* pPool)
+{
+    POOL_GROUP* pGroup;
+
+    if (!(pGroup = calloc(1, sizeof(POOL_GROUP)))) return NULL;
+    pGroup->pPool = pPool;
+    pthread_mutex_init(&pGroup->Mutex, NULL);
+    pthread_cond_init(&pGroup->DoneCond, NULL);
+    return pGroup;
+}
+
+static int queue_task(POOL_GROUP* pGroup, POOL_TASK* pTask)
+{
+    POOL_WORKER* pWorker = pCurrentWorker;
+
+    atomic_fetch_add(&pGroup->ulPending, 1);
+    if (pWorker && pWorker->pPool == pGroup->pPool && deque_push(&pWorker->Deque, pTask))
+    {
+        wake_workers(pGroup->pPool, false);
+        return 0;
+    }
+    if (inject(pGroup->pPool, pTask) == 0) return 0;
+    atomic_fetch_sub(&pGroup->ulPending, 1);
+    return -1;
+}
+
+int pool_submit(POOL_GROUP* pGroup, PoolTask pfnTask, void* pArg)
+{
+    POOL_TASK* pTask;
+
+    if (!(pTask = calloc(1, sizeof(POOL_TASK)))) return -1;
+    pTask->pfnTask = pfnTask;
+    pTask->pArg = pArg;
+    pTask->pGroup = pGroup;
+    if (queue_task(pGroup, pTask) == 0) return 0;
+    free(pTask);
+    return -1;
+}
+
+void pool_group_wait(POOL_GROUP* pGroup)
+{
+    POOL_WORKER* pWorker = pCurrentWorker;
+
+    // A worker blocking here could starve its own group, so it keeps running tasks
+    if (pWorker && pWorker->pPool == pGroup->pPool)
+        while (atomic_load(&pGroup->ulPending))
+        {
+            POOL_TASK* pTask = find_task(pWorker);
+            if (pTask) run_task(pWorker, pTask);
+            else yield_thread();
+        }
+    pthread_mutex_lock(&pGroup->Mutex);
+    while (atomic_load(&pGroup->ulPending)) pthread_cond_wait(&pGroup->DoneCond, &pGroup->Mutex);
+    pthread_mutex_unlock(&pGroup->Mutex);
+}
+
+void pool_group_free(POOL_GROUP* pGroup)
+{
+    if (!pGroup) return;
+    pool_group_wait(pGroup);
+    pthread_mutex_destroy(&pGroup->Mutex);
+    pthread_cond_destroy(&pGroup->DoneCond);
+    free(pGroup);
+}
+
+unsigned long pool_grain(size_t ulItemBytes)
+{
+    static atomic_ulong ulL2;
+    unsigned long ulBytes = atomic_load(&ulL2);
+
+    if (!ulBytes)
+    {
+#if defined(_SC_LEVEL2_CACHE_SIZE)
+        long n = sysconf(_SC_LEVEL2_CACHE_SIZE);
+        ulBytes = n > 0 ? (unsigned long)n : POOL_DEFAULT_L2;
+#else
+        ulBytes = POOL_DEFAULT_L2;
+#endif
+        atomic_store(&ulL2, ulBytes);
+    }
+    // Half the cache, the rest is left to the output and the code
+    ulBytes /= 2;
+    return ulItemBytes && ulBytes > ulItemBytes ? (unsigned long)(ulBytes / ulItemBytes) : 1;
+}
+
+int pool_for(TASK_POOL* pPool, unsigned long ulCount, unsigned long ulGrain, PoolRange pfnRange, void* pArg)
+{
+    POOL_GROUP* pGroup;
+    POOL_TASK* pTask;
+    int rc = 0;
+
+    if (!ulCount) return 0;
+    if (!(pGroup = pool_group_new(pPool))) return -1;
+    if (!(pTask = calloc(1, sizeof(POOL_TASK)))) rc = -1;
+    else
+    {
+        pTask->pfnRange = pfnRange;
+        pTask->pArg = pArg;
+        pTask->ulEnd = ulCount;
+        pTask->ulGrain = ulGrain ? ulGrain : 1;
+        pTask->pGroup = pGroup;
+        if ((rc = queue_task(pGroup, pTask)) != 0) free(pTask);
+    }
+    pool_group_free(pGroup);
+    return rc;
+}
+
+// Single samples and short blocks never start the pool
+void pool_batch(unsigned long ulCount, size_t ulItemBytes, PoolRange pfnRange, void* pArg)
+{
+    unsigned long ulGrain = pool_grain(ulItemBytes);
+    TASK_POOL* pPool;
+
+    if (ulCount < 2 * ulGrain || !(pPool = pool_acquire()))
+    {
+        pfnRange(pArg, 0, ulCount, 0);
+        return;
+    }
+    if (pool_for(pPool, ulCount, ulGrain, pfnRange, pArg) != 0) pfnRange(pArg, 0, ulCount, 0);
+    pool_release(pPool);
+}
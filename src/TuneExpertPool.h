@@ -0,0 +1,57 @@
+﻿// TuneExpertPool.h: Shared work-stealing task pool for batch processing of captures
+//
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define POOL_MAX_THREADS 256
+#define POOL_DEQUE_TASKS 4096               // tasks queued per worker, further splits run inline
+
+// Where the workers run; NUMA nodes come from sysfs and only cores in the process affinity mask are used
+enum E_POOL_PLACEMENT
+{
+    POOL_PLACE_NONE,                        // not pinned
+    POOL_PLACE_COMPACT,                     // one core each, filling a NUMA node before the next
+    POOL_PLACE_SCATTER                      // one core each, round robin over the NUMA nodes
+};
+
+typedef struct {
+    unsigned int uiThreads;                 // 0 = one per allowed core
+    int iPlacement;                         // E_POOL_PLACEMENT
+} PoolConfig;
+
+// uiWorker is the index of the worker running the task, below pool_threads(), for per-worker scratch
+typedef void (*PoolTask)(void* pArg, unsigned int uiWorker);
+typedef void (*PoolRange)(void* pArg, unsigned long ulBegin, unsigned long ulEnd, unsigned int uiWorker);
+
+typedef struct TASK_POOL TASK_POOL;
+typedef struct POOL_GROUP POOL_GROUP;
+
+TASK_POOL* pool_create(const PoolConfig* pConfig);
+void pool_release(TASK_POOL* pPool);                    // the last reference joins the workers
+unsigned int pool_threads(TASK_POOL* pPool);
+int pool_worker_cpu(TASK_POOL* pPool, unsigned int uiWorker);   // -1 when not pinned
+int pool_worker_node(TASK_POOL* pPool, unsigned int uiWorker);  // -1 when not pinned or unknown
+
+// The library pool that batch operations run on, started with the defaults on first use.
+// start_pool resizes it, share_pool hands it a pool of the host application so both share the cores.
+TASK_POOL* pool_acquire(void);
+int start_pool(const PoolConfig* pConfig);
+int share_pool(TASK_POOL* pPool);
+void stop_pool(void);
+
+POOL_GROUP* pool_group_new(TASK_POOL* pPool);
+int pool_submit(POOL_GROUP* pGroup, PoolTask pfnTask, void* pArg);
+void pool_group_wait(POOL_GROUP* pGroup);               // a worker waiting runs other tasks meanwhile
+void pool_group_free(POOL_GROUP* pGroup);               // waits for the group first
+
+// Items of ulItemBytes per chunk that stay in a core's L2 cache
+unsigned long pool_grain(size_t ulItemBytes);
+// Runs pfnRange over [0, ulCount) in chunks of ulGrain items (0 = 1), split lazily so idle workers steal
+// the largest remaining ranges. Returns once every chunk ran, -1 if nothing could be queued.
+int pool_for(TASK_POOL* pPool, unsigned long ulCount, unsigned long ulGrain, PoolRange pfnRange, void* pArg);
+// pool_for on the library pool with pool_grain(ulItemBytes) chunks for batches of several grains; smaller
+// ones, and any the pool cannot take, run inline on the calling thread as worker 0
+void pool_batch(unsigned long ulCount, size_t ulItemBytes, PoolRange pfnRange, void* pArg);
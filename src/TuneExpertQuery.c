@@ -0,0 +1,561 @@
+﻿// TuneExpertQuery.c: Chunk summary pyramid and window aggregate queries
+//
+// Node j of level k summarises capture chunks [j << k, (j + 1) << k). A window covers the chunks lying wholly
+// inside it with at most two nodes per level and decodes only the chunks straddling its edges, so the cost of
+// a window grows with the log of its length. Moments are merged with Chan's formula to stay exact in doubles.
+
+#include "TuneExpertQuery.h"
+#include "TuneExpertPool.h"
+#include <stdatomic.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#define file_seek fseeko
+
+#define QUERY_CACHE_NODES 32                // nodes read at once per level
+#define QUERY_BUILD_BATCH 4096              // chunks summarised in parallel by summary_build
+
+struct SUMMARY_BUILDER {
+    SUMMARY_NODE* apLevel[SUMMARY_LEVELS];
+    unsigned long aulCount[SUMMARY_LEVELS], aulSize[SUMMARY_LEVELS];
+    int iError;
+};
+
+struct QUERY_READER {
+    CAPTURE_READER* pCapture;
+    const CAPTURE_INDEX_ENTRY* pIndex;
+    unsigned long ulEntries;
+    FILE* fp;                               // NULL without a usable sidecar
+    SUMMARY_FILE_HEADER Header;
+    unsigned long long aullOffset[SUMMARY_LEVELS];
+    SUMMARY_NODE aaCache[SUMMARY_LEVELS][QUERY_CACHE_NODES];
+    unsigned long long aullCacheBase[SUMMARY_LEVELS];
+    unsigned long aulCacheCount[SUMMARY_LEVELS];
+    RawSample aChunk[CAPTURE_CHUNK_SAMPLES];
+    unsigned long ulChunk;                  // chunk held in aChunk, ULONG_MAX for none
+    long lChunkCount;
+    double dComp;                           // factor adScale converts with, NaN before the first chunk
+    double adScale[QUERY_CHANNELS], adOffset[QUERY_CHANNELS];
+};
+
+static const unsigned int auiComparatorBits[QUERY_COMPARATORS] = {
+    N1231B_LT_TRUE_1, N1231B_GE_TRUE_1, N1231B_LT_TRUE_2, N1231B_GE_TRUE_2,
+    N1231B_LT_TRUE_3A, N1231B_GE_TRUE_3A, N1231B_LT_TRUE_3B, N1231B_GE_TRUE_3B
+};
+
+// One pass with sums shifted by the first sample, which keeps the variance accurate for large counts
+static void summarise(const RawSample* pSamples, unsigned long ulCount, SUMMARY_NODE* pNode)
+{
+    long long allRef[QUERY_CHANNELS], allMin[QUERY_CHANNELS], allMax[QUERY_CHANNELS];
+    double adSum[QUERY_CHANNELS] = { 0 }, adSq[QUERY_CHANNELS] = { 0 };
+    unsigned long i;
+    int c;
+
+    memset(pNode, 0, sizeof(SUMMARY_NODE));
+    if (ulCount == 0) return;
+    pNode->llFirstTime = pSamples[0].llTime;
+    pNode->llLastTime = pSamples[ulCount - 1].llTime;
+    pNode->ullCount = ulCount;
+    allRef[QUERY_AX1_POS] = pSamples[0].llAx1Pos;
+    allRef[QUERY_AX2_POS] = pSamples[0].llAx2Pos;
+    allRef[QUERY_AX3_POS] = pSamples[0].llAx3Pos;
+    allRef[QUERY_AX1_VEL] = pSamples[0].lAx1Vel;
+    allRef[QUERY_AX2_VEL] = pSamples[0].lAx2Vel;
+    allRef[QUERY_AX3_VEL] = pSamples[0].lAx3Vel;
+    for (c = 0; c < QUERY_CHANNELS; c++) allMin[c] = allMax[c] = allRef[c];
+
+    for (i = 0; i < ulCount; i++)
+    {
+        const RawSample* p = &pSamples[i];
+        const long long allValue[QUERY_CHANNELS] = { p->llAx1Pos, p->llAx2Pos, p->llAx3Pos, p->lAx1Vel, p->lAx2Vel, p->lAx3Vel };
+        unsigned short wValid = p->wValid;
+
+        for (c = 0; c < QUERY_CHANNELS; c++)
+        {
+            double d = (double)(allValue[c] - allRef[c]);
+            if (allValue[c] < allMin[c]) allMin[c] = allValue[c];
+            if (allValue[c] > allMax[c]) allMax[c] = allValue[c];
+            adSum[c] += d;
+            adSq[c] += d * d;
+        }
+        if (!(wValid & N1231B_VALID_1)) pNode->aullInvalid[QUERY_INVALID_1]++;
+        if (!(wValid & N1231B_VALID_2)) pNode->aullInvalid[QUERY_INVALID_2]++;
+        if (!(wValid & N1231B_VALID_3)) pNode->aullInvalid[QUERY_INVALID_3]++;
+        if ((wValid & (N1231B_VALID_1 | N1231B_VALID_2 | N1231B_VALID_3)) != (N1231B_VALID_1 | N1231B_VALID_2 | N1231B_VALID_3))
+            pNode->aullInvalid[QUERY_INVALID_ANY]++;
+        if (p->uiGeLtStatus)
+            for (c = 0; c < QUERY_COMPARATORS; c++)
+                if (p->uiGeLtStatus & auiComparatorBits[c]) pNode->aullComparator[c]++;
+    }
+    for (c = 0; c < QUERY_CHANNELS; c++)
+    {
+        SUMMARY_CHANNEL* ch = &pNode->aChannel[c];
+
+        ch->llMin = allMin[c];
+        ch->llMax = allMax[c];
+        ch->dMean = (double)allRef[c] + adSum[c] / ulCount;
+        ch->dM2 = adSq[c] - adSum[c] * adSum[c] / ulCount;
+        if (ch->dM2 < 0) ch->dM2 = 0;
+    }
+}
+
+// Combines the moments of two sample sets of nA and nB samples
+static void merge_moments(double* pdMean, double* pdM2, double nA, double dMeanB, double dM2B, double nB)
+{
+    double dDelta = dMeanB - *pdMean;
+    double n = nA + nB;
+
+    *pdMean += dDelta * nB / n;
+    *pdM2 += dM2B + dDelta * dDelta * nA * nB / n;
+}
+
+static void merge(SUMMARY_NODE* pTo, const SUMMARY_NODE* pFrom)
+{
+    int c;
+
+    for (c = 0; c < QUERY_CHANNELS; c++)
+    {
+        SUMMARY_CHANNEL* ch = &pTo->aChannel[c];
+        const SUMMARY_CHANNEL* from = &pFrom->aChannel[c];
+
+        if (from->llMin < ch->llMin) ch->llMin = from->llMin;
+        if (from->llMax > ch->llMax) ch->llMax = from->llMax;
+        merge_moments(&ch->dMean, &ch->dM2, (double)pTo->ullCount, from->dMean, from->dM2, (double)pFrom->ullCount);
+    }
+    for (c = 0; c < QUERY_INVALID_COUNTS; c++) pTo->aullInvalid[c] += pFrom->aullInvalid[c];
+    for (c = 0; c < QUERY_COMPARATORS; c++) pTo->aullComparator[c] += pFrom->aullComparator[c];
+    pTo->llLastTime = pFrom->llLastTime;
+    pTo->ullCount += pFrom->ullCount;
+}
+
+static void push(SUMMARY_BUILDER* pSum, int iLevel, const SUMMARY_NODE* pNode)
+{
+    SUMMARY_NODE up;
+
+    if (iLevel >= SUMMARY_LEVELS) return;
+    if (pSum->aulCount[iLevel] == pSum->aulSize[iLevel])
+    {
+        unsigned long ulSize = pSum->aulSize[iLevel] ? pSum->aulSize[iLevel] * 2 : 64;
+        SUMMARY_NODE* a = realloc(pSum->apLevel[iLevel], ulSize * sizeof(SUMMARY_NODE));
+        if (!a)
+        {
+            pSum->iError = -1;
+            return;
+        }
+        pSum->apLevel[iLevel] = a;
+        pSum->aulSize[iLevel] = ulSize;
+    }
+    pSum->apLevel[iLevel][pSum->aulCount[iLevel]++] = *pNode;
+
+    if (pSum->aulCount[iLevel] % 2 == 0)
+    {
+        up = pSum->apLevel[iLevel][pSum->aulCount[iLevel] - 2];
+        merge(&up, pNode);
+        push(pSum, iLevel + 1, &up);
+    }
+}
+
+SUMMARY_BUILDER* summary_new(void)
+{
+    return calloc(1, sizeof(SUMMARY_BUILDER));
+}
+
+void summary_free(SUMMARY_BUILDER* pSum)
+{
+    int i;
+
+    if (!pSum) return;
+    for (i = 0; i < SUMMARY_LEVELS; i++) free(pSum->apLevel[i]);
+    free(pSum);
+}
+
+void summary_add(SUMMARY_BUILDER* pSum, const RawSample* pSamples, unsigned long ulCount)
+{
+    SUMMARY_NODE node;
+
+    summarise(pSamples, ulCount, &node);
+    push(pSum, 0, &node);
+}
+
+// Carries the odd last node of every level up, so level k holds ceil(chunks / 2^k) nodes
+int summary_save(SUMMARY_BUILDER* pSum, const char* pPath)
+{
+    SUMMARY_FILE_HEADER hdr;
+    FILE* fp;
+    int i, rc = 0;
+
+    for (i = 0; i + 1 < SUMMARY_LEVELS && pSum->aulCount[i] > 1; i++)
+        if (pSum->aulCount[i] % 2) push(pSum, i + 1, &pSum->apLevel[i][pSum->aulCount[i] - 1]);
+    if (pSum->iError) return -1;
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.szMagic, SUMMARY_MAGIC, sizeof(SUMMARY_MAGIC));
+    hdr.uiVersion = SUMMARY_VERSION;
+    for (i = 0; i < SUMMARY_LEVELS && pSum->aulCount[i]; i++) hdr.aullCount[i] = pSum->aulCount[i];
+    hdr.uiLevels = i;
+
+    if (!(fp = fopen(pPath, "wb"))) return -1;
+    if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1) rc = -1;
+    for (i = 0; rc == 0 && i < (int)hdr.uiLevels; i++)
+        if (fwrite(pSum->apLevel[i], sizeof(SUMMARY_NODE), pSum->aulCount[i], fp) != pSum->aulCount[i]) rc = -1;
+    if (fclose(fp) != 0) rc = -1;
+    return rc;
+}
+
+// Chunks are summarised on the pool QUERY_BUILD_BATCH at a time and pushed up the pyramid in order
+typedef struct {
+    CAPTURE_READER* pSource;
+    CAPTURE_READER** apReader;              // per pool worker
+    RawSample** apBuf;
+    SUMMARY_NODE* aNodes;
+    unsigned long ulBase;
+    atomic_int iError;
+} SUMMARY_JOB;
+
+static void summarise_chunks(void* pArg, unsigned long ulBegin, unsigned long ulEnd, unsigned int uiWorker)
+{
+    SUMMARY_JOB* pJob = pArg;
+    CAPTURE_READER** ppReader = &pJob->apReader[uiWorker];
+    RawSample** ppBuf = &pJob->apBuf[uiWorker];
+
+    if ((!*ppReader && !(*ppReader = capture_dup_read(pJob->pSource))) ||
+        (!*ppBuf && !(*ppBuf = malloc(CAPTURE_CHUNK_SAMPLES * sizeof(RawSample)))))
+    {
+        atomic_store(&pJob->iError, -1);
+        return;
+    }
+    for (; ulBegin < ulEnd; ulBegin++)
+    {
+        long n = capture_read_chunk(*ppReader, pJob->ulBase + ulBegin, *ppBuf);
+        if (n < 0) atomic_store(&pJob->iError, -1);
+        else summarise(*ppBuf, n, &pJob->aNodes[ulBegin]);
+    }
+}
+
+int summary_build(const char* pCapturePath)
+{
+    char szPath[CAPTURE_PATH_MAX + 8];
+    SUMMARY_JOB job;
+    TASK_POOL* pPool;
+    SUMMARY_BUILDER* pSum;
+    unsigned long ulEntries, ulCount, i;
+    int rc = 0;
+
+    snprintf(szPath, sizeof(szPath), "%s%s", pCapturePath, SUMMARY_SUFFIX);
+    memset(&job, 0, sizeof(job));
+    if (!(job.pSource = capture_open_read(pCapturePath))) return -1;
+    capture_index(job.pSource, &ulEntries);
+    pSum = summary_new();
+    if ((pPool = pool_acquire()) != NULL)
+    {
+        job.apReader = calloc(pool_threads(pPool), sizeof(CAPTURE_READER*));
+        job.apBuf = calloc(pool_threads(pPool), sizeof(RawSample*));
+    }
+    job.aNodes = malloc(QUERY_BUILD_BATCH * sizeof(SUMMARY_NODE));
+    if (!pSum || !pPool || !job.apReader || !job.apBuf || !job.aNodes) rc = -1;
+
+    for (; rc == 0 && job.ulBase < ulEntries; job.ulBase += ulCount)
+    {
+        ulCount = ulEntries - job.ulBase < QUERY_BUILD_BATCH ? ulEntries - job.ulBase : QUERY_BUILD_BATCH;
+        if (pool_for(pPool, ulCount, 1, summarise_chunks, &job) != 0 || atomic_load(&job.iError)) rc = -1;
+        for (i = 0; rc == 0 && i < ulCount; i++) push(pSum, 0, &job.aNodes[i]);
+    }
+    if (rc == 0) rc = summary_save(pSum, szPath);
+
+    for (i = 0; pPool && i < pool_threads(pPool); i++)
+    {
+        if (job.apReader) capture_close_read(job.apReader[i]);
+        if (job.apBuf) free(job.apBuf[i]);
+    }
+    free(job.apReader);
+    free(job.apBuf);
+    free(job.aNodes);
+    pool_release(pPool);
+    summary_free(pSum);
+    capture_close_read(job.pSource);
+    return rc;
+}
+
+QUERY_READER* query_open(const char* pCapturePath)
+{
+    char szPath[CAPTURE_PATH_MAX + 8];
+    QUERY_READER* pReader;
+    unsigned long long ullOffset = sizeof(SUMMARY_FILE_HEADER);
+    unsigned int i;
+
+    if (!(pReader = calloc(1, sizeof(QUERY_READER)))) return NULL;
+    if (!(pReader->pCapture = capture_open_read(pCapturePath)))
+    {
+        free(pReader);
+        return NULL;
+    }
+    pReader->pIndex = capture_index(pReader->pCapture, &pReader->ulEntries);
+    pReader->ulChunk = ULONG_MAX;
+    pReader->dComp = NAN;
+
+    // A sidecar that does not match the index (capture still growing, rebuilt index) is ignored
+    snprintf(szPath, sizeof(szPath), "%s%s", pCapturePath, SUMMARY_SUFFIX);
+    if ((pReader->fp = fopen(szPath, "rb")) &&
+        (fread(&pReader->Header, sizeof(pReader->Header), 1, pReader->fp) != 1 ||
+         memcmp(pReader->Header.szMagic, SUMMARY_MAGIC, sizeof(SUMMARY_MAGIC)) != 0 ||
+         pReader->Header.uiVersion != SUMMARY_VERSION || pReader->Header.uiLevels > SUMMARY_LEVELS ||
+         pReader->Header.aullCount[0] != pReader->ulEntries))
+    {
+        fclose(pReader->fp);
+        pReader->fp = NULL;
+    }
+    for (i = 0; pReader->fp && i < pReader->Header.uiLevels; i++)
+    {
+        pReader->aullOffset[i] = ullOffset;
+        ullOffset += pReader->Header.aullCount[i] * sizeof(SUMMARY_NODE);
+    }
+    return pReader;
+}
+
+void query_close(QUERY_READER* pReader)
+{
+    if (!pReader) return;
+    if (pReader->fp) fclose(pReader->fp);
+    capture_close_read(pReader->pCapture);
+    free(pReader);
+}
+
+static const SUMMARY_NODE* read_node(QUERY_READER* pReader, int iLevel, unsigned long long ullNode)
+{
+    unsigned long long ullBase = ullNode - ullNode % QUERY_CACHE_NODES;
+    unsigned long n;
+
+    if (pReader->aulCacheCount[iLevel] == 0 || ullBase != pReader->aullCacheBase[iLevel])
+    {
+        n = pReader->Header.aullCount[iLevel] - ullBase < QUERY_CACHE_NODES ?
+            (unsigned long)(pReader->Header.aullCount[iLevel] - ullBase) : QUERY_CACHE_NODES;
+        pReader->aulCacheCount[iLevel] = 0;
+        if (file_seek(pReader->fp, (long long)(pReader->aullOffset[iLevel] + ullBase * sizeof(SUMMARY_NODE)), SEEK_SET) != 0 ||
+            fread(pReader->aaCache[iLevel], sizeof(SUMMARY_NODE), n, pReader->fp) != n) return NULL;
+        pReader->aullCacheBase[iLevel] = ullBase;
+        pReader->aulCacheCount[iLevel] = n;
+    }
+    return &pReader->aaCache[iLevel][ullNode - ullBase];
+}
+
+static void clear_windows(QueryWindow* pWindows, unsigned long ulWindows, long long llStart, long long llWindowNs)
+{
+    unsigned long i;
+    int c;
+
+    memset(pWindows, 0, ulWindows * sizeof(QueryWindow));
+    for (i = 0; i < ulWindows; i++)
+    {
+        pWindows[i].llStartTime = llStart + (long long)i * llWindowNs;
+        pWindows[i].llEndTime = pWindows[i].llStartTime + llWindowNs;
+        for (c = 0; c < QUERY_CHANNELS; c++)
+        {
+            pWindows[i].aValue[c].dMin = INFINITY;
+            pWindows[i].aValue[c].dMax = -INFINITY;
+        }
+    }
+}
+
+// dRms holds the sum of squared deviations from dMean until finish_windows
+static void finish_windows(QueryWindow* pWindows, unsigned long ulWindows)
+{
+    unsigned long i;
+    int c;
+
+    for (i = 0; i < ulWindows; i++)
+        for (c = 0; c < QUERY_CHANNELS; c++)
+        {
+            QueryValue* v = &pWindows[i].aValue[c];
+            if (pWindows[i].ullSamples) v->dRms = sqrt(v->dMean * v->dMean + v->dRms / pWindows[i].ullSamples);
+            else v->dMean = v->dRms = v->dMin = v->dMax = NAN;
+        }
+}
+
+// Sets the conversion to the factor chunk ulChunk was recorded with
+static int use_chunk_comp(QUERY_READER* pReader, unsigned long ulChunk)
+{
+    const CAPTURE_FILE_HEADER* pHeader = capture_header(pReader->pCapture);
+    double dCompNum, dPos;
+    int i;
+
+    if (capture_chunk_comp(pReader->pCapture, ulChunk, &dCompNum) != 0) return -1;
+    if (dCompNum == pReader->dComp) return 0;
+    dPos = UM_PER_COUNT_AT(pHeader->dLambdaNm, pHeader->uiFold, dCompNum);
+    for (i = 0; i < 3; i++)
+    {
+        pReader->adScale[QUERY_AX1_POS + i] = dPos;
+        pReader->adOffset[QUERY_AX1_POS + i] = -START_MM * 1000;
+        pReader->adScale[QUERY_AX1_VEL + i] = UMPS_PER_COUNT(dPos);
+        pReader->adOffset[QUERY_AX1_VEL + i] = 0;
+    }
+    pReader->dComp = dCompNum;
+    return 0;
+}
+
+// Converts the node to um with the compensation its chunks were recorded with, so segments and stretches of a
+// capture recorded with different factors combine
+static void add_node(QUERY_READER* pReader, QueryWindow* pWindow, const SUMMARY_NODE* pNode)
+{
+    int c;
+
+    if (pNode->ullCount == 0) return;
+    for (c = 0; c < QUERY_CHANNELS; c++)
+    {
+        const SUMMARY_CHANNEL* ch = &pNode->aChannel[c];
+        QueryValue* v = &pWindow->aValue[c];
+        double a = pReader->adScale[c], b = pReader->adOffset[c];
+        double dLo = a * ch->llMin + b, dHi = a * ch->llMax + b;
+
+        if (a < 0)
+        {
+            double d = dLo;
+            dLo = dHi;
+            dHi = d;
+        }
+        if (dLo < v->dMin) v->dMin = dLo;
+        if (dHi > v->dMax) v->dMax = dHi;
+        merge_moments(&v->dMean, &v->dRms, (double)pWindow->ullSamples, a * ch->dMean + b, a * a * ch->dM2, (double)pNode->ullCount);
+    }
+    for (c = 0; c < QUERY_INVALID_COUNTS; c++) pWindow->aullInvalid[c] += pNode->aullInvalid[c];
+    for (c = 0; c < QUERY_COMPARATORS; c++) pWindow->aullComparator[c] += pNode->aullComparator[c];
+    pWindow->ullSamples += pNode->ullCount;
+}
+
+static int load_chunk(QUERY_READER* pReader, unsigned long ulChunk)
+{
+    if (pReader->ulChunk == ulChunk) return 0;
+    pReader->ulChunk = ULONG_MAX;
+    if ((pReader->lChunkCount = capture_read_chunk(pReader->pCapture, ulChunk, pReader->aChunk)) < 0) return -1;
+    pReader->ulChunk = ulChunk;
+    return 0;
+}
+
+// Decodes one chunk and adds its samples inside the window
+static int add_edge(QUERY_READER* pReader, QueryWindow* pWindow, unsigned long ulChunk)
+{
+    SUMMARY_NODE node;
+    long i, j;
+
+    if (load_chunk(pReader, ulChunk) != 0 || use_chunk_comp(pReader, ulChunk) != 0) return -1;
+    for (i = 0; i < pReader->lChunkCount && pReader->aChunk[i].llTime < pWindow->llStartTime; i++);
+    for (j = i; j < pReader->lChunkCount && pReader->aChunk[j].llTime < pWindow->llEndTime; j++);
+    summarise(pReader->aChunk + i, j - i, &node);
+    add_node(pReader, pWindow, &node);
+    return 0;
+}
+
+// Node ulNode of iLevel, or its children when the compensation changes inside it. Records only grow along the
+// index, so the node is uniform when its first and last chunks agree.
+static int add_tree_node(QUERY_READER* pReader, QueryWindow* pWindow, int iLevel, unsigned long ulNode)
+{
+    unsigned long ulFirst = ulNode << iLevel, ulLast = ((ulNode + 1) << iLevel) - 1;
+    const SUMMARY_NODE* pNode;
+
+    if (ulLast >= pReader->ulEntries) ulLast = pReader->ulEntries - 1;
+    if (iLevel > 0 && pReader->pIndex[ulFirst].uiComp != pReader->pIndex[ulLast].uiComp)
+    {
+        if (add_tree_node(pReader, pWindow, iLevel - 1, ulNode * 2) != 0) return -1;
+        if (((ulNode * 2 + 1) << (iLevel - 1)) >= pReader->ulEntries) return 0;
+        return add_tree_node(pReader, pWindow, iLevel - 1, ulNode * 2 + 1);
+    }
+    if (!(pNode = read_node(pReader, iLevel, ulNode)) || use_chunk_comp(pReader, ulFirst) != 0) return -1;
+    add_node(pReader, pWindow, pNode);
+    return 0;
+}
+
+// Chunks [ulLo, ulHi) through the pyramid, or decoded one by one without a sidecar
+static int add_chunks(QUERY_READER* pReader, QueryWindow* pWindow, unsigned long ulLo, unsigned long ulHi)
+{
+    int iLevel;
+
+    if (!pReader->fp)
+    {
+        for (; ulLo < ulHi; ulLo++)
+            if (add_edge(pReader, pWindow, ulLo) != 0) return -1;
+        return 0;
+    }
+    for (iLevel = 0; ulLo < ulHi; iLevel++, ulLo >>= 1, ulHi >>= 1)
+    {
+        if ((ulLo & 1) && add_tree_node(pReader, pWindow, iLevel, ulLo++) != 0) return -1;
+        if ((ulHi & 1) && add_tree_node(pReader, pWindow, iLevel, --ulHi) != 0) return -1;
+    }
+    return 0;
+}
+
+static int accumulate(QUERY_READER* pReader, QueryWindow* pWindows, unsigned long ulWindows)
+{
+    const CAPTURE_INDEX_ENTRY* pIndex = pReader->pIndex;
+    unsigned long ulEntries = pReader->ulEntries, w;
+
+    if (ulEntries == 0) return 0;
+    for (w = 0; w < ulWindows; w++)
+    {
+        QueryWindow* pWindow = &pWindows[w];
+        unsigned long ulA = 0, ulB = ulEntries, ulFull;
+
+        if (pWindow->llEndTime <= pIndex[0].llFirstTime || pWindow->llStartTime > pIndex[ulEntries - 1].llLastTime) continue;
+
+        // First chunk starting inside the window, then the first one ending at or after its end
+        while (ulA < ulB)
+        {
+            unsigned long ulMid = ulA + (ulB - ulA) / 2;
+            if (pIndex[ulMid].llFirstTime < pWindow->llStartTime) ulA = ulMid + 1;
+            else ulB = ulMid;
+        }
+        ulFull = ulA;
+        ulB = ulEntries;
+        while (ulA < ulB)
+        {
+            unsigned long ulMid = ulA + (ulB - ulA) / 2;
+            if (pIndex[ulMid].llLastTime < pWindow->llEndTime) ulA = ulMid + 1;
+            else ulB = ulMid;
+        }
+
+        if (ulFull > 0 && pIndex[ulFull - 1].llLastTime >= pWindow->llStartTime &&
+            add_edge(pReader, pWindow, ulFull - 1) != 0) return -1;
+        if (add_chunks(pReader, pWindow, ulFull, ulA) != 0) return -1;
+        if (ulA < ulEntries && pIndex[ulA].llFirstTime < pWindow->llEndTime &&
+            add_edge(pReader, pWindow, ulA) != 0) return -1;
+    }
+    return 0;
+}
+
+int query_windows(QUERY_READER* pReader, long long llStart, long long llWindowNs, QueryWindow* pWindows, unsigned long ulWindows)
+{
+    int rc;
+
+    if (ulWindows == 0 || llWindowNs <= 0) return -1;
+    clear_windows(pWindows, ulWindows, llStart, llWindowNs);
+    rc = accumulate(pReader, pWindows, ulWindows);
+    finish_windows(pWindows, ulWindows);
+    return rc;
+}
+
+// Each segment overlapping the range contributes through its own sidecar, the open one by decoding
+int catalog_query(CAPTURE_CATALOG* pCatalog, long long llStart, long long llWindowNs, QueryWindow* pWindows, unsigned long ulWindows)
+{
+    const CaptureSegment* aSegments;
+    unsigned long ulSegments = catalog_segments(pCatalog, &aSegments), i;
+    long long llEnd = llStart + (long long)ulWindows * llWindowNs;
+    int rc = 0;
+
+    if (ulWindows == 0 || llWindowNs <= 0) return -1;
+    clear_windows(pWindows, ulWindows, llStart, llWindowNs);
+    for (i = 0; i < ulSegments; i++)
+    {
+        QUERY_READER* pReader;
+
+        if (aSegments[i].llLastTime < llStart || aSegments[i].llFirstTime >= llEnd) continue;
+        if (!(pReader = query_open(aSegments[i].szPath)))
+        {
+            rc = -1;
+            continue;
+        }
+        if (accumulate(pReader, pWindows, ulWindows) != 0) rc = -1;
+        query_close(pReader);
+    }
+    finish_windows(pWindows, ulWindows);
+    return rc;
+}
@@ -0,0 +1,87 @@
+﻿// TuneExpertQuery.h: Per-window aggregates over captures from precomputed chunk summaries
+//
+
+#pragma once
+
+#include "TuneExpertCapture.h"
+#include <stdint.h>
+
+#define SUMMARY_MAGIC "TESUM1"
+#define SUMMARY_VERSION 1
+#define SUMMARY_LEVELS 32
+#define SUMMARY_SUFFIX ".sum"               // sidecar file is the capture path plus this
+
+enum E_QUERY_CHANNEL
+{
+    QUERY_AX1_POS, QUERY_AX2_POS, QUERY_AX3_POS,
+    QUERY_AX1_VEL, QUERY_AX2_VEL, QUERY_AX3_VEL,
+    QUERY_CHANNELS
+};
+
+// Samples with N1231B_VALID_1/2/3 clear, and with any of them clear
+enum E_QUERY_INVALID
+{
+    QUERY_INVALID_1, QUERY_INVALID_2, QUERY_INVALID_3, QUERY_INVALID_ANY,
+    QUERY_INVALID_COUNTS
+};
+
+// Samples with each N1231B_LT_TRUE_* / N1231B_GE_TRUE_* comparator bit set
+enum E_QUERY_COMPARATOR
+{
+    QUERY_LT_1, QUERY_GE_1, QUERY_LT_2, QUERY_GE_2,
+    QUERY_LT_3A, QUERY_GE_3A, QUERY_LT_3B, QUERY_GE_3B,
+    QUERY_COMPARATORS
+};
+
+typedef struct {
+    double dMean, dM2;                      // raw counts, dM2 is the sum of squared deviations from the mean
+    int64_t llMin, llMax;
+} SUMMARY_CHANNEL;
+
+// Level 0 has one node per capture chunk, every node of level k+1 merges two of level k
+typedef struct {
+    int64_t llFirstTime, llLastTime;
+    uint64_t ullCount;
+    uint64_t aullInvalid[QUERY_INVALID_COUNTS];
+    uint64_t aullComparator[QUERY_COMPARATORS];
+    SUMMARY_CHANNEL aChannel[QUERY_CHANNELS];
+} SUMMARY_NODE;
+
+// Levels follow the header in order, level 0 first
+typedef struct {
+    char szMagic[8];
+    uint32_t uiVersion, uiLevels;
+    uint64_t aullCount[SUMMARY_LEVELS];
+} SUMMARY_FILE_HEADER;
+
+typedef struct {
+    double dMean, dRms, dMin, dMax;         // um or um/s, NaN for an empty window
+} QueryValue;
+
+typedef struct {
+    long long llStartTime, llEndTime;
+    unsigned long long ullSamples;
+    unsigned long long aullInvalid[QUERY_INVALID_COUNTS];
+    unsigned long long aullComparator[QUERY_COMPARATORS];
+    QueryValue aValue[QUERY_CHANNELS];
+} QueryWindow;
+
+typedef struct SUMMARY_BUILDER SUMMARY_BUILDER;
+typedef struct QUERY_READER QUERY_READER;
+
+// Writer side, fed one capture chunk at a time by the capture writer
+SUMMARY_BUILDER* summary_new(void);
+void summary_add(SUMMARY_BUILDER* pSum, const RawSample* pSamples, unsigned long ulCount);
+int summary_save(SUMMARY_BUILDER* pSum, const char* pPath);
+void summary_free(SUMMARY_BUILDER* pSum);
+
+// Creates the sidecar for a capture recorded without one (stream, crash, version 1 file)
+int summary_build(const char* pCapturePath);
+
+// Without a matching sidecar the query still works but decodes every chunk in range
+QUERY_READER* query_open(const char* pCapturePath);
+// Fills ulWindows windows of llWindowNs each, the first starting at llStart
+int query_windows(QUERY_READER* pReader, long long llStart, long long llWindowNs, QueryWindow* pWindows, unsigned long ulWindows);
+void query_close(QUERY_READER* pReader);
+
+int catalog_query(CAPTURE_CATALOG* pCatalog, long long llStart, long long llWindowNs, QueryWindow* pWindows, unsigned long ulWindows);
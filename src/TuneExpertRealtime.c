@@ -0,0 +1,377 @@
+﻿// TuneExpertRealtime.c: CPU pinning, SCHED_FIFO, locked and prefaulted memory, latency histograms
+//
+// The acquisition path runs on whichever thread calls read_data_*(), so real-time mode configures the calling
+// thread. realtime_check() reads back what the kernel actually granted rather than what was asked for.
+
+#ifndef _GNU_SOURCE
+    #define _GNU_SOURCE
+#endif
+
+#include "TuneExpertRealtime.h"
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <errno.h>
+#include <time.h>
+
+#include <pthread.h>
+#include <sched.h>
+#include <alloca.h>
+#include <sys/mman.h>
+#ifdef __GLIBC__
+    #include <malloc.h>
+#endif
+
+#define REALTIME_HEADER 64                  // keeps the caller's buffer cache line aligned
+
+typedef struct {
+    size_t ulMapped;
+    bool bHuge;
+} REALTIME_BLOCK;
+
+typedef struct {
+    atomic_ullong aullBucket[LATENCY_BUCKETS];
+    atomic_ullong ullSumNs;
+    atomic_llong llMinNs, llMaxNs;
+} LATENCY_HIST;
+
+static atomic_bool bUseHugePages;
+static atomic_bool bMemoryLocked;
+static atomic_ullong ullPrefaulted, ullHugeTlb;
+
+static bool bSaved;
+static int iSavedCpu = -1;
+static cpu_set_t SavedAffinity;
+static int iSavedPolicy;
+static struct sched_param SavedParam;
+
+static LATENCY_HIST aLatency[LATENCY_KINDS];
+static atomic_bool bResetLatency = true;
+static long long llLastStart;               // acquisition thread only
+
+static long long monotonic_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void* realtime_alloc(size_t ulBytes)
+{
+    REALTIME_BLOCK* pBlock;
+    size_t ulMapped = (ulBytes + REALTIME_HEADER + 4095) & ~(size_t)4095;
+    bool bHuge = false;
+
+    void* p = MAP_FAILED;
+
+    if (atomic_load(&bUseHugePages) && ulMapped >= REALTIME_HUGE_PAGE)
+    {
+        size_t ulHuge = (ulMapped + REALTIME_HUGE_PAGE - 1) & ~(size_t)(REALTIME_HUGE_PAGE - 1);
+
+        // Reserved huge pages first, then a 2 MB aligned mapping that transparent huge pages can back
+        if ((p = mmap(NULL, ulHuge, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0)) != MAP_FAILED)
+        {
+            ulMapped = ulHuge;
+            bHuge = true;
+        }
+        // Mapped inaccessible first: under mlockall(MCL_FUTURE) a writable mapping is populated before the advice lands
+        else if ((p = mmap(NULL, ulHuge + REALTIME_HUGE_PAGE, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) != MAP_FAILED)
+        {
+            uintptr_t uStart = (uintptr_t)p, uAligned = (uStart + REALTIME_HUGE_PAGE - 1) & ~(uintptr_t)(REALTIME_HUGE_PAGE - 1);
+
+            if (uAligned > uStart) munmap(p, uAligned - uStart);
+            munmap((void*)(uAligned + ulHuge), uStart + REALTIME_HUGE_PAGE - uAligned);
+            p = (void*)uAligned;
+            ulMapped = ulHuge;
+    #ifdef MADV_HUGEPAGE
+            madvise(p, ulMapped, MADV_HUGEPAGE);
+    #endif
+            if (mprotect(p, ulMapped, PROT_READ | PROT_WRITE) != 0)
+            {
+                munmap(p, ulMapped);
+                p = MAP_FAILED;
+                ulMapped = (ulBytes + REALTIME_HEADER + 4095) & ~(size_t)4095;
+            }
+        }
+    }
+    if (p == MAP_FAILED && (p = mmap(NULL, ulMapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED) return NULL;
+    pBlock = p;
+
+    // Writing every page now keeps page faults out of the sampling loop
+    memset(pBlock, 0, ulMapped);
+    if (atomic_load(&bMemoryLocked)) mlock(pBlock, ulMapped);
+    pBlock->ulMapped = ulMapped;
+    pBlock->bHuge = bHuge;
+    atomic_fetch_add(&ullPrefaulted, ulMapped);
+    if (bHuge) atomic_fetch_add(&ullHugeTlb, ulMapped);
+    return (char*)pBlock + REALTIME_HEADER;
+}
+
+void realtime_free(void* p)
+{
+    REALTIME_BLOCK* pBlock;
+
+    if (!p) return;
+    pBlock = (REALTIME_BLOCK*)((char*)p - REALTIME_HEADER);
+    atomic_fetch_sub(&ullPrefaulted, pBlock->ulMapped);
+    if (pBlock->bHuge) atomic_fetch_sub(&ullHugeTlb, pBlock->ulMapped);
+    munmap(pBlock, pBlock->ulMapped);
+}
+
+static void prefault_stack(unsigned long ulBytes)
+{
+    volatile unsigned char* p = alloca(ulBytes);
+    unsigned long i;
+
+    for (i = 0; i < ulBytes; i += 4096) p[i] = 0;
+}
+
+// Parses a kernel cpu list such as "2-3,6"
+static bool cpu_in_list(const char* pList, int iCpu)
+{
+    while (*pList)
+    {
+        char* pEnd;
+        long lLo = strtol(pList, &pEnd, 10), lHi = lLo;
+
+        if (pEnd == pList) break;
+        if (*pEnd == '-') lHi = strtol(pEnd + 1, &pEnd, 10);
+        if (iCpu >= lLo && iCpu <= lHi) return true;
+        pList = *pEnd == ',' ? pEnd + 1 : pEnd;
+    }
+    return false;
+}
+
+// Value in kB of a "Key:   123 kB" line of a /proc file, returned in bytes
+static unsigned long long proc_kb(const char* pPath, const char* pKey)
+{
+    char szLine[256];
+    unsigned long long ullKb = 0;
+    size_t ulKey = strlen(pKey);
+    FILE* fp = fopen(pPath, "r");
+
+    if (!fp) return 0;
+    while (fgets(szLine, sizeof(szLine), fp))
+        if (strncmp(szLine, pKey, ulKey) == 0 && szLine[ulKey] == ':')
+        {
+            ullKb = strtoull(szLine + ulKey + 1, NULL, 10);
+            break;
+        }
+    fclose(fp);
+    return ullKb * 1024;
+}
+
+RealtimeReport realtime_check(void)
+{
+    RealtimeReport r;
+
+    memset(&r, 0, sizeof(r));
+    r.iCpu = -1;
+    r.bMemoryLocked = atomic_load(&bMemoryLocked);
+    r.ullPrefaultedBytes = atomic_load(&ullPrefaulted);
+    {
+        cpu_set_t set;
+        struct sched_param param;
+        char szList[256];
+        FILE* fp;
+        int i;
+
+        if (pthread_getaffinity_np(pthread_self(), sizeof(set), &set) == 0 && CPU_COUNT(&set) == 1)
+            for (i = 0; i < CPU_SETSIZE; i++)
+                if (CPU_ISSET(i, &set)) r.iCpu = i;
+        if (r.iCpu >= 0 && (fp = fopen("/sys/devices/system/cpu/isolated", "r")))
+        {
+            if (fgets(szList, sizeof(szList), fp)) r.bIsolatedCpu = cpu_in_list(szList, r.iCpu);
+            fclose(fp);
+        }
+        if (pthread_getschedparam(pthread_self(), &r.iPolicy, &param) == 0) r.iPriority = param.sched_priority;
+    }
+    r.ullLockedBytes = proc_kb("/proc/self/status", "VmLck");
+    r.ullHugeBytes = atomic_load(&ullHugeTlb) + proc_kb("/proc/self/smaps_rollup", "AnonHugePages");
+    return r;
+}
+
+int realtime_enter(const RealtimeConfig* pConfig, RealtimeReport* pReport)
+{
+    int iAffinityError = 0, iPriorityError = 0, iLockError = 0;
+    unsigned long ulStack = pConfig->ulStackBytes ? pConfig->ulStackBytes : REALTIME_DEFAULT_STACK;
+
+    if (!bSaved)
+    {
+        pthread_getaffinity_np(pthread_self(), sizeof(SavedAffinity), &SavedAffinity);
+        pthread_getschedparam(pthread_self(), &iSavedPolicy, &SavedParam);
+        bSaved = true;
+    }
+    if (pConfig->iCpu >= 0)
+    {
+        cpu_set_t set;
+
+        CPU_ZERO(&set);
+        CPU_SET(pConfig->iCpu, &set);
+        iAffinityError = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+    if (pConfig->iPriority > 0)
+    {
+        struct sched_param param;
+
+        memset(&param, 0, sizeof(param));
+        param.sched_priority = pConfig->iPriority;
+        iPriorityError = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+    }
+    if (pConfig->bLockMemory)
+    {
+    #ifdef __GLIBC__
+        // Freed heap stays mapped and large blocks come from the locked heap instead of fresh mmaps
+        mallopt(M_TRIM_THRESHOLD, -1);
+        mallopt(M_MMAP_MAX, 0);
+    #endif
+        if (mlockall(MCL_CURRENT | MCL_FUTURE) == 0) atomic_store(&bMemoryLocked, true);
+        else iLockError = errno;
+    }
+    atomic_store(&bUseHugePages, pConfig->bHugePages);
+    prefault_stack(ulStack);
+    atomic_fetch_add(&ullPrefaulted, ulStack);
+
+    if (pReport)
+    {
+        *pReport = realtime_check();
+        pReport->iAffinityError = iAffinityError;
+        pReport->iPriorityError = iPriorityError;
+        pReport->iLockError = iLockError;
+    }
+    return iAffinityError || iPriorityError || iLockError ? -1 : 0;
+}
+
+// Restores the calling thread's affinity and scheduling from before the first realtime_enter()
+void realtime_leave(void)
+{
+    if (!bSaved) return;
+    pthread_setaffinity_np(pthread_self(), sizeof(SavedAffinity), &SavedAffinity);
+    pthread_setschedparam(pthread_self(), iSavedPolicy, &SavedParam);
+    if (atomic_exchange(&bMemoryLocked, false)) munlockall();
+    atomic_store(&bUseHugePages, false);
+    iSavedCpu = -1;
+    bSaved = false;
+}
+
+int realtime_report_text(const RealtimeReport* pReport, char* pBuf, size_t ulSize)
+{
+    return snprintf(pBuf, ulSize,
+        "cpu: %d%s%s%s\n"
+        "policy: %s priority %d%s%s\n"
+        "memory locked: %s, %llu kB locked%s%s\n"
+        "prefaulted: %llu kB, huge pages: %llu kB\n",
+        pReport->iCpu, pReport->iCpu < 0 ? " (not pinned)" : pReport->bIsolatedCpu ? " (isolated)" : " (not isolated)",
+        pReport->iAffinityError ? ", pinning failed: " : "", pReport->iAffinityError ? strerror(pReport->iAffinityError) : "",
+        pReport->iPolicy == SCHED_FIFO ? "SCHED_FIFO" : pReport->iPolicy == SCHED_RR ? "SCHED_RR" : "SCHED_OTHER",
+        pReport->iPriority,
+        pReport->iPriorityError ? ", failed: " : "", pReport->iPriorityError ? strerror(pReport->iPriorityError) : "",
+        pReport->bMemoryLocked ? "yes" : "no", pReport->ullLockedBytes / 1024,
+        pReport->iLockError ? ", failed: " : "", pReport->iLockError ? strerror(pReport->iLockError) : "",
+        pReport->ullPrefaultedBytes / 1024, pReport->ullHugeBytes / 1024);
+}
+
+static unsigned int latency_bucket(long long llNs)
+{
+    unsigned long long v = llNs < 0 ? 0 : (unsigned long long)llNs;
+    unsigned int e, b;
+
+    if (v < 8) return (unsigned int)v;
+#if defined(__GNUC__)
+    e = 63 - __builtin_clzll(v);
+#else
+    for (e = 3; (v >> (e + 1)) != 0; e++);
+#endif
+    b = 8 + (e - 3) * 8 + (unsigned int)((v >> (e - 3)) & 7);
+    return b < LATENCY_BUCKETS ? b : LATENCY_BUCKETS - 1;
+}
+
+long long latency_bucket_ns(unsigned int uiBucket)
+{
+    if (uiBucket < 8) return uiBucket;
+    return (8LL + (uiBucket - 8) % 8) << ((uiBucket - 8) / 8);
+}
+
+// Single writer, so plain relaxed loads and stores are enough and the readers never block it
+static void record(LATENCY_HIST* pHist, long long llNs)
+{
+    atomic_ullong* pBucket = &pHist->aullBucket[latency_bucket(llNs)];
+
+    atomic_store_explicit(pBucket, atomic_load_explicit(pBucket, memory_order_relaxed) + 1, memory_order_relaxed);
+    atomic_store_explicit(&pHist->ullSumNs, atomic_load_explicit(&pHist->ullSumNs, memory_order_relaxed) + llNs, memory_order_relaxed);
+    if (llNs < atomic_load_explicit(&pHist->llMinNs, memory_order_relaxed)) atomic_store_explicit(&pHist->llMinNs, llNs, memory_order_relaxed);
+    if (llNs > atomic_load_explicit(&pHist->llMaxNs, memory_order_relaxed)) atomic_store_explicit(&pHist->llMaxNs, llNs, memory_order_relaxed);
+}
+
+long long latency_start(void)
+{
+    return monotonic_ns();
+}
+
+void latency_update(long long llStartNs)
+{
+    long long llNow = monotonic_ns();
+    int i, j;
+
+    // Resets are carried out here so the histograms keep a single writer
+    if (atomic_load_explicit(&bResetLatency, memory_order_relaxed) && atomic_exchange(&bResetLatency, false))
+    {
+        for (i = 0; i < LATENCY_KINDS; i++)
+        {
+            for (j = 0; j < LATENCY_BUCKETS; j++) atomic_store_explicit(&aLatency[i].aullBucket[j], 0, memory_order_relaxed);
+            atomic_store_explicit(&aLatency[i].ullSumNs, 0, memory_order_relaxed);
+            atomic_store_explicit(&aLatency[i].llMinNs, LLONG_MAX, memory_order_relaxed);
+            atomic_store_explicit(&aLatency[i].llMaxNs, 0, memory_order_relaxed);
+        }
+        llLastStart = 0;
+    }
+    if (llLastStart) record(&aLatency[LATENCY_INTERVAL], llStartNs - llLastStart);
+    record(&aLatency[LATENCY_SERVICE], llNow - llStartNs);
+    llLastStart = llStartNs;
+}
+
+void reset_latency(void)
+{
+    atomic_store(&bResetLatency, true);
+}
+
+LatencyHistogram read_latency(int iKind)
+{
+    LatencyHistogram h;
+    const LATENCY_HIST* pHist;
+    int i;
+
+    memset(&h, 0, sizeof(h));
+    if (iKind < 0 || iKind >= LATENCY_KINDS || atomic_load(&bResetLatency)) return h;
+    pHist = &aLatency[iKind];
+    for (i = 0; i < LATENCY_BUCKETS; i++)
+    {
+        h.aullBucket[i] = atomic_load_explicit(&pHist->aullBucket[i], memory_order_relaxed);
+        h.ullCount += h.aullBucket[i];
+    }
+    if (h.ullCount == 0) return h;
+    h.llMinNs = atomic_load_explicit(&pHist->llMinNs, memory_order_relaxed);
+    h.llMaxNs = atomic_load_explicit(&pHist->llMaxNs, memory_order_relaxed);
+    h.dMeanNs = (double)atomic_load_explicit(&pHist->ullSumNs, memory_order_relaxed) / h.ullCount;
+    return h;
+}
+
+// Upper edge of the bucket holding the requested fraction of samples, capped at the maximum seen
+long long latency_percentile(const LatencyHistogram* pHist, double dFraction)
+{
+    unsigned long long ullTarget = (unsigned long long)(dFraction * pHist->ullCount + 0.5), ullSeen = 0;
+    unsigned int i;
+
+    if (pHist->ullCount == 0) return 0;
+    if (ullTarget < 1) ullTarget = 1;
+    for (i = 0; i < LATENCY_BUCKETS; i++)
+    {
+        if ((ullSeen += pHist->aullBucket[i]) < ullTarget) continue;
+        if (i + 1 < LATENCY_BUCKETS && latency_bucket_ns(i + 1) - 1 < pHist->llMaxNs) return latency_bucket_ns(i + 1) - 1;
+        return pHist->llMaxNs;
+    }
+    return pHist->llMaxNs;
+}
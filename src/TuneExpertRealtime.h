@@ -0,0 +1,64 @@
+﻿// TuneExpertRealtime.h: Real-time setup of the acquisition thread and sample latency histograms
+//
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#define REALTIME_DEFAULT_STACK (256 * 1024)
+#define REALTIME_HUGE_PAGE (2 * 1024 * 1024)
+#define LATENCY_BUCKETS 256                 // 8 per power of two, see latency_bucket_ns()
+
+typedef struct {
+    int iCpu;                               // core to pin the calling thread to, -1 = leave
+    int iPriority;                          // SCHED_FIFO priority 1..99, 0 = leave the policy
+    bool bLockMemory;                       // mlockall current and future pages, keep freed heap mapped
+    bool bHugePages;                        // back realtime_alloc() buffers with huge pages where possible
+    unsigned long ulStackBytes;             // stack to prefault, 0 = REALTIME_DEFAULT_STACK
+} RealtimeConfig;
+
+// What is actually in effect for the thread, plus the error of each requested setting that failed
+typedef struct {
+    int iCpu;                               // only core the thread may run on, -1 if it may run on several
+    bool bIsolatedCpu;                      // iCpu is listed in /sys/devices/system/cpu/isolated
+    int iPolicy, iPriority;                 // SCHED_* policy and priority
+    bool bMemoryLocked;
+    unsigned long long ullLockedBytes;      // VmLck of the process
+    unsigned long long ullPrefaultedBytes;  // realtime_alloc() buffers and stack
+    unsigned long long ullHugeBytes;        // part of it backed by huge pages
+    int iAffinityError, iPriorityError, iLockError;     // errno, 0 if applied or not requested
+} RealtimeReport;
+
+enum E_LATENCY
+{
+    LATENCY_INTERVAL,                       // start of one sample to the start of the next
+    LATENCY_SERVICE,                        // time spent inside the acquisition path per sample
+    LATENCY_KINDS
+};
+
+typedef struct {
+    unsigned long long ullCount;
+    long long llMinNs, llMaxNs;
+    double dMeanNs;
+    unsigned long long aullBucket[LATENCY_BUCKETS];
+} LatencyHistogram;
+
+// Applies to the calling thread, which should be the one reading samples. Returns 0 when everything requested took effect.
+int realtime_enter(const RealtimeConfig* pConfig, RealtimeReport* pReport);
+void realtime_leave(void);
+RealtimeReport realtime_check(void);
+int realtime_report_text(const RealtimeReport* pReport, char* pBuf, size_t ulSize);
+
+// Prefaulted (and locked in real-time mode) buffers for the acquisition path
+void* realtime_alloc(size_t ulBytes);
+void realtime_free(void* p);
+
+LatencyHistogram read_latency(int iKind);
+void reset_latency(void);
+long long latency_bucket_ns(unsigned int uiBucket);     // lower bound of the bucket
+long long latency_percentile(const LatencyHistogram* pHist, double dFraction);
+
+// Acquisition side
+long long latency_start(void);
+void latency_update(long long llStartNs);
@@ -0,0 +1,243 @@
+﻿// TuneExpertReplay.c: Capture replay behind acquire_sample, paced to the recorded timestamps
+//
+// Samples keep their recorded times so a replay is repeatable; pacing maps them onto the monotonic clock
+// from an anchor that is reset at the start, after a speed change and when a looping replay wraps.
+
+#include "TuneExpertReplay.h"
+#include "TuneExpertCapture.h"
+#include "TuneExpertEnv.h"
+#include <stdatomic.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+
+#define REPLAY_SPIN_NS 100000               // sleep until this close to the target, then spin
+#define REPLAY_MAX_SLEEP_NS 100000000LL     // longest single timed wait, bounds a wall clock step
+
+typedef struct {
+    CAPTURE_READER* pReader;
+    CAPTURE_CATALOG* pCatalog;
+    RawSample aBuf[REPLAY_BUFFER];
+    unsigned long ulCount, ulPos;
+    double dFillComp;                       // factor aBuf was recorded with
+    double dComp;                           // factor last posted for the replayed samples
+    RawSample Last;
+    bool bLoop, bAnchored;
+    long long llWallStart, llCaptureStart;
+    double dAnchorSpeed;
+    _Atomic double dSpeed;
+    atomic_bool bFinished;
+    atomic_bool bCancel;                    // replaced or closed: stop pacing, the sample in hand goes out now
+    atomic_ullong ullServed;
+    atomic_llong llMaxLate;
+} REPLAY;
+
+static _Atomic(REPLAY*) pLiveReplay;
+static atomic_bool bReplayBusy;
+static pthread_mutex_t ReplayMutex = PTHREAD_MUTEX_INITIALIZER;
+static double dSavedCompNum;               // factor in use before the first replay, restored on close
+static pthread_mutex_t WaitMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t WaitCond = PTHREAD_COND_INITIALIZER;
+
+static long long monotonic_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Pacing runs while replay_next() holds bReplayBusy, so the sleep is a timed wait swap_replay() can cut short
+static void wait_until(REPLAY* p, long long llTarget)
+{
+    long long llLeft;
+
+    while ((llLeft = llTarget - monotonic_ns()) > 0 && !atomic_load_explicit(&p->bCancel, memory_order_relaxed))
+    {
+        if (llLeft > 2 * REPLAY_SPIN_NS)
+        {
+            struct timespec ts;
+            long long llWake;
+
+            llLeft -= REPLAY_SPIN_NS;
+            if (llLeft > REPLAY_MAX_SLEEP_NS) llLeft = REPLAY_MAX_SLEEP_NS;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            llWake = ts.tv_sec * 1000000000LL + ts.tv_nsec + llLeft;
+            ts.tv_sec = llWake / 1000000000LL;
+            ts.tv_nsec = llWake % 1000000000LL;
+            pthread_mutex_lock(&WaitMutex);
+            if (!atomic_load(&p->bCancel)) pthread_cond_timedwait(&WaitCond, &WaitMutex, &ts);
+            pthread_mutex_unlock(&WaitMutex);
+        }
+    }
+}
+
+static void replay_free(REPLAY* p)
+{
+    if (!p) return;
+    capture_close_read(p->pReader);
+    catalog_close(p->pCatalog);
+    free(p);
+}
+
+// Caller holds ReplayMutex; returns the previous replay once acquire_sample has stopped using it. A paced wait
+// in progress is woken, so this only spins for the rest of a sample, never for the gap to the next one.
+static REPLAY* swap_replay(REPLAY* pNew)
+{
+    REPLAY* pOld = atomic_exchange(&pLiveReplay, pNew);
+
+    if (pOld)
+    {
+        pthread_mutex_lock(&WaitMutex);
+        atomic_store(&pOld->bCancel, true);
+        pthread_cond_broadcast(&WaitCond);
+        pthread_mutex_unlock(&WaitMutex);
+    }
+    while (atomic_load(&bReplayBusy));
+    return pOld;
+}
+
+static long fill(REPLAY* p)
+{
+    long n = p->pReader ? capture_read_comp(p->pReader, p->aBuf, REPLAY_BUFFER, &p->dFillComp)
+                        : catalog_read_comp(p->pCatalog, p->aBuf, REPLAY_BUFFER, &p->dFillComp);
+
+    p->ulPos = 0;
+    p->ulCount = n > 0 ? (unsigned long)n : 0;
+    return n;
+}
+
+static int rewind_replay(REPLAY* p)
+{
+    return p->pReader ? capture_seek(p->pReader, LLONG_MIN) : catalog_seek(p->pCatalog, LLONG_MIN);
+}
+
+static void pace(REPLAY* p, long long llTime)
+{
+    double dSpeed = atomic_load_explicit(&p->dSpeed, memory_order_relaxed);
+    long long llTarget, llLate;
+
+    if (!p->bAnchored || dSpeed != p->dAnchorSpeed)
+    {
+        p->llWallStart = monotonic_ns();
+        p->llCaptureStart = llTime;
+        p->dAnchorSpeed = dSpeed;
+        p->bAnchored = true;
+        return;
+    }
+    if (dSpeed <= 0) return;
+
+    llTarget = p->llWallStart + (long long)((llTime - p->llCaptureStart) / dSpeed);
+    llLate = monotonic_ns() - llTarget;
+    if (llLate > atomic_load_explicit(&p->llMaxLate, memory_order_relaxed))
+        atomic_store_explicit(&p->llMaxLate, llLate, memory_order_relaxed);
+    else
+        wait_until(p, llTarget);
+}
+
+int open_replay(const char* pPath, double dSpeed, bool bLoop)
+{
+    REPLAY* p = calloc(1, sizeof(REPLAY));
+    double dCompNum;
+
+    if (!p) return -1;
+    if ((p->pReader = capture_open_read(pPath)) != NULL)
+        dCompNum = capture_header(p->pReader)->dCompNum;
+    else
+    {
+        const CaptureSegment* aSegments;
+        CAPTURE_READER* pFirst;
+
+        if (!(p->pCatalog = catalog_open(pPath)) || catalog_segments(p->pCatalog, &aSegments) == 0 ||
+            !(pFirst = capture_open_read(aSegments[0].szPath)))
+        {
+            replay_free(p);
+            return -1;
+        }
+        dCompNum = capture_header(pFirst)->dCompNum;
+        capture_close_read(pFirst);
+    }
+    p->bLoop = bLoop;
+    p->dComp = dCompNum;
+    atomic_init(&p->dSpeed, dSpeed);
+
+    // Convert with the factor the recording was made with; this also sets the scale when no board was opened
+    pthread_mutex_lock(&ReplayMutex);
+    if (!atomic_load(&pLiveReplay)) dSavedCompNum = read_comp_num();
+    set_comp_num(dCompNum);
+    replay_free(swap_replay(p));
+    pthread_mutex_unlock(&ReplayMutex);
+    return 0;
+}
+
+void close_replay(void)
+{
+    REPLAY* p;
+
+    pthread_mutex_lock(&ReplayMutex);
+    if ((p = swap_replay(NULL)) != NULL) set_comp_num(dSavedCompNum);
+    replay_free(p);
+    pthread_mutex_unlock(&ReplayMutex);
+}
+
+void set_replay_speed(double dSpeed)
+{
+    REPLAY* p;
+
+    pthread_mutex_lock(&ReplayMutex);
+    if ((p = atomic_load(&pLiveReplay)) != NULL) atomic_store(&p->dSpeed, dSpeed);
+    pthread_mutex_unlock(&ReplayMutex);
+}
+
+ReplayStatus read_replay_status(void)
+{
+    ReplayStatus rs;
+    REPLAY* p;
+
+    memset(&rs, 0, sizeof(rs));
+    pthread_mutex_lock(&ReplayMutex);
+    if ((p = atomic_load(&pLiveReplay)) != NULL)
+    {
+        rs.bActive = true;
+        rs.bFinished = atomic_load(&p->bFinished);
+        rs.dSpeed = atomic_load(&p->dSpeed);
+        rs.ullSamples = atomic_load(&p->ullServed);
+        rs.llMaxLateNs = atomic_load(&p->llMaxLate);
+    }
+    pthread_mutex_unlock(&ReplayMutex);
+    return rs;
+}
+
+static int next_sample(REPLAY* p, RawSample* pRaw)
+{
+    if (p->ulPos == p->ulCount && fill(p) <= 0)
+    {
+        if (!p->bLoop || !atomic_load_explicit(&p->ullServed, memory_order_relaxed) || rewind_replay(p) != 0 || fill(p) <= 0)
+        {
+            *pRaw = p->Last;
+            atomic_store(&p->bFinished, true);
+            return REPLAY_END;
+        }
+        p->bAnchored = false;
+    }
+    // Entering samples recorded under another factor: acquire_sample takes the update before converting this one
+    if (p->ulPos == 0 && p->dFillComp != p->dComp) set_comp_num(p->dComp = p->dFillComp);
+    *pRaw = p->aBuf[p->ulPos++];
+    pace(p, pRaw->llTime);
+    p->Last = *pRaw;
+    atomic_fetch_add_explicit(&p->ullServed, 1, memory_order_relaxed);
+    return REPLAY_SAMPLE;
+}
+
+// Runs on the acquisition thread
+int replay_next(RawSample* pRaw)
+{
+    REPLAY* p;
+    int rc = REPLAY_OFF;
+
+    atomic_store(&bReplayBusy, true);
+    if ((p = atomic_load(&pLiveReplay)) != NULL) rc = next_sample(p, pRaw);
+    atomic_store(&bReplayBusy, false);
+    return rc;
+}
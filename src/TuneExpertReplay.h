@@ -0,0 +1,33 @@
+﻿// TuneExpertReplay.h: Serves a recorded capture through the live read functions instead of the board
+//
+
+#pragma once
+
+#include "TuneExpertData.h"
+#include <stdbool.h>
+
+#define REPLAY_AS_FAST 0.0                  // speed that disables pacing
+#define REPLAY_BUFFER 4096
+
+enum E_REPLAY_STATE
+{
+    REPLAY_OFF,                             // no replay open, read the board
+    REPLAY_SAMPLE,                          // next recorded sample returned
+    REPLAY_END                              // recording exhausted, last sample returned again
+};
+
+typedef struct {
+    bool bActive, bFinished;
+    double dSpeed;
+    unsigned long long ullSamples;          // samples served so far
+    long long llMaxLateNs;                  // worst lag behind the paced schedule
+} ReplayStatus;
+
+// pPath is a capture file or a segment catalog; dSpeed 1 is the original timing, 2 twice as fast, REPLAY_AS_FAST no waiting
+int open_replay(const char* pPath, double dSpeed, bool bLoop);
+void close_replay(void);                    // also restores the compensation factor in use before the replay
+void set_replay_speed(double dSpeed);
+ReplayStatus read_replay_status(void);
+
+// Acquisition side
+int replay_next(RawSample* pRaw);
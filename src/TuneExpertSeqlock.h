@@ -0,0 +1,39 @@
+﻿// TuneExpertSeqlock.h: Single writer sequence lock for publishing data to lock free readers
+//
+
+#pragma once
+
+#include <stdatomic.h>
+#include <stdbool.h>
+
+typedef struct {
+    atomic_uint uiSeq;
+} SEQLOCK;
+
+// Writer side, only one thread may write at a time. The sequence is odd while an update is in progress.
+static inline void seqlock_write_begin(SEQLOCK* pLock)
+{
+    unsigned int uiSeq = atomic_load_explicit(&pLock->uiSeq, memory_order_relaxed);
+    atomic_store_explicit(&pLock->uiSeq, uiSeq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+}
+
+static inline void seqlock_write_end(SEQLOCK* pLock)
+{
+    unsigned int uiSeq = atomic_load_explicit(&pLock->uiSeq, memory_order_relaxed);
+    atomic_store_explicit(&pLock->uiSeq, uiSeq + 1, memory_order_release);
+}
+
+// Reader side: copy the data between read_begin and read_retry and try again while read_retry is true
+static inline unsigned int seqlock_read_begin(SEQLOCK* pLock)
+{
+    unsigned int uiSeq;
+    while ((uiSeq = atomic_load_explicit(&pLock->uiSeq, memory_order_acquire)) & 1u);
+    return uiSeq;
+}
+
+static inline bool seqlock_read_retry(SEQLOCK* pLock, unsigned int uiSeq)
+{
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(&pLock->uiSeq, memory_order_relaxed) != uiSeq;
+}
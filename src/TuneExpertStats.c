@@ -0,0 +1,180 @@
+﻿// TuneExpertStats.c: Rolling window statistics with O(1) amortized updates
+//
+
+#include "TuneExpertStats.h"
+#include "TuneExpertRealtime.h"
+#include "TuneExpertSeqlock.h"
+#include <stdlib.h>
+#include <math.h>
+
+bool rolling_stats_init(ROLLING_STATS* pStats, unsigned long ulWindow)
+{
+    if (ulWindow == 0) ulWindow = 1;
+
+    pStats->pdBuf = realtime_alloc(ulWindow * sizeof(double));
+    pStats->pulMinQ = realtime_alloc(ulWindow * sizeof(unsigned long));
+    pStats->pulMaxQ = realtime_alloc(ulWindow * sizeof(unsigned long));
+    if (!pStats->pdBuf || !pStats->pulMinQ || !pStats->pulMaxQ)
+    {
+        rolling_stats_free(pStats);
+        return false;
+    }
+
+    pStats->ulWindow = ulWindow;
+    pStats->ulMinHead = pStats->ulMinSize = 0;
+    pStats->ulMaxHead = pStats->ulMaxSize = 0;
+    pStats->ulCount = pStats->ulSeq = 0;
+    pStats->dMean = pStats->dM2 = 0;
+    return true;
+}
+
+void rolling_stats_free(ROLLING_STATS* pStats)
+{
+    realtime_free(pStats->pdBuf);
+    realtime_free(pStats->pulMinQ);
+    realtime_free(pStats->pulMaxQ);
+    pStats->pdBuf = NULL;
+    pStats->pulMinQ = pStats->pulMaxQ = NULL;
+    pStats->ulWindow = pStats->ulCount = 0;
+}
+
+// Recompute mean and M2 from the buffer once per window to stop rounding drift of the sliding update
+static void rolling_stats_resync(ROLLING_STATS* pStats)
+{
+    double dSum = 0, dM2 = 0;
+    unsigned long i;
+
+    for (i = 0; i < pStats->ulCount; i++) dSum += pStats->pdBuf[i];
+    pStats->dMean = dSum / pStats->ulCount;
+    for (i = 0; i < pStats->ulCount; i++)
+    {
+        double d = pStats->pdBuf[i] - pStats->dMean;
+        dM2 += d * d;
+    }
+    pStats->dM2 = dM2;
+}
+
+void rolling_stats_push(ROLLING_STATS* pStats, double dValue)
+{
+    unsigned long ulW = pStats->ulWindow;
+    unsigned long ulSeq, ulSlot;
+    double dOldMean = pStats->dMean;
+
+    if (!pStats->pdBuf) return;
+    ulSeq = pStats->ulSeq++;
+    ulSlot = ulSeq % ulW;
+
+    // Welford update, sliding once the window is full
+    if (pStats->ulCount < ulW)
+    {
+        pStats->ulCount++;
+        pStats->dMean += (dValue - dOldMean) / pStats->ulCount;
+        pStats->dM2 += (dValue - dOldMean) * (dValue - pStats->dMean);
+    }
+    else
+    {
+        double dOld = pStats->pdBuf[ulSlot];
+        pStats->dMean += (dValue - dOld) / ulW;
+        pStats->dM2 += (dValue - dOld) * (dValue - pStats->dMean + dOld - dOldMean);
+        if (pStats->dM2 < 0) pStats->dM2 = 0;
+    }
+
+    // Expire deque entries that left the window before their slot is overwritten
+    if (pStats->ulMinSize && pStats->pulMinQ[pStats->ulMinHead] + ulW <= ulSeq)
+    {
+        pStats->ulMinHead = (pStats->ulMinHead + 1) % ulW;
+        pStats->ulMinSize--;
+    }
+    if (pStats->ulMaxSize && pStats->pulMaxQ[pStats->ulMaxHead] + ulW <= ulSeq)
+    {
+        pStats->ulMaxHead = (pStats->ulMaxHead + 1) % ulW;
+        pStats->ulMaxSize--;
+    }
+
+    pStats->pdBuf[ulSlot] = dValue;
+
+    while (pStats->ulMinSize &&
+        pStats->pdBuf[pStats->pulMinQ[(pStats->ulMinHead + pStats->ulMinSize - 1) % ulW] % ulW] >= dValue)
+        pStats->ulMinSize--;
+    pStats->pulMinQ[(pStats->ulMinHead + pStats->ulMinSize++) % ulW] = ulSeq;
+
+    while (pStats->ulMaxSize &&
+        pStats->pdBuf[pStats->pulMaxQ[(pStats->ulMaxHead + pStats->ulMaxSize - 1) % ulW] % ulW] <= dValue)
+        pStats->ulMaxSize--;
+    pStats->pulMaxQ[(pStats->ulMaxHead + pStats->ulMaxSize++) % ulW] = ulSeq;
+
+    if (ulSlot == ulW - 1) rolling_stats_resync(pStats);
+}
+
+AxisStats rolling_stats_get(const ROLLING_STATS* pStats)
+{
+    AxisStats as = { 0 };
+
+    if (pStats->ulCount == 0) return as;
+
+    as.ulCount = pStats->ulCount;
+    as.dMean = pStats->dMean;
+    as.dStdDev = pStats->ulCount > 1 ? sqrt(pStats->dM2 / (pStats->ulCount - 1)) : 0;
+    as.dRms = sqrt(pStats->dMean * pStats->dMean + pStats->dM2 / pStats->ulCount);
+    as.dMin = pStats->pdBuf[pStats->pulMinQ[pStats->ulMinHead] % pStats->ulWindow];
+    as.dMax = pStats->pdBuf[pStats->pulMaxQ[pStats->ulMaxHead] % pStats->ulWindow];
+    as.dPkPk = as.dMax - as.dMin;
+    return as;
+}
+
+static ROLLING_STATS aLiveStats[STATS_AXES];
+static atomic_ulong aulPendingWindow[STATS_AXES];
+static atomic_bool bResetPending;
+static SEQLOCK StatsLock;
+static AxisStats aPublished[STATS_AXES];
+
+// Runs on the acquisition thread only; window changes and resets are picked up here so the
+// writer never races a reconfiguration
+void stats_update(double dPos1, double dPos2, double dPos3)
+{
+    double adPos[STATS_AXES] = { dPos1, dPos2, dPos3 };
+    bool bReset = atomic_exchange_explicit(&bResetPending, false, memory_order_acquire);
+    int i;
+
+    for (i = 0; i < STATS_AXES; i++)
+    {
+        unsigned long ulWindow = atomic_exchange_explicit(&aulPendingWindow[i], 0, memory_order_acquire);
+
+        if (ulWindow == 0 && (bReset || !aLiveStats[i].pdBuf))
+            ulWindow = aLiveStats[i].pdBuf ? aLiveStats[i].ulWindow : STATS_DEFAULT_WINDOW;
+        if (ulWindow)
+        {
+            rolling_stats_free(&aLiveStats[i]);
+            rolling_stats_init(&aLiveStats[i], ulWindow);
+        }
+        rolling_stats_push(&aLiveStats[i], adPos[i]);
+    }
+
+    seqlock_write_begin(&StatsLock);
+    for (i = 0; i < STATS_AXES; i++) aPublished[i] = rolling_stats_get(&aLiveStats[i]);
+    seqlock_write_end(&StatsLock);
+}
+
+void set_stats_window(short axis, unsigned long ulWindow)
+{
+    if (axis < 0 || axis >= STATS_AXES || ulWindow == 0) return;
+    atomic_store_explicit(&aulPendingWindow[axis], ulWindow, memory_order_release);
+}
+
+void reset_stats(void)
+{
+    atomic_store_explicit(&bResetPending, true, memory_order_release);
+}
+
+AxisStats read_stats(short axis)
+{
+    AxisStats as = { 0 };
+    unsigned int uiSeq;
+
+    if (axis < 0 || axis >= STATS_AXES) return as;
+    do {
+        uiSeq = seqlock_read_begin(&StatsLock);
+        as = aPublished[axis];
+    } while (seqlock_read_retry(&StatsLock, uiSeq));
+    return as;
+}
@@ -0,0 +1,35 @@
+﻿// TuneExpertStats.h: Rolling window statistics (mean, RMS, min, max, peak-to-peak) per axis
+//
+
+#pragma once
+
+#include <stdbool.h>
+
+#define STATS_AXES 3
+#define STATS_DEFAULT_WINDOW 1000
+
+typedef struct {
+    double dMean, dStdDev, dRms;
+    double dMin, dMax, dPkPk;
+    unsigned long ulCount;          // samples currently in the window
+} AxisStats;
+
+typedef struct {
+    double* pdBuf;                  // last ulWindow samples, indexed by sequence number % ulWindow
+    unsigned long* pulMinQ;         // monotonic deques of sequence numbers
+    unsigned long* pulMaxQ;
+    unsigned long ulMinHead, ulMinSize, ulMaxHead, ulMaxSize;
+    unsigned long ulWindow, ulCount, ulSeq;
+    double dMean, dM2;
+} ROLLING_STATS;
+
+bool rolling_stats_init(ROLLING_STATS* pStats, unsigned long ulWindow);
+void rolling_stats_free(ROLLING_STATS* pStats);
+void rolling_stats_push(ROLLING_STATS* pStats, double dValue);
+AxisStats rolling_stats_get(const ROLLING_STATS* pStats);
+
+// Live statistics on the converted positions, fed by the acquisition path
+void stats_update(double dPos1, double dPos2, double dPos3);
+void set_stats_window(short axis, unsigned long ulWindow);
+void reset_stats(void);
+AxisStats read_stats(short axis);
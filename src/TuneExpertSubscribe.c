@@ -0,0 +1,393 @@
+﻿// TuneExpertSubscribe.c: Batched callbacks fed from the broadcast ring
+//
+// A delivery thread copies each subscription's new samples into a staging batch, which releases the ring
+// slots early and keeps the spans contiguous across the ring's wrap, and calls back when the batch is full or
+// its first sample has waited llMaxLatencyNs. Between batches the thread sleeps on the consumers' eventfds,
+// armed for the samples still missing, so the acquisition thread only ever signals once per wakeup.
+// Callbacks run without any lock held, so they may subscribe and unsubscribe freely. A callback that
+// unsubscribes only marks the subscription; its delivery thread unlinks and frees it between passes, and stops
+// itself when that was the last one. Any other unsubscribe waits for a running callback of the subscription.
+
+#ifndef _GNU_SOURCE
+    #define _GNU_SOURCE
+#endif
+
+#include "TuneExpertSubscribe.h"
+#include <stdatomic.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <limits.h>
+
+#include <poll.h>
+#include <sched.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#define SUBSCRIBE_POLL_NS 100000            // without eventfds
+
+typedef struct DELIVERY_THREAD DELIVERY_THREAD;
+
+struct SUBSCRIPTION {
+    SubscribeConfig Config;
+    BROADCAST_CONSUMER* pConsumer;
+    DELIVERY_THREAD* pThread;
+    SUBSCRIPTION* pNext;
+    LatestSample* pStage;
+    unsigned long ulStaged;
+    long long llFirstNs;                    // when the first staged sample was taken off the ring
+    bool bEnded;
+    bool bDetached;                         // being unsubscribed outside any callback, skipped by pThread
+    atomic_bool bRemoved;                   // unsubscribed from a callback, freed by pThread
+    atomic_ullong ullCalls, ullSamples, ullLatencyFlushes;
+    atomic_llong llMaxCallbackNs;
+};
+
+struct DELIVERY_THREAD {
+    pthread_t Thread;
+    pthread_mutex_t Mutex;                  // guards pList and pBusy, never held during a callback
+    pthread_cond_t IdleCond;                // pBusy changed
+    SUBSCRIPTION* pList;
+    SUBSCRIPTION* pBusy;                    // being serviced, so its callback may be running
+    int fdWake;                             // interrupts the sleep when the list changes
+    atomic_bool bStop;
+    int iCpu;
+};
+
+static DELIVERY_THREAD* apShared[SUBSCRIBE_MAX_THREADS];
+static pthread_mutex_t SubscribeMutex = PTHREAD_MUTEX_INITIALIZER;
+static _Thread_local DELIVERY_THREAD* pCurrentThread;  // set on delivery threads, where the callbacks run
+
+static long long monotonic_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void drain_fd(int fd)
+{
+    uint64_t ullCount;
+    if (fd >= 0 && read(fd, &ullCount, sizeof(ullCount)) < 0) return;
+}
+
+static void wake_thread(DELIVERY_THREAD* pThread)
+{
+    uint64_t ullOne = 1;
+    if (pThread->fdWake >= 0 && write(pThread->fdWake, &ullOne, sizeof(ullOne)) < 0) return;
+}
+
+static void deliver(SUBSCRIPTION* pSub, bool bLate)
+{
+    long long llStart = monotonic_ns(), llTook;
+
+    pSub->Config.pfnCallback(pSub->pStage, pSub->ulStaged, pSub->Config.pArg);
+    llTook = monotonic_ns() - llStart;
+    atomic_fetch_add_explicit(&pSub->ullCalls, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&pSub->ullSamples, pSub->ulStaged, memory_order_relaxed);
+    if (bLate) atomic_fetch_add_explicit(&pSub->ullLatencyFlushes, 1, memory_order_relaxed);
+    if (llTook > atomic_load_explicit(&pSub->llMaxCallbackNs, memory_order_relaxed)) atomic_store_explicit(&pSub->llMaxCallbackNs, llTook, memory_order_relaxed);
+    pSub->ulStaged = 0;
+}
+
+// Moves what the ring holds into the batch, calls back as limits are reached and arms the consumer.
+// Returns the time the partial batch is due, LLONG_MAX if none.
+static long long service(SUBSCRIPTION* pSub)
+{
+    unsigned long ulBatch = pSub->Config.ulBatch;
+    long long llLatency = pSub->Config.llMaxLatencyNs;
+
+    if (pSub->bEnded) return LLONG_MAX;
+    drain_fd(broadcast_notify_fd(pSub->pConsumer));
+    while (true)
+    {
+        const LatestSample* p;
+        long n;
+        unsigned long ulWant;
+
+        while (!pSub->bRemoved && (n = broadcast_wait(pSub->pConsumer, &p, 0)) > 0)
+        {
+            unsigned long ulTake = (unsigned long)n < ulBatch - pSub->ulStaged ? (unsigned long)n : ulBatch - pSub->ulStaged;
+
+            memcpy(pSub->pStage + pSub->ulStaged, p, ulTake * sizeof(LatestSample));
+            // Samples a DROP_OLDEST consumer was lapped on are dropped rather than delivered torn
+            if (broadcast_release(pSub->pConsumer, ulTake) != 0) continue;
+            if (pSub->ulStaged == 0) pSub->llFirstNs = monotonic_ns();
+            pSub->ulStaged += ulTake;
+            if (pSub->ulStaged == ulBatch) deliver(pSub, false);
+        }
+        if (pSub->bRemoved) return LLONG_MAX;
+        if (n < 0)
+        {
+            if (pSub->ulStaged) deliver(pSub, false);
+            pSub->bEnded = true;
+            return LLONG_MAX;
+        }
+        if (pSub->ulStaged && llLatency && monotonic_ns() - pSub->llFirstNs >= llLatency) deliver(pSub, true);
+        if (pSub->bRemoved) return LLONG_MAX;
+
+        // An empty batch only needs to hear about its first sample when the latency clock has to start
+        ulWant = pSub->ulStaged == 0 && llLatency ? 1 : ulBatch - pSub->ulStaged;
+        if (broadcast_arm(pSub->pConsumer, ulWant) != 1) break;
+    }
+    return pSub->ulStaged && llLatency ? pSub->llFirstNs + llLatency : LLONG_MAX;
+}
+
+static void free_subscription(SUBSCRIPTION* pSub)
+{
+    broadcast_unsubscribe(pSub->pConsumer);
+    free(pSub->pStage);
+    free(pSub);
+}
+
+static void free_thread(DELIVERY_THREAD* pThread)
+{
+    if (pThread->fdWake >= 0) close(pThread->fdWake);
+    pthread_cond_destroy(&pThread->IdleCond);
+    pthread_mutex_destroy(&pThread->Mutex);
+    free(pThread);
+}
+
+// The last subscription was removed from a callback, so the thread ends itself unless one was added meanwhile.
+// An unsubscribe stopping the thread holds SubscribeMutex while it joins, hence the try lock.
+static bool retire_thread(DELIVERY_THREAD* pThread)
+{
+    bool bEmpty;
+    int i;
+
+    while (pthread_mutex_trylock(&SubscribeMutex) != 0)
+    {
+        struct timespec ts = { 0, SUBSCRIBE_POLL_NS };
+
+        if (atomic_load(&pThread->bStop)) return false;
+        nanosleep(&ts, NULL);
+    }
+    pthread_mutex_lock(&pThread->Mutex);
+    bEmpty = pThread->pList == NULL;
+    pthread_mutex_unlock(&pThread->Mutex);
+    if (bEmpty)
+        for (i = 0; i < SUBSCRIBE_MAX_THREADS; i++)
+            if (apShared[i] == pThread) apShared[i] = NULL;
+    pthread_mutex_unlock(&SubscribeMutex);
+    if (!bEmpty) return false;
+    pthread_detach(pthread_self());
+    free_thread(pThread);
+    return true;
+}
+
+static void* delivery_thread(void* pArg)
+{
+    DELIVERY_THREAD* pThread = pArg;
+
+    struct pollfd aFds[BROADCAST_MAX_CONSUMERS + 1];
+
+    if (pThread->iCpu >= 0)
+    {
+        cpu_set_t set;
+
+        CPU_ZERO(&set);
+        CPU_SET(pThread->iCpu, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+    pCurrentThread = pThread;
+    while (!atomic_load(&pThread->bStop))
+    {
+        long long llDue = LLONG_MAX, llWait;
+        bool bBlind = false, bEmpty;
+        SUBSCRIPTION *pSub, **pp, *pRemoved = NULL;
+        unsigned int n = 0;
+
+        pthread_mutex_lock(&pThread->Mutex);
+        for (pp = &pThread->pList; (pSub = *pp) != NULL; )
+        {
+            long long llSubDue = LLONG_MAX;
+            int fd;
+
+            if (pSub->bDetached)
+            {
+                pp = &pSub->pNext;
+                continue;
+            }
+            if (!pSub->bRemoved)
+            {
+                // The list may change while the callbacks run; only pSub stays linked, as pBusy
+                pThread->pBusy = pSub;
+                pthread_mutex_unlock(&pThread->Mutex);
+                llSubDue = service(pSub);
+                pthread_mutex_lock(&pThread->Mutex);
+                pThread->pBusy = NULL;
+                pthread_cond_broadcast(&pThread->IdleCond);
+                for (pp = &pThread->pList; *pp != pSub; pp = &(*pp)->pNext);
+            }
+            fd = broadcast_notify_fd(pSub->pConsumer);
+            if (pSub->bRemoved)
+            {
+                *pp = pSub->pNext;
+                pSub->pNext = pRemoved;
+                pRemoved = pSub;
+                continue;
+            }
+            pp = &pSub->pNext;
+            if (llSubDue < llDue) llDue = llSubDue;
+            if (pSub->bEnded) continue;
+            if (fd >= 0 && n < BROADCAST_MAX_CONSUMERS)
+            {
+                aFds[n].fd = fd;
+                aFds[n++].events = POLLIN;
+            }
+            else bBlind = true;
+        }
+        bEmpty = pRemoved && !pThread->pList;
+        pthread_mutex_unlock(&pThread->Mutex);
+
+        while ((pSub = pRemoved) != NULL)
+        {
+            pRemoved = pSub->pNext;
+            free_subscription(pSub);
+        }
+        if (bEmpty && retire_thread(pThread)) return NULL;
+
+        llWait = llDue == LLONG_MAX ? -1 : llDue - monotonic_ns();
+        if (llWait < -1) llWait = 0;
+        if (bBlind && (llWait < 0 || llWait > SUBSCRIBE_POLL_NS)) llWait = SUBSCRIBE_POLL_NS;
+        aFds[n].fd = pThread->fdWake;
+        aFds[n++].events = POLLIN;
+        if (llWait < 0) ppoll(aFds, n, NULL, NULL);
+        else
+        {
+            struct timespec ts = { (time_t)(llWait / 1000000000), (long)(llWait % 1000000000) };
+            ppoll(aFds, n, &ts, NULL);
+        }
+        drain_fd(pThread->fdWake);
+    }
+    return NULL;
+}
+
+static DELIVERY_THREAD* start_thread(int iCpu)
+{
+    DELIVERY_THREAD* pThread = calloc(1, sizeof(DELIVERY_THREAD));
+
+    if (!pThread) return NULL;
+    pthread_mutex_init(&pThread->Mutex, NULL);
+    pthread_cond_init(&pThread->IdleCond, NULL);
+    pThread->iCpu = iCpu;
+    pThread->fdWake = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (pthread_create(&pThread->Thread, NULL, delivery_thread, pThread) != 0)
+    {
+        if (pThread->fdWake >= 0) close(pThread->fdWake);
+        pthread_cond_destroy(&pThread->IdleCond);
+        pthread_mutex_destroy(&pThread->Mutex);
+        free(pThread);
+        return NULL;
+    }
+    return pThread;
+}
+
+static void stop_thread(DELIVERY_THREAD* pThread)
+{
+    atomic_store(&pThread->bStop, true);
+    wake_thread(pThread);
+    pthread_join(pThread->Thread, NULL);
+    free_thread(pThread);
+}
+
+SUBSCRIPTION* subscribe(const SubscribeConfig* pConfig)
+{
+    SUBSCRIPTION* pSub;
+    DELIVERY_THREAD* pThread;
+
+    if (!pConfig->pfnCallback || pConfig->iThread >= SUBSCRIBE_MAX_THREADS || pConfig->iThread < SUBSCRIBE_OWN_THREAD) return NULL;
+    if (!(pSub = calloc(1, sizeof(SUBSCRIPTION)))) return NULL;
+    pSub->Config = *pConfig;
+    if (!pSub->Config.ulBatch) pSub->Config.ulBatch = 1;
+    if (!(pSub->pStage = malloc(pSub->Config.ulBatch * sizeof(LatestSample))) ||
+        !(pSub->pConsumer = broadcast_subscribe_config(&pSub->Config.Broadcast)))
+    {
+        free(pSub->pStage);
+        free(pSub);
+        return NULL;
+    }
+
+    pthread_mutex_lock(&SubscribeMutex);
+    if (pConfig->iThread == SUBSCRIBE_OWN_THREAD) pThread = start_thread(pConfig->iCpu);
+    else
+    {
+        if (!apShared[pConfig->iThread]) apShared[pConfig->iThread] = start_thread(pConfig->iCpu);
+        pThread = apShared[pConfig->iThread];
+    }
+    if (pThread)
+    {
+        pthread_mutex_lock(&pThread->Mutex);
+        pSub->pThread = pThread;
+        pSub->pNext = pThread->pList;
+        pThread->pList = pSub;
+        pthread_mutex_unlock(&pThread->Mutex);
+        wake_thread(pThread);
+    }
+    pthread_mutex_unlock(&SubscribeMutex);
+    if (!pThread)
+    {
+        broadcast_unsubscribe(pSub->pConsumer);
+        free(pSub->pStage);
+        free(pSub);
+        return NULL;
+    }
+    return pSub;
+}
+
+void unsubscribe(SUBSCRIPTION* pSub)
+{
+    DELIVERY_THREAD* pThread;
+    SUBSCRIPTION** pp;
+    bool bEmpty;
+
+    if (!pSub) return;
+    pThread = pSub->pThread;
+    // From a callback, which must not wait for other callbacks: the subscription's delivery thread finishes the removal
+    if (pCurrentThread)
+    {
+        // Under the Mutex so the thread cannot free the subscription and retire before it is woken
+        pthread_mutex_lock(&pThread->Mutex);
+        atomic_store(&pSub->bRemoved, true);
+        wake_thread(pThread);
+        pthread_mutex_unlock(&pThread->Mutex);
+        return;
+    }
+    // Waits without SubscribeMutex, which the running callback may need
+    pthread_mutex_lock(&pThread->Mutex);
+    pSub->bDetached = true;
+    while (pThread->pBusy == pSub) pthread_cond_wait(&pThread->IdleCond, &pThread->Mutex);
+    pthread_mutex_unlock(&pThread->Mutex);
+
+    // Still linked, so the thread cannot retire itself meanwhile
+    pthread_mutex_lock(&SubscribeMutex);
+    pthread_mutex_lock(&pThread->Mutex);
+    for (pp = &pThread->pList; *pp != pSub; pp = &(*pp)->pNext);
+    *pp = pSub->pNext;
+    bEmpty = pThread->pList == NULL;
+    pthread_mutex_unlock(&pThread->Mutex);
+    // A shared thread with nothing left to deliver is stopped as well
+    if (bEmpty)
+    {
+        int i;
+        for (i = 0; i < SUBSCRIBE_MAX_THREADS; i++)
+            if (apShared[i] == pThread) apShared[i] = NULL;
+        stop_thread(pThread);
+    }
+    pthread_mutex_unlock(&SubscribeMutex);
+    free_subscription(pSub);
+}
+
+SubscribeStats read_subscription_stats(SUBSCRIPTION* pSub)
+{
+    SubscribeStats ss;
+
+    ss.ullCalls = atomic_load(&pSub->ullCalls);
+    ss.ullSamples = atomic_load(&pSub->ullSamples);
+    ss.ullLatencyFlushes = atomic_load(&pSub->ullLatencyFlushes);
+    ss.llMaxCallbackNs = atomic_load(&pSub->llMaxCallbackNs);
+    ss.Ring = read_broadcast_stats(pSub->pConsumer);
+    return ss;
+}
@@ -0,0 +1,38 @@
+﻿// TuneExpertSubscribe.h: Push delivery of acquired samples in batches on delivery threads
+//
+
+#pragma once
+
+#include "TuneExpertBroadcast.h"
+
+#define SUBSCRIBE_MAX_THREADS 8
+#define SUBSCRIBE_OWN_THREAD -1
+
+// Called with ulCount contiguous samples, a full batch unless the latency limit or the end of the broadcast forced it out
+typedef void (*SubscribeCallback)(const LatestSample* pSamples, unsigned long ulCount, void* pArg);
+
+typedef struct {
+    SubscribeCallback pfnCallback;
+    void* pArg;
+    unsigned long ulBatch;                  // samples per call, 0 = 1
+    long long llMaxLatencyNs;               // oldest sample held back at most this long, 0 = wait for full batches
+    BroadcastConfig Broadcast;              // policy when the callback falls behind
+    int iThread;                            // shared delivery thread 0..SUBSCRIBE_MAX_THREADS-1, or SUBSCRIBE_OWN_THREAD
+    int iCpu;                               // pins a delivery thread this subscription starts, -1 = not pinned
+} SubscribeConfig;
+
+typedef struct {
+    unsigned long long ullCalls, ullSamples;
+    unsigned long long ullLatencyFlushes;   // calls with a partial batch because of llMaxLatencyNs
+    long long llMaxCallbackNs;
+    BroadcastStats Ring;
+} SubscribeStats;
+
+typedef struct SUBSCRIPTION SUBSCRIPTION;
+
+// Needs a running broadcast (start_broadcast); no callback runs once unsubscribe has returned. Callbacks may
+// subscribe and unsubscribe any subscription, itself included. An unsubscribe from a callback does not wait: the
+// subscription's delivery thread frees it later, and one on another delivery thread may be called back once more.
+SUBSCRIPTION* subscribe(const SubscribeConfig* pConfig);
+void unsubscribe(SUBSCRIPTION* pSub);
+SubscribeStats read_subscription_stats(SUBSCRIPTION* pSub);
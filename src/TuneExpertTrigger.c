@@ -0,0 +1,167 @@
+﻿// TuneExpertTrigger.c: Triggered capture, recorded by the acquisition thread while sampling carries on
+//
+
+#include "TuneExpertTrigger.h"
+#include "TuneExpertRealtime.h"
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+static TriggerConfig Config;
+static RawSample* pHistory;             // last ulPreSamples samples while armed
+static unsigned long ulHistoryCount;
+static bool bLevelBeyond;               // previous sample was already past the level, so no crossing yet
+static TriggerCapture* pCapture;
+
+static atomic_int iState = TRIG_IDLE;
+static atomic_bool bSoftware;
+static atomic_bool bBusy;               // set while the acquisition thread is inside trigger_update()
+
+// Moves the state away from the acquisition thread and waits until it has left trigger_update()
+static void claim(int iNewState)
+{
+    atomic_store(&iState, iNewState);
+    while (atomic_load(&bBusy));
+}
+
+static void release_buffers(void)
+{
+    realtime_free(pHistory);
+    pHistory = NULL;
+    free_trigger_capture(pCapture);
+    pCapture = NULL;
+}
+
+int arm_trigger(const TriggerConfig* pConfig)
+{
+    claim(TRIG_ARMING);
+    release_buffers();
+
+    Config = *pConfig;
+    // Written on every sample while armed, so prefaulted (and huge page backed in real-time mode)
+    pHistory = realtime_alloc((Config.ulPreSamples ? Config.ulPreSamples : 1) * sizeof(RawSample));
+    pCapture = calloc(1, sizeof(TriggerCapture));
+    if (pCapture) pCapture->pSamples = realtime_alloc((Config.ulPreSamples + Config.ulPostSamples + 1) * sizeof(RawSample));
+    if (!pHistory || !pCapture || !pCapture->pSamples)
+    {
+        release_buffers();
+        atomic_store(&iState, TRIG_IDLE);
+        return -1;
+    }
+
+    ulHistoryCount = 0;
+    bLevelBeyond = true;
+    atomic_store(&bSoftware, false);
+    atomic_store(&iState, TRIG_ARMED);
+    return 0;
+}
+
+void disarm_trigger(void)
+{
+    claim(TRIG_IDLE);
+    release_buffers();
+}
+
+void fire_trigger(void)
+{
+    atomic_store(&bSoftware, true);
+}
+
+int read_trigger_state(void)
+{
+    return atomic_load(&iState);
+}
+
+// Hands the finished capture to the caller, who frees it. The trigger must be armed again afterwards.
+TriggerCapture* take_trigger_capture(void)
+{
+    TriggerCapture* pDone;
+    int iExpected = TRIG_DONE;
+
+    if (!atomic_compare_exchange_strong(&iState, &iExpected, TRIG_ARMING)) return NULL;
+    pDone = pCapture;
+    pCapture = NULL;
+    realtime_free(pHistory);
+    pHistory = NULL;
+    atomic_store(&iState, TRIG_IDLE);
+    return pDone;
+}
+
+void free_trigger_capture(TriggerCapture* pCapture)
+{
+    if (!pCapture) return;
+    realtime_free(pCapture->pSamples);
+    free(pCapture);
+}
+
+bool trigger_wants_gelt(void)
+{
+    return atomic_load_explicit(&iState, memory_order_acquire) == TRIG_ARMED && Config.uiGeLtMask;
+}
+
+static unsigned int check_conditions(const RawSample* pRaw, const PosVelSample* pvs)
+{
+    unsigned int uiCause = 0;
+
+    if (atomic_exchange_explicit(&bSoftware, false, memory_order_relaxed)) uiCause |= TRIG_CAUSE_SOFTWARE;
+    if (pRaw->uiGeLtStatus & Config.uiGeLtMask) uiCause |= TRIG_CAUSE_COMPARATOR;
+    if ((pRaw->wValid & Config.wPathErrorMask) != Config.wPathErrorMask) uiCause |= TRIG_CAUSE_PATH_ERROR;
+    // Edge sensitive: fires when a sample passes the level and the one before it had not, never on the first
+    // sample after arming
+    if (Config.bLevelEnabled && Config.sLevelAxis >= AXIS_1 && Config.sLevelAxis <= AXIS_3)
+    {
+        double adPos[3] = { pvs->p1, pvs->p2, pvs->p3 };
+        double adVel[3] = { pvs->v1, pvs->v2, pvs->v3 };
+        double dValue = Config.bLevelVelocity ? adVel[Config.sLevelAxis] : adPos[Config.sLevelAxis];
+        bool bBeyond = Config.bLevelAbove ? dValue > Config.dLevel : dValue < Config.dLevel;
+
+        if (bBeyond && !bLevelBeyond) uiCause |= TRIG_CAUSE_LEVEL;
+        bLevelBeyond = bBeyond;
+    }
+    return uiCause;
+}
+
+void trigger_update(const RawSample* pRaw, const PosVelSample* pvs, double dCompNum)
+{
+    unsigned long ulPre;
+    unsigned int uiCause;
+    int iNow;
+
+    atomic_store(&bBusy, true);
+    iNow = atomic_load(&iState);
+    ulPre = Config.ulPreSamples;
+
+    if (iNow == TRIG_ARMED)
+    {
+        uiCause = check_conditions(pRaw, pvs);
+        if (uiCause && atomic_compare_exchange_strong(&iState, &iNow, TRIG_POST))
+        {
+            // Freeze the history oldest first, the trigger sample follows it
+            unsigned long ulHave = ulHistoryCount < ulPre ? ulHistoryCount : ulPre;
+            unsigned long ulFirst = ulHistoryCount - ulHave;
+            unsigned long i;
+
+            for (i = 0; i < ulHave; i++) pCapture->pSamples[i] = pHistory[(ulFirst + i) % ulPre];
+            pCapture->ulTriggerIndex = ulHave;
+            pCapture->ulCount = ulHave;
+            pCapture->uiCause = uiCause;
+            pCapture->llTriggerTime = pRaw->llTime;
+            pCapture->dCompNum = dCompNum;
+            iNow = TRIG_POST;
+        }
+        else if (!uiCause && ulPre)
+        {
+            pHistory[ulHistoryCount % ulPre] = *pRaw;
+            ulHistoryCount++;
+        }
+    }
+
+    if (iNow == TRIG_POST)
+    {
+        pCapture->pSamples[pCapture->ulCount++] = *pRaw;
+        if (pCapture->ulCount - pCapture->ulTriggerIndex >= Config.ulPostSamples)
+            atomic_compare_exchange_strong(&iState, &iNow, TRIG_DONE);
+    }
+
+    atomic_store(&bBusy, false);
+}
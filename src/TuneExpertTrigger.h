@@ -0,0 +1,52 @@
+﻿// TuneExpertTrigger.h: Triggered capture of pre- and post-trigger samples from a circular history
+//
+
+#pragma once
+
+#include "TuneExpertData.h"
+
+enum E_TRIGGER_STATE
+{
+    TRIG_IDLE,
+    TRIG_ARMING,
+    TRIG_ARMED,         // recording history and watching the trigger conditions
+    TRIG_POST,          // triggered, collecting post-trigger samples
+    TRIG_DONE           // capture ready for take_trigger_capture()
+};
+
+#define TRIG_CAUSE_SOFTWARE     0x0001
+#define TRIG_CAUSE_COMPARATOR   0x0002
+#define TRIG_CAUSE_PATH_ERROR   0x0004
+#define TRIG_CAUSE_LEVEL        0x0008
+
+typedef struct {
+    unsigned long ulPreSamples, ulPostSamples;  // post includes the trigger sample
+    unsigned int uiGeLtMask;                    // N1231B_LT_TRUE_* / N1231B_GE_TRUE_* bits, 0 = off
+    unsigned short wPathErrorMask;              // N1231B_VALID_* bits that must stay set, 0 = off
+    bool bLevelEnabled;                         // level trigger, off in a zeroed config
+    short sLevelAxis;                           // AXIS_1..AXIS_3
+    bool bLevelVelocity;                        // compare velocity (um/s) instead of position (um)
+    bool bLevelAbove;                           // trigger on crossing above dLevel, otherwise below
+    double dLevel;
+} TriggerConfig;
+
+typedef struct {
+    long long llTriggerTime;
+    unsigned int uiCause;                       // TRIG_CAUSE_* bits
+    double dCompNum;                            // compensation in effect at the trigger
+    unsigned long ulTriggerIndex;               // index of the trigger sample in pSamples
+    unsigned long ulCount;
+    RawSample* pSamples;
+} TriggerCapture;
+
+int arm_trigger(const TriggerConfig* pConfig);
+void disarm_trigger(void);
+void fire_trigger(void);
+int read_trigger_state(void);
+TriggerCapture* take_trigger_capture(void);
+void free_trigger_capture(TriggerCapture* pCapture);
+
+// Acquisition side
+bool trigger_wants_gelt(void);
+// dCompNum is the factor pvs was converted with, as for capture_update()
+void trigger_update(const RawSample* pRaw, const PosVelSample* pvs, double dCompNum);
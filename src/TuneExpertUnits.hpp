@@ -0,0 +1,95 @@
+﻿// TuneExpertUnits.hpp: C++17 compile-time conversion constants and unit checked lengths
+//
+// Optics<Fold, Laser> holds the scale factors of one interferometer configuration as constexpr functions, so
+// with the nominal COMP_NUM they and the preset/threshold counts are computed by the compiler. The formulas
+// are those of the UM_PER_COUNT/MM_TO_COUNTS macros, so both give the same doubles and counts. Length<Unit>
+// keeps raw counts, nm and um apart: only lengths of the same unit combine, and changing unit goes through
+// an Optics conversion.
+
+#pragma once
+
+extern "C" {
+#include "TuneExpertData.h"
+}
+
+namespace TuneExpert {
+
+enum class Unit { Counts, Nm, Um };
+
+template <Unit U, class T = double> class Length {
+public:
+    using value_type = T;
+
+    constexpr Length() = default;
+    constexpr explicit Length(T v) : Value(v) {}
+    constexpr T value() const { return Value; }
+
+    constexpr Length operator+(Length Other) const { return Length(Value + Other.Value); }
+    constexpr Length operator-(Length Other) const { return Length(Value - Other.Value); }
+    constexpr Length operator-() const { return Length(-Value); }
+    constexpr Length operator*(T k) const { return Length(Value * k); }
+    constexpr Length operator/(T k) const { return Length(Value / k); }
+    constexpr Length& operator+=(Length Other) { Value += Other.Value; return *this; }
+    constexpr Length& operator-=(Length Other) { Value -= Other.Value; return *this; }
+    constexpr bool operator==(Length Other) const { return Value == Other.Value; }
+    constexpr bool operator!=(Length Other) const { return Value != Other.Value; }
+    constexpr bool operator<(Length Other) const { return Value < Other.Value; }
+    constexpr bool operator<=(Length Other) const { return Value <= Other.Value; }
+    constexpr bool operator>(Length Other) const { return Value > Other.Value; }
+    constexpr bool operator>=(Length Other) const { return Value >= Other.Value; }
+
+private:
+    T Value = 0;
+};
+
+using Counts = Length<Unit::Counts, long long>;
+using Nanometers = Length<Unit::Nm>;
+using Micrometers = Length<Unit::Um>;
+
+// Vacuum wavelength of the laser head
+struct HeNe633 {
+    static constexpr double dNm = LAMBDA_NM;
+};
+
+template <unsigned Fold, class Laser = HeNe633> struct Optics {
+    static_assert(Fold > 0 && !(Fold & (Fold - 1)), "Fold is the optics' power of two path multiplier");
+
+    static constexpr unsigned uiFold = Fold;
+    static constexpr double dLambdaNm = Laser::dNm;
+
+    static constexpr double um_per_count(double dCompNum = COMP_NUM) { return UM_PER_COUNT_AT(dLambdaNm, Fold, dCompNum); }
+    static constexpr double umps_per_count(double dCompNum = COMP_NUM) { return UMPS_PER_COUNT(um_per_count(dCompNum)); }
+    static constexpr double nm_per_count(double dCompNum = COMP_NUM) { return dLambdaNm * dCompNum / (Fold * 1024); }
+
+    // Truncated as the board presets and thresholds always have been
+    static constexpr Counts counts_from_mm(double dMm, double dCompNum = COMP_NUM)
+    {
+        return Counts((long long)(dMm * 1000000 / (dLambdaNm * dCompNum / (Fold * 1024))));
+    }
+
+    static constexpr Micrometers to_um(Counts c, double dCompNum = COMP_NUM) { return Micrometers(um_per_count(dCompNum) * c.value()); }
+    static constexpr Nanometers to_nm(Counts c, double dCompNum = COMP_NUM) { return Nanometers(nm_per_count(dCompNum) * c.value()); }
+    static constexpr Counts to_counts(Micrometers um, double dCompNum = COMP_NUM) { return Counts((long long)(um.value() / um_per_count(dCompNum))); }
+    static constexpr Counts to_counts(Nanometers nm, double dCompNum = COMP_NUM) { return Counts((long long)(nm.value() / nm_per_count(dCompNum))); }
+
+    // Position as the library reports it, um from START_MM
+    static constexpr Micrometers position_um(Counts c, double dCompNum = COMP_NUM)
+    {
+        return Micrometers(um_per_count(dCompNum) * c.value() - START_MM * 1000);
+    }
+
+    // Board setup values at the nominal compensation
+    static constexpr Counts Start = counts_from_mm(START_MM);
+    static constexpr Counts Max = counts_from_mm(MAX_MM);
+    static constexpr Counts Min = counts_from_mm(MIN_MM);
+};
+
+using LinearOptics = Optics<2>;
+using PlaneMirrorOptics = Optics<4>;
+using HighResolutionOptics = Optics<8>;
+using LibraryOptics = Optics<FOLD>;     // what TuneExpertData.c converts with
+
+static_assert(LibraryOptics::um_per_count() == UM_PER_COUNT(COMP_NUM), "Optics and the C conversion macros disagree");
+static_assert(LibraryOptics::Min < LibraryOptics::Start && LibraryOptics::Start < LibraryOptics::Max, "START_MM outside MIN_MM..MAX_MM");
+
+} // namespace TuneExpert
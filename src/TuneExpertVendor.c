@@ -0,0 +1,402 @@
+﻿// TuneExpertVendor.c: Lazy loading of the Keysight libraries and the simulated board
+//
+// libN1231B.so does not record its dependency on libPlxApi.so, so PlxApi is loaded globally first. The library
+// is searched for at VENDOR_LIBRARY_ENV, then the usual dlopen() paths, which include this library's run path.
+
+#include "TuneExpertVendor.h"
+#include <stdatomic.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include <dlfcn.h>
+#include <unistd.h>
+#define VENDOR_LIBRARY "libN1231B.so"
+#define VENDOR_PLX_LIBRARY "libPlxApi.so"
+
+#define SIM_AMPLITUDE 6000.0                // counts, about 1.9 um at FOLD 2
+#define SIM_TWO_PI 6.283185307179586
+
+// The simulated board: each axis oscillates around its preset
+typedef struct {
+    pthread_mutex_t Mutex;
+    bool bOpen;
+    long long llEpoch;
+    double adOffset[3];
+    long long allLatchPos[3];
+    long alLatchVel[3];
+    long long allGe[3], allLt[3];
+} SIM_BOARD;
+
+static const double adSimHz[3] = { 1.0, 1.3, 1.7 };
+
+static SIM_BOARD Sim = { .Mutex = PTHREAD_MUTEX_INITIALIZER };
+static VENDOR_API DriverApi;
+static pthread_mutex_t LoadMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t BoardMutex;
+static pthread_once_t BoardMutexOnce = PTHREAD_ONCE_INIT;
+static atomic_int iBackend;
+static char acError[512];
+
+static long long sim_time_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static double sim_phase(int iAxis, long long llNow)
+{
+    return SIM_TWO_PI * adSimHz[iAxis] * (llNow - Sim.llEpoch) * 1e-9;
+}
+
+// Velocity in counts per 4096 board clocks, as the board reports it
+static void sim_latch(int iAxis, long long llNow)
+{
+    double dPhase = sim_phase(iAxis, llNow);
+
+    Sim.allLatchPos[iAxis] = (long long)(Sim.adOffset[iAxis] + SIM_AMPLITUDE * sin(dPhase));
+    Sim.alLatchVel[iAxis] = (long)(SIM_AMPLITUDE * SIM_TWO_PI * adSimHz[iAxis] * cos(dPhase) * (4194304 / 1024) / N1231B_CLOCK);
+}
+
+static void sim_preset(int iAxis, N1231B_INT64 Preset, long long llNow)
+{
+    union { N1231B_INT64 s; long i64; } u;
+
+    u.s = Preset;
+    Sim.adOffset[iAxis] = u.i64 - SIM_AMPLITUDE * sin(sim_phase(iAxis, llNow));
+}
+
+static void sim_store(N1231B_INT64* pPos, long long llPos)
+{
+    union { N1231B_INT64 s; long i64; } u;
+
+    memset(&u, 0, sizeof(u));
+    u.i64 = (long)llPos;
+    *pPos = u.s;
+}
+
+static N1231B_RETURN sim_lock(N1231B_HANDLE h)
+{
+    pthread_mutex_lock(&Sim.Mutex);
+    if (h == (N1231B_HANDLE)&Sim && Sim.bOpen) return N1231B_SUCCESS;
+    pthread_mutex_unlock(&Sim.Mutex);
+    return N1231B_ERR_HANDLE;
+}
+
+static N1231B_RETURN sim_Open(N1231B_LOCATION* pDevice, N1231B_HANDLE* pHandle, unsigned long* pProductId)
+{
+    int i;
+
+    if (!pHandle) return N1231B_ERR_PARAM;
+    pthread_mutex_lock(&Sim.Mutex);
+    if (!Sim.bOpen)
+    {
+        Sim.bOpen = true;
+        Sim.llEpoch = sim_time_ns();
+        for (i = 0; i < 3; i++) Sim.adOffset[i] = 0;
+    }
+    pthread_mutex_unlock(&Sim.Mutex);
+    if (pDevice) pDevice->BusNumber = pDevice->SlotNumber = 0;
+    if (pProductId) *pProductId = 0x0001231B;
+    *pHandle = (N1231B_HANDLE)&Sim;
+    return N1231B_SUCCESS;
+}
+
+static N1231B_RETURN sim_Close(N1231B_HANDLE* pHandle)
+{
+    if (!pHandle) return N1231B_ERR_PARAM;
+    if (sim_lock(*pHandle) != N1231B_SUCCESS) return N1231B_ERR_HANDLE;
+    Sim.bOpen = false;
+    pthread_mutex_unlock(&Sim.Mutex);
+    *pHandle = NULL;
+    return N1231B_SUCCESS;
+}
+
+static void sim_DefaultDevice(N1231B_LOCATION* pDevice)
+{
+    pDevice->BusNumber = pDevice->SlotNumber = N1231B_IGNORE_FIELD;
+}
+
+static N1231B_RETURN sim_Find(const N1231B_LOCATION* pDevice, unsigned int* pNumFound, N1231B_LOCATION* pDeviceArray, unsigned int numMax)
+{
+    (void)pDevice;
+    if (!pNumFound || (!pDeviceArray && numMax)) return N1231B_ERR_PARAM;
+    *pNumFound = 1;
+    if (pDeviceArray && numMax) pDeviceArray[0].BusNumber = pDeviceArray[0].SlotNumber = 0;
+    return N1231B_SUCCESS;
+}
+
+static char* sim_GetErrStr(N1231B_RETURN err)
+{
+    static char* apErr[] = { "Invalid Handle", "Invalid Parameter", "Device not found", "No device driver installed",
+        "Insufficient memory", "Invalid register", "No space on heap", "Heap locked", "Axis does not exist", "Axis error" };
+
+    if (err == N1231B_SUCCESS) return "Success";
+    if (err >= N1231B_ERR_HANDLE && err <= N1231B_ERR_AXIS) return apErr[err - N1231B_ERR_HANDLE];
+    return "Unknown error";
+}
+
+static N1231B_RETURN sim_GetRawPosVelAll(N1231B_HANDLE h, N1231B_INT64* pPosition1, long* pVelocity1, N1231B_INT64* pPosition2, long* pVelocity2,
+    N1231B_INT64* pPosition3, long* pVelocity3, unsigned short* pValid)
+{
+    N1231B_INT64* apPos[3] = { pPosition1, pPosition2, pPosition3 };
+    long* apVel[3] = { pVelocity1, pVelocity2, pVelocity3 };
+    long long llNow = sim_time_ns();
+    int i;
+
+    if (sim_lock(h) != N1231B_SUCCESS) return N1231B_ERR_HANDLE;
+    for (i = 0; i < 3; i++)
+    {
+        sim_latch(i, llNow);
+        if (apPos[i]) sim_store(apPos[i], Sim.allLatchPos[i]);
+        if (apVel[i]) *apVel[i] = Sim.alLatchVel[i];
+    }
+    pthread_mutex_unlock(&Sim.Mutex);
+    if (pValid) *pValid = N1231B_VALID_1 | N1231B_VALID_2 | N1231B_VALID_3;
+    return N1231B_SUCCESS;
+}
+
+static N1231B_RETURN sim_GetGeLtStatus(N1231B_HANDLE h, unsigned long* pGeLtStatus)
+{
+    static const unsigned long aulGe[3] = { N1231B_GE_TRUE_1, N1231B_GE_TRUE_2, N1231B_GE_TRUE_3A };
+    static const unsigned long aulLt[3] = { N1231B_LT_TRUE_1, N1231B_LT_TRUE_2, N1231B_LT_TRUE_3A };
+    int i;
+
+    if (!pGeLtStatus) return N1231B_ERR_PARAM;
+    if (sim_lock(h) != N1231B_SUCCESS) return N1231B_ERR_HANDLE;
+    *pGeLtStatus = 0;
+    for (i = 0; i < 3; i++)
+    {
+        if (Sim.allLatchPos[i] >= Sim.allGe[i]) *pGeLtStatus |= aulGe[i];
+        if (Sim.allLatchPos[i] < Sim.allLt[i]) *pGeLtStatus |= aulLt[i];
+    }
+    pthread_mutex_unlock(&Sim.Mutex);
+    return N1231B_SUCCESS;
+}
+
+static N1231B_RETURN sim_GetStatus(N1231B_HANDLE h, unsigned long* pStatus, unsigned short* pDataValid)
+{
+    if (sim_lock(h) != N1231B_SUCCESS) return N1231B_ERR_HANDLE;
+    pthread_mutex_unlock(&Sim.Mutex);
+    if (pStatus) *pStatus = 0;
+    if (pDataValid) *pDataValid = N1231B_VALID_1 | N1231B_VALID_2 | N1231B_VALID_3;
+    return N1231B_SUCCESS;
+}
+
+static N1231B_RETURN sim_ClearStatusBits(N1231B_HANDLE h, unsigned long resetBits, unsigned long* pStatus)
+{
+    (void)resetBits;
+    return sim_GetStatus(h, pStatus, NULL);
+}
+
+static N1231B_RETURN sim_ClearPathErrorAll(N1231B_HANDLE h, unsigned long* pStatus)
+{
+    return sim_GetStatus(h, pStatus, NULL);
+}
+
+static N1231B_RETURN sim_PresetRaw(N1231B_HANDLE h, N1231B_AXIS axis, N1231B_INT64 preset, unsigned long* pStatus)
+{
+    if (axis < AXIS_1 || axis > AXIS_3) return N1231B_ERR_BAD_AXIS;
+    if (sim_lock(h) != N1231B_SUCCESS) return N1231B_ERR_HANDLE;
+    sim_preset(axis, preset, sim_time_ns());
+    pthread_mutex_unlock(&Sim.Mutex);
+    if (pStatus) *pStatus = 0;
+    return N1231B_SUCCESS;
+}
+
+static N1231B_RETURN sim_PresetRawAll(N1231B_HANDLE h, N1231B_INT64 preset1, N1231B_INT64 preset2, N1231B_INT64 preset3, unsigned long* pStatus)
+{
+    long long llNow = sim_time_ns();
+
+    if (sim_lock(h) != N1231B_SUCCESS) return N1231B_ERR_HANDLE;
+    sim_preset(0, preset1, llNow);
+    sim_preset(1, preset2, llNow);
+    sim_preset(2, preset3, llNow);
+    pthread_mutex_unlock(&Sim.Mutex);
+    if (pStatus) *pStatus = 0;
+    return N1231B_SUCCESS;
+}
+
+static N1231B_RETURN sim_SamplePosVel(N1231B_HANDLE h, N1231B_AXIS axis)
+{
+    if (axis < AXIS_1 || axis > AXIS_3) return N1231B_ERR_BAD_AXIS;
+    if (sim_lock(h) != N1231B_SUCCESS) return N1231B_ERR_HANDLE;
+    sim_latch(axis, sim_time_ns());
+    pthread_mutex_unlock(&Sim.Mutex);
+    return N1231B_SUCCESS;
+}
+
+static N1231B_RETURN sim_ReadRawPos(N1231B_HANDLE h, N1231B_AXIS axis, N1231B_INT64* pPosition)
+{
+    if (!pPosition) return N1231B_ERR_PARAM;
+    if (axis < AXIS_1 || axis > AXIS_3) return N1231B_ERR_BAD_AXIS;
+    if (sim_lock(h) != N1231B_SUCCESS) return N1231B_ERR_HANDLE;
+    sim_store(pPosition, Sim.allLatchPos[axis]);
+    pthread_mutex_unlock(&Sim.Mutex);
+    return N1231B_SUCCESS;
+}
+
+static N1231B_RETURN sim_ReadRawVel(N1231B_HANDLE h, N1231B_AXIS axis, long* pVelocity)
+{
+    if (!pVelocity) return N1231B_ERR_PARAM;
+    if (axis < AXIS_1 || axis > AXIS_3) return N1231B_ERR_BAD_AXIS;
+    if (sim_lock(h) != N1231B_SUCCESS) return N1231B_ERR_HANDLE;
+    *pVelocity = Sim.alLatchVel[axis];
+    pthread_mutex_unlock(&Sim.Mutex);
+    return N1231B_SUCCESS;
+}
+
+static N1231B_RETURN sim_SetGeLtThresholds(N1231B_HANDLE h, N1231B_AXIS axis, N1231B_INT64 geValue, N1231B_INT64 ltValue)
+{
+    union { N1231B_INT64 s; long i64; } uGe, uLt;
+
+    if (axis < AXIS_1 || axis > AXIS_3) return N1231B_ERR_BAD_AXIS;
+    if (sim_lock(h) != N1231B_SUCCESS) return N1231B_ERR_HANDLE;
+    uGe.s = geValue;
+    uLt.s = ltValue;
+    Sim.allGe[axis] = uGe.i64;
+    Sim.allLt[axis] = uLt.i64;
+    pthread_mutex_unlock(&Sim.Mutex);
+    return N1231B_SUCCESS;
+}
+
+// Configuration the simulation has no use for
+static N1231B_RETURN sim_accept(N1231B_HANDLE h)
+{
+    if (sim_lock(h) != N1231B_SUCCESS) return N1231B_ERR_HANDLE;
+    pthread_mutex_unlock(&Sim.Mutex);
+    return N1231B_SUCCESS;
+}
+
+static N1231B_RETURN sim_SetConfig(N1231B_HANDLE h, unsigned long config) { (void)config; return sim_accept(h); }
+static N1231B_RETURN sim_SetFilter(N1231B_HANDLE h, unsigned short filter) { (void)filter; return sim_accept(h); }
+static N1231B_RETURN sim_SetGeLtDirections(N1231B_HANDLE h, unsigned long alertDirections) { (void)alertDirections; return sim_accept(h); }
+static N1231B_RETURN sim_SetHdwIoSetup(N1231B_HANDLE h, unsigned short HdwIoSetup) { (void)HdwIoSetup; return sim_accept(h); }
+
+#define VENDOR_SIM(name) sim_##name,
+
+static const VENDOR_API SimApi = { VENDOR_FUNCTIONS(VENDOR_SIM) };
+static _Atomic(const VENDOR_API*) pApi = &SimApi;
+
+const VENDOR_API* vendor_api(void)
+{
+    return atomic_load_explicit(&pApi, memory_order_acquire);
+}
+
+// A real-time acquisition thread must not wait behind a watchdog that was preempted while holding the board
+static void init_board_mutex(void)
+{
+    pthread_mutexattr_t Attr;
+
+    pthread_mutexattr_init(&Attr);
+#if defined(_POSIX_THREAD_PRIO_INHERIT) && _POSIX_THREAD_PRIO_INHERIT > 0
+    pthread_mutexattr_setprotocol(&Attr, PTHREAD_PRIO_INHERIT);
+#endif
+    pthread_mutex_init(&BoardMutex, &Attr);
+    pthread_mutexattr_destroy(&Attr);
+}
+
+void vendor_lock(void)
+{
+    pthread_once(&BoardMutexOnce, init_board_mutex);
+    pthread_mutex_lock(&BoardMutex);
+}
+
+void vendor_unlock(void)
+{
+    pthread_mutex_unlock(&BoardMutex);
+}
+
+static bool load_driver(void)
+{
+    const char* pPath = getenv(VENDOR_LIBRARY_ENV);
+    char acPlx[4096];
+    void* pPlx;
+    void* pLib;
+
+    // PlxApi sits beside an explicitly given library
+    if (pPath && *pPath)
+    {
+        const char* pSlash = strrchr(pPath, '/');
+
+        if (pSlash) snprintf(acPlx, sizeof(acPlx), "%.*s/" VENDOR_PLX_LIBRARY, (int)(pSlash - pPath), pPath);
+        else snprintf(acPlx, sizeof(acPlx), VENDOR_PLX_LIBRARY);
+    }
+    else
+    {
+        pPath = VENDOR_LIBRARY;
+        snprintf(acPlx, sizeof(acPlx), VENDOR_PLX_LIBRARY);
+    }
+    if (!(pPlx = dlopen(acPlx, RTLD_NOW | RTLD_GLOBAL)))
+    {
+        snprintf(acError, sizeof(acError), "%s", dlerror());
+        return false;
+    }
+    if (!(pLib = dlopen(pPath, RTLD_NOW | RTLD_LOCAL)))
+    {
+        snprintf(acError, sizeof(acError), "%s", dlerror());
+        dlclose(pPlx);
+        return false;
+    }
+    #define VENDOR_RESOLVE(name) \
+        if (!(DriverApi.pfn##name = (__typeof__(N1231B##name)*)dlsym(pLib, "N1231B" #name))) \
+        { \
+            snprintf(acError, sizeof(acError), "N1231B" #name " missing from %s", pPath); \
+            dlclose(pLib); \
+            dlclose(pPlx); \
+            return false; \
+        }
+    VENDOR_FUNCTIONS(VENDOR_RESOLVE)
+    return true;
+}
+
+static bool simulate_requested(void)
+{
+    const char* pValue = getenv(VENDOR_SIMULATE_ENV);
+    return pValue && *pValue && strcmp(pValue, "0") != 0;
+}
+
+int vendor_load(void)
+{
+    int iResult = 0;
+
+    if (atomic_load(&iBackend) != VENDOR_NONE) return 0;
+    pthread_mutex_lock(&LoadMutex);
+    if (atomic_load(&iBackend) == VENDOR_NONE)
+    {
+        if (load_driver())
+        {
+            atomic_store(&pApi, &DriverApi);
+            atomic_store(&iBackend, VENDOR_DRIVER);
+        }
+        else if (simulate_requested()) atomic_store(&iBackend, VENDOR_SIMULATED);
+        else iResult = -1;
+    }
+    pthread_mutex_unlock(&LoadMutex);
+    return iResult;
+}
+
+int vendor_simulate(void)
+{
+    int iResult = 0;
+
+    pthread_mutex_lock(&LoadMutex);
+    if (atomic_load(&iBackend) == VENDOR_DRIVER) iResult = -1;
+    else atomic_store(&iBackend, VENDOR_SIMULATED);
+    pthread_mutex_unlock(&LoadMutex);
+    return iResult;
+}
+
+int read_vendor_backend(void)
+{
+    return atomic_load(&iBackend);
+}
+
+const char* read_vendor_error(void)
+{
+    return acError;
+}
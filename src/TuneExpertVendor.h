@@ -0,0 +1,46 @@
+﻿// TuneExpertVendor.h: N1231B driver calls through a table, loaded with the driver library on first device open
+//
+// Nothing links the Keysight libraries: open_device() loads them and fails when they are missing, unless the
+// simulated board was opted into with vendor_simulate() or VENDOR_SIMULATE_ENV. Until a backend is chosen the table holds the simulated functions, which answer a null handle
+// with N1231B_ERR_HANDLE as the driver would, so replay and analysis never touch the driver at all.
+
+#pragma once
+
+#include "TuneExpertData.h"
+
+#define VENDOR_LIBRARY_ENV "N1231B_LIBRARY"  // path of libN1231B.so / N1231B.dll, overrides the search
+#define VENDOR_SIMULATE_ENV "N1231B_SIMULATE" // set and not "0": simulate the board when the driver cannot be loaded
+
+enum E_VENDOR_BACKEND
+{
+    VENDOR_NONE,                            // nothing loaded yet
+    VENDOR_DRIVER,                          // Keysight library, real boards
+    VENDOR_SIMULATED                        // one software board with slowly oscillating axes
+};
+
+#define VENDOR_FUNCTIONS(X) \
+    X(Open) X(Close) X(DefaultDevice) X(Find) X(GetErrStr) \
+    X(GetRawPosVelAll) X(GetGeLtStatus) X(GetStatus) X(ClearStatusBits) X(ClearPathErrorAll) \
+    X(PresetRaw) X(PresetRawAll) X(SamplePosVel) X(ReadRawPos) X(ReadRawVel) \
+    X(SetConfig) X(SetFilter) X(SetGeLtDirections) X(SetGeLtThresholds) X(SetHdwIoSetup)
+
+#define VENDOR_MEMBER(name) __typeof__(N1231B##name)* pfn##name;
+
+typedef struct {
+    VENDOR_FUNCTIONS(VENDOR_MEMBER)
+} VENDOR_API;
+
+const VENDOR_API* vendor_api(void);
+
+// The driver is not safe for concurrent calls on one handle: threads sharing a board (acquisition, health
+// watchdog, Board reads) make their calls between these. Priority inheriting where the platform supports it.
+void vendor_lock(void);
+void vendor_unlock(void);
+
+// 0 once a backend is in place, -1 when the driver library cannot be loaded (see read_vendor_error()) and
+// VENDOR_SIMULATE_ENV does not ask for the simulated board
+int vendor_load(void);
+// Selects the simulated board, -1 if the driver is already loaded
+int vendor_simulate(void);
+int read_vendor_backend(void);
+const char* read_vendor_error(void);
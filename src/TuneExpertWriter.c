@@ -0,0 +1,524 @@
+﻿// TuneExpertWriter.c: Asynchronous writer thread fed with filled aligned buffers
+//
+// The producer only copies into its current buffer; a full buffer is queued for the writer thread and a free
+// one taken in its place. The producer blocks only when every buffer is in flight, and that wait is counted.
+// On Linux the writer thread submits through io_uring, elsewhere (or if io_uring is refused) it uses pwrite.
+
+#ifndef _GNU_SOURCE
+    #define _GNU_SOURCE         // O_DIRECT
+#endif
+
+#include "TuneExpertData.h"
+#include "TuneExpertWriter.h"
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+
+#include <unistd.h>
+
+#ifdef __linux__
+    #include <linux/io_uring.h>
+    #include <sys/mman.h>
+    #include <sys/syscall.h>
+
+typedef struct {
+    int fd;
+    unsigned int uiEntries;
+    unsigned int *puiSqHead, *puiSqTail, *puiSqMask, *puiSqArray;
+    unsigned int *puiCqHead, *puiCqTail, *puiCqMask;
+    struct io_uring_sqe* pSqes;
+    struct io_uring_cqe* pCqes;
+    void *pSqRing, *pCqRing;
+    size_t ulSqSize, ulCqSize;
+} URING;
+#endif
+
+typedef struct {
+    unsigned char* pData;
+    size_t ulUsed;
+    size_t ulCarry;                 // leading bytes repeated from the previous buffer's last block, see async_writer_flush
+    unsigned long long ullOffset;
+} WRITE_BUFFER;
+
+struct ASYNC_WRITER {
+    int fd;
+    WRITE_BUFFER* aBuf;
+    unsigned int uiBuffers;
+    size_t ulBufferBytes;
+    unsigned int* auiFree;
+    unsigned int uiFreeCount;
+    unsigned int* auiFilled;
+    unsigned int uiFilledHead, uiFilledCount;
+    unsigned int uiInFlight;
+    int iCurrent;                   // buffer the producer is filling, -1 for none
+    unsigned long long ullOffset;   // file offset of the next hand-off
+    unsigned char* pCarry;          // unaligned tail of the last flushed buffer, copied into the next one
+    size_t ulCarry;
+    int bClosing;
+    pthread_mutex_t Mutex;
+    pthread_cond_t FreeCond, FilledCond;
+    pthread_t Thread;
+    WriterStats Stats;              // Stats.iError is filled from iError when read
+    atomic_int iError;              // first errno of the writer thread, checked by the producer without the lock
+#ifdef __linux__
+    URING Ring;
+#endif
+};
+
+#ifdef __linux__
+static int uring_init(URING* pRing, unsigned int uiEntries)
+{
+    struct io_uring_params p;
+    unsigned char *pSq, *pCq;
+
+    memset(&p, 0, sizeof(p));
+    memset(pRing, 0, sizeof(*pRing));
+    pRing->fd = (int)syscall(__NR_io_uring_setup, uiEntries, &p);
+    if (pRing->fd < 0) return -1;
+
+    pRing->uiEntries = p.sq_entries;
+    pRing->ulSqSize = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    pRing->ulCqSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (pRing->ulCqSize > pRing->ulSqSize) pRing->ulSqSize = pRing->ulCqSize;
+        pRing->ulCqSize = 0;
+    }
+
+    pRing->pSqRing = mmap(NULL, pRing->ulSqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, pRing->fd, IORING_OFF_SQ_RING);
+    if (pRing->pSqRing == MAP_FAILED) goto fail;
+    pRing->pCqRing = pRing->pSqRing;
+    if (pRing->ulCqSize)
+    {
+        pRing->pCqRing = mmap(NULL, pRing->ulCqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, pRing->fd, IORING_OFF_CQ_RING);
+        if (pRing->pCqRing == MAP_FAILED) goto fail;
+    }
+    pRing->pSqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, pRing->fd, IORING_OFF_SQES);
+    if (pRing->pSqes == MAP_FAILED) goto fail;
+
+    pSq = pRing->pSqRing;
+    pCq = pRing->pCqRing;
+    pRing->puiSqHead = (unsigned int*)(pSq + p.sq_off.head);
+    pRing->puiSqTail = (unsigned int*)(pSq + p.sq_off.tail);
+    pRing->puiSqMask = (unsigned int*)(pSq + p.sq_off.ring_mask);
+    pRing->puiSqArray = (unsigned int*)(pSq + p.sq_off.array);
+    pRing->puiCqHead = (unsigned int*)(pCq + p.cq_off.head);
+    pRing->puiCqTail = (unsigned int*)(pCq + p.cq_off.tail);
+    pRing->puiCqMask = (unsigned int*)(pCq + p.cq_off.ring_mask);
+    pRing->pCqes = (struct io_uring_cqe*)(pCq + p.cq_off.cqes);
+    return 0;
+
+fail:
+    if (pRing->pSqRing && pRing->pSqRing != MAP_FAILED) munmap(pRing->pSqRing, pRing->ulSqSize);
+    if (pRing->ulCqSize && pRing->pCqRing && pRing->pCqRing != MAP_FAILED) munmap(pRing->pCqRing, pRing->ulCqSize);
+    close(pRing->fd);
+    pRing->fd = -1;
+    return -1;
+}
+
+static void uring_free(URING* pRing)
+{
+    if (pRing->fd < 0) return;
+    munmap(pRing->pSqes, pRing->uiEntries * sizeof(struct io_uring_sqe));
+    if (pRing->ulCqSize) munmap(pRing->pCqRing, pRing->ulCqSize);
+    munmap(pRing->pSqRing, pRing->ulSqSize);
+    close(pRing->fd);
+    pRing->fd = -1;
+}
+
+static void uring_queue_write(URING* pRing, int fd, const void* pData, unsigned int uiLen, unsigned long long ullOffset, unsigned long long ullUser)
+{
+    unsigned int uiTail = *pRing->puiSqTail;
+    unsigned int uiIndex = uiTail & *pRing->puiSqMask;
+    struct io_uring_sqe* pSqe = &pRing->pSqes[uiIndex];
+
+    memset(pSqe, 0, sizeof(*pSqe));
+    pSqe->opcode = IORING_OP_WRITE;
+    pSqe->fd = fd;
+    pSqe->addr = (unsigned long long)(uintptr_t)pData;
+    pSqe->len = uiLen;
+    pSqe->off = ullOffset;
+    pSqe->user_data = ullUser;
+    pRing->puiSqArray[uiIndex] = uiIndex;
+    __atomic_store_n(pRing->puiSqTail, uiTail + 1, __ATOMIC_RELEASE);
+}
+
+static int uring_enter(URING* pRing, unsigned int uiSubmit, unsigned int uiWait)
+{
+    int rc;
+
+    do {
+        rc = (int)syscall(__NR_io_uring_enter, pRing->fd, uiSubmit, uiWait, uiWait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    } while (rc < 0 && errno == EINTR);
+    return rc;
+}
+#endif
+
+// Under O_DIRECT a short write only counts up to its last whole WRITER_ALIGN block, and the rest is written again
+// from there, so address, offset and length all stay aligned
+static int write_at(int fd, const unsigned char* pData, size_t ulBytes, unsigned long long ullOffset, int bDirect)
+{
+    while (ulBytes)
+    {
+        ssize_t lDone = pwrite(fd, pData, ulBytes, (off_t)ullOffset);
+        if (lDone < 0)
+        {
+            if (errno == EINTR) continue;
+            return errno;
+        }
+        if (bDirect) lDone &= ~(long)(WRITER_ALIGN - 1);
+        if (lDone == 0) return EIO;
+        pData += lDone;
+        ulBytes -= lDone;
+        ullOffset += lDone;
+    }
+    return 0;
+}
+
+static void release_buffer(ASYNC_WRITER* pWriter, unsigned int uiBuf, int iError)
+{
+    int iNone = 0;
+
+    if (iError) atomic_compare_exchange_strong(&pWriter->iError, &iNone, iError);
+    pthread_mutex_lock(&pWriter->Mutex);
+    if (!iError)
+    {
+        pWriter->Stats.ullBytesWritten += pWriter->aBuf[uiBuf].ulUsed - pWriter->aBuf[uiBuf].ulCarry;
+        pWriter->Stats.ullBuffersWritten++;
+    }
+    pWriter->auiFree[pWriter->uiFreeCount++] = uiBuf;
+    pWriter->uiInFlight--;
+    pthread_cond_signal(&pWriter->FreeCond);
+    pthread_mutex_unlock(&pWriter->Mutex);
+}
+
+// Writes are padded to WRITER_ALIGN for O_DIRECT, close truncates the file back to its real length
+static size_t padded(const ASYNC_WRITER* pWriter, size_t ulUsed)
+{
+    return pWriter->Stats.bDirect ? (ulUsed + WRITER_ALIGN - 1) & ~(size_t)(WRITER_ALIGN - 1) : ulUsed;
+}
+
+static void write_sync(ASYNC_WRITER* pWriter, const unsigned int* puiTake, unsigned int uiTake)
+{
+    unsigned int i;
+
+    for (i = 0; i < uiTake; i++)
+    {
+        WRITE_BUFFER* pBuf = &pWriter->aBuf[puiTake[i]];
+        release_buffer(pWriter, puiTake[i], write_at(pWriter->fd, pBuf->pData, padded(pWriter, pBuf->ulUsed), pBuf->ullOffset, pWriter->Stats.bDirect));
+    }
+}
+
+static void* writer_thread(void* pArg)
+{
+    ASYNC_WRITER* pWriter = pArg;
+    unsigned int uiSubmitted = 0;
+
+    for (;;)
+    {
+        unsigned int auiTake[64];
+        unsigned int uiTake = 0, uiRoom = 64, i;
+
+        pthread_mutex_lock(&pWriter->Mutex);
+        while (!pWriter->uiFilledCount && !pWriter->bClosing && !uiSubmitted)
+            pthread_cond_wait(&pWriter->FilledCond, &pWriter->Mutex);
+        if (!pWriter->uiFilledCount && pWriter->bClosing && !uiSubmitted)
+        {
+            pthread_mutex_unlock(&pWriter->Mutex);
+            break;
+        }
+#ifdef __linux__
+        if (pWriter->Stats.iBackend == WRITER_IO_URING) uiRoom = pWriter->Ring.uiEntries - uiSubmitted;
+#endif
+        while (pWriter->uiFilledCount && uiTake < uiRoom && uiTake < 64)
+        {
+            // A buffer rewriting the block the one before it ended in only goes out once nothing else is in
+            // flight, so the older padded copy of that block cannot land after it
+            if (pWriter->aBuf[pWriter->auiFilled[pWriter->uiFilledHead]].ulCarry && (uiTake || uiSubmitted)) break;
+            auiTake[uiTake++] = pWriter->auiFilled[pWriter->uiFilledHead];
+            pWriter->uiFilledHead = (pWriter->uiFilledHead + 1) % pWriter->uiBuffers;
+            pWriter->uiFilledCount--;
+        }
+        pthread_mutex_unlock(&pWriter->Mutex);
+
+#ifdef __linux__
+        // After a fallback to pwrite the writes already submitted are still reaped here, so their buffers come back
+        if (pWriter->Stats.iBackend == WRITER_IO_URING || uiSubmitted)
+        {
+            URING* pRing = &pWriter->Ring;
+            unsigned int uiQueued = 0, uiHead, uiTail;
+
+            if (pWriter->Stats.iBackend == WRITER_IO_URING)
+            {
+                for (i = 0; i < uiTake; i++)
+                {
+                    WRITE_BUFFER* pBuf = &pWriter->aBuf[auiTake[i]];
+                    uring_queue_write(pRing, pWriter->fd, pBuf->pData, (unsigned int)padded(pWriter, pBuf->ulUsed), pBuf->ullOffset, auiTake[i]);
+                }
+                uiQueued = uiTake;
+            }
+            else write_sync(pWriter, auiTake, uiTake);
+            uiSubmitted += uiQueued;
+
+            if (uring_enter(pRing, uiQueued, uiSubmitted ? 1 : 0) < 0)
+            {
+                // Submission refused: take back the entries the kernel has not consumed, write them synchronously
+                // and stay on pwrite from now on
+                unsigned int uiLeft = *pRing->puiSqTail - __atomic_load_n(pRing->puiSqHead, __ATOMIC_ACQUIRE);
+
+                if (uiLeft > uiQueued) uiLeft = uiQueued;
+
+                pWriter->Stats.iBackend = WRITER_PWRITE;
+                __atomic_store_n(pRing->puiSqTail, *pRing->puiSqTail - uiLeft, __ATOMIC_RELEASE);
+                write_sync(pWriter, auiTake + uiQueued - uiLeft, uiLeft);
+                uiSubmitted -= uiLeft;
+            }
+
+            uiHead = *pRing->puiCqHead;
+            uiTail = __atomic_load_n(pRing->puiCqTail, __ATOMIC_ACQUIRE);
+            while (uiHead != uiTail)
+            {
+                struct io_uring_cqe* pCqe = &pRing->pCqes[uiHead & *pRing->puiCqMask];
+                unsigned int uiBuf = (unsigned int)pCqe->user_data;
+                WRITE_BUFFER* pBuf = &pWriter->aBuf[uiBuf];
+                size_t ulWant = padded(pWriter, pBuf->ulUsed);
+                int iError = 0;
+
+                if (pCqe->res < 0)
+                {
+                    // Old kernels without IORING_OP_WRITE report EINVAL; either way the buffer is retried with pwrite
+                    if (pCqe->res == -EINVAL) pWriter->Stats.iBackend = WRITER_PWRITE;
+                    iError = write_at(pWriter->fd, pBuf->pData, ulWant, pBuf->ullOffset, pWriter->Stats.bDirect);
+                }
+                else if ((size_t)pCqe->res < ulWant)
+                {
+                    // Resume from the last aligned block written, O_DIRECT refuses anything else with EINVAL
+                    size_t ulDone = pWriter->Stats.bDirect ? (size_t)pCqe->res & ~(size_t)(WRITER_ALIGN - 1) : (size_t)pCqe->res;
+                    iError = write_at(pWriter->fd, pBuf->pData + ulDone, ulWant - ulDone, pBuf->ullOffset + ulDone, pWriter->Stats.bDirect);
+                }
+
+                uiHead++;
+                __atomic_store_n(pRing->puiCqHead, uiHead, __ATOMIC_RELEASE);
+                uiSubmitted--;
+                release_buffer(pWriter, uiBuf, iError);
+            }
+            continue;
+        }
+#endif
+        write_sync(pWriter, auiTake, uiTake);
+    }
+    return NULL;
+}
+
+static void* aligned_buffer(size_t ulBytes)
+{
+    void* p = NULL;
+    return posix_memalign(&p, WRITER_ALIGN, ulBytes) == 0 ? p : NULL;
+}
+
+static void aligned_free(void* p)
+{
+    free(p);
+}
+
+static void writer_free(ASYNC_WRITER* pWriter)
+{
+    unsigned int i;
+
+    if (pWriter->aBuf)
+        for (i = 0; i < pWriter->uiBuffers; i++) aligned_free(pWriter->aBuf[i].pData);
+    free(pWriter->aBuf);
+    free(pWriter->auiFree);
+    free(pWriter->auiFilled);
+    aligned_free(pWriter->pCarry);
+#ifdef __linux__
+    uring_free(&pWriter->Ring);
+#endif
+    if (pWriter->fd >= 0) close(pWriter->fd);
+    pthread_mutex_destroy(&pWriter->Mutex);
+    pthread_cond_destroy(&pWriter->FreeCond);
+    pthread_cond_destroy(&pWriter->FilledCond);
+    free(pWriter);
+}
+
+ASYNC_WRITER* async_writer_open(const char* pPath, unsigned int uiBuffers, size_t ulBufferBytes)
+{
+    ASYNC_WRITER* pWriter;
+    unsigned int i;
+
+    if (uiBuffers < 2) uiBuffers = WRITER_DEFAULT_BUFFERS;
+    if (ulBufferBytes == 0) ulBufferBytes = WRITER_DEFAULT_BUFFER_BYTES;
+    ulBufferBytes = (ulBufferBytes + WRITER_ALIGN - 1) & ~(size_t)(WRITER_ALIGN - 1);
+
+    if (!(pWriter = calloc(1, sizeof(ASYNC_WRITER)))) return NULL;
+    pthread_mutex_init(&pWriter->Mutex, NULL);
+    pthread_cond_init(&pWriter->FreeCond, NULL);
+    pthread_cond_init(&pWriter->FilledCond, NULL);
+    pWriter->iCurrent = -1;
+    pWriter->uiBuffers = uiBuffers;
+    pWriter->ulBufferBytes = ulBufferBytes;
+#ifdef __linux__
+    pWriter->Ring.fd = -1;
+#endif
+
+#if defined(__linux__) && defined(O_DIRECT)
+    pWriter->fd = open(pPath, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+    pWriter->Stats.bDirect = pWriter->fd >= 0;
+    if (pWriter->fd < 0)
+#endif
+    pWriter->fd = open(pPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (pWriter->fd < 0)
+    {
+        writer_free(pWriter);
+        return NULL;
+    }
+
+    pWriter->aBuf = calloc(uiBuffers, sizeof(WRITE_BUFFER));
+    pWriter->auiFree = malloc(uiBuffers * sizeof(unsigned int));
+    pWriter->auiFilled = malloc(uiBuffers * sizeof(unsigned int));
+    pWriter->pCarry = aligned_buffer(WRITER_ALIGN);
+    if (!pWriter->aBuf || !pWriter->auiFree || !pWriter->auiFilled || !pWriter->pCarry)
+    {
+        writer_free(pWriter);
+        return NULL;
+    }
+    for (i = 0; i < uiBuffers; i++)
+    {
+        if (!(pWriter->aBuf[i].pData = aligned_buffer(ulBufferBytes)))
+        {
+            writer_free(pWriter);
+            return NULL;
+        }
+        memset(pWriter->aBuf[i].pData, 0, ulBufferBytes);     // prefault so the first hand-offs do not page fault
+        pWriter->auiFree[pWriter->uiFreeCount++] = i;
+    }
+
+    pWriter->Stats.iBackend = WRITER_PWRITE;
+#ifdef __linux__
+    if (uring_init(&pWriter->Ring, uiBuffers) == 0) pWriter->Stats.iBackend = WRITER_IO_URING;
+#endif
+
+    if (pthread_create(&pWriter->Thread, NULL, writer_thread, pWriter) != 0)
+    {
+        writer_free(pWriter);
+        return NULL;
+    }
+    return pWriter;
+}
+
+static int take_buffer(ASYNC_WRITER* pWriter)
+{
+    WRITE_BUFFER* pBuf;
+
+    pthread_mutex_lock(&pWriter->Mutex);
+    if (pWriter->uiFreeCount == 0)
+    {
+        long long llStart = get_time_ns();
+        unsigned long long ullWait;
+
+        pWriter->Stats.ullProducerWaits++;
+        while (pWriter->uiFreeCount == 0) pthread_cond_wait(&pWriter->FreeCond, &pWriter->Mutex);
+        ullWait = (unsigned long long)(get_time_ns() - llStart);
+        pWriter->Stats.ullProducerWaitNs += ullWait;
+        if (ullWait > pWriter->Stats.ullMaxWaitNs) pWriter->Stats.ullMaxWaitNs = ullWait;
+    }
+    pWriter->iCurrent = (int)pWriter->auiFree[--pWriter->uiFreeCount];
+    pthread_mutex_unlock(&pWriter->Mutex);
+
+    pBuf = &pWriter->aBuf[pWriter->iCurrent];
+    memcpy(pBuf->pData, pWriter->pCarry, pWriter->ulCarry);
+    pBuf->ulUsed = pBuf->ulCarry = pWriter->ulCarry;
+    pWriter->ulCarry = 0;
+    return pWriter->iCurrent;
+}
+
+static void hand_off(ASYNC_WRITER* pWriter)
+{
+    WRITE_BUFFER* pBuf = &pWriter->aBuf[pWriter->iCurrent];
+
+    pBuf->ullOffset = pWriter->ullOffset - pBuf->ulCarry;
+    pWriter->ullOffset += pBuf->ulUsed - pBuf->ulCarry;
+    if (pBuf->ulUsed < pWriter->ulBufferBytes)
+        memset(pBuf->pData + pBuf->ulUsed, 0, padded(pWriter, pBuf->ulUsed) - pBuf->ulUsed);
+
+    pthread_mutex_lock(&pWriter->Mutex);
+    pWriter->auiFilled[(pWriter->uiFilledHead + pWriter->uiFilledCount++) % pWriter->uiBuffers] = (unsigned int)pWriter->iCurrent;
+    if (++pWriter->uiInFlight > pWriter->Stats.uiMaxInFlight) pWriter->Stats.uiMaxInFlight = pWriter->uiInFlight;
+    pthread_cond_signal(&pWriter->FilledCond);
+    pthread_mutex_unlock(&pWriter->Mutex);
+    pWriter->iCurrent = -1;
+}
+
+int async_writer_write(ASYNC_WRITER* pWriter, const void* pData, size_t ulBytes)
+{
+    const unsigned char* p = pData;
+
+    if (atomic_load_explicit(&pWriter->iError, memory_order_relaxed)) return -1;
+    while (ulBytes)
+    {
+        WRITE_BUFFER* pBuf;
+        size_t n;
+
+        if (pWriter->iCurrent < 0) take_buffer(pWriter);
+        pBuf = &pWriter->aBuf[pWriter->iCurrent];
+        n = pWriter->ulBufferBytes - pBuf->ulUsed;
+        if (n > ulBytes) n = ulBytes;
+        memcpy(pBuf->pData + pBuf->ulUsed, p, n);
+        pBuf->ulUsed += n;
+        p += n;
+        ulBytes -= n;
+        if (pBuf->ulUsed == pWriter->ulBufferBytes) hand_off(pWriter);
+    }
+    return 0;
+}
+
+int async_writer_flush(ASYNC_WRITER* pWriter)
+{
+    WRITE_BUFFER* pBuf;
+
+    if (atomic_load_explicit(&pWriter->iError, memory_order_relaxed)) return -1;
+    if (pWriter->iCurrent < 0) return 0;
+    pBuf = &pWriter->aBuf[pWriter->iCurrent];
+    if (pBuf->ulUsed == pBuf->ulCarry) return 0;
+
+    // O_DIRECT writes whole blocks: the next buffer starts over at the block this one ends in
+    if (pWriter->Stats.bDirect) pWriter->ulCarry = pBuf->ulUsed & (WRITER_ALIGN - 1);
+    memcpy(pWriter->pCarry, pBuf->pData + pBuf->ulUsed - pWriter->ulCarry, pWriter->ulCarry);
+    hand_off(pWriter);
+    return 0;
+}
+
+int async_writer_close(ASYNC_WRITER* pWriter)
+{
+    int iError;
+
+    if (!pWriter) return 0;
+    if (pWriter->iCurrent >= 0 && pWriter->aBuf[pWriter->iCurrent].ulUsed > pWriter->aBuf[pWriter->iCurrent].ulCarry) hand_off(pWriter);
+
+    pthread_mutex_lock(&pWriter->Mutex);
+    pWriter->bClosing = 1;
+    pthread_cond_signal(&pWriter->FilledCond);
+    pthread_mutex_unlock(&pWriter->Mutex);
+    pthread_join(pWriter->Thread, NULL);
+
+    iError = atomic_load(&pWriter->iError);
+    if (ftruncate(pWriter->fd, (off_t)pWriter->ullOffset) != 0 && !iError) iError = errno;
+    if (fsync(pWriter->fd) != 0 && !iError) iError = errno;
+    writer_free(pWriter);
+    return iError ? -1 : 0;
+}
+
+WriterStats async_writer_stats(ASYNC_WRITER* pWriter)
+{
+    WriterStats ws;
+
+    pthread_mutex_lock(&pWriter->Mutex);
+    ws = pWriter->Stats;
+    pthread_mutex_unlock(&pWriter->Mutex);
+    ws.iError = atomic_load(&pWriter->iError);
+    return ws;
+}
@@ -0,0 +1,36 @@
+﻿// TuneExpertWriter.h: Asynchronous file writer with bounded aligned buffers (io_uring or pwrite thread)
+//
+
+#pragma once
+
+#include <stddef.h>
+
+#define WRITER_ALIGN 4096
+#define WRITER_DEFAULT_BUFFERS 8
+#define WRITER_DEFAULT_BUFFER_BYTES (1 << 20)
+
+enum E_WRITER_BACKEND
+{
+    WRITER_PWRITE,
+    WRITER_IO_URING
+};
+
+typedef struct {
+    int iBackend;                           // E_WRITER_BACKEND in use
+    int bDirect;                            // file opened with O_DIRECT
+    int iError;                             // first errno seen by the writer thread, 0 if none
+    unsigned int uiMaxInFlight;             // most buffers queued or being written at once
+    unsigned long long ullBytesWritten, ullBuffersWritten;
+    unsigned long long ullProducerWaits;    // hand-offs that found no free buffer
+    unsigned long long ullProducerWaitNs, ullMaxWaitNs;
+    unsigned long long ullOverruns;         // live samples dropped because the recording queue was full
+    unsigned long long ullDropped;          // live samples dropped because writing them failed, see iError
+} WriterStats;
+
+typedef struct ASYNC_WRITER ASYNC_WRITER;
+
+ASYNC_WRITER* async_writer_open(const char* pPath, unsigned int uiBuffers, size_t ulBufferBytes);
+int async_writer_write(ASYNC_WRITER* pWriter, const void* pData, size_t ulBytes);
+int async_writer_flush(ASYNC_WRITER* pWriter);    // hands the buffer being filled to the writer thread now
+int async_writer_close(ASYNC_WRITER* pWriter);
+WriterStats async_writer_stats(ASYNC_WRITER* pWriter);
@@ -0,0 +1,624 @@
+﻿// test_capture.c: Capture files written, read back and seeked, synchronously and through the async writer,
+// and window queries checked against aggregates computed directly from the samples
+// Takes the directory for its scratch files as the only argument.
+
+#include "TuneExpertCapture.h"
+#include "TuneExpertEnv.h"
+#include "TuneExpertEnvelope.h"
+#include "TuneExpertParallel.h"
+#include "TuneExpertQuery.h"
+#include "TuneExpertReplay.h"
+#include "TuneExpertVendor.h"
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <unistd.h>
+
+#define TEST_SAMPLES (5 * CAPTURE_CHUNK_SAMPLES + 123)
+#define TEST_START 1620000000000000000LL
+#define TEST_STEP 1000                      // ns between samples
+#define TEST_COMP_AT (2 * CAPTURE_CHUNK_SAMPLES + 500)  // first sample recorded with the second factor
+#define TEST_WINDOWS 32
+#define TEST_ENV_SAMPLES (9 * 65536 + 37)   // several envelope blocks at level 0 and 1
+#define TEST_ENV_COMP_AT (5 * ENVELOPE_BASE + 300)  // mid bucket, so buckets span the change
+#define TEST_BOARD_SAMPLES 400
+#define TEST_BOARD_SLEEP_NS 2000000     // spans most of a period of each simulated axis
+
+#define CHECK(cond) \
+    do { if (!(cond)) { fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); return 1; } } while (0)
+
+static RawSample aSamples[TEST_SAMPLES], aRead[TEST_SAMPLES + 1];
+static double adComp[2];                    // factors before and from TEST_COMP_AT on
+static const unsigned int auiComparator[QUERY_COMPARATORS] = {
+    N1231B_LT_TRUE_1, N1231B_GE_TRUE_1, N1231B_LT_TRUE_2, N1231B_GE_TRUE_2,
+    N1231B_LT_TRUE_3A, N1231B_GE_TRUE_3A, N1231B_LT_TRUE_3B, N1231B_GE_TRUE_3B
+};
+
+static void make_samples(void)
+{
+    unsigned long i;
+
+    memset(aSamples, 0, sizeof(aSamples));
+    for (i = 0; i < TEST_SAMPLES; i++)
+    {
+        aSamples[i].llTime = TEST_START + (long long)i * TEST_STEP;
+        aSamples[i].llAx1Pos = (long long)i * 7 - 40000;
+        aSamples[i].llAx2Pos = (long long)(i % 1000) * (i % 3 ? 1 : -1);
+        aSamples[i].llAx3Pos = 1LL << 34;
+        aSamples[i].lAx1Vel = (long)(i % 211) - 105;
+        aSamples[i].uiGeLtStatus = (unsigned int)(i / 4096) | (i % 5 ? 0 : N1231B_GE_TRUE_1) | (i % 7 ? 0 : N1231B_LT_TRUE_3B);
+        aSamples[i].wValid = N1231B_VALID_1 | N1231B_VALID_2 | N1231B_VALID_3;
+        if (i % 13 == 0) aSamples[i].wValid &= ~N1231B_VALID_2;
+        if (i % 29 == 0) aSamples[i].wValid &= ~(N1231B_VALID_1 | N1231B_VALID_3);
+    }
+}
+
+static void remove_capture(const char* pPath)
+{
+    char acSidecar[CAPTURE_PATH_MAX + 8];
+
+    remove(pPath);
+    snprintf(acSidecar, sizeof(acSidecar), "%s" ENVELOPE_SUFFIX, pPath);
+    remove(acSidecar);
+    snprintf(acSidecar, sizeof(acSidecar), "%s" SUMMARY_SUFFIX, pPath);
+    remove(acSidecar);
+}
+
+static int same_sample(const RawSample* a, const RawSample* b)
+{
+    return a->llTime == b->llTime && a->llAx1Pos == b->llAx1Pos && a->llAx2Pos == b->llAx2Pos && a->llAx3Pos == b->llAx3Pos
+        && a->lAx1Vel == b->lAx1Vel && a->lAx2Vel == b->lAx2Vel && a->lAx3Vel == b->lAx3Vel
+        && a->uiGeLtStatus == b->uiGeLtStatus && a->wValid == b->wValid;
+}
+
+// Reads from the current position to the end and checks it matches aSamples from ulFirst on
+static int check_rest(CAPTURE_READER* pReader, unsigned long ulFirst)
+{
+    unsigned long ulDone = 0, i;
+    long n;
+
+    // Odd request sizes cross chunk boundaries mid call
+    while ((n = capture_read(pReader, aRead + ulDone, 1000)) > 0) ulDone += (unsigned long)n;
+    CHECK(n == 0);
+    CHECK(ulDone == TEST_SAMPLES - ulFirst);
+    for (i = 0; i < ulDone; i++) CHECK(same_sample(&aRead[i], &aSamples[ulFirst + i]));
+    return 0;
+}
+
+static int test_file(const char* pPath, int bAsync)
+{
+    CAPTURE_WRITER* pWriter = bAsync ? capture_open_async(pPath) : capture_open(pPath);
+    CAPTURE_READER* pReader;
+    const CAPTURE_INDEX_ENTRY* pIndex;
+    unsigned long ulEntries, ulTotal = 0, i;
+
+    CHECK(pWriter != NULL);
+    // Uneven writes so chunks fill across calls
+    for (i = 0; i < TEST_SAMPLES; i += 777)
+        CHECK(capture_write(pWriter, aSamples + i, TEST_SAMPLES - i < 777 ? TEST_SAMPLES - i : 777) == 0);
+    CHECK(capture_close(pWriter) == 0);
+
+    CHECK((pReader = capture_open_read(pPath)) != NULL);
+    CHECK(memcmp(capture_header(pReader)->szMagic, CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC)) == 0);
+    CHECK(capture_header(pReader)->uiVersion == CAPTURE_VERSION);
+    CHECK(capture_header(pReader)->uiSource == CAPTURE_SOURCE_UNKNOWN);
+    pIndex = capture_index(pReader, &ulEntries);
+    CHECK(ulEntries > 1);
+    for (i = 0; i < ulEntries; i++)
+    {
+        CHECK(pIndex[i].llFirstTime <= pIndex[i].llLastTime);
+        if (i) CHECK(pIndex[i].llFirstTime > pIndex[i - 1].llLastTime);
+        ulTotal += pIndex[i].uiSamples;
+    }
+    CHECK(ulTotal == TEST_SAMPLES);
+    CHECK(pIndex[0].llFirstTime == TEST_START);
+    CHECK(check_rest(pReader, 0) == 0);
+
+    // Exact sample, between samples, on a chunk boundary, before the start and past the end
+    CHECK(capture_seek(pReader, TEST_START + 12345LL * TEST_STEP) == 0);
+    CHECK(check_rest(pReader, 12345) == 0);
+    CHECK(capture_seek(pReader, TEST_START + 999LL * TEST_STEP + 1) == 0);
+    CHECK(check_rest(pReader, 1000) == 0);
+    CHECK(capture_seek(pReader, pIndex[2].llFirstTime) == 0);
+    CHECK(check_rest(pReader, 2 * CAPTURE_CHUNK_SAMPLES) == 0);
+    CHECK(capture_seek(pReader, TEST_START - 1) == 0);
+    CHECK(check_rest(pReader, 0) == 0);
+    CHECK(capture_seek(pReader, TEST_START + (long long)TEST_SAMPLES * TEST_STEP) == 0);
+    CHECK(capture_read(pReader, aRead, 1) == 0);
+
+    // Every chunk decodes on its own
+    CHECK(capture_read_chunk(pReader, ulEntries - 1, aRead) == (long)pIndex[ulEntries - 1].uiSamples);
+    CHECK(same_sample(&aRead[0], &aSamples[TEST_SAMPLES - pIndex[ulEntries - 1].uiSamples]));
+    capture_close_read(pReader);
+    remove_capture(pPath);
+    return 0;
+}
+
+// An asynchronous capture still open decodes up to its last complete chunk, even when O_DIRECT leaves every
+// chunk ending mid block
+static int test_unclosed(const char* pPath)
+{
+    const unsigned long ulChunks = 3;
+    CAPTURE_WRITER* pWriter = capture_open_async(pPath);
+    CAPTURE_READER* pReader;
+    struct timespec ts = {0, 1000000}, tsStart, tsEnd;
+    unsigned long ulDone = 0, i;
+    int iWait;
+    long n;
+
+    CHECK(pWriter != NULL);
+    clock_gettime(CLOCK_MONOTONIC, &tsStart);
+    for (i = 0; i < ulChunks * CAPTURE_CHUNK_SAMPLES + 100; i += 777)
+        CHECK(capture_write(pWriter, aSamples + i, ulChunks * CAPTURE_CHUNK_SAMPLES + 100 - i < 777 ? ulChunks * CAPTURE_CHUNK_SAMPLES + 100 - i : 777) == 0);
+    clock_gettime(CLOCK_MONOTONIC, &tsEnd);
+    // Completed chunks share a buffer until CAPTURE_FLUSH_NS passes, then capture_flush hands them on at once
+    if ((tsEnd.tv_sec - tsStart.tv_sec) * 1000000000LL + tsEnd.tv_nsec - tsStart.tv_nsec < CAPTURE_FLUSH_NS)
+        CHECK(capture_writer_stats(pWriter).ullBuffersWritten == 0);
+    CHECK(capture_flush(pWriter) == 0);
+    for (iWait = 0; iWait < 5000 && capture_writer_stats(pWriter).ullBuffersWritten < 1; iWait++) nanosleep(&ts, NULL);
+    CHECK(capture_writer_stats(pWriter).ullBuffersWritten == 1);
+
+    CHECK((pReader = capture_open_read(pPath)) != NULL);
+    while ((n = capture_read(pReader, aRead + ulDone, 1000)) > 0) ulDone += (unsigned long)n;
+    CHECK(ulDone == ulChunks * CAPTURE_CHUNK_SAMPLES + 100);
+    for (i = 0; i < ulDone; i++) CHECK(same_sample(&aRead[i], &aSamples[i]));
+    capture_close_read(pReader);
+
+    CHECK(capture_close(pWriter) == 0);
+    remove_capture(pPath);
+    return 0;
+}
+
+// Live recording goes through the queue and the recording thread; stopping writes out what was queued
+static int test_live(const char* pPath)
+{
+    CAPTURE_READER* pReader;
+    unsigned long ulEntries, i;
+    double dComp;
+
+    CHECK(start_recording(pPath) == 0);
+    for (i = 0; i < TEST_SAMPLES; i++) capture_update(&aSamples[i], adComp[i >= TEST_COMP_AT]);
+    CHECK(read_recording_stats().ullOverruns == 0);
+    stop_recording();
+
+    CHECK((pReader = capture_open_read(pPath)) != NULL);
+    CHECK(check_rest(pReader, 0) == 0);
+    capture_index(pReader, &ulEntries);
+    CHECK(capture_chunk_comp(pReader, 0, &dComp) == 0 && dComp == adComp[0]);
+    CHECK(capture_chunk_comp(pReader, ulEntries - 1, &dComp) == 0 && dComp == adComp[1]);
+    capture_close_read(pReader);
+    remove_capture(pPath);
+    return 0;
+}
+
+// A stream writer keeps no error of its own: the recording reports the first failed write and counts the
+// samples it could not write
+static int test_live_error(void)
+{
+    struct timespec ts = {0, 1000000};
+    WriterStats ws;
+    int afd[2], iWait;
+    unsigned long i;
+
+    signal(SIGPIPE, SIG_IGN);
+    CHECK(pipe(afd) == 0);
+    close(afd[0]);
+    CHECK(start_recording_fd(afd[1]) == 0);
+    for (i = 0; i < TEST_SAMPLES; i++) capture_update(&aSamples[i], adComp[0]);
+    for (iWait = 0; iWait < 5000 && read_recording_stats().iError == 0; iWait++) nanosleep(&ts, NULL);
+    ws = read_recording_stats();
+    stop_recording();
+    CHECK(ws.iError == EPIPE);
+    CHECK(ws.ullDropped > 0 && ws.ullDropped <= TEST_SAMPLES);
+    CHECK(ws.ullOverruns == 0);
+    return 0;
+}
+
+static int near(double dGot, double dWant)
+{
+    return fabs(dGot - dWant) <= 1e-9 * (1 + fabs(dWant));
+}
+
+// Every field of every window against a pass over the samples, converted sample by sample
+static int check_windows(const QueryWindow* pWindows, unsigned long ulWindows)
+{
+    unsigned long w, i;
+    int c;
+
+    for (w = 0; w < ulWindows; w++)
+    {
+        const QueryWindow* pWindow = &pWindows[w];
+        unsigned long long ullCount = 0, aullInvalid[QUERY_INVALID_COUNTS] = { 0 }, aullComparator[QUERY_COMPARATORS] = { 0 };
+        double adSum[QUERY_CHANNELS] = { 0 }, adSq[QUERY_CHANNELS] = { 0 }, adMin[QUERY_CHANNELS], adMax[QUERY_CHANNELS];
+
+        for (c = 0; c < QUERY_CHANNELS; c++)
+        {
+            adMin[c] = INFINITY;
+            adMax[c] = -INFINITY;
+        }
+        for (i = 0; i < TEST_SAMPLES; i++)
+        {
+            const RawSample* p = &aSamples[i];
+            double dPos = UM_PER_COUNT_AT(LAMBDA_NM, FOLD, adComp[i >= TEST_COMP_AT]);
+            double adValue[QUERY_CHANNELS];
+
+            if (p->llTime < pWindow->llStartTime || p->llTime >= pWindow->llEndTime) continue;
+            adValue[QUERY_AX1_POS] = dPos * p->llAx1Pos - START_MM * 1000;
+            adValue[QUERY_AX2_POS] = dPos * p->llAx2Pos - START_MM * 1000;
+            adValue[QUERY_AX3_POS] = dPos * p->llAx3Pos - START_MM * 1000;
+            adValue[QUERY_AX1_VEL] = UMPS_PER_COUNT(dPos) * p->lAx1Vel;
+            adValue[QUERY_AX2_VEL] = UMPS_PER_COUNT(dPos) * p->lAx2Vel;
+            adValue[QUERY_AX3_VEL] = UMPS_PER_COUNT(dPos) * p->lAx3Vel;
+            for (c = 0; c < QUERY_CHANNELS; c++)
+            {
+                adSum[c] += adValue[c];
+                adSq[c] += adValue[c] * adValue[c];
+                if (adValue[c] < adMin[c]) adMin[c] = adValue[c];
+                if (adValue[c] > adMax[c]) adMax[c] = adValue[c];
+            }
+            if (!(p->wValid & N1231B_VALID_1)) aullInvalid[QUERY_INVALID_1]++;
+            if (!(p->wValid & N1231B_VALID_2)) aullInvalid[QUERY_INVALID_2]++;
+            if (!(p->wValid & N1231B_VALID_3)) aullInvalid[QUERY_INVALID_3]++;
+            if ((p->wValid & (N1231B_VALID_1 | N1231B_VALID_2 | N1231B_VALID_3)) != (N1231B_VALID_1 | N1231B_VALID_2 | N1231B_VALID_3))
+                aullInvalid[QUERY_INVALID_ANY]++;
+            for (c = 0; c < QUERY_COMPARATORS; c++)
+                if (p->uiGeLtStatus & auiComparator[c]) aullComparator[c]++;
+            ullCount++;
+        }
+
+        CHECK(pWindow->ullSamples == ullCount);
+        for (c = 0; c < QUERY_INVALID_COUNTS; c++) CHECK(pWindow->aullInvalid[c] == aullInvalid[c]);
+        for (c = 0; c < QUERY_COMPARATORS; c++) CHECK(pWindow->aullComparator[c] == aullComparator[c]);
+        for (c = 0; c < QUERY_CHANNELS; c++)
+        {
+            const QueryValue* v = &pWindow->aValue[c];
+
+            if (!ullCount)
+            {
+                CHECK(isnan(v->dMean) && isnan(v->dRms) && isnan(v->dMin) && isnan(v->dMax));
+                continue;
+            }
+            CHECK(near(v->dMean, adSum[c] / ullCount));
+            CHECK(near(v->dRms, sqrt(adSq[c] / ullCount)));
+            CHECK(near(v->dMin, adMin[c]));
+            CHECK(near(v->dMax, adMax[c]));
+        }
+    }
+    return 0;
+}
+
+// Windows straddling chunk edges, spanning whole chunks and the capture, and lying before and after it
+static int check_queries(QUERY_READER* pReader, CAPTURE_CATALOG* pCatalog)
+{
+    static const long long allStart[] = { TEST_START - 3000LL * TEST_STEP, TEST_START + 77LL * TEST_STEP, TEST_START - 1 };
+    static const long long allWindow[] = { 1500LL * TEST_STEP, 10000LL * TEST_STEP + 333, (long long)TEST_SAMPLES * TEST_STEP + 10 };
+    static const unsigned long aulWindows[] = { TEST_WINDOWS, 4, 1 };
+    QueryWindow aWindows[TEST_WINDOWS];
+    int i;
+
+    for (i = 0; i < (int)(sizeof(allStart) / sizeof(allStart[0])); i++)
+    {
+        if (pReader) CHECK(query_windows(pReader, allStart[i], allWindow[i], aWindows, aulWindows[i]) == 0);
+        else CHECK(catalog_query(pCatalog, allStart[i], allWindow[i], aWindows, aulWindows[i]) == 0);
+        CHECK(check_windows(aWindows, aulWindows[i]) == 0);
+    }
+    return 0;
+}
+
+// The factor changes mid capture: the writer ends the chunk there and the query converts each side with its own
+static int write_query_capture(CAPTURE_WRITER* pWriter)
+{
+    unsigned long i;
+
+    CHECK(pWriter != NULL);
+    for (i = 0; i < TEST_SAMPLES; i += 777)
+    {
+        unsigned long n = TEST_SAMPLES - i < 777 ? TEST_SAMPLES - i : 777;
+
+        if (i < TEST_COMP_AT && i + n > TEST_COMP_AT)
+        {
+            CHECK(capture_write(pWriter, aSamples + i, TEST_COMP_AT - i) == 0);
+            CHECK(capture_set_comp(pWriter, adComp[1]) == 0);
+            CHECK(capture_write(pWriter, aSamples + TEST_COMP_AT, i + n - TEST_COMP_AT) == 0);
+        }
+        else CHECK(capture_write(pWriter, aSamples + i, n) == 0);
+    }
+    CHECK(capture_close(pWriter) == 0);
+    return 0;
+}
+
+// Parallel decoding converts every chunk with the factor it was recorded under
+static int check_parallel(const char* pPath)
+{
+    ParallelConfig pc;
+    ParallelBlock blk;
+    PARALLEL_READER* pReader;
+    PosVelSample pvs;
+    unsigned long ulDone = 0, i;
+    int rc;
+
+    memset(&pc, 0, sizeof(pc));
+    pc.uiThreads = 2;
+    pc.bConvert = true;
+    CHECK((pReader = parallel_open(pPath, &pc)) != NULL);
+    while ((rc = parallel_next(pReader, &blk)) == 1)
+        for (i = 0; i < blk.ulCount; i++, ulDone++)
+        {
+            CHECK(same_sample(&blk.pRaw[i], &aSamples[ulDone]));
+            convert_block_comp(&aSamples[ulDone], &pvs, 1, adComp[ulDone >= TEST_COMP_AT]);
+            CHECK(blk.pSamples[i].p1 == pvs.p1 && blk.pSamples[i].p2 == pvs.p2 && blk.pSamples[i].p3 == pvs.p3);
+            CHECK(blk.pSamples[i].v1 == pvs.v1 && blk.pSamples[i].v2 == pvs.v2 && blk.pSamples[i].v3 == pvs.v3);
+        }
+    CHECK(rc == 0 && ulDone == TEST_SAMPLES);
+    parallel_close(pReader);
+    return 0;
+}
+
+// A replay posts each recorded factor as it reaches it, so every sample is converted with its own; no board is
+// opened, read_data_struct only reads one while no replay is active
+static int check_replay(const char* pPath)
+{
+    PosVelSample pvs, want;
+    unsigned long i;
+
+    CHECK(open_replay(pPath, REPLAY_AS_FAST, false) == 0);
+    for (i = 0; i < TEST_SAMPLES; i++)
+    {
+        pvs = read_data_struct();
+        convert_block_comp(&aSamples[i], &want, 1, adComp[i >= TEST_COMP_AT]);
+        CHECK(near(pvs.p1, want.p1) && near(pvs.p2, want.p2) && near(pvs.p3, want.p3));
+        CHECK(near(pvs.v1, want.v1) && near(pvs.v2, want.v2) && near(pvs.v3, want.v3));
+    }
+    close_replay();
+    return 0;
+}
+
+static int test_query(const char* pDir)
+{
+    char acPath[CAPTURE_PATH_MAX], acSidecar[CAPTURE_PATH_MAX + 8];
+    QUERY_READER* pReader;
+    CAPTURE_READER* pCapture;
+    CAPTURE_CATALOG* pCatalog;
+    const CaptureSegment* aSegments;
+    unsigned long ulSegments, i;
+    double dCompNum;
+
+    adComp[0] = read_comp_num();
+    adComp[1] = adComp[0] * 1.0001;
+    snprintf(acPath, sizeof(acPath), "%s/test_query.cap", pDir);
+    CHECK(write_query_capture(capture_open(acPath)) == 0);
+
+    // The change is recorded once and read back per chunk, from the footer index and from a rebuilt one
+    for (i = 0; i < 2; i++)
+    {
+        unsigned long ulEntries;
+
+        CHECK((pCapture = capture_open_read(acPath)) != NULL);
+        CHECK(capture_chunk_comp(pCapture, 0, &dCompNum) == 0 && dCompNum == adComp[0]);
+        CHECK(capture_chunk_comp(pCapture, 3, &dCompNum) == 0 && dCompNum == adComp[1]);
+        CHECK(capture_chunk_comp(pCapture, 2, &dCompNum) == 0 && dCompNum == adComp[0]);
+        CHECK(capture_index(pCapture, &ulEntries)[2].uiSamples == TEST_COMP_AT - 2 * CAPTURE_CHUNK_SAMPLES);
+        CHECK(capture_chunk_comp(pCapture, ulEntries - 1, &dCompNum) == 0 && dCompNum == adComp[1]);
+        capture_close_read(pCapture);
+        if (i == 0)
+        {
+            CAPTURE_FOOTER ftr;
+            FILE* fp = fopen(acPath, "r+b");
+
+            memset(&ftr, 0, sizeof(ftr));
+            CHECK(fp != NULL);
+            CHECK(fseek(fp, -(long)sizeof(ftr), SEEK_END) == 0 && fwrite(&ftr, sizeof(ftr), 1, fp) == 1);
+            CHECK(fclose(fp) == 0);
+        }
+    }
+
+    CHECK((pReader = query_open(acPath)) != NULL);
+    CHECK(check_queries(pReader, NULL) == 0);
+    query_close(pReader);
+
+    // Without the sidecar every chunk in range is decoded, and summary_build restores it
+    snprintf(acSidecar, sizeof(acSidecar), "%s" SUMMARY_SUFFIX, acPath);
+    remove(acSidecar);
+    CHECK((pReader = query_open(acPath)) != NULL);
+    CHECK(check_queries(pReader, NULL) == 0);
+    query_close(pReader);
+    CHECK(summary_build(acPath) == 0);
+    CHECK((pReader = query_open(acPath)) != NULL);
+    CHECK(check_queries(pReader, NULL) == 0);
+    query_close(pReader);
+    CHECK(check_parallel(acPath) == 0);
+    CHECK(check_replay(acPath) == 0);
+    remove_capture(acPath);
+
+    // Segments of three chunks each, so windows also cross segment boundaries
+    snprintf(acPath, sizeof(acPath), "%s/test_query", pDir);
+    CHECK(write_query_capture(capture_open_segments(acPath, 2LL * CAPTURE_CHUNK_SAMPLES * TEST_STEP, 0)) == 0);
+    snprintf(acSidecar, sizeof(acSidecar), "%s.cat", acPath);
+    CHECK((pCatalog = catalog_open(acSidecar)) != NULL);
+    ulSegments = catalog_segments(pCatalog, &aSegments);
+    CHECK(ulSegments > 1);
+    CHECK(check_queries(NULL, pCatalog) == 0);
+    for (i = 0; i < ulSegments; i++) remove_capture(aSegments[i].szPath);
+    catalog_close(pCatalog);
+    remove(acSidecar);
+    return 0;
+}
+
+static void env_sample(unsigned long i, RawSample* p)
+{
+    memset(p, 0, sizeof(*p));
+    p->llTime = TEST_START + (long long)i * TEST_STEP;
+    p->llAx1Pos = (long long)((i * 7919) % 10007) - 5000 + (long long)i * 3;
+    p->llAx2Pos = -(long long)(i / 3);
+    p->llAx3Pos = (1LL << 33) + (long long)(i % 4093);
+    p->wValid = N1231B_VALID_1 | N1231B_VALID_2 | N1231B_VALID_3;
+}
+
+// Pixels aligned to buckets: two level 0 buckets each, read in batches that straddle blocks, two level 2
+// buckets each, and one pixel over the whole capture
+static int check_envelope(const char* pPath)
+{
+    static const unsigned long aulFirst[] = { 3 * ENVELOPE_BASE, 0, 0 };
+    static const unsigned long aulPerPixel[] = { 2 * ENVELOPE_BASE, 8 * ENVELOPE_BASE, TEST_ENV_SAMPLES };
+    static EnvelopePixel aPixels[TEST_ENV_SAMPLES / (2 * ENVELOPE_BASE)];
+    ENVELOPE_READER* pReader;
+    unsigned int uiPass, p;
+
+    CHECK((pReader = envelope_open(pPath)) != NULL);
+    for (uiPass = 0; uiPass < 3; uiPass++)
+    {
+        unsigned long ulPerPixel = aulPerPixel[uiPass];
+        unsigned int uiPixels = (unsigned int)((TEST_ENV_SAMPLES - aulFirst[uiPass]) / ulPerPixel);
+        long long llStart = TEST_START + (long long)aulFirst[uiPass] * TEST_STEP;
+
+        CHECK(envelope_query(pReader, llStart, llStart + (long long)ulPerPixel * uiPixels * TEST_STEP, aPixels, uiPixels) == 0);
+        for (p = 0; p < uiPixels; p++)
+        {
+            double adMin[3] = { INFINITY, INFINITY, INFINITY }, adMax[3] = { -INFINITY, -INFINITY, -INFINITY }, adSum[3] = { 0 };
+            unsigned long i;
+            int j;
+
+            for (i = aulFirst[uiPass] + p * ulPerPixel; i < aulFirst[uiPass] + (p + 1) * ulPerPixel; i++)
+            {
+                const double dPos = UM_PER_COUNT(adComp[i >= TEST_ENV_COMP_AT]);
+                RawSample s;
+                double adValue[3];
+
+                env_sample(i, &s);
+                adValue[0] = dPos * s.llAx1Pos - START_MM * 1000;
+                adValue[1] = dPos * s.llAx2Pos - START_MM * 1000;
+                adValue[2] = dPos * s.llAx3Pos - START_MM * 1000;
+                for (j = 0; j < 3; j++)
+                {
+                    if (adValue[j] < adMin[j]) adMin[j] = adValue[j];
+                    if (adValue[j] > adMax[j]) adMax[j] = adValue[j];
+                    adSum[j] += adValue[j];
+                }
+            }
+            CHECK(aPixels[p].ullSamples == ulPerPixel);
+            for (j = 0; j < 3; j++)
+            {
+                CHECK(near(aPixels[p].aAxis[j].dMin, adMin[j]));
+                CHECK(near(aPixels[p].aAxis[j].dMax, adMax[j]));
+                CHECK(near(aPixels[p].aAxis[j].dMean, adSum[j] / ulPerPixel));
+            }
+        }
+    }
+    envelope_close(pReader);
+    return 0;
+}
+
+// The sidecar is written block by block while the capture grows, and only usable once finished
+static int test_envelope(const char* pDir)
+{
+    char acPath[CAPTURE_PATH_MAX], acSidecar[CAPTURE_PATH_MAX + 8];
+    RawSample aBuf[CAPTURE_CHUNK_SAMPLES];
+    CAPTURE_WRITER* pWriter;
+    ENVELOPE_BUILDER* pEnv;
+    unsigned long i, n;
+
+    snprintf(acPath, sizeof(acPath), "%s/test_envelope.cap", pDir);
+    snprintf(acSidecar, sizeof(acSidecar), "%s" ENVELOPE_SUFFIX, acPath);
+    // A factor far enough from the first that scaling with the wrong one fails the checks
+    adComp[0] = read_comp_num();
+    adComp[1] = adComp[0] * 1.01;
+    CHECK((pWriter = capture_open(acPath)) != NULL);
+    for (i = 0; i < TEST_ENV_SAMPLES; i += n)
+    {
+        unsigned long ulEnd = i < TEST_ENV_COMP_AT ? TEST_ENV_COMP_AT : TEST_ENV_SAMPLES;
+
+        for (n = 0; n < CAPTURE_CHUNK_SAMPLES && i + n < ulEnd; n++) env_sample(i + n, &aBuf[n]);
+        CHECK(capture_write(pWriter, aBuf, n) == 0);
+        if (i + n == TEST_ENV_COMP_AT) CHECK(capture_set_comp(pWriter, adComp[1]) == 0);
+    }
+    CHECK(capture_close(pWriter) == 0);
+    CHECK(check_envelope(acPath) == 0);
+
+    CHECK((pEnv = envelope_new(acSidecar)) != NULL);
+    envelope_add(pEnv, aBuf, 100, UM_PER_COUNT(adComp[0]));
+    envelope_free(pEnv);
+    CHECK(envelope_open(acPath) == NULL);
+    CHECK(envelope_build(acPath) == 0);
+    CHECK(check_envelope(acPath) == 0);
+    remove_capture(acPath);
+    return 0;
+}
+
+// Recording through the acquisition path of the simulated board: the comparator status is read for the
+// recording, so every sample's bits match its own position and the window aggregate counts them
+static int test_board(const char* pDir)
+{
+    char acPath[CAPTURE_PATH_MAX];
+    union { N1231B_INT64 s; long i64; } uAt;
+    struct timespec ts = { 0, TEST_BOARD_SLEEP_NS };
+    unsigned long long ullGe1 = 0, ullLt2 = 0;
+    CAPTURE_READER* pReader;
+    QUERY_READER* pQuery;
+    QueryWindow window;
+    long lCount, i;
+
+    snprintf(acPath, sizeof(acPath), "%s/board.cap", pDir);
+    CHECK(vendor_simulate() == 0);
+    open_device();
+    // Thresholds at the preset, which each axis oscillates around
+    uAt.i64 = (long)MM_TO_COUNTS(START_MM, read_comp_num());
+    CHECK(vendor_api()->pfnSetGeLtThresholds(hBrd, AXIS_1, uAt.s, uAt.s) == N1231B_SUCCESS);
+    CHECK(vendor_api()->pfnSetGeLtThresholds(hBrd, AXIS_2, uAt.s, uAt.s) == N1231B_SUCCESS);
+
+    CHECK(start_recording(acPath) == 0);
+    for (i = 0; i < TEST_BOARD_SAMPLES; i++)
+    {
+        read_data_struct();
+        nanosleep(&ts, NULL);
+    }
+    CHECK(read_recording_stats().ullOverruns == 0);
+    stop_recording();
+
+    CHECK((pReader = capture_open_read(acPath)) != NULL);
+    lCount = capture_read(pReader, aRead, TEST_SAMPLES);
+    capture_close_read(pReader);
+    CHECK(lCount == TEST_BOARD_SAMPLES);
+    for (i = 0; i < lCount; i++)
+    {
+        CHECK(!(aRead[i].uiGeLtStatus & N1231B_GE_TRUE_1) == (aRead[i].llAx1Pos < uAt.i64));
+        CHECK(!(aRead[i].uiGeLtStatus & N1231B_LT_TRUE_2) == (aRead[i].llAx2Pos >= uAt.i64));
+        ullGe1 += (aRead[i].uiGeLtStatus & N1231B_GE_TRUE_1) != 0;
+        ullLt2 += (aRead[i].uiGeLtStatus & N1231B_LT_TRUE_2) != 0;
+    }
+    CHECK(ullGe1 > 0 && ullGe1 < (unsigned long long)lCount);
+    CHECK(ullLt2 > 0 && ullLt2 < (unsigned long long)lCount);
+
+    CHECK((pQuery = query_open(acPath)) != NULL);
+    CHECK(query_windows(pQuery, aRead[0].llTime, aRead[lCount - 1].llTime - aRead[0].llTime + 1, &window, 1) == 0);
+    query_close(pQuery);
+    CHECK(window.ullSamples == (unsigned long long)lCount);
+    CHECK(window.aullComparator[QUERY_GE_1] == ullGe1);
+    CHECK(window.aullComparator[QUERY_LT_2] == ullLt2);
+    CHECK(window.aullComparator[QUERY_LT_1] == lCount - ullGe1 && window.aullComparator[QUERY_GE_2] == lCount - ullLt2);
+    remove_capture(acPath);
+    return 0;
+}
+
+int main(int argc, char** argv)
+{
+    char acPath[CAPTURE_PATH_MAX];
+
+    if (argc < 2) return 2;
+    make_samples();
+    snprintf(acPath, sizeof(acPath), "%s/test_capture.cap", argv[1]);
+    if (test_file(acPath, 0)) return 1;
+    snprintf(acPath, sizeof(acPath), "%s/test_capture_async.cap", argv[1]);
+    if (test_file(acPath, 1)) return 1;
+    if (test_unclosed(acPath)) return 1;
+    snprintf(acPath, sizeof(acPath), "%s/test_capture_live.cap", argv[1]);
+    if (test_live(acPath)) return 1;
+    if (test_live_error()) return 1;
+    if (test_query(argv[1])) return 1;
+    if (test_envelope(argv[1])) return 1;
+    if (test_board(argv[1])) return 1;
+    printf("capture ok\n");
+    return 0;
+}
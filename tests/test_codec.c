@@ -0,0 +1,147 @@
+﻿// test_codec.c: Codec round trip and CRC-32C check vectors
+//
+// Built once per vector path (run time choice, scalar, SSE2, AVX2 + SSE4.2) from the same source, see
+// CMakeLists.txt. The encoder is shared, so every build must produce the same stream, checked against ENCODED_CRC.
+
+#include "TuneExpertCodec.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#define TEST_SAMPLES 10000
+#define TEST_SKIP 77                        // SKIP_RETURN_CODE in CMakeLists.txt
+#define ENCODED_CRC 0x073b17fau
+
+#define CHECK(cond) \
+    do { if (!(cond)) { fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); return 1; } } while (0)
+
+static uint64_t ullSeed = 0x9e3779b97f4a7c15ull;
+
+static uint64_t next_random(void)
+{
+    ullSeed ^= ullSeed << 13;
+    ullSeed ^= ullSeed >> 7;
+    ullSeed ^= ullSeed << 17;
+    return ullSeed;
+}
+
+// A slow random walk with a few full range jumps, so every bit width turns up
+static void make_samples(RawSample* pSamples, unsigned long ulCount)
+{
+    long long llTime = 1620000000000000000LL, allPos[3] = { 0, -5, 1LL << 34 };
+    unsigned long i;
+    int j;
+
+    memset(pSamples, 0, ulCount * sizeof(*pSamples));
+    for (i = 0; i < ulCount; i++)
+    {
+        uint64_t r = next_random();
+
+        llTime += 1000 + (long long)(r % 64) - 32;
+        for (j = 0; j < 3; j++)
+        {
+            if (r % 997 == 0) allPos[j] = (long long)(next_random() % (1ull << 36)) - (1LL << 35);
+            else allPos[j] += (long long)(next_random() % 2001) - 1000;
+        }
+        pSamples[i].llTime = llTime;
+        pSamples[i].llAx1Pos = allPos[0];
+        pSamples[i].llAx2Pos = allPos[1];
+        pSamples[i].llAx3Pos = allPos[2];
+        pSamples[i].lAx1Vel = (long)(r >> 40) - (1L << 23);
+        pSamples[i].lAx2Vel = -pSamples[i].lAx1Vel / 3;
+        pSamples[i].lAx3Vel = i % 17 == 0 ? -(1L << 30) : 0;
+        pSamples[i].uiGeLtStatus = (unsigned int)(r >> 61);
+        pSamples[i].wValid = (unsigned short)(i % 500 ? 7 : 3);
+    }
+}
+
+static int same_sample(const RawSample* a, const RawSample* b)
+{
+    return a->llTime == b->llTime && a->llAx1Pos == b->llAx1Pos && a->llAx2Pos == b->llAx2Pos && a->llAx3Pos == b->llAx3Pos
+        && a->lAx1Vel == b->lAx1Vel && a->lAx2Vel == b->lAx2Vel && a->lAx3Vel == b->lAx3Vel
+        && a->uiGeLtStatus == b->uiGeLtStatus && a->wValid == b->wValid;
+}
+
+static int test_crc(void)
+{
+    static const unsigned char aucZero[32], aucOnes[32] = {
+        0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+        0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
+    const char* pCheck = "123456789";
+
+    CHECK(codec_crc32c(0, "", 0) == 0);
+    CHECK(codec_crc32c(0, pCheck, 9) == 0xe3069283u);
+    CHECK(codec_crc32c(codec_crc32c(0, pCheck, 4), pCheck + 4, 5) == 0xe3069283u);
+    // RFC 3720 B.4
+    CHECK(codec_crc32c(0, aucZero, sizeof(aucZero)) == 0x8a9136aau);
+    CHECK(codec_crc32c(0, aucOnes, sizeof(aucOnes)) == 0x62a8ab43u);
+    return 0;
+}
+
+static int test_varint(void)
+{
+    static const unsigned long long aullValues[] = { 0, 1, 127, 128, 300, 1ull << 35, ~0ull };
+    unsigned char aucBuf[10];
+    unsigned long long ullValue;
+    size_t i, ulLen;
+
+    for (i = 0; i < sizeof(aullValues) / sizeof(aullValues[0]); i++)
+    {
+        ulLen = codec_put_varint(aucBuf, aullValues[i]);
+        CHECK(ulLen >= 1 && ulLen <= sizeof(aucBuf));
+        CHECK(codec_get_varint(aucBuf, ulLen, &ullValue) == ulLen && ullValue == aullValues[i]);
+        CHECK(codec_get_varint(aucBuf, ulLen - 1, &ullValue) == 0);
+    }
+    return 0;
+}
+
+static int test_round_trip(void)
+{
+    static RawSample aIn[TEST_SAMPLES], aOut[CODEC_BLOCK];
+    static unsigned char aucBuf[CODEC_MAX_BYTES(CODEC_BLOCK)];
+    // Partial blocks exercise the scalar tails after the vector loops
+    static const unsigned long aulSizes[] = { 1, 2, 3, 5, 255, CODEC_BLOCK };
+    unsigned int uiCrc = 0;
+    unsigned long ulDone = 0, k = 0, i;
+
+    make_samples(aIn, TEST_SAMPLES);
+    while (ulDone < TEST_SAMPLES)
+    {
+        unsigned long ulCount = aulSizes[k++ % (sizeof(aulSizes) / sizeof(aulSizes[0]))];
+        size_t ulLen, ulUsed = 0;
+
+        if (ulCount > TEST_SAMPLES - ulDone) ulCount = TEST_SAMPLES - ulDone;
+        ulLen = codec_encode_block(aIn + ulDone, ulCount, aucBuf);
+        CHECK(ulLen <= CODEC_MAX_BYTES(ulCount));
+        uiCrc = codec_crc32c(uiCrc, aucBuf, ulLen);
+
+        CHECK(codec_decode_block(aucBuf, ulLen, aOut, CODEC_BLOCK, &ulUsed) == (long)ulCount);
+        CHECK(ulUsed == ulLen);
+        for (i = 0; i < ulCount; i++) CHECK(same_sample(&aIn[ulDone + i], &aOut[i]));
+
+        // Truncated or undersized input is refused, never overrun
+        CHECK(codec_decode_block(aucBuf, ulLen - 1, aOut, CODEC_BLOCK, NULL) < 0);
+        if (ulCount > 1) CHECK(codec_decode_block(aucBuf, ulLen, aOut, ulCount - 1, NULL) < 0);
+        ulDone += ulCount;
+    }
+    if (uiCrc != ENCODED_CRC)
+    {
+        fprintf(stderr, "encoded stream CRC %08x, expected %08x\n", uiCrc, ENCODED_CRC);
+        return 1;
+    }
+    return 0;
+}
+
+int main(void)
+{
+#if defined(__AVX2__) && (defined(__GNUC__) || defined(__clang__))
+    if (!__builtin_cpu_supports("avx2") || !__builtin_cpu_supports("sse4.2"))
+    {
+        printf("AVX2 not supported, skipped\n");
+        return TEST_SKIP;
+    }
+#endif
+    if (test_crc() || test_varint() || test_round_trip()) return 1;
+    printf("codec ok\n");
+    return 0;
+}
@@ -0,0 +1,105 @@
+﻿// test_cpp.cpp: The C++ headers compiled and run against the simulated board: Board reads specialised on
+// axes, samples of the acquisition path awaited through an Executor and a SampleStream, and the Optics
+// constants checked by the compiler
+
+#include "TuneExpertBoard.hpp"
+#include "TuneExpertCoro.hpp"
+#include "TuneExpertUnits.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <thread>
+
+extern "C" {
+#include "TuneExpertBroadcast.h"
+}
+
+#define TEST_STREAM_SAMPLES 64
+#define TEST_PRODUCER_SLEEP_US 50           // well inside the ring while the coroutine sleeps
+#define TEST_RANGE_UM 5.0                   // the simulated axes oscillate about 1.9 um around the preset
+
+#define CHECK(cond) \
+    do { if (!(cond)) { std::fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); return 1; } } while (0)
+
+using namespace TuneExpert;
+
+// The header asserts LibraryOptics against the C macros; the other configurations follow from the fold
+static_assert(LibraryOptics::uiFold == FOLD && LibraryOptics::dLambdaNm == LAMBDA_NM);
+static_assert(LinearOptics::um_per_count() == 2 * PlaneMirrorOptics::um_per_count());
+static_assert(PlaneMirrorOptics::um_per_count() == 2 * HighResolutionOptics::um_per_count());
+static_assert(LibraryOptics::Start.value() == (long long)MM_TO_COUNTS(START_MM, COMP_NUM));
+static_assert(LibraryOptics::position_um(LibraryOptics::Start).value() > -LibraryOptics::um_per_count());
+static_assert(Micrometers(1.5) + Micrometers(2.5) == Micrometers(4.0));
+
+// Axes 1 and 3 only: the others stay zero and carry no valid bit
+static int test_board(const Board& board)
+{
+    Reading<Axis1 | Axis3> r = board.read<Axis1 | Axis3>();
+    RawReading<Axis2, PosVel> raw = board.read_raw<Axis2, PosVel>();
+
+    CHECK(r.valid<0>() && r.valid<2>());
+    CHECK(!(r.wValid & N1231B_VALID_2));
+    CHECK(std::fabs(r.pos<0>()) < TEST_RANGE_UM && std::fabs(r.pos<2>()) < TEST_RANGE_UM);
+    CHECK(r.aPos[1] == 0);
+    CHECK(std::llabs(raw.pos<1>() - LibraryOptics::Start.value()) < LibraryOptics::to_counts(Micrometers(TEST_RANGE_UM)).value());
+    return 0;
+}
+
+static Task<size_t> take_samples(Executor& ex, SampleStream& stream, unsigned long long* pullLast)
+{
+    co_await ex.sleep_for(std::chrono::milliseconds(1));
+    std::span<const LatestSample> block = co_await stream.next(TEST_STREAM_SAMPLES);
+    for (size_t i = 1; i < block.size(); i++)
+        if (block[i].ullSequence != block[i - 1].ullSequence + 1) co_return 0;
+    *pullLast = block.empty() ? 0 : block.back().ullSequence;
+    co_return block.size();
+}
+
+static Task<> run_stream(Executor& ex, SampleStream& stream, size_t* pulTaken, unsigned long long* pullLast)
+{
+    *pulTaken = co_await take_samples(ex, stream, pullLast);
+}
+
+// Samples the acquisition thread reads from the board reach a coroutine through the broadcast ring
+static int test_stream()
+{
+    Executor ex;
+    std::atomic<bool> bRun{ true };
+    size_t ulTaken = 0;
+    unsigned long long ullLast = 0;
+
+    CHECK(start_broadcast(1024) == 0);
+    {
+        SampleStream stream(ex, BROADCAST_DROP_OLDEST);
+        CHECK(stream.valid());
+        std::thread producer([&bRun] {
+            while (bRun)
+            {
+                read_data_struct();
+                std::this_thread::sleep_for(std::chrono::microseconds(TEST_PRODUCER_SLEEP_US));
+            }
+        });
+
+        ex.spawn(run_stream(ex, stream, &ulTaken, &ullLast));
+        ex.run();
+        bRun = false;
+        producer.join();
+    }
+    stop_broadcast();
+    CHECK(ulTaken == TEST_STREAM_SAMPLES);
+    CHECK(ullLast >= TEST_STREAM_SAMPLES);
+    return 0;
+}
+
+int main()
+{
+    CHECK(vendor_simulate() == 0);
+    Board board;
+
+    if (test_board(board)) return 1;
+    if (test_stream()) return 1;
+    std::printf("cpp ok\n");
+    return 0;
+}
@@ -0,0 +1,121 @@
+﻿// test_fixed.c: Fixed point column pass against the scalar conversion, value for value
+//
+// fixed_apply_column takes the AVX2 pass wherever the CPU has it, so on such a machine this compares the
+// vector and scalar integers; elsewhere it still checks the pooled scalar pass.
+
+#include "TuneExpertFixed.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TEST_LARGE 200000                   // enough to be split across the pool
+
+#define CHECK(cond) \
+    do { if (!(cond)) { fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); return 1; } } while (0)
+
+static uint64_t ullSeed = 0x2545f4914f6cdd1dull;
+
+static uint64_t next_random(void)
+{
+    ullSeed ^= ullSeed << 13;
+    ullSeed ^= ullSeed >> 7;
+    ullSeed ^= ullSeed << 17;
+    return ullSeed;
+}
+
+// Full 36 bit signed range with the extremes placed at the start and in the scalar tail
+static void make_raw(long long* pRaw, unsigned long ulCount)
+{
+    static const long long allEdges[] = { -(1LL << 35), (1LL << 35) - 1, 0, -1, 1 };
+    unsigned long i;
+
+    for (i = 0; i < ulCount; i++)
+        pRaw[i] = i < 5 ? allEdges[i] : (long long)(next_random() % (1ull << 36)) - (1LL << 35);
+    if (ulCount > 5) pRaw[ulCount - 1] = -(1LL << 35);
+}
+
+static int check_column(const FixedScale* pScale, long long llOffset, long long* pRaw, long long* pOut, unsigned long ulCount)
+{
+    unsigned long i;
+
+    make_raw(pRaw, ulCount);
+    fixed_apply_column(pRaw, pOut, ulCount, pScale, llOffset);
+    for (i = 0; i < ulCount; i++)
+        if (pOut[i] != fixed_apply(pRaw[i], pScale) - llOffset)
+        {
+            fprintf(stderr, "count %lu, raw %lld: column %lld, scalar %lld (scale %lld %lld %lld)\n", ulCount, pRaw[i], pOut[i],
+                fixed_apply(pRaw[i], pScale) - llOffset, pScale->llInt, pScale->llFrac1, pScale->llFrac2);
+            return 1;
+        }
+    return 0;
+}
+
+static int check_block(const FixedConversion* pConv, RawSample* pRaw, FixedSample* pOut, unsigned long ulCount)
+{
+    unsigned long i;
+
+    memset(pRaw, 0, ulCount * sizeof(*pRaw));
+    for (i = 0; i < ulCount; i++)
+    {
+        uint64_t r = next_random();
+
+        pRaw[i].llAx1Pos = (long long)(r % (1ull << 36)) - (1LL << 35);
+        pRaw[i].llAx2Pos = -pRaw[i].llAx1Pos / 7;
+        pRaw[i].llAx3Pos = (long long)(i % 1000);
+        pRaw[i].lAx1Vel = (long)(r >> 40) - (1L << 23);
+        pRaw[i].lAx2Vel = -(1L << 30);
+        pRaw[i].lAx3Vel = (long)i;
+    }
+    convert_block_fixed(pRaw, pOut, ulCount, pConv);
+    for (i = 0; i < ulCount; i++)
+    {
+        CHECK(pOut[i].llP1 == fixed_apply(pRaw[i].llAx1Pos, &pConv->Pos) - pConv->llOffset);
+        CHECK(pOut[i].llP2 == fixed_apply(pRaw[i].llAx2Pos, &pConv->Pos) - pConv->llOffset);
+        CHECK(pOut[i].llP3 == fixed_apply(pRaw[i].llAx3Pos, &pConv->Pos) - pConv->llOffset);
+        CHECK(pOut[i].llV1 == fixed_apply(pRaw[i].lAx1Vel, &pConv->Vel));
+        CHECK(pOut[i].llV2 == fixed_apply(pRaw[i].lAx2Vel, &pConv->Vel));
+        CHECK(pOut[i].llV3 == fixed_apply(pRaw[i].lAx3Vel, &pConv->Vel));
+    }
+    return 0;
+}
+
+int main(void)
+{
+    static const double adCompNum[] = { 1.0, 0.99972854, 1.000293 };
+    // Fraction extremes, the largest llInt the vector pass takes and one it leaves to the scalar loop
+    static const FixedScale aEdges[] = {
+        { 0, 0, 0 }, { 0, (1LL << FIXED_FRACTION_BITS) - 1, (1LL << FIXED_FRACTION_BITS) - 1 },
+        { (1LL << FIXED_FRACTION_BITS) - 1, (1LL << FIXED_FRACTION_BITS) - 1, (1LL << FIXED_FRACTION_BITS) - 1 },
+        { 1LL << FIXED_FRACTION_BITS, 12345, 678 } };
+    static const unsigned long aulCounts[] = { 0, 1, 3, 4, 5, 7, 8, 1001, TEST_LARGE };
+    long long* pRaw = malloc(TEST_LARGE * sizeof(long long));
+    long long* pOut = malloc(TEST_LARGE * sizeof(long long));
+    RawSample* pSamples = malloc(TEST_LARGE * sizeof(RawSample));
+    FixedSample* pFixed = malloc(TEST_LARGE * sizeof(FixedSample));
+    size_t c, k;
+    int iUnit, iResult = 0;
+
+    if (!pRaw || !pOut || !pSamples || !pFixed) return 1;
+    for (c = 0; c < sizeof(adCompNum) / sizeof(adCompNum[0]) && !iResult; c++)
+        for (iUnit = FIXED_PM; iUnit <= FIXED_NM && !iResult; iUnit++)
+        {
+            FixedConversion conv;
+
+            fixed_conversion(&conv, adCompNum[c], iUnit);
+            for (k = 0; k < sizeof(aulCounts) / sizeof(aulCounts[0]) && !iResult; k++)
+                iResult = check_column(&conv.Pos, conv.llOffset, pRaw, pOut, aulCounts[k])
+                    || check_column(&conv.Vel, 0, pRaw, pOut, aulCounts[k]);
+            if (!iResult) iResult = check_block(&conv, pSamples, pFixed, TEST_LARGE);
+        }
+    for (c = 0; c < sizeof(aEdges) / sizeof(aEdges[0]) && !iResult; c++)
+        for (k = 0; k < sizeof(aulCounts) / sizeof(aulCounts[0]) && !iResult; k++)
+            iResult = check_column(&aEdges[c], -123456789, pRaw, pOut, aulCounts[k]);
+
+    free(pRaw);
+    free(pOut);
+    free(pSamples);
+    free(pFixed);
+    if (!iResult) printf("fixed ok\n");
+    return iResult;
+}